@@ -10,20 +10,28 @@
 #define alphakv_hpp
 
 #include "keyvalue.hpp"
+#include "bitcask.hpp"
+#include "lsm.hpp"
+#include "shard.hpp"
+#include "async.hpp"
+#include "coro.hpp"
+#include "replica.hpp"
 
 NS_HIVE_BEGIN
 
 #define ALPHAKV_HASH_SLOT 4096
 
-class AlphaKV
+// 数据库的外观接口，_DB_为存储引擎：KeyValue（数据块原地更新）、Bitcask（日志结构只追加写入）或者Lsm（LSM树，key不需要常驻内存）；
+// 引擎不支持的接口（例如Bitcask的压缩和缓存设置、只有Lsm支持的范围查询）只有在调用时才会编译报错
+template <typename _DB_>
+class AlphaDB
 {
 public:
-	typedef KeyValue<ALPHAKV_HASH_SLOT> KeyValueData;
+	typedef _DB_ KeyValueData;
 	KeyValueData* m_pDB;
-	CharVector m_buffer;
 public:
-	AlphaKV(void) : m_pDB(NULL){}
-	virtual ~AlphaKV(void){
+	AlphaDB(void) : m_pDB(NULL){}
+	virtual ~AlphaDB(void){
 		closeDB();
 	}
 	
@@ -41,19 +49,170 @@ public:
 			m_pDB = NULL;
 		}
 	}
+	// 打开线程安全模式，之后可以在多个线程中同时调用；读操作可以并行，写操作共用一个全局写锁，仍然串行执行；
+	// 需要在打开数据库之后、多个线程开始使用之前设置
+	void setThreadSafe(bool enable){
+		m_pDB->setThreadSafe(enable);
+	}
+	// 不超过length长度的value直接保存在key记录中，读取不需要访问数据文件；小于0表示关闭
+	void setInlineLength(int32 length){
+		m_pDB->setInlineLength((int64)length);
+	}
+	// 设置value缓存的内存上限（字节），0表示关闭缓存
+	void setCacheSize(uint64 capacity){
+		m_pDB->setCacheSize((int64)capacity);
+	}
+	// 缓存的命中、未命中、淘汰次数和内存占用
+	CacheStat getCacheStat(void){
+		return m_pDB->getCacheStat();
+	}
+	// 运行统计：各种操作的次数和采样的延迟、数据块分配和文件扩展的计数
+	void getStats(StatSnapshot& snapshot){
+		m_pDB->getStats(snapshot);
+	}
+	// 文本格式的运行统计，每行一个"名称:数值"
+	std::string dumpStats(void){
+		std::string text;
+		m_pDB->dumpStats(text);
+		return text;
+	}
+	// 空间统计：数据文件的有效数据、空闲块分布和填充浪费，key和index文件中已经删除的记录
+	void getSpaceStat(SpaceStat& stat){
+		m_pDB->getSpaceStat(stat);
+	}
+	std::string dumpSpaceStat(void){
+		std::string text;
+		m_pDB->dumpSpaceStat(text);
+		return text;
+	}
+	// 创建快照：之后的写入不影响通过快照读取到的数据，被替换的数据块在快照释放前不会重用；用完需要releaseSnapshot
+	uint64 createSnapshot(void){
+		return m_pDB->createSnapshot();
+	}
+	void releaseSnapshot(uint64 snapshot){
+		m_pDB->releaseSnapshot(snapshot);
+	}
+	bool getSnapshot(uint64 snapshot, const char* key, uint32 keyLength, CharVector& value){
+		int result = m_pDB->getSnapshotValue(snapshot, key, keyLength, value);
+		return (FILE_OK == result);
+	}
+	bool getSnapshot(uint64 snapshot, uint64 key, CharVector& value){
+		int result = m_pDB->getSnapshotValue(snapshot, key, value);
+		return (FILE_OK == result);
+	}
+	// 快照中所有的字符串key和数字key，之后可以边写入边逐个读取
+	bool getSnapshotKeys(uint64 snapshot, std::vector<std::string>& keys, std::vector<uint64>& indexes){
+		int result = m_pDB->getSnapshotKeys(snapshot, keys, indexes);
+		return (FILE_OK == result);
+	}
+	// 打开全库遍历（AlphaKVIterator）：按value在数据文件中的位置顺序读取，遍历期间可以继续写入
+	template <typename _ITERATOR_>
+	bool openIterator(_ITERATOR_& it){
+		int result = it.open(m_pDB);
+		return (FILE_OK == result);
+	}
+	// 开始在线备份到name，备份期间可以继续读写；incremental为true时只复制上一次备份到同一位置之后写入过的区域
+	bool startCheckpoint(const char* name, bool incremental){
+		int result = m_pDB->startCheckpoint(name, incremental);
+		return (FILE_OK == result);
+	}
+	bool isCheckpointDone(void){
+		return m_pDB->isCheckpointDone();
+	}
+	// 等待备份完成；备份目录中有name.ckpt文件才是完整的备份
+	bool finishCheckpoint(void){
+		int result = m_pDB->finishCheckpoint();
+		return (FILE_OK == result);
+	}
+	// 设置读取时检查value校验码的方式：CHECKSUM_VERIFY_ALWAYS / SAMPLED / SCAN
+	void setChecksumVerify(int mode){
+		m_pDB->setChecksumVerify(mode);
+	}
+	// 后台校验全库的value
+	bool startScrub(void){
+		int result = m_pDB->startScrub();
+		return (FILE_OK == result);
+	}
+	bool isScrubDone(void){
+		return m_pDB->isScrubDone();
+	}
+	// 等待校验完成；stat中返回出错的key，全部通过时返回true
+	bool finishScrub(ScrubStat& stat){
+		int result = m_pDB->finishScrub(stat);
+		return (FILE_OK == result);
+	}
+	// 批量导入：reader依次填充要写入的数据，没有数据时返回false；value顺序写入数据文件末尾，适合初始化新的节点
+	bool bulkLoad(const BulkReader& reader){
+		int result = m_pDB->bulkLoad(reader);
+		return (FILE_OK == result);
+	}
+	// 回收到期的key，每次最多处理maxCount个；写操作会顺带回收，空闲时可以定时调用
+	int64 expireCycle(int64 maxCount){
+		return m_pDB->expireCycle(maxCount);
+	}
+	// 设置默认的压缩方式（VALUE_CODEC_NONE/LZ/ZLIB），小于threshold长度的value不压缩
+	void setCompress(int codec, uint32 threshold){
+		m_pDB->setCompress(codec, threshold);
+	}
+	// 设置小数据的压缩字典，只能设置一次
+	bool setDictionary(const char* dict, uint32 length){
+		int result = m_pDB->setDictionary(dict, length);
+		return (FILE_OK == result);
+	}
+	// 返回的指针指向当前线程的缓冲区，同一个线程下一次调用后失效；length为value的长度
 	char* get(const char* key, uint32 keyLength, uint32* length){
-		m_buffer.clear();
-		int result = m_pDB->get(key, keyLength, m_buffer);
+		CharVector& buffer = getThreadBuffer();
+		int result = m_pDB->getValue(key, keyLength, buffer);
 		if(FILE_OK == result){
-			*length = *(int*)(m_buffer.data());
-			return m_buffer.data() + sizeof(int);
+			*length = (uint32)buffer.size();
+			buffer.push_back(0);		// 结尾补0，方便作为字符串使用
+			return buffer.data();
 		}
 		return NULL;
 	}
+	// 读取到调用者的缓冲区，不使用线程的缓冲区；缓冲区不够时返回false，length为需要的长度
+	bool get(const char* key, uint32 keyLength, char* buffer, uint32 bufferSize, uint32* length){
+		int64 valueLength = 0;
+		int result = m_pDB->get(key, keyLength, buffer, bufferSize, &valueLength);
+		*length = (uint32)valueLength;
+		return (FILE_OK == result);
+	}
+	bool get(const char* key, uint32 keyLength, CharVector& value){
+		int result = m_pDB->getValue(key, keyLength, value);
+		return (FILE_OK == result);
+	}
 	bool set(const char* key, uint32 keyLength, const char* value, uint32 valueLength){
 		int result = m_pDB->set(key, keyLength, value, valueLength, true, false);
 		return (FILE_OK == result);
 	}
+	// 指定这个value的压缩方式，例如热数据使用VALUE_CODEC_LZ，冷数据使用VALUE_CODEC_ZLIB
+	bool set(const char* key, uint32 keyLength, const char* value, uint32 valueLength, int codec){
+		int result = m_pDB->set(key, keyLength, value, valueLength, true, false, codec);
+		return (FILE_OK == result);
+	}
+	// 写入并设置seconds秒后过期
+	bool setex(const char* key, uint32 keyLength, const char* value, uint32 valueLength, uint32 seconds){
+		int result = m_pDB->set(key, keyLength, value, valueLength, true, false, VALUE_CODEC_DEFAULT, getTimeSecond() + seconds);
+		return (FILE_OK == result);
+	}
+	// 设置seconds秒后过期
+	bool expire(const char* key, uint32 keyLength, uint32 seconds){
+		int result = m_pDB->setExpire(key, keyLength, getTimeSecond() + seconds);
+		return (FILE_OK == result);
+	}
+	// 取消过期时间
+	bool persist(const char* key, uint32 keyLength){
+		int result = m_pDB->setExpire(key, keyLength, 0);
+		return (FILE_OK == result);
+	}
+	// 剩余的秒数；不存在返回-2，没有设置过期时间返回-1
+	int64 ttl(const char* key, uint32 keyLength){
+		uint32 expireTime;
+		if(FILE_OK != m_pDB->getExpire(key, keyLength, expireTime)){
+			return -2;
+		}
+		return getRemainSecond(expireTime);
+	}
 	bool del(const char* key, uint32 keyLength){
 		int result = m_pDB->del(key, keyLength);
 		return (FILE_OK == result);
@@ -62,20 +221,74 @@ public:
 		int result = m_pDB->replace(key, length, newKey, newLength);
 		return (FILE_OK == result);
 	}
+	// value作为十进制整数加上delta，result为加上之后的值；key不存在时从0开始
+	bool incrby(const char* key, uint32 keyLength, int64 delta, int64* result){
+		int ret = m_pDB->incrby(key, keyLength, delta, *result);
+		return (FILE_OK == ret);
+	}
+	// 批量写入：不是原子操作，每个key各自生效，返回false时可能已经有一部分key写入
+	bool mset(const KeySetEntryVector& entries){
+		int result = m_pDB->mset(entries, false);
+		return (FILE_OK == result);
+	}
+	// 批量读取，value写入每个数据项的缓冲区，每个数据项的result记录各自的结果
+	bool mget(KeyGetEntryVector& entries){
+		int result = m_pDB->mget(entries);
+		return (FILE_OK == result);
+	}
+	// 范围查询[start, end)，按key排序；endLength为0表示不限制，limit为0表示不限制数量
+	bool scan(const char* start, uint32 startLength, const char* end, uint32 endLength, uint32 limit, KeyScanVector& result){
+		int ret = m_pDB->scan(start, startLength, end, endLength, limit, result);
+		return (FILE_OK == ret);
+	}
 
 	char* get(uint64 key, uint32* length){
-		m_buffer.clear();
-		int result = m_pDB->get(key, m_buffer);
+		CharVector& buffer = getThreadBuffer();
+		int result = m_pDB->getValue(key, buffer);
 		if(FILE_OK == result){
-			*length = *(int*)(m_buffer.data());
-			return m_buffer.data() + sizeof(int);
+			*length = (uint32)buffer.size();
+			buffer.push_back(0);		// 结尾补0，方便作为字符串使用
+			return buffer.data();
 		}
 		return NULL;
 	}
+	bool get(uint64 key, char* buffer, uint32 bufferSize, uint32* length){
+		int64 valueLength = 0;
+		int result = m_pDB->get(key, buffer, bufferSize, &valueLength);
+		*length = (uint32)valueLength;
+		return (FILE_OK == result);
+	}
+	bool get(uint64 key, CharVector& value){
+		int result = m_pDB->getValue(key, value);
+		return (FILE_OK == result);
+	}
 	bool set(uint64 key, const char* value, uint32 valueLength){
 		int result = m_pDB->set(key, value, valueLength, true, false);
 		return (FILE_OK == result);
 	}
+	bool set(uint64 key, const char* value, uint32 valueLength, int codec){
+		int result = m_pDB->set(key, value, valueLength, true, false, codec);
+		return (FILE_OK == result);
+	}
+	bool setex(uint64 key, const char* value, uint32 valueLength, uint32 seconds){
+		int result = m_pDB->set(key, value, valueLength, true, false, VALUE_CODEC_DEFAULT, getTimeSecond() + seconds);
+		return (FILE_OK == result);
+	}
+	bool expire(uint64 key, uint32 seconds){
+		int result = m_pDB->setExpire(key, getTimeSecond() + seconds);
+		return (FILE_OK == result);
+	}
+	bool persist(uint64 key){
+		int result = m_pDB->setExpire(key, 0);
+		return (FILE_OK == result);
+	}
+	int64 ttl(uint64 key){
+		uint32 expireTime;
+		if(FILE_OK != m_pDB->getExpire(key, expireTime)){
+			return -2;
+		}
+		return getRemainSecond(expireTime);
+	}
 	bool del(uint64 key){
 		int result = m_pDB->del(key);
 		return (FILE_OK == result);
@@ -84,8 +297,48 @@ public:
 		int result = m_pDB->replace(key, newKey);
 		return (FILE_OK == result);
 	}
+	bool incrby(uint64 key, int64 delta, int64* result){
+		int ret = m_pDB->incrby(key, delta, *result);
+		return (FILE_OK == ret);
+	}
+	bool mset(const IndexSetEntryVector& entries){
+		int result = m_pDB->mset(entries, false);
+		return (FILE_OK == result);
+	}
+	bool mget(IndexGetEntryVector& entries){
+		int result = m_pDB->mget(entries);
+		return (FILE_OK == result);
+	}
+	bool scan(uint64 start, uint64 end, uint32 limit, IndexScanVector& result){
+		int ret = m_pDB->scan(start, end, limit, result);
+		return (FILE_OK == ret);
+	}
+protected:
+	// 返回char*的get使用的缓冲区，每个线程一个
+	static CharVector& getThreadBuffer(void){
+		static thread_local CharVector buffer;
+		return buffer;
+	}
+	inline int64 getRemainSecond(uint32 expireTime){
+		if(0 == expireTime){
+			return -1;
+		}
+		return std::max((int64)expireTime - (int64)getTimeSecond(), (int64)0);
+	}
 };
 
+typedef AlphaDB<KeyValue<ALPHAKV_HASH_SLOT> > AlphaKV;
+typedef AlphaDB<Bitcask<ALPHAKV_HASH_SLOT> > AlphaBitcask;
+typedef AlphaDB<Lsm<ALPHAKV_HASH_SLOT> > AlphaLSM;
+typedef KeyValue<ALPHAKV_HASH_SLOT>::Iterator AlphaKVIterator;
+typedef ShardDB<KeyValue<ALPHAKV_HASH_SLOT> > AlphaShardKV;
+typedef AsyncDB<KeyValue<ALPHAKV_HASH_SLOT> > AlphaAsyncKV;
+typedef ReplicationServer<KeyValue<ALPHAKV_HASH_SLOT> > AlphaReplicationServer;
+typedef ReplicaClient<KeyValue<ALPHAKV_HASH_SLOT> > AlphaReplicaClient;
+#ifdef USE_COROUTINE
+typedef CoroDB<KeyValue<ALPHAKV_HASH_SLOT> > AlphaCoroKV;
+#endif
+
 NS_HIVE_END
 
 #endif /* alphakv_h */
@@ -0,0 +1,358 @@
+//
+//  async.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/17.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef async_hpp
+#define async_hpp
+
+#include "keyvalue.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+NS_HIVE_BEGIN
+
+#define ASYNC_BATCH_MAX_COUNT 4096				// 后台线程每次最多合并写入的数量
+#define ASYNC_PENDING_MAX_BYTES 268435456		// 还没有写入文件的数据超过这个大小时，新的写入等待后台线程，限制内存占用
+
+// 异步写入完成后的回调，result为写入文件的结果；在后台线程中执行，不能阻塞
+typedef std::function<void(int result)> AsyncCallback;
+
+// 一次异步写入：创建后不再修改，内存视图和写入队列共享同一个对象
+template <typename _KEY_>
+struct AsyncWrite{
+	_KEY_ key;
+	CharVector value;
+	uint32 expire;					// 过期时间（秒级时间戳），0表示不过期
+	bool isDelete;
+	AsyncCallback callback;
+	AsyncWrite(const _KEY_& k, bool del) : key(k), expire(0), isDelete(del){}
+};
+
+// 一种key的内存视图和写入队列：视图中是每个key最后一次还没有写入文件的修改
+template <typename _KEY_>
+struct AsyncOverlay{
+	typedef std::shared_ptr< AsyncWrite<_KEY_> > WritePtr;
+	typedef std::unordered_map<_KEY_, WritePtr> WriteMap;
+	typedef std::vector<WritePtr> WriteVector;
+	WriteMap writes;
+	WriteVector queue;
+};
+
+// 异步写入的数据库：写入先进入内存视图，读取立即可见；后台线程把队列中连续的写入合并成批量写入，写入文件后通过future或者回调通知；
+// 调用线程不等待磁盘（除非未写入的数据超过ASYNC_PENDING_MAX_BYTES）；写入文件失败的修改从内存视图中移除，通过返回结果通知调用者；
+// 存储引擎使用线程安全模式，读取和后台写入可以同时进行；需要写入的操作都要通过这里，直接修改引擎的数据会被内存视图覆盖
+template <typename _DB_>
+class AsyncDB
+{
+public:
+	typedef _DB_ KeyValueData;
+	typedef AsyncOverlay<std::string> KeyOverlay;
+	typedef AsyncOverlay<uint64> IndexOverlay;
+	KeyValueData* m_pDB;
+	KeyOverlay m_keys;
+	IndexOverlay m_indexes;
+	std::mutex m_mutex;
+	std::condition_variable m_writeCondition;		// 通知后台线程有新的写入
+	std::condition_variable m_doneCondition;		// 通知等待的线程有写入完成
+	std::thread m_thread;
+	std::atomic<uint64> m_pendingCount;				// 内存视图中的key数量，为0时读取不需要加锁
+	uint64 m_pendingBytes;
+	uint64 m_queuedCount;							// 队列中和正在写入的数量
+	bool m_isStop;
+public:
+	AsyncDB(void) : m_pDB(NULL), m_pendingCount(0), m_pendingBytes(0), m_queuedCount(0), m_isStop(false){}
+	virtual ~AsyncDB(void){
+		closeDB();
+	}
+	bool openDB(const char* name){
+		if(NULL != m_pDB){
+			return false;
+		}
+		m_pDB = new KeyValueData(name);
+		if(FILE_OK != m_pDB->openDB()){
+			delete m_pDB;
+			m_pDB = NULL;
+			return false;
+		}
+		m_pDB->setThreadSafe(true);
+		m_isStop = false;
+		m_thread = std::thread(&AsyncDB::run, this);
+		return true;
+	}
+	// 先写完队列中的所有修改再关闭
+	void closeDB(void){
+		if(NULL == m_pDB){
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_isStop = true;
+		}
+		m_writeCondition.notify_one();
+		m_thread.join();
+		m_pDB->closeDB();
+		delete m_pDB;
+		m_pDB = NULL;
+	}
+	// 存储引擎，用于设置和不修改数据的接口
+	inline KeyValueData* getDB(void){
+		return m_pDB;
+	}
+	// 等待之前提交的写入全部写入文件
+	void flush(void){
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCondition.wait(lock, [this](){ return 0 == m_queuedCount; });
+	}
+	// 内存视图中还没有写入文件的key数量
+	inline uint64 getPendingCount(void) const {
+		return m_pendingCount.load();
+	}
+
+	// 先读内存视图，没有修改时读存储引擎
+	bool get(const char* key, uint32 keyLength, CharVector& value){
+		int result = readOverlay(m_keys, std::string(key, keyLength), value);
+		if(FERR_KEY_NOT_FOUND == result){
+			return false;
+		}
+		if(FILE_OK != result){
+			result = m_pDB->getValue(key, keyLength, value);
+		}
+		return (FILE_OK == result);
+	}
+	std::future<int> setAsync(const char* key, uint32 keyLength, const char* value, uint32 valueLength){
+		return makeFuture([&](const AsyncCallback& callback){ setAsync(key, keyLength, value, valueLength, callback); });
+	}
+	void setAsync(const char* key, uint32 keyLength, const char* value, uint32 valueLength, const AsyncCallback& callback){
+		submit(m_keys, makeSet(std::string(key, keyLength), value, valueLength, 0, callback));
+	}
+	// 写入并设置seconds秒后过期
+	std::future<int> setexAsync(const char* key, uint32 keyLength, const char* value, uint32 valueLength, uint32 seconds){
+		return makeFuture([&](const AsyncCallback& callback){ setexAsync(key, keyLength, value, valueLength, seconds, callback); });
+	}
+	void setexAsync(const char* key, uint32 keyLength, const char* value, uint32 valueLength, uint32 seconds, const AsyncCallback& callback){
+		submit(m_keys, makeSet(std::string(key, keyLength), value, valueLength, getTimeSecond() + seconds, callback));
+	}
+	// 删除立即对读取可见；key不存在时返回结果为FERR_KEY_NOT_FOUND
+	std::future<int> delAsync(const char* key, uint32 keyLength){
+		return makeFuture([&](const AsyncCallback& callback){ delAsync(key, keyLength, callback); });
+	}
+	void delAsync(const char* key, uint32 keyLength, const AsyncCallback& callback){
+		submit(m_keys, makeDelete(std::string(key, keyLength), callback));
+	}
+
+	bool get(uint64 key, CharVector& value){
+		int result = readOverlay(m_indexes, key, value);
+		if(FERR_KEY_NOT_FOUND == result){
+			return false;
+		}
+		if(FILE_OK != result){
+			result = m_pDB->getValue(key, value);
+		}
+		return (FILE_OK == result);
+	}
+	std::future<int> setAsync(uint64 key, const char* value, uint32 valueLength){
+		return makeFuture([&](const AsyncCallback& callback){ setAsync(key, value, valueLength, callback); });
+	}
+	void setAsync(uint64 key, const char* value, uint32 valueLength, const AsyncCallback& callback){
+		submit(m_indexes, makeSet(key, value, valueLength, 0, callback));
+	}
+	std::future<int> setexAsync(uint64 key, const char* value, uint32 valueLength, uint32 seconds){
+		return makeFuture([&](const AsyncCallback& callback){ setexAsync(key, value, valueLength, seconds, callback); });
+	}
+	void setexAsync(uint64 key, const char* value, uint32 valueLength, uint32 seconds, const AsyncCallback& callback){
+		submit(m_indexes, makeSet(key, value, valueLength, getTimeSecond() + seconds, callback));
+	}
+	std::future<int> delAsync(uint64 key){
+		return makeFuture([&](const AsyncCallback& callback){ delAsync(key, callback); });
+	}
+	void delAsync(uint64 key, const AsyncCallback& callback){
+		submit(m_indexes, makeDelete(key, callback));
+	}
+protected:
+	template <typename _KEY_>
+	static std::shared_ptr< AsyncWrite<_KEY_> > makeSet(const _KEY_& key, const char* value, uint32 valueLength, uint32 expire, const AsyncCallback& callback){
+		std::shared_ptr< AsyncWrite<_KEY_> > pWrite = std::make_shared< AsyncWrite<_KEY_> >(key, false);
+		pWrite->value.assign(value, value + valueLength);
+		pWrite->expire = expire;
+		pWrite->callback = callback;
+		return pWrite;
+	}
+	template <typename _KEY_>
+	static std::shared_ptr< AsyncWrite<_KEY_> > makeDelete(const _KEY_& key, const AsyncCallback& callback){
+		std::shared_ptr< AsyncWrite<_KEY_> > pWrite = std::make_shared< AsyncWrite<_KEY_> >(key, true);
+		pWrite->callback = callback;
+		return pWrite;
+	}
+	// 回调版本的写入包装成future版本
+	static std::future<int> makeFuture(const std::function<void(const AsyncCallback& callback)>& call){
+		std::shared_ptr< std::promise<int> > pPromise = std::make_shared< std::promise<int> >();
+		std::future<int> result = pPromise->get_future();
+		call([pPromise](int ret){ pPromise->set_value(ret); });
+		return result;
+	}
+	// 读取内存视图：FILE_OK为找到，FERR_KEY_NOT_FOUND为已经删除或者过期，FERR_BLOCK_EMPTY为没有修改
+	template <typename _KEY_>
+	inline int readOverlay(AsyncOverlay<_KEY_>& overlay, const _KEY_& key, CharVector& value){
+		if(0 == m_pendingCount.load()){
+			return FERR_BLOCK_EMPTY;
+		}
+		std::lock_guard<std::mutex> guard(m_mutex);
+		typename AsyncOverlay<_KEY_>::WriteMap::iterator it = overlay.writes.find(key);
+		if(it == overlay.writes.end()){
+			return FERR_BLOCK_EMPTY;
+		}
+		const AsyncWrite<_KEY_>& write = *(it->second);
+		if(write.isDelete || (0 != write.expire && write.expire <= getTimeSecond())){
+			return FERR_KEY_NOT_FOUND;
+		}
+		value = write.value;
+		return FILE_OK;
+	}
+	// 写入内存视图和队列；未写入的数据太多时等待后台线程
+	template <typename _KEY_>
+	inline void submit(AsyncOverlay<_KEY_>& overlay, const std::shared_ptr< AsyncWrite<_KEY_> >& pWrite){
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_doneCondition.wait(lock, [this](){ return m_pendingBytes < ASYNC_PENDING_MAX_BYTES; });
+			std::shared_ptr< AsyncWrite<_KEY_> >& pLast = overlay.writes[pWrite->key];
+			if(!pLast){
+				m_pendingCount.fetch_add(1);
+			}
+			pLast = pWrite;
+			overlay.queue.push_back(pWrite);
+			m_pendingBytes += pWrite->value.size();
+			++m_queuedCount;
+		}
+		m_writeCondition.notify_one();
+	}
+	// 后台线程：每次取出队列中的全部写入（不超过ASYNC_BATCH_MAX_COUNT）合并写入；停止时先写完队列
+	void run(void){
+		while(true){
+			typename KeyOverlay::WriteVector keyBatch;
+			typename IndexOverlay::WriteVector indexBatch;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_writeCondition.wait(lock, [this](){ return m_isStop || !m_keys.queue.empty() || !m_indexes.queue.empty(); });
+				if(m_keys.queue.empty() && m_indexes.queue.empty()){
+					return;
+				}
+				takeBatch(m_keys, keyBatch);
+				takeBatch(m_indexes, indexBatch);
+			}
+			std::vector<int> keyResults;
+			std::vector<int> indexResults;
+			writeBatch(keyBatch, keyResults);
+			writeBatch(indexBatch, indexResults);
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				finishBatch(m_keys, keyBatch);
+				finishBatch(m_indexes, indexBatch);
+			}
+			m_doneCondition.notify_all();
+			// 回调不持有锁，回调中可以继续提交写入
+			for(size_t i=0; i<keyBatch.size(); ++i){
+				if(keyBatch[i]->callback){
+					keyBatch[i]->callback(keyResults[i]);
+				}
+			}
+			for(size_t i=0; i<indexBatch.size(); ++i){
+				if(indexBatch[i]->callback){
+					indexBatch[i]->callback(indexResults[i]);
+				}
+			}
+		}
+	}
+	template <typename _KEY_>
+	inline void takeBatch(AsyncOverlay<_KEY_>& overlay, typename AsyncOverlay<_KEY_>::WriteVector& batch){
+		if(overlay.queue.size() <= ASYNC_BATCH_MAX_COUNT){
+			batch.swap(overlay.queue);
+			return;
+		}
+		batch.assign(overlay.queue.begin(), overlay.queue.begin() + ASYNC_BATCH_MAX_COUNT);
+		overlay.queue.erase(overlay.queue.begin(), overlay.queue.begin() + ASYNC_BATCH_MAX_COUNT);
+	}
+	// 写入完成：内存视图中还是这次写入的key移除（之后又有修改的保留），失败的修改也随之不可见
+	template <typename _KEY_>
+	inline void finishBatch(AsyncOverlay<_KEY_>& overlay, const typename AsyncOverlay<_KEY_>::WriteVector& batch){
+		for(size_t i=0; i<batch.size(); ++i){
+			typename AsyncOverlay<_KEY_>::WriteMap::iterator it = overlay.writes.find(batch[i]->key);
+			if(it != overlay.writes.end() && it->second == batch[i]){
+				overlay.writes.erase(it);
+				m_pendingCount.fetch_sub(1);
+			}
+			m_pendingBytes -= batch[i]->value.size();
+			--m_queuedCount;
+		}
+	}
+	// 同一个key只写入批次中的最后一次修改，被覆盖的修改使用它的结果；
+	// 不过期的写入合并成一次mset，整批失败时逐个写入得到各自的结果；删除和带过期时间的写入逐个执行
+	// 回调中不能提交写入后等待它的future，future要在后台线程处理完这一批之后才能完成
+	template <typename _KEY_>
+	inline void writeBatch(const std::vector< std::shared_ptr< AsyncWrite<_KEY_> > >& batch, std::vector<int>& results){
+		results.assign(batch.size(), FILE_OK);
+		std::unordered_map<_KEY_, size_t> lastWrites;
+		for(size_t i=0; i<batch.size(); ++i){
+			lastWrites[batch[i]->key] = i;
+		}
+		std::vector<size_t> sets;
+		for(size_t i=0; i<batch.size(); ++i){
+			const AsyncWrite<_KEY_>& write = *(batch[i]);
+			if(lastWrites[write.key] != i){
+				continue;
+			}
+			if(write.isDelete){
+				results[i] = deleteKey(write.key);
+			}else if(0 != write.expire){
+				results[i] = setKey(write);
+			}else{
+				sets.push_back(i);
+			}
+		}
+		int result = (sets.size() > 1) ? setKeys(batch, sets) : FERR_BLOCK_EMPTY;
+		for(size_t i=0; i<sets.size(); ++i){
+			results[sets[i]] = (FILE_OK == result) ? FILE_OK : setKey(*(batch[sets[i]]));
+		}
+		for(size_t i=0; i<batch.size(); ++i){
+			results[i] = results[lastWrites[batch[i]->key]];
+		}
+	}
+	inline int setKey(const AsyncWrite<std::string>& write){
+		return m_pDB->set(write.key.data(), (int64)write.key.size(), write.value.data(), (int64)write.value.size(), true, false, VALUE_CODEC_DEFAULT, write.expire);
+	}
+	inline int setKey(const AsyncWrite<uint64>& write){
+		return m_pDB->set(write.key, write.value.data(), (int64)write.value.size(), true, false, VALUE_CODEC_DEFAULT, write.expire);
+	}
+	inline int deleteKey(const std::string& key){
+		return m_pDB->del(key.data(), (int64)key.size());
+	}
+	inline int deleteKey(uint64 key){
+		return m_pDB->del(key);
+	}
+	inline int setKeys(const KeyOverlay::WriteVector& batch, const std::vector<size_t>& sets){
+		KeySetEntryVector entries;
+		entries.reserve(sets.size());
+		for(size_t i=0; i<sets.size(); ++i){
+			const AsyncWrite<std::string>& write = *(batch[sets[i]]);
+			entries.push_back(KeySetEntry(write.key.data(), (int64)write.key.size(), write.value.data(), (int64)write.value.size()));
+		}
+		return m_pDB->mset(entries, false);
+	}
+	inline int setKeys(const IndexOverlay::WriteVector& batch, const std::vector<size_t>& sets){
+		IndexSetEntryVector entries;
+		entries.reserve(sets.size());
+		for(size_t i=0; i<sets.size(); ++i){
+			const AsyncWrite<uint64>& write = *(batch[sets[i]]);
+			entries.push_back(IndexSetEntry(write.key, write.value.data(), (int64)write.value.size()));
+		}
+		return m_pDB->mset(entries, false);
+	}
+};
+
+NS_HIVE_END
+
+#endif /* async_hpp */
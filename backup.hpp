@@ -0,0 +1,170 @@
+//
+//  backup.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/12.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef backup_hpp
+#define backup_hpp
+
+#include "file.hpp"
+#include <memory>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define USE_KERNEL_COPY					// 使用reflink和copy_file_range，数据不经过用户态
+// linux/fs.h会把BLOCK_SIZE重新定义为1024，这里只定义reflink需要的结构
+#ifndef FICLONERANGE
+struct file_clone_range{
+	int64 src_fd;
+	uint64 src_offset;
+	uint64 src_length;
+	uint64 dest_offset;
+};
+#define FICLONERANGE _IOW(0x94, 13, struct file_clone_range)
+#endif
+#endif
+
+NS_HIVE_BEGIN
+
+#define BACKUP_COPY_CHUNK_SIZE 67108864	// 复制文件时每次复制的最大长度
+#define BACKUP_BUFFER_SIZE 4194304		// 不支持内核复制时读写复制的缓冲区长度
+#define BACKUP_MARK_EXT ".ckpt"			// 备份完成的标记文件，没有这个文件的备份不完整
+
+// 一次在线备份需要写入的内容，由后台线程执行
+typedef struct CheckpointJob{
+	std::string source;					// 数据文件的文件名
+	std::string target;					// 备份的名称，备份文件为target.v/.k/.i/.d
+	int64 length;						// 开始备份时数据文件的长度
+	bool isIncremental;					// 增量备份只复制dirtyBits中的区域
+	std::vector<uint64> dirtyBits;
+	CharVector keyImage;				// .k文件的内容
+	CharVector indexImage;				// .i文件的内容
+	CharVector dictionary;				// .d文件的内容
+	bool isCloneFailed;					// reflink失败过一次就不再尝试
+	CheckpointJob(void) : length(0), isIncremental(false), isCloneFailed(false){}
+}CheckpointJob;
+
+// 复制文件的一段到目标文件的相同位置：优先使用reflink共享数据块，其次copy_file_range在内核中复制，最后读写复制
+inline bool copyFileRegion(CheckpointJob* pJob, int inFd, int outFd, int64 offset, int64 length){
+#ifdef USE_KERNEL_COPY
+#ifdef FICLONERANGE
+	if(!pJob->isCloneFailed){
+		struct file_clone_range range;
+		range.src_fd = inFd;
+		range.src_offset = (uint64)offset;
+		range.src_length = (uint64)length;
+		range.dest_offset = (uint64)offset;
+		if(0 == ioctl(outFd, FICLONERANGE, &range)){
+			return true;
+		}
+		pJob->isCloneFailed = true;
+	}
+#endif
+#ifdef SYS_copy_file_range
+	loff_t inOffset = offset;
+	loff_t outOffset = offset;
+	while(length > 0){
+		ssize_t n = syscall(SYS_copy_file_range, inFd, &inOffset, outFd, &outOffset, (size_t)length, 0);
+		if(n <= 0){
+			break;
+		}
+		length -= n;
+	}
+	if(0 == length){
+		return true;
+	}
+	offset = inOffset;
+#endif
+#endif
+	CharVector buffer(std::min(length, (int64)BACKUP_BUFFER_SIZE));
+	while(length > 0){
+		ssize_t n = pread(inFd, buffer.data(), (size_t)std::min(length, (int64)buffer.size()), offset);
+		if(n <= 0){
+			return false;
+		}
+		for(ssize_t written=0; written<n; ){
+			ssize_t w = pwrite(outFd, buffer.data() + written, (size_t)(n - written), offset + written);
+			if(w <= 0){
+				return false;
+			}
+			written += w;
+		}
+		offset += n;
+		length -= n;
+	}
+	return true;
+}
+// 执行备份：先复制数据文件，再写入key文件和字典，最后写入完成标记
+inline int runCheckpoint(std::shared_ptr<CheckpointJob> pJob){
+	std::string markName = pJob->target + BACKUP_MARK_EXT;
+	unlink(markName.c_str());
+	int inFd = open(pJob->source.c_str(), O_RDONLY);
+	if(-1 == inFd){
+		fprintf(stderr, "runCheckpoint open source failed file=%s\n", pJob->source.c_str());
+		return FERR_CHECKPOINT_FAILED;
+	}
+	std::string valueName = pJob->target + ".v";
+	int outFd = open(valueName.c_str(), O_WRONLY|O_CREAT|(pJob->isIncremental ? 0 : O_TRUNC), 0644);
+	if(-1 == outFd){
+		close(inFd);
+		fprintf(stderr, "runCheckpoint open target failed file=%s\n", valueName.c_str());
+		return FERR_CHECKPOINT_FAILED;
+	}
+	bool ok = (0 == ftruncate(outFd, pJob->length));
+	if(pJob->isIncremental){
+		// 连续的脏区域合并成一次复制
+		uint64 regionCount = pJob->dirtyBits.size() * 64;
+		uint64 region = 0;
+		while(ok && region < regionCount){
+			if(0 == (pJob->dirtyBits[region >> 6] & ((uint64)1 << (region & 63)))){
+				++region;
+				continue;
+			}
+			uint64 end = region + 1;
+			while(end < regionCount && 0 != (pJob->dirtyBits[end >> 6] & ((uint64)1 << (end & 63)))){
+				++end;
+			}
+			int64 offset = (int64)(region << DIRTY_REGION_SHIFT);
+			int64 endOffset = std::min((int64)(end << DIRTY_REGION_SHIFT), pJob->length);
+			if(offset < endOffset){
+				ok = copyFileRegion(pJob.get(), inFd, outFd, offset, endOffset - offset);
+			}
+			region = end;
+		}
+	}else{
+		for(int64 offset=0; ok && offset<pJob->length; offset+=BACKUP_COPY_CHUNK_SIZE){
+			ok = copyFileRegion(pJob.get(), inFd, outFd, offset, std::min((int64)BACKUP_COPY_CHUNK_SIZE, pJob->length - offset));
+		}
+	}
+	ok = ok && (0 == fsync(outFd));
+	close(outFd);
+	close(inFd);
+	if(!ok){
+		fprintf(stderr, "runCheckpoint copy value failed file=%s\n", valueName.c_str());
+		return FERR_CHECKPOINT_FAILED;
+	}
+	std::string dictName = pJob->target + ".d";
+	if(pJob->dictionary.empty()){
+		unlink(dictName.c_str());
+	}else if(!writeWholeFile(dictName, pJob->dictionary)){
+		return FERR_CHECKPOINT_FAILED;
+	}
+	if(!writeWholeFile(pJob->target + ".k", pJob->keyImage) || !writeWholeFile(pJob->target + ".i", pJob->indexImage)){
+		fprintf(stderr, "runCheckpoint write key failed target=%s\n", pJob->target.c_str());
+		return FERR_CHECKPOINT_FAILED;
+	}
+	CharVector mark((const char*)&(pJob->length), (const char*)&(pJob->length) + sizeof(int64));
+	if(!writeWholeFile(markName, mark)){
+		return FERR_CHECKPOINT_FAILED;
+	}
+	return FILE_OK;
+}
+
+NS_HIVE_END
+
+#endif /* backup_hpp */
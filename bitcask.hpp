@@ -0,0 +1,871 @@
+//
+//  bitcask.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/8.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef bitcask_hpp
+#define bitcask_hpp
+
+#include "keyvalue.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+NS_HIVE_BEGIN
+
+#define BITCASK_SEGMENT_SIZE 67108864		// 数据段写满这个长度后封存，之后的数据写入新的数据段
+#define BITCASK_MERGE_DEAD_PERCENT 50		// 失效数据超过这个比例的封存数据段由后台线程合并
+#define BITCASK_MERGE_INTERVAL 1000			// 后台合并线程的检查间隔（毫秒）
+#define BITCASK_MERGE_BATCH 256				// 合并时每次加锁处理的记录数量
+#define BITCASK_SEGMENT_EXT ".seg"
+#define BITCASK_HINT_EXT ".hint"
+
+enum BitcaskRecordType{
+	BITCASK_PUT_KEY = 1,			// 字符串key的数据
+	BITCASK_PUT_INDEX = 2,			// 数字key的数据
+	BITCASK_DEL_KEY = 3,			// 字符串key的删除标记
+	BITCASK_DEL_INDEX = 4,			// 数字key的删除标记
+};
+
+// 数据段中每条记录的头部，后面紧跟字符串key和value
+typedef struct BitcaskHeader{
+	uint32 crc;					// crc之后的头部、key和value的crc32
+	uint32 expire;				// 过期时间（秒），0表示不过期
+	uint32 valueLength;
+	uint16 keyLength;			// 字符串key的长度，数字key为0
+	uint8 type;					// BitcaskRecordType
+	uint8 reserved;
+	uint64 index;				// 数字key
+	BitcaskHeader(void){ memset(this, 0, sizeof(BitcaskHeader)); }
+	inline bool isPut(void) const { return (BITCASK_PUT_KEY == type || BITCASK_PUT_INDEX == type); }
+	inline bool isIndex(void) const { return (BITCASK_PUT_INDEX == type || BITCASK_DEL_INDEX == type); }
+	inline int64 getRecordLength(void) const { return (int64)sizeof(BitcaskHeader) + keyLength + valueLength; }
+}BitcaskHeader;
+
+// hint文件的记录：数据段中一条记录的偏移和头部，后面紧跟字符串key；启动时读取hint不需要扫描整个数据段
+typedef struct BitcaskHint{
+	int64 offset;
+	BitcaskHeader header;
+}BitcaskHint;
+
+// 内存中key对应的记录位置
+typedef struct BitcaskEntry{
+	uint32 segment;				// 数据段编号
+	uint32 expire;
+	int64 offset;				// 记录在数据段中的偏移
+	uint32 length;				// 记录的总长度
+	uint32 valueLength;
+	BitcaskEntry(uint32 s, int64 o, const BitcaskHeader& h) : segment(s), expire(h.expire), offset(o), length((uint32)h.getRecordLength()), valueLength(h.valueLength){}
+	BitcaskEntry(void) : segment(0), expire(0), offset(0), length(0), valueLength(0){}
+	inline int64 getValueOffset(void) const { return offset + length - valueLength; }
+	inline bool isExpired(uint32 now) const { return (0 != expire && expire <= now); }
+}BitcaskEntry;
+
+// 只追加写入的数据段文件
+class BitcaskSegment : public File
+{
+public:
+	uint32 m_id;
+	int64 m_deadLength;				// 已经失效的记录长度
+	CharVector m_hints;				// 活动数据段的hint数据，封存时写入hint文件
+public:
+	BitcaskSegment(const std::string& name, uint32 id) : File(name, getNumberExt(id, BITCASK_SEGMENT_EXT)), m_id(id), m_deadLength(0) {}
+	virtual ~BitcaskSegment(void){}
+	inline bool isMergeable(void) const {
+		return (m_fileLength > 0 && m_deadLength * 100 >= m_fileLength * BITCASK_MERGE_DEAD_PERCENT);
+	}
+};
+
+// 日志结构的存储引擎：所有写入追加到数据段末尾，内存中的key指向(数据段, 偏移)；
+// 写满的数据段封存并生成hint文件，失效数据较多的封存数据段由后台线程把有效数据重写到活动数据段后删除
+template <uint64 _KEY_SLOT_NUMBER_>
+class Bitcask
+{
+public:
+	typedef std::unordered_map<std::string, BitcaskEntry> KeyEntryMap;
+	typedef std::unordered_map<uint64, BitcaskEntry> IndexEntryMap;
+	typedef std::map<uint32, BitcaskSegment*> SegmentMap;
+	// 一条等待追加的记录
+	typedef struct BitcaskWrite{
+		BitcaskHeader header;
+		const char* key;
+		const char* value;
+		uint32 segment;					// 写入后的位置
+		int64 offset;
+		BitcaskWrite(const BitcaskHeader& h, const char* k, const char* v) : header(h), key(k), value(v), segment(0), offset(0){}
+	}BitcaskWrite;
+	typedef std::vector<BitcaskWrite> BitcaskWriteVector;
+
+	std::string m_name;
+	KeyEntryMap m_keyMapArray[_KEY_SLOT_NUMBER_];
+	IndexEntryMap m_indexMap;
+	SegmentMap m_segments;
+	BitcaskSegment* m_pActive;				// 当前追加写入的数据段
+	TimerWheel<std::string> m_keyTimers;
+	TimerWheel<uint64> m_indexTimers;
+	std::mutex m_mutex;						// 保护内存索引和活动数据段，后台合并和调用者的操作互斥
+	std::condition_variable m_condition;
+	std::thread m_mergeThread;
+	bool m_isRunning;
+	int64 m_segmentSize;					// 数据段封存的长度
+public:
+	Bitcask(const std::string& name) : m_name(name), m_pActive(NULL), m_isRunning(false), m_segmentSize(BITCASK_SEGMENT_SIZE) {}
+	virtual ~Bitcask(void){
+		closeDB();
+	}
+	// 写入value；Bitcask模式的value总是带有长度，不做压缩，recordLength和codec参数忽略
+	inline int set(const char* key, int64 keyLen, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec = VALUE_CODEC_DEFAULT, uint32 expire = 0){
+		if(keyLen >= MAX_KEY_LENGTH){
+			return FERR_KEY_IS_TOO_LONG;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		expireTick();
+		if(setNotExist && NULL != findEntry(key, keyLen)){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_KEY, keyLen, 0, valueLen, expire), key, (const char*)value));
+		if(!appendRecords(writes)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		return FILE_OK;
+	}
+	inline int set(uint64 key, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec = VALUE_CODEC_DEFAULT, uint32 expire = 0){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		expireTick();
+		if(setNotExist && NULL != findEntry(key)){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_INDEX, 0, key, valueLen, expire), NULL, (const char*)value));
+		if(!appendRecords(writes)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		return FILE_OK;
+	}
+	inline int get(const char* key, int64 keyLen, char* buffer, int64 bufferSize, int64* length){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key, keyLen);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return readEntry(*pEntry, buffer, bufferSize, length);
+	}
+	inline int get(uint64 key, char* buffer, int64 bufferSize, int64* length){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return readEntry(*pEntry, buffer, bufferSize, length);
+	}
+	inline int getValue(const char* key, int64 keyLen, CharVector& value){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key, keyLen);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return readEntry(*pEntry, value);
+	}
+	inline int getValue(uint64 key, CharVector& value){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return readEntry(*pEntry, value);
+	}
+	// 删除时追加一条删除标记，重启时用来覆盖之前的数据
+	inline int del(const char* key, int64 keyLen){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		expireTick();
+		if(NULL == findEntry(key, keyLen)){
+			return FERR_KEY_NOT_FOUND;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_DEL_KEY, keyLen, 0, 0, 0), key, NULL));
+		if(!appendRecords(writes)){
+			return FERR_KEY_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		return FILE_OK;
+	}
+	inline int del(uint64 key){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		expireTick();
+		if(NULL == findEntry(key)){
+			return FERR_KEY_NOT_FOUND;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_DEL_INDEX, 0, key, 0, 0), NULL, NULL));
+		if(!appendRecords(writes)){
+			return FERR_KEY_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		return FILE_OK;
+	}
+	// 新key的数据和旧key的删除标记一次追加写入
+	inline int replace(const char* key, uint64 length, const char* newKey, uint64 newLength){
+		if(newLength >= MAX_KEY_LENGTH){
+			return FERR_KEY_IS_TOO_LONG;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key, length);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		if(NULL != findEntry(newKey, newLength)){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		CharVector value;
+		int result = readEntry(*pEntry, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_KEY, newLength, 0, value.size(), pEntry->expire), newKey, value.data()));
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_DEL_KEY, length, 0, 0, 0), key, NULL));
+		if(!appendRecords(writes)){
+			return FERR_KEY_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		applyWrite(writes[1]);
+		return FILE_OK;
+	}
+	inline int replace(uint64 key, uint64 newKey){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		if(NULL != findEntry(newKey)){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		CharVector value;
+		int result = readEntry(*pEntry, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_INDEX, 0, newKey, value.size(), pEntry->expire), NULL, value.data()));
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_DEL_INDEX, 0, key, 0, 0), NULL, NULL));
+		if(!appendRecords(writes)){
+			return FERR_KEY_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		applyWrite(writes[1]);
+		return FILE_OK;
+	}
+	// 批量写入：整批记录一次追加写入；重复的key以最后一个为准
+	inline int mset(const KeySetEntryVector& entries, bool setNotExist, int codec = VALUE_CODEC_DEFAULT){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		expireTick();
+		BitcaskWriteVector writes;
+		writes.reserve(entries.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			const KeySetEntry& entry = entries[i];
+			if(entry.keyLen >= MAX_KEY_LENGTH){
+				return FERR_KEY_IS_TOO_LONG;
+			}
+			if(setNotExist && NULL != findEntry(entry.key, entry.keyLen)){
+				return FERR_KEY_ALREADY_EXIST;
+			}
+			writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_KEY, entry.keyLen, 0, entry.valueLen, 0), entry.key, (const char*)entry.value));
+		}
+		if(!appendRecords(writes)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		for(size_t i=0; i<writes.size(); ++i){
+			applyWrite(writes[i]);
+		}
+		return FILE_OK;
+	}
+	inline int mset(const IndexSetEntryVector& entries, bool setNotExist, int codec = VALUE_CODEC_DEFAULT){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		expireTick();
+		BitcaskWriteVector writes;
+		writes.reserve(entries.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			const IndexSetEntry& entry = entries[i];
+			if(setNotExist && NULL != findEntry(entry.key)){
+				return FERR_KEY_ALREADY_EXIST;
+			}
+			writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_INDEX, 0, entry.key, entry.valueLen, 0), NULL, (const char*)entry.value));
+		}
+		if(!appendRecords(writes)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		for(size_t i=0; i<writes.size(); ++i){
+			applyWrite(writes[i]);
+		}
+		return FILE_OK;
+	}
+	inline int mget(KeyGetEntryVector& entries){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for(size_t i=0; i<entries.size(); ++i){
+			KeyGetEntry& entry = entries[i];
+			BitcaskEntry* pEntry = findEntry(entry.key, entry.keyLen);
+			entry.length = 0;
+			entry.result = (NULL == pEntry) ? FERR_KEY_NOT_FOUND : readEntry(*pEntry, entry.buffer, entry.bufferSize, &(entry.length));
+		}
+		return FILE_OK;
+	}
+	inline int mget(IndexGetEntryVector& entries){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for(size_t i=0; i<entries.size(); ++i){
+			IndexGetEntry& entry = entries[i];
+			BitcaskEntry* pEntry = findEntry(entry.key);
+			entry.length = 0;
+			entry.result = (NULL == pEntry) ? FERR_KEY_NOT_FOUND : readEntry(*pEntry, entry.buffer, entry.bufferSize, &(entry.length));
+		}
+		return FILE_OK;
+	}
+	// 修改过期时间需要重新追加一条记录
+	inline int setExpire(const char* key, int64 keyLen, uint32 expire){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key, keyLen);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		if(pEntry->expire == expire){
+			return FILE_OK;
+		}
+		CharVector value;
+		int result = readEntry(*pEntry, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_KEY, keyLen, 0, value.size(), expire), key, value.data()));
+		if(!appendRecords(writes)){
+			return FERR_KEY_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		return FILE_OK;
+	}
+	inline int setExpire(uint64 key, uint32 expire){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		if(pEntry->expire == expire){
+			return FILE_OK;
+		}
+		CharVector value;
+		int result = readEntry(*pEntry, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		BitcaskWriteVector writes;
+		writes.push_back(BitcaskWrite(makeHeader(BITCASK_PUT_INDEX, 0, key, value.size(), expire), NULL, value.data()));
+		if(!appendRecords(writes)){
+			return FERR_KEY_SET_FAILED;
+		}
+		applyWrite(writes[0]);
+		return FILE_OK;
+	}
+	inline int getExpire(const char* key, int64 keyLen, uint32& expire){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key, keyLen);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		expire = pEntry->expire;
+		return FILE_OK;
+	}
+	inline int getExpire(uint64 key, uint32& expire){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskEntry* pEntry = findEntry(key);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		expire = pEntry->expire;
+		return FILE_OK;
+	}
+	// 到期的key从内存索引中删除，记录占用的空间计入失效数据，由合并回收；不需要写入删除标记
+	inline int64 expireCycle(int64 maxCount){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return reclaimExpired(maxCount);
+	}
+	// 设置数据段封存的长度，在openDB之前调用
+	inline void setSegmentSize(int64 size){
+		m_segmentSize = std::max(size, (int64)sizeof(BitcaskHeader));
+	}
+	// 立即合并所有失效数据超过比例的封存数据段，返回合并的数据段数量
+	inline int64 merge(void){
+		int64 count = 0;
+		uint32 id;
+		while(findMergeSegment(id)){
+			if(!mergeSegment(id)){
+				break;
+			}
+			++count;
+		}
+		return count;
+	}
+	int openDB(void){
+		std::vector<uint32> ids;
+		if(!listFileNumbers(m_name, BITCASK_SEGMENT_EXT, ids)){
+			return FERR_OPENRW_FAILED;
+		}
+		uint32 now = getTimeSecond();
+		m_keyTimers.reset(now);
+		m_indexTimers.reset(now);
+		for(size_t i=0; i<ids.size(); ++i){
+			BitcaskSegment* pSegment = new BitcaskSegment(m_name, ids[i]);
+			m_segments.insert(std::make_pair(ids[i], pSegment));
+			if(FILE_OK != pSegment->touchFile(NULL, 0) || !pSegment->openReadWrite("rb+")){
+				return FERR_OPENRW_FAILED;
+			}
+			// 封存的数据段优先读取hint文件，最后一个数据段可能还在写入，总是扫描并截掉不完整的记录
+			bool isLast = (i + 1 == ids.size());
+			if(isLast || !loadHint(pSegment)){
+				int result = loadSegment(pSegment, isLast);
+				if(FILE_OK != result){
+					return result;
+				}
+			}
+		}
+		if(ids.empty() || m_segments.rbegin()->second->m_fileLength >= m_segmentSize){
+			if(!rollSegment()){
+				return FERR_OPENRW_FAILED;
+			}
+		}else{
+			m_pActive = m_segments.rbegin()->second;
+		}
+		m_isRunning = true;
+		m_mergeThread = std::thread(&Bitcask::mergeLoop, this);
+		return FILE_OK;
+	}
+	void closeDB(void){
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_isRunning = false;
+		}
+		m_condition.notify_all();
+		if(m_mergeThread.joinable()){
+			m_mergeThread.join();
+		}
+		for(typename SegmentMap::iterator it = m_segments.begin(); it != m_segments.end(); ++it){
+#ifdef USE_STREAM_FILE
+			it->second->flush();
+#endif
+			delete it->second;
+		}
+		m_segments.clear();
+		m_pActive = NULL;
+	}
+protected:
+	inline BitcaskHeader makeHeader(uint8 type, int64 keyLen, uint64 index, int64 valueLen, uint32 expire){
+		BitcaskHeader header;
+		header.type = type;
+		header.keyLength = (uint16)keyLen;
+		header.index = index;
+		header.valueLength = (uint32)valueLen;
+		header.expire = expire;
+		return header;
+	}
+	inline uint32 getRecordCrc(const BitcaskHeader& header, const char* key, const char* value){
+		uLong crc = crc32(0L, (const Bytef*)&header + 4, sizeof(BitcaskHeader) - 4);
+		if(header.keyLength > 0){
+			crc = crc32(crc, (const Bytef*)key, header.keyLength);
+		}
+		if(header.valueLength > 0){
+			crc = crc32(crc, (const Bytef*)value, header.valueLength);
+		}
+		return (uint32)crc;
+	}
+	inline KeyEntryMap& findKeyEntryMap(const char* key, int64 keyLen){
+		uint64 hash = binary_hash(key, (int)keyLen, BINARY_HASH_SEED);
+		return m_keyMapArray[hash % _KEY_SLOT_NUMBER_];
+	}
+	// 查找没有过期的key
+	inline BitcaskEntry* findEntry(const char* key, int64 keyLen){
+		KeyEntryMap& kvMap = findKeyEntryMap(key, keyLen);
+		typename KeyEntryMap::iterator itCur = kvMap.find(std::string(key, keyLen));
+		if(itCur == kvMap.end() || itCur->second.isExpired(getTimeSecond())){
+			return NULL;
+		}
+		return &(itCur->second);
+	}
+	inline BitcaskEntry* findEntry(uint64 key){
+		typename IndexEntryMap::iterator itCur = m_indexMap.find(key);
+		if(itCur == m_indexMap.end() || itCur->second.isExpired(getTimeSecond())){
+			return NULL;
+		}
+		return &(itCur->second);
+	}
+	inline void addDeadLength(uint32 segment, int64 length){
+		typename SegmentMap::iterator itCur = m_segments.find(segment);
+		if(itCur != m_segments.end()){
+			itCur->second->m_deadLength += length;
+		}
+	}
+	// 把一条已经写入（或者启动时读取到）的记录应用到内存索引，被覆盖的记录计入失效数据
+	inline void applyRecord(uint32 segment, int64 offset, const BitcaskHeader& header, const char* key){
+		BitcaskEntry entry(segment, offset, header);
+		if(header.isIndex()){
+			typename IndexEntryMap::iterator itCur = m_indexMap.find(header.index);
+			if(itCur != m_indexMap.end()){
+				addDeadLength(itCur->second.segment, itCur->second.length);
+				if(header.isPut()){
+					itCur->second = entry;
+				}else{
+					m_indexMap.erase(itCur);
+				}
+			}else if(header.isPut()){
+				m_indexMap.insert(std::make_pair(header.index, entry));
+			}
+			if(header.isPut() && 0 != header.expire){
+				m_indexTimers.add(header.index, header.expire);
+			}
+		}else{
+			std::string keyString(key, header.keyLength);
+			KeyEntryMap& kvMap = findKeyEntryMap(key, header.keyLength);
+			typename KeyEntryMap::iterator itCur = kvMap.find(keyString);
+			if(itCur != kvMap.end()){
+				addDeadLength(itCur->second.segment, itCur->second.length);
+				if(header.isPut()){
+					itCur->second = entry;
+				}else{
+					kvMap.erase(itCur);
+				}
+			}else if(header.isPut()){
+				kvMap.insert(std::make_pair(keyString, entry));
+			}
+			if(header.isPut() && 0 != header.expire){
+				m_keyTimers.add(keyString, header.expire);
+			}
+		}
+		// 删除标记只用于重启时覆盖之前的数据，本身就是失效数据
+		if(!header.isPut()){
+			addDeadLength(segment, header.getRecordLength());
+		}
+	}
+	inline void applyWrite(const BitcaskWrite& write){
+		applyRecord(write.segment, write.offset, write.header, write.key);
+	}
+	// 追加写入一批记录：整批使用一次向量写入；写入后活动数据段超过长度就封存
+	inline bool appendRecords(BitcaskWriteVector& writes){
+		if(NULL == m_pActive){
+			return false;
+		}
+		BitcaskSegment* pSegment = m_pActive;
+		WriteSegmentVector segments;
+		segments.reserve(writes.size() * 3);
+		int64 offset = pSegment->m_fileLength;
+		for(size_t i=0; i<writes.size(); ++i){
+			BitcaskWrite& write = writes[i];
+			write.header.crc = getRecordCrc(write.header, write.key, write.value);
+			write.segment = pSegment->m_id;
+			write.offset = offset;
+			segments.push_back(WriteSegment(offset, &(write.header), sizeof(BitcaskHeader)));
+			offset += sizeof(BitcaskHeader);
+			if(write.header.keyLength > 0){
+				segments.push_back(WriteSegment(offset, write.key, write.header.keyLength));
+				offset += write.header.keyLength;
+			}
+			if(write.header.valueLength > 0){
+				segments.push_back(WriteSegment(offset, write.value, write.header.valueLength));
+				offset += write.header.valueLength;
+			}
+		}
+		if(!pSegment->saveSegments(segments)){
+			return false;
+		}
+		for(size_t i=0; i<writes.size(); ++i){
+			addHint(pSegment, writes[i].offset, writes[i].header, writes[i].key);
+		}
+		if(pSegment->m_fileLength >= m_segmentSize){
+			rollSegment();
+		}
+		return true;
+	}
+	inline void addHint(BitcaskSegment* pSegment, int64 offset, const BitcaskHeader& header, const char* key){
+		BitcaskHint hint;
+		hint.offset = offset;
+		hint.header = header;
+		CharVector& hints = pSegment->m_hints;
+		hints.insert(hints.end(), (const char*)&hint, (const char*)&hint + sizeof(BitcaskHint));
+		if(header.keyLength > 0){
+			hints.insert(hints.end(), key, key + header.keyLength);
+		}
+	}
+	// 封存当前的活动数据段（写入hint文件），创建新的活动数据段
+	inline bool rollSegment(void){
+		uint32 id = 1;
+		if(NULL != m_pActive){
+			saveHint(m_pActive);
+		}
+		if(!m_segments.empty()){
+			id = m_segments.rbegin()->first + 1;
+		}
+		BitcaskSegment* pSegment = new BitcaskSegment(m_name, id);
+		if(FILE_OK != pSegment->touchFile(NULL, 0) || !pSegment->openReadWrite("rb+")){
+			delete pSegment;
+			return false;
+		}
+		m_segments.insert(std::make_pair(id, pSegment));
+		m_pActive = pSegment;
+		return true;
+	}
+	inline void saveHint(BitcaskSegment* pSegment){
+		File hintFile(m_name, getNumberExt(pSegment->m_id, BITCASK_HINT_EXT));
+		if(FILE_OK == hintFile.touchFile(NULL, 0) && hintFile.openReadWrite("rb+")){
+			WriteSegmentVector segments;
+			if(!pSegment->m_hints.empty()){
+				segments.push_back(WriteSegment(0, pSegment->m_hints.data(), (int64)pSegment->m_hints.size()));
+			}
+			if(hintFile.saveSegments(segments)){
+				hintFile.flush();
+			}
+		}
+		CharVector().swap(pSegment->m_hints);
+	}
+	inline bool loadHint(BitcaskSegment* pSegment){
+		File hintFile(m_name, getNumberExt(pSegment->m_id, BITCASK_HINT_EXT));
+		if(0 != access(hintFile.m_fileName.c_str(), F_OK) || FILE_OK != hintFile.touchFile(NULL, 0) || !hintFile.openReadWrite("rb+")){
+			return false;
+		}
+		CharVector hints(hintFile.m_fileLength);
+		if(hintFile.m_fileLength != hintFile.seekRead(hints.data(), 1, hintFile.m_fileLength, 0, SEEK_SET)){
+			return false;
+		}
+		int64 position = 0;
+		int64 length = (int64)hints.size();
+		while(position + (int64)sizeof(BitcaskHint) <= length){
+			BitcaskHint hint;
+			memcpy(&hint, hints.data() + position, sizeof(BitcaskHint));
+			position += sizeof(BitcaskHint);
+			if(position + hint.header.keyLength > length){
+				break;
+			}
+			applyRecord(pSegment->m_id, hint.offset, hint.header, hints.data() + position);
+			position += hint.header.keyLength;
+		}
+		return true;
+	}
+	// 扫描数据段的所有记录；遇到不完整或者校验失败的记录时停止，truncate为true时截掉后面的数据
+	inline int loadSegment(BitcaskSegment* pSegment, bool truncate){
+		CharVector data(pSegment->m_fileLength);
+		if(pSegment->m_fileLength != pSegment->seekRead(data.data(), 1, pSegment->m_fileLength, 0, SEEK_SET)){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		int64 position = 0;
+		int64 length = (int64)data.size();
+		while(position + (int64)sizeof(BitcaskHeader) <= length){
+			BitcaskHeader header;
+			memcpy(&header, data.data() + position, sizeof(BitcaskHeader));
+			if(header.type < BITCASK_PUT_KEY || header.type > BITCASK_DEL_INDEX || position + header.getRecordLength() > length){
+				break;
+			}
+			const char* key = data.data() + position + sizeof(BitcaskHeader);
+			if(header.crc != getRecordCrc(header, key, key + header.keyLength)){
+				break;
+			}
+			applyRecord(pSegment->m_id, position, header, key);
+			addHint(pSegment, position, header, key);
+			position += header.getRecordLength();
+		}
+		if(position < length){
+			fprintf(stderr, "Bitcask::loadSegment file=%s broken at offset=%lld length=%lld\n", pSegment->m_fileName.c_str(), position, length);
+			if(truncate){
+				if(0 != ::truncate(pSegment->m_fileName.c_str(), position)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				pSegment->m_fileLength = position;
+			}
+		}
+		if(!truncate){
+			saveHint(pSegment);
+		}
+		return FILE_OK;
+	}
+	inline BitcaskSegment* findSegment(uint32 id){
+		typename SegmentMap::iterator itCur = m_segments.find(id);
+		if(itCur == m_segments.end()){
+			return NULL;
+		}
+		return itCur->second;
+	}
+	inline int readEntry(const BitcaskEntry& entry, char* buffer, int64 bufferSize, int64* length){
+		*length = entry.valueLength;
+		if(*length > bufferSize){
+			return FERR_BUFFER_TOO_SMALL;
+		}
+		BitcaskSegment* pSegment = findSegment(entry.segment);
+		if(NULL == pSegment){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		ReadSegmentVector segments;
+		segments.push_back(ReadSegment(entry.getValueOffset(), buffer, entry.valueLength));
+		return pSegment->loadSegments(segments) ? FILE_OK : FERR_BLOCK_READ_FAIL;
+	}
+	inline int readEntry(const BitcaskEntry& entry, CharVector& value){
+		value.resize(entry.valueLength);
+		int64 length = 0;
+		int result = readEntry(entry, value.data(), (int64)value.size(), &length);
+		if(FILE_OK != result){
+			value.clear();
+		}
+		return result;
+	}
+	inline void expireTick(void){
+		uint32 now = getTimeSecond();
+		if(m_keyTimers.hasReady(now) || m_indexTimers.hasReady(now)){
+			reclaimExpired(EXPIRE_CYCLE_WORK);
+		}
+	}
+	inline int64 reclaimExpired(int64 maxCount){
+		uint32 now = getTimeSecond();
+		m_keyTimers.advance(now);
+		m_indexTimers.advance(now);
+		int64 work = 0;
+		int64 count = 0;
+		std::string key;
+		uint32 expire;
+		while(work < maxCount && m_keyTimers.pop(key, expire)){
+			++work;
+			KeyEntryMap& kvMap = findKeyEntryMap(key.data(), key.length());
+			typename KeyEntryMap::iterator itCur = kvMap.find(key);
+			if(itCur != kvMap.end() && itCur->second.expire == expire){
+				addDeadLength(itCur->second.segment, itCur->second.length);
+				kvMap.erase(itCur);
+				++count;
+			}
+		}
+		uint64 index;
+		while(work < maxCount && m_indexTimers.pop(index, expire)){
+			++work;
+			typename IndexEntryMap::iterator itCur = m_indexMap.find(index);
+			if(itCur != m_indexMap.end() && itCur->second.expire == expire){
+				addDeadLength(itCur->second.segment, itCur->second.length);
+				m_indexMap.erase(itCur);
+				++count;
+			}
+		}
+		return count;
+	}
+	// 找到最早的一个需要合并的封存数据段
+	inline bool findMergeSegment(uint32& id){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(!m_isRunning){
+			return false;
+		}
+		for(typename SegmentMap::iterator it = m_segments.begin(); it != m_segments.end(); ++it){
+			if(it->second != m_pActive && it->second->isMergeable()){
+				id = it->first;
+				return true;
+			}
+		}
+		return false;
+	}
+	// 记录是不是仍然有效：内存索引仍然指向这条记录，删除标记在更早的数据段还存在并且key没有重新写入时需要保留
+	inline bool isLiveRecord(uint32 segment, int64 offset, const BitcaskHeader& header, const char* key){
+		if(header.isPut()){
+			BitcaskEntry* pEntry = header.isIndex() ? findEntry(header.index) : findEntry(key, header.keyLength);
+			return (NULL != pEntry && pEntry->segment == segment && pEntry->offset == offset);
+		}
+		if(m_segments.begin()->first >= segment){
+			return false;
+		}
+		if(header.isIndex()){
+			return (m_indexMap.find(header.index) == m_indexMap.end());
+		}
+		KeyEntryMap& kvMap = findKeyEntryMap(key, header.keyLength);
+		return (kvMap.find(std::string(key, header.keyLength)) == kvMap.end());
+	}
+	// 合并一个封存的数据段：有效的记录重新追加到活动数据段，完成后删除这个数据段和hint文件
+	inline bool mergeSegment(uint32 id){
+		std::string fileName;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			BitcaskSegment* pSegment = findSegment(id);
+			if(NULL == pSegment || pSegment == m_pActive){
+				return false;
+			}
+			fileName = pSegment->m_fileName;
+		}
+		// 封存的数据段不会再修改，使用单独的文件句柄读取，不需要加锁
+		File reader(fileName, "");
+		if(FILE_OK != reader.touchFile(NULL, 0) || !reader.openReadWrite("rb+")){
+			return false;
+		}
+		CharVector data(reader.m_fileLength);
+		if(reader.m_fileLength != reader.seekRead(data.data(), 1, reader.m_fileLength, 0, SEEK_SET)){
+			return false;
+		}
+		reader.closeReadWrite();
+		int64 position = 0;
+		int64 length = (int64)data.size();
+		while(position < length){
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(!m_isRunning && m_mergeThread.get_id() == std::this_thread::get_id()){
+				return false;
+			}
+			BitcaskWriteVector writes;
+			for(int i=0; i<BITCASK_MERGE_BATCH && position + (int64)sizeof(BitcaskHeader) <= length; ++i){
+				BitcaskHeader header;
+				memcpy(&header, data.data() + position, sizeof(BitcaskHeader));
+				if(header.type < BITCASK_PUT_KEY || header.type > BITCASK_DEL_INDEX || position + header.getRecordLength() > length){
+					position = length;
+					break;
+				}
+				const char* key = data.data() + position + sizeof(BitcaskHeader);
+				if(isLiveRecord(id, position, header, key)){
+					writes.push_back(BitcaskWrite(header, key, key + header.keyLength));
+				}
+				position += header.getRecordLength();
+			}
+			if(position + (int64)sizeof(BitcaskHeader) > length){
+				position = length;
+			}
+			if(writes.empty()){
+				continue;
+			}
+			if(!appendRecords(writes)){
+				return false;
+			}
+			for(size_t i=0; i<writes.size(); ++i){
+				applyWrite(writes[i]);
+			}
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BitcaskSegment* pSegment = findSegment(id);
+		if(NULL != pSegment){
+			m_segments.erase(id);
+			delete pSegment;
+			unlink(fileName.c_str());
+			unlink((m_name + getNumberExt(id, BITCASK_HINT_EXT)).c_str());
+		}
+		return true;
+	}
+	void mergeLoop(void){
+		while(true){
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_condition.wait_for(lock, std::chrono::milliseconds(BITCASK_MERGE_INTERVAL));
+				if(!m_isRunning){
+					return;
+				}
+			}
+			uint32 id;
+			while(findMergeSegment(id)){
+				if(!mergeSegment(id)){
+					break;
+				}
+			}
+		}
+	}
+};
+
+NS_HIVE_END
+
+#endif /* bitcask_hpp */
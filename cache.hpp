@@ -0,0 +1,263 @@
+//
+//  cache.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/2.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef cache_hpp
+#define cache_hpp
+
+#include "file.hpp"
+#include <list>
+#include <mutex>
+
+NS_HIVE_BEGIN
+
+#define CACHE_ENTRY_OVERHEAD 96			// 每个缓存项除数据以外的内存估算（链表节点、哈希表节点）
+#define CACHE_WINDOW_PERCENT 1			// 窗口LRU占总容量的百分比
+#define CACHE_PROTECTED_PERCENT 80		// 主缓存中保护区占的百分比
+#define CACHE_MIN_WINDOW_SIZE 65536		// 窗口的最小容量，也是可以缓存的最大value长度下限
+#define CACHE_SKETCH_DEPTH 4			// 频率统计的哈希行数
+#define CACHE_SKETCH_MAX_COUNT 15		// 频率计数的上限
+#define CACHE_SKETCH_AVERAGE_SIZE 256	// 估算缓存项数量时使用的平均长度
+
+// 缓存的统计数据
+typedef struct CacheStat{
+	uint64 hitCount;				// 命中次数
+	uint64 missCount;				// 未命中次数
+	uint64 evictCount;				// 淘汰次数
+	uint64 rejectCount;				// 频率不够没有进入主缓存的次数
+	uint64 entryCount;				// 当前缓存项数量
+	int64 usedSize;					// 当前占用的内存
+	int64 capacity;					// 内存上限
+	CacheStat(void) : hitCount(0), missCount(0), evictCount(0), rejectCount(0), entryCount(0), usedSize(0), capacity(0){}
+}CacheStat;
+
+// W-TinyLFU缓存：新数据先进入很小的窗口LRU，从窗口淘汰的数据需要比主缓存(SLRU)中的淘汰候选访问频率更高才能进入主缓存；
+// 一次性的扫描访问只会经过窗口，不会冲掉主缓存中的热数据；命中也会修改链表，所有操作由m_mutex保护
+class ValueCache
+{
+public:
+	enum CacheRegion{
+		REGION_WINDOW = 0,
+		REGION_PROBATION = 1,
+		REGION_PROTECTED = 2,
+	};
+	typedef struct CacheEntry{
+		uint64 key;
+		std::string data;
+		int region;
+		CacheEntry(uint64 k, const char* d, int64 l) : key(k), data(d, l), region(REGION_WINDOW){}
+		inline int64 getSize(void) const { return (int64)data.size() + CACHE_ENTRY_OVERHEAD; }
+	}CacheEntry;
+	typedef std::list<CacheEntry> EntryList;
+	typedef std::unordered_map<uint64, EntryList::iterator> EntryMap;
+
+	EntryMap m_entries;
+	EntryList m_lists[3];				// 每个区域的LRU链表，头部是最近使用的
+	int64 m_sizes[3];					// 每个区域占用的内存
+	int64 m_capacity;
+	int64 m_windowCapacity;
+	int64 m_protectedCapacity;
+	std::vector<uint8> m_sketch;		// Count-Min频率统计
+	uint64 m_sketchMask;
+	uint64 m_sketchAdditions;			// 达到采样数量后所有计数减半，让旧的热点逐渐冷却
+	uint64 m_sketchSampleSize;
+	CacheStat m_stat;
+	std::mutex m_mutex;
+public:
+	ValueCache(void) : m_capacity(0), m_windowCapacity(0), m_protectedCapacity(0), m_sketchMask(0), m_sketchAdditions(0), m_sketchSampleSize(0) {
+		m_sizes[0] = m_sizes[1] = m_sizes[2] = 0;
+	}
+	virtual ~ValueCache(void){}
+	inline bool isEnabled(void) const {
+		return (m_capacity > 0);
+	}
+	// 设置内存上限，0表示关闭缓存；会清空当前的数据
+	inline void setCapacity(int64 capacity){
+		std::lock_guard<std::mutex> guard(m_mutex);
+		clearEntries();
+		m_capacity = std::max(capacity, (int64)0);
+		m_windowCapacity = std::min(std::max(m_capacity * CACHE_WINDOW_PERCENT / 100, (int64)CACHE_MIN_WINDOW_SIZE), m_capacity);
+		m_protectedCapacity = (m_capacity - m_windowCapacity) * CACHE_PROTECTED_PERCENT / 100;
+		uint64 width = 1024;
+		while(width < (uint64)(m_capacity / CACHE_SKETCH_AVERAGE_SIZE)){
+			width <<= 1;
+		}
+		m_sketch.assign(m_capacity > 0 ? width * CACHE_SKETCH_DEPTH : 0, 0);
+		m_sketchMask = width - 1;
+		m_sketchAdditions = 0;
+		m_sketchSampleSize = width * 10;
+	}
+	inline void clear(void){
+		std::lock_guard<std::mutex> guard(m_mutex);
+		clearEntries();
+	}
+	// 命中时把数据复制到buffer；buffer不够时返回FERR_BUFFER_TOO_SMALL，length为需要的长度
+	inline int get(uint64 key, char* buffer, int64 bufferSize, int64* length){
+		std::lock_guard<std::mutex> guard(m_mutex);
+		CacheEntry* pEntry = find(key);
+		if(NULL == pEntry){
+			return FERR_KEY_NOT_FOUND;
+		}
+		*length = (int64)pEntry->data.size();
+		if(*length > bufferSize){
+			return FERR_BUFFER_TOO_SMALL;
+		}
+		memcpy(buffer, pEntry->data.data(), pEntry->data.size());
+		return FILE_OK;
+	}
+	inline bool get(uint64 key, CharVector& value){
+		std::lock_guard<std::mutex> guard(m_mutex);
+		CacheEntry* pEntry = find(key);
+		if(NULL == pEntry){
+			return false;
+		}
+		value.assign(pEntry->data.begin(), pEntry->data.end());
+		return true;
+	}
+	inline void put(uint64 key, const char* data, int64 length){
+		if(!isEnabled() || length + CACHE_ENTRY_OVERHEAD > m_windowCapacity){
+			return;
+		}
+		std::lock_guard<std::mutex> guard(m_mutex);
+		removeEntry(key);
+		EntryList& window = m_lists[REGION_WINDOW];
+		window.push_front(CacheEntry(key, data, length));
+		m_entries[key] = window.begin();
+		m_sizes[REGION_WINDOW] += window.front().getSize();
+		++m_stat.entryCount;
+		// 窗口满了，淘汰的数据尝试进入主缓存
+		while(m_sizes[REGION_WINDOW] > m_windowCapacity){
+			EntryList::iterator candidate = --window.end();
+			moveTo(candidate, REGION_PROBATION);
+			admit(m_lists[REGION_PROBATION].begin());
+		}
+	}
+	inline void remove(uint64 key){
+		if(!isEnabled()){
+			return;
+		}
+		std::lock_guard<std::mutex> guard(m_mutex);
+		removeEntry(key);
+	}
+	inline CacheStat getStat(void){
+		std::lock_guard<std::mutex> guard(m_mutex);
+		m_stat.usedSize = m_sizes[0] + m_sizes[1] + m_sizes[2];
+		m_stat.capacity = m_capacity;
+		return m_stat;
+	}
+protected:
+	inline void clearEntries(void){
+		m_entries.clear();
+		for(int i=0; i<3; ++i){
+			m_lists[i].clear();
+			m_sizes[i] = 0;
+		}
+		m_stat.entryCount = 0;
+	}
+	inline void removeEntry(uint64 key){
+		EntryMap::iterator itCur = m_entries.find(key);
+		if(itCur == m_entries.end()){
+			return;
+		}
+		erase(itCur->second);
+	}
+	inline CacheEntry* find(uint64 key){
+		if(!isEnabled()){
+			return NULL;
+		}
+		increment(key);
+		EntryMap::iterator itCur = m_entries.find(key);
+		if(itCur == m_entries.end()){
+			++m_stat.missCount;
+			return NULL;
+		}
+		++m_stat.hitCount;
+		EntryList::iterator it = itCur->second;
+		if(REGION_PROBATION == it->region){
+			// 试用区再次命中，提升到保护区；保护区超出容量时把最久没用的降回试用区
+			moveTo(it, REGION_PROTECTED);
+			while(m_sizes[REGION_PROTECTED] > m_protectedCapacity && m_lists[REGION_PROTECTED].size() > 1){
+				moveTo(--m_lists[REGION_PROTECTED].end(), REGION_PROBATION);
+			}
+		}else{
+			EntryList& list = m_lists[it->region];
+			list.splice(list.begin(), list, it);
+		}
+		return &(*it);
+	}
+	// candidate已经放在试用区头部；主缓存超出容量时，与试用区尾部的数据比较频率，淘汰频率低的
+	inline void admit(EntryList::iterator candidate){
+		int64 mainCapacity = m_capacity - m_windowCapacity;
+		EntryList& probation = m_lists[REGION_PROBATION];
+		while(m_sizes[REGION_PROBATION] + m_sizes[REGION_PROTECTED] > mainCapacity){
+			EntryList::iterator victim = --probation.end();
+			if(victim == candidate){
+				// 试用区只剩候选者，从保护区淘汰
+				if(m_lists[REGION_PROTECTED].empty()){
+					++m_stat.evictCount;
+					erase(candidate);
+					return;
+				}
+				moveTo(--m_lists[REGION_PROTECTED].end(), REGION_PROBATION);
+				continue;
+			}
+			if(frequency(candidate->key) > frequency(victim->key)){
+				++m_stat.evictCount;
+				erase(victim);
+			}else{
+				++m_stat.rejectCount;
+				erase(candidate);
+				return;
+			}
+		}
+	}
+	inline void moveTo(EntryList::iterator it, int region){
+		int64 size = it->getSize();
+		m_sizes[it->region] -= size;
+		m_sizes[region] += size;
+		EntryList& list = m_lists[region];
+		list.splice(list.begin(), m_lists[it->region], it);
+		it->region = region;
+	}
+	inline void erase(EntryList::iterator it){
+		m_sizes[it->region] -= it->getSize();
+		m_entries.erase(it->key);
+		m_lists[it->region].erase(it);
+		--m_stat.entryCount;
+	}
+	inline uint64 sketchHash(uint64 key, int row) const {
+		uint64 h = key + (uint64)(row + 1) * 0x9E3779B97F4A7C15ULL;
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+		return (h ^ (h >> 31));
+	}
+	inline void increment(uint64 key){
+		for(int row=0; row<CACHE_SKETCH_DEPTH; ++row){
+			uint8& counter = m_sketch[(uint64)row * (m_sketchMask + 1) + (sketchHash(key, row) & m_sketchMask)];
+			if(counter < CACHE_SKETCH_MAX_COUNT){
+				++counter;
+			}
+		}
+		if(++m_sketchAdditions >= m_sketchSampleSize){
+			for(size_t i=0; i<m_sketch.size(); ++i){
+				m_sketch[i] >>= 1;
+			}
+			m_sketchAdditions /= 2;
+		}
+	}
+	inline uint32 frequency(uint64 key) const {
+		uint32 result = CACHE_SKETCH_MAX_COUNT;
+		for(int row=0; row<CACHE_SKETCH_DEPTH; ++row){
+			result = std::min(result, (uint32)m_sketch[(uint64)row * (m_sketchMask + 1) + (sketchHash(key, row) & m_sketchMask)]);
+		}
+		return result;
+	}
+};
+
+NS_HIVE_END
+
+#endif /* cache_hpp */
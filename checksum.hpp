@@ -0,0 +1,115 @@
+//
+//  checksum.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/13.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef checksum_hpp
+#define checksum_hpp
+
+#include "file.hpp"
+
+// 支持的平台上使用CPU的CRC32C指令，其余平台查表计算
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define USE_SSE42_CRC32C
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define USE_ARM_CRC32C
+#endif
+
+NS_HIVE_BEGIN
+
+#define CRC32C_POLY 0x82F63B78			// Castagnoli多项式（反转表示）
+
+inline const uint32* getCrc32cTable(void){
+	static uint32 table[256];
+	static bool isInitialized = [](){
+		for(uint32 i=0; i<256; ++i){
+			uint32 crc = i;
+			for(int k=0; k<8; ++k){
+				crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+			}
+			table[i] = crc;
+		}
+		return true;
+	}();
+	(void)isInitialized;
+	return table;
+}
+inline uint32 crc32cSoftware(uint32 crc, const void* data, int64 length){
+	const uint32* table = getCrc32cTable();
+	const uint8* ptr = (const uint8*)data;
+	size_t remain = (size_t)length;
+	crc = ~crc;
+	while(remain-- > 0){
+		crc = table[(crc ^ *ptr++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#ifdef USE_SSE42_CRC32C
+__attribute__((target("sse4.2")))
+inline uint32 crc32cHardware(uint32 crc, const void* data, int64 length){
+	const uint8* ptr = (const uint8*)data;
+	uint64 value = ~crc & 0xFFFFFFFF;
+	size_t remain = (size_t)length;
+	while(remain >= 8){
+		uint64 word;
+		memcpy(&word, ptr, 8);
+		value = _mm_crc32_u64(value, word);
+		ptr += 8;
+		remain -= 8;
+	}
+	uint32 crc32 = (uint32)value;
+	while(remain-- > 0){
+		crc32 = _mm_crc32_u8(crc32, *ptr++);
+	}
+	return ~crc32;
+}
+inline bool isCrc32cHardware(void){
+	static bool isSupported = __builtin_cpu_supports("sse4.2");
+	return isSupported;
+}
+#elif defined(USE_ARM_CRC32C)
+inline uint32 crc32cHardware(uint32 crc, const void* data, int64 length){
+	const uint8* ptr = (const uint8*)data;
+	crc = ~crc;
+	size_t remain = (size_t)length;
+	while(remain >= 8){
+		uint64 word;
+		memcpy(&word, ptr, 8);
+		crc = __crc32cd(crc, word);
+		ptr += 8;
+		remain -= 8;
+	}
+	while(remain-- > 0){
+		crc = __crc32cb(crc, *ptr++);
+	}
+	return ~crc;
+}
+inline bool isCrc32cHardware(void){
+	return true;
+}
+#else
+inline uint32 crc32cHardware(uint32 crc, const void* data, int64 length){
+	return crc32cSoftware(crc, data, length);
+}
+inline bool isCrc32cHardware(void){
+	return false;
+}
+#endif
+
+// 计算CRC32C；crc为前一段数据的结果，可以分段连续计算，第一段传0
+inline uint32 crc32c(uint32 crc, const void* data, int64 length){
+	if(isCrc32cHardware()){
+		return crc32cHardware(crc, data, length);
+	}
+	return crc32cSoftware(crc, data, length);
+}
+
+NS_HIVE_END
+
+#endif /* checksum_hpp */
@@ -0,0 +1,235 @@
+//
+//  compress.hpp
+//  base
+//
+//  Created by AppleTree on 17/3/25.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef compress_hpp
+#define compress_hpp
+
+#include "file.hpp"
+#include <zlib.h>
+
+NS_HIVE_BEGIN
+
+// value的压缩方式，保存在长度记录的高位
+enum ValueCodec{
+	VALUE_CODEC_NONE = 0,			// 不压缩
+	VALUE_CODEC_LZ = 1,				// 快速的LZ压缩，适合热数据
+	VALUE_CODEC_ZLIB = 2,			// zlib压缩，适合冷数据
+	VALUE_CODEC_ZLIB_DICT = 3,		// 使用数据库字典的zlib压缩，适合小数据
+};
+
+#define VALUE_CODEC_DEFAULT -1				// 使用数据库设置的压缩方式
+#define VALUE_CODEC_SHIFT 28
+#define VALUE_CODEC_MASK 0x70000000			// 长度记录的28~30位保存压缩方式
+#define VALUE_LENGTH_MASK 0x0FFFFFFF		// 长度记录的低28位保存长度（最大64M+4）
+#define VALUE_CHECKSUM_FLAG 0x80000000		// 长度记录的第31位表示数据后面有CRC32C校验码
+#define VALUE_CHECKSUM_LENGTH 4				// 校验码的长度，不计入长度记录
+
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5					// 末尾的字节总是作为字面量保存
+#define LZ_MATCH_LIMIT 12					// 距离末尾不足这个长度时不再查找匹配
+
+inline int getValueCodec(int prefix){
+	return (prefix & VALUE_CODEC_MASK) >> VALUE_CODEC_SHIFT;
+}
+inline int getValueLength(int prefix){
+	return (prefix & VALUE_LENGTH_MASK);
+}
+inline bool hasValueChecksum(int prefix){
+	return (0 != ((uint32)prefix & VALUE_CHECKSUM_FLAG));
+}
+inline int makeValuePrefix(int codec, int length){
+	return (codec << VALUE_CODEC_SHIFT) | length;
+}
+
+// 压缩的最坏长度
+inline int64 lzCompressBound(int64 length){
+	return length + length / 255 + 16;
+}
+inline uint32 lzRead32(const char* ptr){
+	uint32 v;
+	memcpy(&v, ptr, 4);
+	return v;
+}
+// 写入LZ格式的扩展长度：每个字节255表示继续
+// 位置和长度都用无符号数，和剩余空间比较，避免有符号数溢出的假设
+inline bool lzWriteLength(char*& op, const char* opEnd, size_t length){
+	while(length >= 255){
+		if(op >= opEnd){
+			return false;
+		}
+		*op++ = (char)255;
+		length -= 255;
+	}
+	if(op >= opEnd){
+		return false;
+	}
+	*op++ = (char)length;
+	return true;
+}
+// 写入一个序列：token(高4位字面量长度，低4位匹配长度) + 字面量 + 偏移 + 匹配长度
+inline bool lzWriteSequence(char*& op, const char* opEnd, const char* literal, size_t literalLength, size_t offset, size_t matchLength){
+	if(op >= opEnd){
+		return false;
+	}
+	char* token = op++;
+	uint8 t = (uint8)(literalLength >= 15 ? 15 : literalLength) << 4;
+	if(literalLength >= 15 && !lzWriteLength(op, opEnd, literalLength - 15)){
+		return false;
+	}
+	if(literalLength > (size_t)(opEnd - op)){
+		return false;
+	}
+	memcpy(op, literal, literalLength);
+	op += literalLength;
+	if(matchLength > 0){
+		if((size_t)(opEnd - op) < 2){
+			return false;
+		}
+		*op++ = (char)(offset & 0xFF);
+		*op++ = (char)((offset >> 8) & 0xFF);
+		size_t m = matchLength - LZ_MIN_MATCH;
+		t |= (uint8)(m >= 15 ? 15 : m);
+		if(m >= 15 && !lzWriteLength(op, opEnd, m - 15)){
+			return false;
+		}
+	}
+	*token = (char)t;
+	return true;
+}
+// LZ77压缩，返回压缩后的长度；输出空间不够时返回0
+inline int64 lzCompress(const char* src, int64 srcLength, char* dst, int64 dstCapacity){
+	int32 table[1 << LZ_HASH_LOG];
+	memset(table, -1, sizeof(table));
+	char* op = dst;
+	const char* opEnd = dst + dstCapacity;
+	size_t length = (size_t)srcLength;
+	size_t ip = 0;
+	size_t anchor = 0;
+	size_t matchLimit = length > LZ_MATCH_LIMIT ? length - LZ_MATCH_LIMIT : 0;
+	size_t matchEnd = length > LZ_LAST_LITERALS ? length - LZ_LAST_LITERALS : 0;
+	while(ip < matchLimit){
+		uint32 seq = lzRead32(src + ip);
+		uint32 h = (seq * 2654435761U) >> (32 - LZ_HASH_LOG);
+		int32 ref = table[h];
+		table[h] = (int32)ip;
+		if(ref < 0 || ip - (size_t)ref > LZ_MAX_OFFSET || lzRead32(src + ref) != seq){
+			++ip;
+			continue;
+		}
+		size_t matchLength = LZ_MIN_MATCH;
+		while(ip + matchLength < matchEnd && src[ref + matchLength] == src[ip + matchLength]){
+			++matchLength;
+		}
+		if(!lzWriteSequence(op, opEnd, src + anchor, ip - anchor, ip - (size_t)ref, matchLength)){
+			return 0;
+		}
+		ip += matchLength;
+		anchor = ip;
+	}
+	if(!lzWriteSequence(op, opEnd, src + anchor, length - anchor, 0, 0)){
+		return 0;
+	}
+	return (int64)(op - dst);
+}
+inline bool lzReadLength(const uint8*& ip, const uint8* ipEnd, int64& length){
+	uint8 b;
+	do{
+		if(ip >= ipEnd){
+			return false;
+		}
+		b = *ip++;
+		length += b;
+	}while(b == 255);
+	return true;
+}
+// LZ77解压，输出长度必须等于dstLength；所有读写都做边界检查
+inline bool lzDecompress(const char* src, int64 srcLength, char* dst, int64 dstLength){
+	const uint8* ip = (const uint8*)src;
+	const uint8* ipEnd = ip + srcLength;
+	char* op = dst;
+	char* opEnd = dst + dstLength;
+	while(ip < ipEnd){
+		uint8 token = *ip++;
+		int64 literalLength = token >> 4;
+		if(literalLength == 15 && !lzReadLength(ip, ipEnd, literalLength)){
+			return false;
+		}
+		if(ip + literalLength > ipEnd || op + literalLength > opEnd){
+			return false;
+		}
+		memcpy(op, ip, literalLength);
+		ip += literalLength;
+		op += literalLength;
+		if(ip == ipEnd){
+			break;
+		}
+		if(ip + 2 > ipEnd){
+			return false;
+		}
+		int64 offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int64 matchLength = token & 15;
+		if(matchLength == 15 && !lzReadLength(ip, ipEnd, matchLength)){
+			return false;
+		}
+		matchLength += LZ_MIN_MATCH;
+		if(offset == 0 || offset > op - dst || op + matchLength > opEnd){
+			return false;
+		}
+		// 匹配可能和输出重叠，逐字节复制
+		const char* ref = op - offset;
+		for(int64 i=0; i<matchLength; ++i){
+			op[i] = ref[i];
+		}
+		op += matchLength;
+	}
+	return (op == opEnd);
+}
+// zlib压缩（raw deflate，省去头部），dict不为空时使用预设字典；返回压缩后的长度，失败返回0
+inline int64 zlibCompress(const char* src, int64 srcLength, char* dst, int64 dstCapacity, const char* dict, int64 dictLength, int level){
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(Z_OK != deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY)){
+		return 0;
+	}
+	if(NULL != dict && dictLength > 0){
+		deflateSetDictionary(&zs, (const Bytef*)dict, (uInt)dictLength);
+	}
+	zs.next_in = (Bytef*)src;
+	zs.avail_in = (uInt)srcLength;
+	zs.next_out = (Bytef*)dst;
+	zs.avail_out = (uInt)dstCapacity;
+	int ret = deflate(&zs, Z_FINISH);
+	int64 length = (int64)zs.total_out;
+	deflateEnd(&zs);
+	return (Z_STREAM_END == ret) ? length : 0;
+}
+inline bool zlibDecompress(const char* src, int64 srcLength, char* dst, int64 dstLength, const char* dict, int64 dictLength){
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(Z_OK != inflateInit2(&zs, -MAX_WBITS)){
+		return false;
+	}
+	if(NULL != dict && dictLength > 0){
+		inflateSetDictionary(&zs, (const Bytef*)dict, (uInt)dictLength);
+	}
+	zs.next_in = (Bytef*)src;
+	zs.avail_in = (uInt)srcLength;
+	zs.next_out = (Bytef*)dst;
+	zs.avail_out = (uInt)dstLength;
+	int ret = inflate(&zs, Z_FINISH);
+	int64 length = (int64)zs.total_out;
+	inflateEnd(&zs);
+	return (Z_STREAM_END == ret && length == dstLength);
+}
+
+NS_HIVE_END
+
+#endif /* compress_hpp */
@@ -0,0 +1,330 @@
+//
+//  coro.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/18.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef coro_hpp
+#define coro_hpp
+
+#include "shard.hpp"
+
+// 协程接口需要C++20，低版本编译时这个文件为空；make coro 使用C++20编译并运行协程的测试
+// 存储引擎没有非阻塞的文件接口，数据文件的读写是在调度器的线程池中执行的pread/pwrite，不是io_uring之类的异步IO；
+// 协程只是把等待磁盘的时间让给其它协程，需要真正的异步IO时可以实现自己的CoroScheduler，在submit中使用
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define USE_COROUTINE
+#endif
+#endif
+
+#ifdef USE_COROUTINE
+#include <coroutine>
+#include <exception>
+
+NS_HIVE_BEGIN
+
+#define CORO_IO_THREAD_NUMBER 4			// 默认调度器执行数据文件读写的线程数量
+
+// 协程的调度接口，接入自己的事件循环时继承这个类：
+// submit执行需要访问数据文件的操作，可以交给自己的IO线程；resume在操作完成后恢复协程，通常投递到事件循环的线程中执行
+class CoroScheduler
+{
+public:
+	typedef std::function<void(void)> Work;
+public:
+	CoroScheduler(void){}
+	virtual ~CoroScheduler(void){}
+	virtual void submit(const Work& work) = 0;
+	virtual void resume(std::coroutine_handle<> handle) = 0;
+};
+
+// 默认的调度器：数据文件的读写在内部的工作线程中执行，完成后在工作线程中直接恢复协程
+class CoroThreadScheduler : public CoroScheduler
+{
+public:
+	std::vector<ShardWorker*> m_workers;
+	std::atomic<uint32> m_next;
+public:
+	CoroThreadScheduler(uint32 threadCount = CORO_IO_THREAD_NUMBER) : CoroScheduler(), m_next(0){
+		for(uint32 i=0; i<std::max(threadCount, (uint32)1); ++i){
+			m_workers.push_back(new ShardWorker());
+		}
+	}
+	virtual ~CoroThreadScheduler(void){
+		for(size_t i=0; i<m_workers.size(); ++i){
+			delete m_workers[i];
+		}
+	}
+	virtual void submit(const Work& work){
+		m_workers[m_next.fetch_add(1) % m_workers.size()]->post(work);
+	}
+	virtual void resume(std::coroutine_handle<> handle){
+		handle.resume();
+	}
+};
+
+// co_await的结果为FileError：已经有结果时不挂起协程，否则把操作交给调度器，完成后恢复
+class CoroAwaiter
+{
+public:
+	typedef std::function<int(void)> Call;
+	CoroScheduler* m_pScheduler;
+	Call m_call;
+	int m_result;
+	bool m_isReady;
+public:
+	CoroAwaiter(int result) : m_pScheduler(NULL), m_result(result), m_isReady(true){}
+	CoroAwaiter(CoroScheduler* pScheduler, const Call& call) : m_pScheduler(pScheduler), m_call(call), m_result(FILE_OK), m_isReady(false){}
+	inline bool await_ready(void) const noexcept {
+		return m_isReady;
+	}
+	inline void await_suspend(std::coroutine_handle<> handle){
+		m_pScheduler->submit([this, handle](){
+			m_result = m_call();
+			m_pScheduler->resume(handle);
+		});
+	}
+	inline int await_resume(void) const noexcept {
+		return m_result;
+	}
+};
+
+// 协程的返回类型：co_return一个结果（通常是FileError）；创建后不马上执行，
+// 在另一个协程中co_await时开始执行并在结束后恢复等待的协程，普通函数中调用wait开始执行并等待结果
+template <typename _T_ = int>
+class CoroTask
+{
+public:
+	// wait使用的同步状态，放在调用者的栈上，协程结束后不再访问协程的数据
+	typedef struct WaitState{
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool isDone;
+		WaitState(void) : isDone(false){}
+	}WaitState;
+	class promise_type
+	{
+	public:
+		_T_ m_value;
+		std::coroutine_handle<> m_continuation;		// co_await这个任务的协程
+		WaitState* m_pWait;
+	public:
+		promise_type(void) : m_value(), m_continuation(), m_pWait(NULL){}
+		inline CoroTask get_return_object(void){
+			return CoroTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		inline std::suspend_always initial_suspend(void) noexcept {
+			return std::suspend_always();
+		}
+		// 结束时恢复等待的协程（对称转移，不增加调用栈），或者通知wait
+		class FinalAwaiter
+		{
+		public:
+			inline bool await_ready(void) const noexcept {
+				return false;
+			}
+			inline std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+				promise_type& promise = handle.promise();
+				if(promise.m_continuation){
+					return promise.m_continuation;
+				}
+				if(NULL != promise.m_pWait){
+					std::lock_guard<std::mutex> guard(promise.m_pWait->mutex);
+					promise.m_pWait->isDone = true;
+					promise.m_pWait->condition.notify_one();
+				}
+				return std::noop_coroutine();
+			}
+			inline void await_resume(void) const noexcept {}
+		};
+		inline FinalAwaiter final_suspend(void) noexcept {
+			return FinalAwaiter();
+		}
+		inline void return_value(const _T_& value){
+			m_value = value;
+		}
+		// 存储引擎不使用异常
+		inline void unhandled_exception(void){
+			std::terminate();
+		}
+	};
+	typedef std::coroutine_handle<promise_type> Handle;
+	Handle m_handle;
+public:
+	explicit CoroTask(Handle handle) : m_handle(handle){}
+	CoroTask(CoroTask&& other) noexcept : m_handle(other.m_handle){
+		other.m_handle = Handle();
+	}
+	CoroTask(const CoroTask&) = delete;
+	CoroTask& operator=(const CoroTask&) = delete;
+	~CoroTask(void){
+		if(m_handle){
+			m_handle.destroy();
+		}
+	}
+	inline bool await_ready(void) const noexcept {
+		return false;
+	}
+	inline std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+		m_handle.promise().m_continuation = continuation;
+		return m_handle;
+	}
+	inline _T_ await_resume(void){
+		return m_handle.promise().m_value;
+	}
+	// 在普通函数中执行任务并等待结果，任务中的co_await可能在调度器的线程中恢复
+	inline _T_ wait(void){
+		WaitState state;
+		m_handle.promise().m_pWait = &state;
+		m_handle.resume();
+		std::unique_lock<std::mutex> lock(state.mutex);
+		state.condition.wait(lock, [&state](){ return state.isDone; });
+		return m_handle.promise().m_value;
+	}
+};
+
+// 协程接口的数据库：co_await get/set/del/mget得到FileError；
+// 内存中的key查找在调用的协程中同步完成，内联或者缓存中的value直接返回不挂起，只有读写数据文件时挂起协程；
+// 操作在调度器的线程中执行，存储引擎使用线程安全模式；参数中的缓冲区和数据项在co_await返回之前需要保持有效
+template <typename _DB_>
+class CoroDB
+{
+public:
+	typedef _DB_ KeyValueData;
+	KeyValueData* m_pDB;
+	CoroScheduler* m_pScheduler;
+	bool m_isOwnScheduler;			// 默认调度器由这里创建和释放
+public:
+	CoroDB(void) : m_pDB(NULL), m_pScheduler(NULL), m_isOwnScheduler(false){}
+	virtual ~CoroDB(void){
+		closeDB();
+	}
+	// pScheduler为NULL时使用默认的调度器；传入的调度器由调用者释放，需要在关闭数据库之后
+	bool openDB(const char* name, CoroScheduler* pScheduler = NULL){
+		if(NULL != m_pDB){
+			return false;
+		}
+		m_pDB = new KeyValueData(name);
+		if(FILE_OK != m_pDB->openDB()){
+			delete m_pDB;
+			m_pDB = NULL;
+			return false;
+		}
+		m_pDB->setThreadSafe(true);
+		m_isOwnScheduler = (NULL == pScheduler);
+		m_pScheduler = m_isOwnScheduler ? new CoroThreadScheduler() : pScheduler;
+		return true;
+	}
+	// 关闭前需要等待所有的co_await返回
+	void closeDB(void){
+		if(NULL == m_pDB){
+			return;
+		}
+		if(m_isOwnScheduler){
+			delete m_pScheduler;
+		}
+		m_pScheduler = NULL;
+		m_pDB->closeDB();
+		delete m_pDB;
+		m_pDB = NULL;
+	}
+	// 存储引擎，用于设置接口
+	inline KeyValueData* getDB(void){
+		return m_pDB;
+	}
+
+	CoroAwaiter get(const char* key, uint32 keyLength, CharVector& value){
+		int result = m_pDB->getMemoryValue(key, (int64)keyLength, value);
+		if(FERR_VALUE_NOT_IN_MEMORY != result){
+			return CoroAwaiter(result);
+		}
+		KeyValueData* pDB = m_pDB;
+		std::string k(key, keyLength);
+		return CoroAwaiter(m_pScheduler, [pDB, k, &value](){ return pDB->getValue(k.data(), (int64)k.size(), value); });
+	}
+	CoroAwaiter set(const char* key, uint32 keyLength, const char* value, uint32 valueLength){
+		KeyValueData* pDB = m_pDB;
+		std::string k(key, keyLength);
+		return CoroAwaiter(m_pScheduler, [pDB, k, value, valueLength](){ return pDB->set(k.data(), (int64)k.size(), value, (int64)valueLength, true, false); });
+	}
+	CoroAwaiter setex(const char* key, uint32 keyLength, const char* value, uint32 valueLength, uint32 seconds){
+		KeyValueData* pDB = m_pDB;
+		std::string k(key, keyLength);
+		uint32 expire = getTimeSecond() + seconds;
+		return CoroAwaiter(m_pScheduler, [pDB, k, value, valueLength, expire](){ return pDB->set(k.data(), (int64)k.size(), value, (int64)valueLength, true, false, VALUE_CODEC_DEFAULT, expire); });
+	}
+	CoroAwaiter del(const char* key, uint32 keyLength){
+		KeyValueData* pDB = m_pDB;
+		std::string k(key, keyLength);
+		return CoroAwaiter(m_pScheduler, [pDB, k](){ return pDB->del(k.data(), (int64)k.size()); });
+	}
+	// 批量读取：内存中的value同步读取，其余的合并成一次批量读取；每个数据项的result记录各自的结果
+	CoroAwaiter mget(KeyGetEntryVector& entries){
+		return readEntries(entries, [this](KeyGetEntry& entry){ return m_pDB->getMemoryValue(entry.key, entry.keyLen, entry.buffer, entry.bufferSize, &(entry.length)); });
+	}
+
+	CoroAwaiter get(uint64 key, CharVector& value){
+		int result = m_pDB->getMemoryValue(key, value);
+		if(FERR_VALUE_NOT_IN_MEMORY != result){
+			return CoroAwaiter(result);
+		}
+		KeyValueData* pDB = m_pDB;
+		return CoroAwaiter(m_pScheduler, [pDB, key, &value](){ return pDB->getValue(key, value); });
+	}
+	CoroAwaiter set(uint64 key, const char* value, uint32 valueLength){
+		KeyValueData* pDB = m_pDB;
+		return CoroAwaiter(m_pScheduler, [pDB, key, value, valueLength](){ return pDB->set(key, value, (int64)valueLength, true, false); });
+	}
+	CoroAwaiter setex(uint64 key, const char* value, uint32 valueLength, uint32 seconds){
+		KeyValueData* pDB = m_pDB;
+		uint32 expire = getTimeSecond() + seconds;
+		return CoroAwaiter(m_pScheduler, [pDB, key, value, valueLength, expire](){ return pDB->set(key, value, (int64)valueLength, true, false, VALUE_CODEC_DEFAULT, expire); });
+	}
+	CoroAwaiter del(uint64 key){
+		KeyValueData* pDB = m_pDB;
+		return CoroAwaiter(m_pScheduler, [pDB, key](){ return pDB->del(key); });
+	}
+	CoroAwaiter mget(IndexGetEntryVector& entries){
+		return readEntries(entries, [this](IndexGetEntry& entry){ return m_pDB->getMemoryValue(entry.key, entry.buffer, entry.bufferSize, &(entry.length)); });
+	}
+protected:
+	// 先同步读取内存中的数据项，剩下的数据项在调度器中批量读取后写回结果
+	template <typename _ENTRY_VECTOR_, typename _READ_>
+	inline CoroAwaiter readEntries(_ENTRY_VECTOR_& entries, const _READ_& readMemory){
+		std::vector<size_t> positions;
+		for(size_t i=0; i<entries.size(); ++i){
+			entries[i].length = 0;
+			entries[i].result = readMemory(entries[i]);
+			if(FERR_VALUE_NOT_IN_MEMORY == entries[i].result){
+				positions.push_back(i);
+			}
+		}
+		if(positions.empty()){
+			return CoroAwaiter(FILE_OK);
+		}
+		KeyValueData* pDB = m_pDB;
+		_ENTRY_VECTOR_* pEntries = &entries;
+		return CoroAwaiter(m_pScheduler, [pDB, pEntries, positions](){
+			_ENTRY_VECTOR_ reads;
+			reads.reserve(positions.size());
+			for(size_t i=0; i<positions.size(); ++i){
+				reads.push_back((*pEntries)[positions[i]]);
+			}
+			int result = pDB->mget(reads);
+			for(size_t i=0; i<positions.size(); ++i){
+				(*pEntries)[positions[i]].length = reads[i].length;
+				(*pEntries)[positions[i]].result = reads[i].result;
+			}
+			return result;
+		});
+	}
+};
+
+NS_HIVE_END
+
+#endif /* USE_COROUTINE */
+
+#endif /* coro_hpp */
@@ -0,0 +1,205 @@
+//
+//  corotest.cpp
+//  test
+//
+//  Created by AppleTree on 17/4/23.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+// 协程接口的功能测试，需要C++20（make coro）；任何一项失败时返回1，数据库文件使用-d指定的名字，用例结束后删除
+
+#include <thread>
+#include <atomic>
+#include <dirent.h>
+#include <unistd.h>
+#include "alphakv.hpp"
+USING_NS_HIVE;
+
+#ifndef USE_COROUTINE
+#error "corotest needs C++20 coroutines, build it with make coro"
+#endif
+
+static std::atomic<int> g_failed(0);
+
+#define TEST_CHECK(condition) do{ \
+	if(!(condition)){ \
+		fprintf(stderr, "%s:%d check failed: %s\n", __FILE__, __LINE__, #condition); \
+		++g_failed; \
+	} \
+}while(0)
+
+// 删除同一目录下以“name.”开头的所有数据库文件
+static void removeDB(const std::string& name){
+	std::string dirName = ".";
+	std::string prefix = name + ".";
+	size_t pos = name.rfind('/');
+	if(std::string::npos != pos){
+		dirName = name.substr(0, pos + 1);
+		prefix = name.substr(pos + 1) + ".";
+	}
+	DIR* pDir = opendir(dirName.c_str());
+	if(NULL == pDir){
+		return;
+	}
+	struct dirent* pEntry;
+	while(NULL != (pEntry = readdir(pDir))){
+		if(0 == strncmp(pEntry->d_name, prefix.c_str(), prefix.length())){
+			unlink((dirName + "/" + pEntry->d_name).c_str());
+		}
+	}
+	closedir(pDir);
+}
+static std::string makeValue(const std::string& key, size_t length){
+	std::string value(length, '\0');
+	for(size_t i=0; i<length; ++i){
+		value[i] = key[i % key.length()] ^ (char)(length + i / key.length());
+	}
+	return value;
+}
+static bool isSame(const CharVector& value, const std::string& expect){
+	return (value.size() == expect.length() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+
+static CoroTask<int> setValue(AlphaCoroKV& db, std::string key, std::string value){
+	co_return co_await db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length());
+}
+// 写入、读取、删除后再读取，任务之间互相co_await
+static CoroTask<int> setGetDel(AlphaCoroKV& db, std::string key, std::string value){
+	int result = co_await setValue(db, key, value);
+	if(FILE_OK != result){
+		co_return result;
+	}
+	CharVector data;
+	result = co_await db.get(key.data(), (uint32)key.length(), data);
+	TEST_CHECK(FILE_OK == result && isSame(data, value));
+	uint64 number = (uint64)value.length();
+	TEST_CHECK(FILE_OK == co_await db.set(number, value.data(), (uint32)value.length()));
+	TEST_CHECK(FILE_OK == co_await db.get(number, data) && isSame(data, value));
+	TEST_CHECK(FILE_OK == co_await db.del(number));
+	TEST_CHECK(FERR_KEY_NOT_FOUND == co_await db.get(number, data));
+	result = co_await db.del(key.data(), (uint32)key.length());
+	if(FILE_OK != result){
+		co_return result;
+	}
+	co_return co_await db.get(key.data(), (uint32)key.length(), data);
+}
+static void testSetGetDel(const std::string& name){
+	AlphaCoroKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	static const size_t lengths[] = {5, 200, 5000, 100000};
+	for(size_t i=0; i<sizeof(lengths)/sizeof(lengths[0]); ++i){
+		std::string key = "coro" + std::to_string(i);
+		TEST_CHECK(FERR_KEY_NOT_FOUND == setGetDel(db, key, makeValue(key, lengths[i])).wait());
+	}
+}
+
+// 记录co_await前后所在的线程：内存中的value不挂起，仍然在调用的线程；需要读取数据文件时在调度器的线程中恢复
+static CoroTask<int> getOnThread(AlphaCoroKV& db, std::string key, std::string expect, bool* pIsSameThread){
+	std::thread::id before = std::this_thread::get_id();
+	CharVector data;
+	int result = co_await db.get(key.data(), (uint32)key.length(), data);
+	*pIsSameThread = (before == std::this_thread::get_id());
+	TEST_CHECK(FILE_OK != result || isSame(data, expect));
+	co_return result;
+}
+static void testSuspend(const std::string& name){
+	AlphaCoroKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string block = makeValue("block", 3000);
+	TEST_CHECK(FILE_OK == setValue(db, "inline", "tiny").wait());
+	TEST_CHECK(FILE_OK == setValue(db, "block", block).wait());
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	bool isSameThread = false;
+	TEST_CHECK(FILE_OK == getOnThread(db, "inline", "tiny", &isSameThread).wait());
+	TEST_CHECK(isSameThread);
+	TEST_CHECK(FILE_OK == getOnThread(db, "block", block, &isSameThread).wait());
+	TEST_CHECK(!isSameThread);
+	TEST_CHECK(FERR_KEY_NOT_FOUND == getOnThread(db, "missing", "", &isSameThread).wait());
+	TEST_CHECK(isSameThread);
+}
+
+// 批量读取：内存中的value同步读取，其余的在调度器中批量读取，每个数据项得到各自的结果
+static CoroTask<int> readEntries(AlphaCoroKV& db, KeyGetEntryVector& entries){
+	co_return co_await db.mget(entries);
+}
+static void testMget(const std::string& name){
+	AlphaCoroKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<20; ++i){
+		keys.push_back("mget" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), (0 == i % 2) ? 8 : 500 + i));
+		TEST_CHECK(FILE_OK == setValue(db, keys.back(), values.back()).wait());
+	}
+	std::vector<CharVector> buffers(keys.size() + 1, CharVector(1000));
+	KeyGetEntryVector entries;
+	for(size_t i=0; i<keys.size(); ++i){
+		entries.push_back(KeyGetEntry(keys[i].data(), (int64)keys[i].length(), buffers[i].data(), (int64)buffers[i].size()));
+	}
+	entries.push_back(KeyGetEntry("missing", 7, buffers.back().data(), (int64)buffers.back().size()));
+	TEST_CHECK(FILE_OK == readEntries(db, entries).wait());
+	for(size_t i=0; i<keys.size(); ++i){
+		TEST_CHECK(FILE_OK == entries[i].result && (int64)values[i].length() == entries[i].length);
+		TEST_CHECK(0 == memcmp(buffers[i].data(), values[i].data(), values[i].length()));
+	}
+	TEST_CHECK(FERR_KEY_NOT_FOUND == entries.back().result);
+}
+
+// 多个线程同时执行协程任务，每个任务读写自己的一组key
+static CoroTask<int> readWriteLoop(AlphaCoroKV& db, int id){
+	for(int i=0; i<200; ++i){
+		std::string key = "loop" + std::to_string(id) + "_" + std::to_string(i % 16);
+		std::string value = makeValue(key, 10 + (i * 37) % 3000);
+		int result = co_await db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length());
+		if(FILE_OK != result){
+			co_return result;
+		}
+		CharVector data;
+		result = co_await db.get(key.data(), (uint32)key.length(), data);
+		if(FILE_OK != result || !isSame(data, value)){
+			co_return FERR_BLOCK_READ_FAIL;
+		}
+	}
+	co_return FILE_OK;
+}
+static void testConcurrentTasks(const std::string& name){
+	AlphaCoroKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::vector<std::thread> threads;
+	for(int t=0; t<8; ++t){
+		threads.push_back(std::thread([&db, t](){
+			TEST_CHECK(FILE_OK == readWriteLoop(db, t).wait());
+		}));
+	}
+	for(size_t i=0; i<threads.size(); ++i){
+		threads[i].join();
+	}
+}
+
+static void runTest(const char* title, void (*test)(const std::string&), const std::string& name){
+	int failed = g_failed.load();
+	removeDB(name);
+	test(name);
+	removeDB(name);
+	fprintf(stderr, "%s: %s\n", title, (g_failed.load() > failed) ? "failed" : "ok");
+}
+
+int main(int argc, char * argv[]) {
+	std::string name = "corotestdb";
+	int opt;
+	while(-1 != (opt = getopt(argc, argv, "d:"))){
+		if('d' == opt){
+			name = optarg;
+		}else{
+			fprintf(stderr, "usage: %s [-d dbname]\n", argv[0]);
+			return 1;
+		}
+	}
+	runTest("coro set get del", testSetGetDel, name);
+	runTest("coro suspend", testSuspend, name);
+	runTest("coro mget", testMget, name);
+	runTest("coro concurrent tasks", testConcurrentTasks, name);
+	return g_failed.load() ? 1 : 0;
+}
@@ -32,12 +32,16 @@ typedef unsigned long long int  	uint64;
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <dirent.h>
 #include <string>
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 #include <algorithm>
 
 // 在非苹果平台（linux）上面加载这个文件；使用open,read,write操作文件的读写
@@ -50,7 +54,7 @@ typedef unsigned long long int  	uint64;
 #include <sys/io.h>
 #endif
 
-#include <fcntl.h>
+#include <sys/uio.h>
 #else
 #define USE_STREAM_FILE
 #endif
@@ -80,6 +84,8 @@ NS_HIVE_BEGIN
 
 #define BASE_FILE_DESC "base 1.0 AppleTree@2016"        // 28个字节以内
 
+typedef std::vector<char> CharVector;
+
 enum FileError{
 	FILE_OK = 0,
 	FERR_TOUCH_FAILED,
@@ -101,24 +107,63 @@ enum FileError{
 	FERR_KEY_VALUE_SIZE_NOT_MATCH,
 	FERR_KEY_LENGTH_NOT_MATCH,
 	FERR_KEY_ALREADY_EXIST,
+	FERR_BUFFER_TOO_SMALL,
+	FERR_BLOCK_DECODE_FAILED,
+	FERR_FORMAT_VERSION_NOT_MATCH,
+	FERR_SNAPSHOT_NOT_FOUND,
+	FERR_CHECKPOINT_RUNNING,
+	FERR_CHECKPOINT_FAILED,
+	FERR_CHECKSUM_MISMATCH,
+	FERR_SCRUB_RUNNING,
+	FERR_SHARD_MISMATCH,
+	FERR_VALUE_NOT_IN_MEMORY,
+	FERR_VALUE_NOT_INTEGER,
+	FERR_REPLICA_LOG_TRIMMED,
+	FERR_REPLICA_CLOSED,
 };
 
 #define BLOCK_SIZE 64					// 每个文件块的大小
 #define EXPAND_BLOCK_SIZE 8192			// 文件扩展步长
 #define MAX_EXPAND_BLOCK_SIZE 67108864	// 64M，最大保存的单个文件块长度
+#define MAX_WRITE_SEGMENT_NUMBER 1024	// 单次向量写入的最大数据段数量（IOV_MAX）
+#define FILE_FORMAT_VERSION 3			// key和index文件的格式版本，保存在头部；记录的格式改变时增加
+#define LEGACY_HEAD_OFFSET 32			// 没有版本的旧文件的头部长度，旧文件的记录是8字节的BlockNode
+#define DIRTY_REGION_SHIFT 16			// 记录写入区域的粒度（64K），增量备份时只复制写入过的区域
+
+// 批量写入时的一个数据段
+typedef struct WriteSegment{
+	int64 offset;				// 文件中的偏移
+	const void* ptr;			// 数据指针
+	int64 length;				// 数据长度
+	WriteSegment(int64 o, const void* p, int64 l) : offset(o), ptr(p), length(l){}
+}WriteSegment;
+typedef std::vector<WriteSegment> WriteSegmentVector;
+
+// 批量读取时的一个数据段
+typedef struct ReadSegment{
+	int64 offset;				// 文件中的偏移
+	void* ptr;					// 读取的目标地址
+	int64 length;				// 数据长度
+	ReadSegment(int64 o, void* p, int64 l) : offset(o), ptr(p), length(l){}
+}ReadSegment;
+typedef std::vector<ReadSegment> ReadSegmentVector;
 
 class File
 {
 public:
 	std::string m_fileName;		// 文件名
 	int64 m_fileLength;			// 文件长度
+	bool m_isTrackDirty;		// 是否记录写入过的区域
+	std::vector<uint64> m_dirtyBits;	// 写入过的区域，每一位对应一个区域
+	std::atomic<uint64> m_extendCount;	// 写入使文件变长的次数，用于运行统计
+	std::atomic<uint64> m_extendBytes;	// 写入使文件增加的长度
 #ifdef USE_STREAM_FILE
 	FILE* m_pFile;				// 文件句柄
 #else
 	int m_fileHandle;			// linux下文件句柄
 #endif
 public:
-	File(const std::string& name, const std::string& ext) : m_fileName(name+ext), m_fileLength(0),
+	File(const std::string& name, const std::string& ext) : m_fileName(name+ext), m_fileLength(0), m_isTrackDirty(false), m_extendCount(0), m_extendBytes(0),
 #ifdef USE_STREAM_FILE
 	m_pFile(NULL)
 #else
@@ -193,7 +238,47 @@ public:
 	inline void setFileName(const char* fileName){
 		m_fileName = fileName;
 	}
+	// 开始或者停止记录写入过的区域，会清空已经记录的区域
+	inline void setTrackDirty(bool enable){
+		m_isTrackDirty = enable;
+		m_dirtyBits.clear();
+	}
+	inline bool isTrackDirty(void) const {
+		return m_isTrackDirty;
+	}
+	// 取出上次取出之后写入过的区域，重新开始记录
+	inline void takeDirtyBits(std::vector<uint64>& bits){
+		bits.clear();
+		bits.swap(m_dirtyBits);
+	}
+	// 标记[offset, endOffset)区域被写入过
+	inline void markDirty(int64 offset, int64 endOffset){
+		if(!m_isTrackDirty || endOffset <= offset){
+			return;
+		}
+		uint64 first = (uint64)offset >> DIRTY_REGION_SHIFT;
+		uint64 last = ((uint64)endOffset - 1) >> DIRTY_REGION_SHIFT;
+		if(m_dirtyBits.size() <= (last >> 6)){
+			m_dirtyBits.resize((last >> 6) + 1, 0);
+		}
+		for(uint64 region=first; region<=last; ++region){
+			m_dirtyBits[region >> 6] |= ((uint64)1 << (region & 63));
+		}
+	}
 	inline bool saveData(const void* ptr, int64 length, int64 offset, int64 expandSize, bool recordLength){
+		int64 fileLength = m_fileLength;
+		bool result = writeData(ptr, length, offset, expandSize, recordLength);
+		countExtend(fileLength);
+		return result;
+	}
+	// 文件变长时计数；写入由调用者串行执行，只有统计读取在其它线程，所以不需要原子加法
+	inline void countExtend(int64 fileLength){
+		if(m_fileLength > fileLength){
+			m_extendCount.store(m_extendCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			m_extendBytes.store(m_extendBytes.load(std::memory_order_relaxed) + (uint64)(m_fileLength - fileLength), std::memory_order_relaxed);
+		}
+	}
+	inline bool writeData(const void* ptr, int64 length, int64 offset, int64 expandSize, bool recordLength){
 		int saveLength;
 		if(recordLength){
 			saveLength = 4 + (int)length;
@@ -202,6 +287,7 @@ public:
 		}
 		// 这个数据的保存不超出当前文件的长度
 		int64 endOffset = offset + (int64)saveLength;
+		markDirty(std::min(offset, m_fileLength), endOffset + expandSize);
 		if(endOffset <= m_fileLength){
 			if(recordLength){
 #ifdef USE_STREAM_FILE
@@ -353,14 +439,166 @@ public:
 		delete []saveBuffer;
 		return true;
 	}
+#ifdef USE_STREAM_FILE
 	inline int64 seekRead(void * ptr, int64 size, int64 n, int64 offset, int seek){
 		fileSeek(offset, seek);
 		return fileRead(ptr, size, n);
 	}
+#else
+	// 从文件开头定位的读取使用pread，不修改共享的文件位置，多个线程可以同时读取
+	inline int64 seekRead(void * ptr, int64 size, int64 n, int64 offset, int seek){
+		if(SEEK_SET != seek){
+			fileSeek(offset, seek);
+			return fileRead(ptr, size, n);
+		}
+		int64 total = size * n;
+		int64 done = 0;
+		while(done < total){
+			ssize_t count = pread(m_fileHandle, (char*)ptr + done, (size_t)(total - done), offset + done);
+			if(count <= 0){
+				break;
+			}
+			done += count;
+		}
+		return done;
+	}
+#endif
 	inline int64 seekWrite(const void * ptr, int64 size, int64 n, int64 offset, int seek){
 		fileSeek(offset, seek);
 		return fileWrite(ptr, size, n);
 	}
+	// 批量写入数据段：按偏移排序，首尾相连的数据段合并为一次向量写入；数据段之间不能重叠
+	inline bool saveSegments(WriteSegmentVector& segments){
+		std::sort(segments.begin(), segments.end(), compareSegmentOffset);
+		size_t count = segments.size();
+		size_t begin = 0;
+		while(begin < count){
+			size_t end = begin + 1;
+			int64 endOffset = segments[begin].offset + segments[begin].length;
+			while(end < count && (end - begin) < MAX_WRITE_SEGMENT_NUMBER && segments[end].offset == endOffset){
+				endOffset += segments[end].length;
+				++end;
+			}
+			markDirty(segments[begin].offset, endOffset);
+			if(!writeSegmentRun(&segments[begin], end - begin, endOffset - segments[begin].offset)){
+				return false;
+			}
+			if(endOffset > m_fileLength){
+				int64 fileLength = m_fileLength;
+				m_fileLength = endOffset;
+				countExtend(fileLength);
+			}
+			begin = end;
+		}
+		return true;
+	}
+	static bool compareSegmentOffset(const WriteSegment& a, const WriteSegment& b){
+		return (a.offset < b.offset);
+	}
+	// 批量读取数据段：按偏移排序，首尾相连的数据段合并为一次向量读取
+	inline bool loadSegments(ReadSegmentVector& segments){
+		std::sort(segments.begin(), segments.end(), compareReadSegmentOffset);
+		size_t count = segments.size();
+		size_t begin = 0;
+		while(begin < count){
+			size_t end = begin + 1;
+			int64 endOffset = segments[begin].offset + segments[begin].length;
+			while(end < count && (end - begin) < MAX_WRITE_SEGMENT_NUMBER && segments[end].offset == endOffset){
+				endOffset += segments[end].length;
+				++end;
+			}
+			if(!readSegmentRun(&segments[begin], end - begin, endOffset - segments[begin].offset)){
+				return false;
+			}
+			begin = end;
+		}
+		return true;
+	}
+	static bool compareReadSegmentOffset(const ReadSegment& a, const ReadSegment& b){
+		return (a.offset < b.offset);
+	}
+#ifdef USE_STREAM_FILE
+	inline bool writeSegmentRun(const WriteSegment* pSegments, size_t count, int64 totalLength){
+		fileSeek(pSegments[0].offset, SEEK_SET);
+		for(size_t i=0; i<count; ++i){
+			if(pSegments[i].length != fileWrite(pSegments[i].ptr, 1, pSegments[i].length)){
+				flush();
+				return false;
+			}
+		}
+		flush();
+		return true;
+	}
+	inline bool readSegmentRun(const ReadSegment* pSegments, size_t count, int64 totalLength){
+		fileSeek(pSegments[0].offset, SEEK_SET);
+		for(size_t i=0; i<count; ++i){
+			if(pSegments[i].length != fileRead(pSegments[i].ptr, 1, pSegments[i].length)){
+				return false;
+			}
+		}
+		return true;
+	}
+#else
+	// 连续的数据段使用pwritev一次写入，处理部分写入的情况
+	inline bool writeSegmentRun(const WriteSegment* pSegments, size_t count, int64 totalLength){
+		struct iovec iov[MAX_WRITE_SEGMENT_NUMBER];
+		for(size_t i=0; i<count; ++i){
+			iov[i].iov_base = (void*)pSegments[i].ptr;
+			iov[i].iov_len = (size_t)pSegments[i].length;
+		}
+		struct iovec* pIov = iov;
+		int iovCount = (int)count;
+		int64 offset = pSegments[0].offset;
+		while(totalLength > 0){
+			ssize_t n = pwritev(m_fileHandle, pIov, iovCount, offset);
+			if(n <= 0){
+				return false;
+			}
+			totalLength -= n;
+			offset += n;
+			// 跳过已经写入的部分
+			while(iovCount > 0 && (size_t)n >= pIov->iov_len){
+				n -= pIov->iov_len;
+				++pIov;
+				--iovCount;
+			}
+			if(iovCount > 0){
+				pIov->iov_base = (char*)pIov->iov_base + n;
+				pIov->iov_len -= n;
+			}
+		}
+		return true;
+	}
+	// 连续的数据段使用preadv一次读取，读到文件末尾视为失败
+	inline bool readSegmentRun(const ReadSegment* pSegments, size_t count, int64 totalLength){
+		struct iovec iov[MAX_WRITE_SEGMENT_NUMBER];
+		for(size_t i=0; i<count; ++i){
+			iov[i].iov_base = pSegments[i].ptr;
+			iov[i].iov_len = (size_t)pSegments[i].length;
+		}
+		struct iovec* pIov = iov;
+		int iovCount = (int)count;
+		int64 offset = pSegments[0].offset;
+		while(totalLength > 0){
+			ssize_t n = preadv(m_fileHandle, pIov, iovCount, offset);
+			if(n <= 0){
+				return false;
+			}
+			totalLength -= n;
+			offset += n;
+			while(iovCount > 0 && (size_t)n >= pIov->iov_len){
+				n -= pIov->iov_len;
+				++pIov;
+				--iovCount;
+			}
+			if(iovCount > 0){
+				pIov->iov_base = (char*)pIov->iov_base + n;
+				pIov->iov_len -= n;
+			}
+		}
+		return true;
+	}
+#endif
 #ifdef USE_STREAM_FILE
 	// 文件读写操作
 	inline int64 fileRead(void * ptr, int64 size, int64 n){
@@ -411,7 +649,86 @@ public:
 #endif
 };
 
-
+// 写入完整的文件：先写临时文件，同步后改名，不会留下写了一半的文件
+inline bool writeWholeFile(const std::string& fileName, const CharVector& data){
+	std::string tempName = fileName + ".tmp";
+	int fd = open(tempName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(-1 == fd){
+		return false;
+	}
+	int64 written = 0;
+	while(written < (int64)data.size()){
+		ssize_t n = write(fd, data.data() + written, (size_t)((int64)data.size() - written));
+		if(n <= 0){
+			close(fd);
+			return false;
+		}
+		written += n;
+	}
+	bool ok = (0 == fsync(fd));
+	close(fd);
+	return ok && (0 == rename(tempName.c_str(), fileName.c_str()));
+}
+// key和index文件升级时把旧格式的记录转换成当前的记录：旧记录的字段是当前记录的前缀，后面补0；
+// 不能转换时返回false，需要其它转换方式的记录类型重载这个函数
+template<typename _TYPE_>
+inline bool upgradeRecord(_TYPE_& value, const char* data, uint64 size){
+	if(size > sizeof(_TYPE_)){
+		return false;
+	}
+	value = _TYPE_(0);
+	memcpy((void*)&value, data, size);
+	return true;
+}
+// 查找name所在目录中文件名为 name.NNNNNNNN+ext 的所有文件，ids返回排好序的编号
+inline bool listFileNumbers(const std::string& name, const char* ext, std::vector<uint32>& ids){
+	std::string dirName = ".";
+	std::string baseName = name;
+	size_t pos = name.rfind('/');
+	if(pos != std::string::npos){
+		dirName = name.substr(0, pos);
+		baseName = name.substr(pos + 1);
+		if(dirName.empty()){
+			dirName = "/";
+		}
+	}
+	DIR* pDir = opendir(dirName.c_str());
+	if(NULL == pDir){
+		return false;
+	}
+	std::string extName = ext;
+	struct dirent* pEntry;
+	while(NULL != (pEntry = readdir(pDir))){
+		std::string fileName = pEntry->d_name;
+		if(fileName.length() != baseName.length() + 9 + extName.length() || fileName.compare(0, baseName.length(), baseName) != 0 || fileName[baseName.length()] != '.'){
+			continue;
+		}
+		if(fileName.compare(fileName.length() - extName.length(), extName.length(), extName) != 0){
+			continue;
+		}
+		std::string number = fileName.substr(baseName.length() + 1, 8);
+		if(number.find_first_not_of("0123456789") != std::string::npos){
+			continue;
+		}
+		ids.push_back((uint32)strtoul(number.c_str(), NULL, 10));
+	}
+	closedir(pDir);
+	std::sort(ids.begin(), ids.end());
+	return true;
+}
+// 编号文件的扩展名：.00000001+ext
+inline std::string getNumberExt(uint32 id, const char* ext){
+	char buffer[32];
+	sprintf(buffer, ".%08u%s", id, ext);
+	return std::string(buffer);
+}
+// key记录写入文件前计算校验码，加载时检查；默认的记录类型没有校验码，需要校验的记录类型重载这两个函数
+template<typename _TYPE_>
+inline void sealRecord(_TYPE_& value, const void* key, uint64 length){}
+template<typename _TYPE_>
+inline bool checkRecord(const _TYPE_& value, const void* key, uint64 length){
+	return true;
+}
 
 NS_HIVE_END
 
@@ -0,0 +1,107 @@
+//
+//  histogram.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/21.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef histogram_hpp
+#define histogram_hpp
+
+#include "file.hpp"
+#include <chrono>
+
+NS_HIVE_BEGIN
+
+#define HISTOGRAM_SUB_BITS 8			// 压力测试的精度：每个数量级128个子桶，相对误差不超过1/128
+
+// 单调时钟的纳秒数，用于计算耗时
+inline uint64 getTimeNanosecond(void){
+	return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 对数线性分桶的延迟直方图（HDR Histogram的做法）：小于2^_SUB_BITS_的值精确记录，
+// 更大的值按最高位分数量级，每个数量级2^(_SUB_BITS_-1)个子桶；百分位返回所在桶的上界，最小值、最大值和总和精确记录
+template <uint32 _SUB_BITS_>
+class Histogram
+{
+public:
+	enum{
+		SUB_COUNT = (1 << _SUB_BITS_),
+		HALF_COUNT = (1 << (_SUB_BITS_ - 1)),
+		BUCKET_COUNT = SUB_COUNT + (64 - _SUB_BITS_) * HALF_COUNT,		// 覆盖全部uint64
+	};
+	std::vector<uint64> m_counts;
+	uint64 m_count;
+	uint64 m_sum;
+	uint64 m_min;
+	uint64 m_max;
+public:
+	Histogram(void) : m_counts(BUCKET_COUNT, 0), m_count(0), m_sum(0), m_min((uint64)-1), m_max(0){}
+	virtual ~Histogram(void){}
+	inline void record(uint64 value){
+		++m_counts[getBucket(value)];
+		++m_count;
+		m_sum += value;
+		m_min = std::min(m_min, value);
+		m_max = std::max(m_max, value);
+	}
+	inline void merge(const Histogram& other){
+		for(size_t i=0; i<BUCKET_COUNT; ++i){
+			m_counts[i] += other.m_counts[i];
+		}
+		m_count += other.m_count;
+		m_sum += other.m_sum;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+	}
+	inline void reset(void){
+		std::fill(m_counts.begin(), m_counts.end(), 0);
+		m_count = 0;
+		m_sum = 0;
+		m_min = (uint64)-1;
+		m_max = 0;
+	}
+	inline uint64 getCount(void) const { return m_count; }
+	inline uint64 getMin(void) const { return (0 == m_count) ? 0 : m_min; }
+	inline uint64 getMax(void) const { return m_max; }
+	inline double getMean(void) const { return (0 == m_count) ? 0.0 : (double)m_sum / (double)m_count; }
+	// percentile为0到100，例如99.9
+	inline uint64 getPercentile(double percentile) const {
+		if(0 == m_count){
+			return 0;
+		}
+		uint64 target = (uint64)(percentile / 100.0 * (double)m_count + 0.5);
+		target = std::max(target, (uint64)1);
+		uint64 total = 0;
+		for(size_t i=0; i<BUCKET_COUNT; ++i){
+			total += m_counts[i];
+			if(total >= target){
+				return std::min(getBucketHigh(i), m_max);
+			}
+		}
+		return m_max;
+	}
+	static inline size_t getBucket(uint64 value){
+		if(value < SUB_COUNT){
+			return (size_t)value;
+		}
+		uint32 shift = (uint32)(63 - __builtin_clzll(value)) - (_SUB_BITS_ - 1);
+		return (size_t)(SUB_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT));
+	}
+	// 桶内最大的值
+	static inline uint64 getBucketHigh(size_t bucket){
+		if(bucket < SUB_COUNT){
+			return (uint64)bucket;
+		}
+		uint32 shift = (uint32)((bucket - SUB_COUNT) / HALF_COUNT) + 1;
+		uint64 mantissa = (uint64)((bucket - SUB_COUNT) % HALF_COUNT) + HALF_COUNT;
+		return (mantissa << shift) + ((uint64)1 << shift) - 1;
+	}
+};
+typedef Histogram<HISTOGRAM_SUB_BITS> LatencyHistogram;
+
+NS_HIVE_END
+
+#endif /* histogram_hpp */
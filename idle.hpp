@@ -10,14 +10,16 @@
 #define idle_hpp
 
 #include "file.hpp"
+#include <map>
 
 NS_HIVE_BEGIN
 
 #define BLOCK_MAX_SAVE_NUMBER 524288	// 64M/128Byte计算的结果
 #define BLOCK_MAX_SAVE_SIZE 67108864	// 64M，最大保存的单个文件块长度
-#define BLOCK_MAX_IDLE_NUMBER 16777215	// 空闲块的数量最大值，超过会分成两个来保存,<2G
+#define BLOCK_MAX_IDLE_NUMBER 8388607	// 空闲块的数量最大值（BlockNode的size为23位），超过会分成两个来保存,<512M
 
 #define IDLE_LIMITED_LOOP 1024
+#define IDLE_RUN_BUCKET_NUMBER 24		// 空闲段按长度（块数）的2的幂分桶，第i个桶为[2^i, 2^(i+1))，段长度不超过23位
 
 template <typename _NODE_>
 class Idle
@@ -28,8 +30,15 @@ public:
 	int64 m_maxIdleSize;			// 记录最大的Idle数据
 	int64 m_maxIdleIndex;			// 记录最大的Idle的下标
 	bool m_isMaxIdleNew;			// 当前的idle是不是最新的
+	uint64 m_freeBlocks;			// 空闲块的总数
+	uint64 m_runCounts[IDLE_RUN_BUCKET_NUMBER];		// 每个桶的空闲段数量
+	uint64 m_runBlocks[IDLE_RUN_BUCKET_NUMBER];		// 每个桶的空闲块数量
+	std::map<uint64, uint64> m_runSizes;			// 空闲段长度 -> 段数量，用于得到最大的空闲段
 public:
-	Idle(void) : m_maxIdleSize(0), m_maxIdleIndex(0), m_isMaxIdleNew(false) {}
+	Idle(void) : m_maxIdleSize(0), m_maxIdleIndex(0), m_isMaxIdleNew(false), m_freeBlocks(0) {
+		memset(m_runCounts, 0, sizeof(m_runCounts));
+		memset(m_runBlocks, 0, sizeof(m_runBlocks));
+	}
 	virtual ~Idle(void){}
 	// 找到能够保存数据的节点；没有则返回NULL
 	inline _NODE_* getIdleNode(uint64 size, uint64* index){
@@ -44,17 +53,17 @@ public:
 		if(m_isMaxIdleNew){
 			return NULL;
 		}
-		int64 arraySize = (int64)m_idles.size();
+		size_t arraySize = m_idles.size();
 		if(arraySize > IDLE_LIMITED_LOOP){
 			return NULL;
 		}
 		uint64 emptySize;
-		for(int64 i = arraySize - 1; i > -1; --i){
-			_NODE_ &node = m_idles[i];
+		for(size_t i = arraySize; i > 0; --i){
+			_NODE_ &node = m_idles[i - 1];
 			emptySize = node.size;
 			if(emptySize > (uint64)m_maxIdleSize){
 				m_maxIdleSize = emptySize;
-				m_maxIdleIndex = i;
+				m_maxIdleIndex = (int64)(i - 1);
 			}
 		}
 		m_isMaxIdleNew = true;
@@ -64,8 +73,16 @@ public:
 		}
 		return NULL;
 	}
-	// 添加一个新的空闲数据信息
+	// 添加一个新的空闲数据信息；插入或删除节点会移动下标，完成后按offset重新定位记录的最大段
 	inline void setIdleNode(uint64 offset, uint64 size){
+		uint64 maxIdleOffset = (m_maxIdleSize > 0) ? m_idles[m_maxIdleIndex].offset : 0;
+		insertIdleNode(offset, size);
+		m_isMaxIdleNew = false;
+		if(m_maxIdleSize > 0){
+			locateMaxIdle(maxIdleOffset);
+		}
+	}
+	inline void insertIdleNode(uint64 offset, uint64 size){
 		// 找到是否有相连的节点，直接拼接空闲节点
 		if(m_idles.empty()){
 			addIdleNodeAtEnd(offset, size);
@@ -80,6 +97,7 @@ public:
 				if(newSize > BLOCK_MAX_IDLE_NUMBER){
 					addIdleNodeAtEnd(offset, size);
 				}else{
+					resizeRun(endNode.size, newSize);
 					endNode.size = newSize;
 				}
 				return;
@@ -98,6 +116,7 @@ public:
 				if(newSize > BLOCK_MAX_IDLE_NUMBER){
 					addIdleNodeAtBegin(offset, size);
 				}else{
+					resizeRun(beginNode.size, newSize);
 					beginNode.size = newSize;
 					beginNode.offset = offset;
 				}
@@ -157,6 +176,7 @@ public:
 				// 没有合并操作
 			case 0:{
 				m_idles.insert(m_idles.begin() + max, _NODE_(offset, size));
+				addRun(size);
 				break;
 			}
 				// 和min节点合并
@@ -164,7 +184,9 @@ public:
 				newSize = minNode.size + size;
 				if(newSize > BLOCK_MAX_IDLE_NUMBER){
 					m_idles.insert(m_idles.begin() + max, _NODE_(offset, size));
+					addRun(size);
 				}else{
+					resizeRun(minNode.size, newSize);
 					minNode.size = newSize;
 				}
 				break;
@@ -174,7 +196,9 @@ public:
 				newSize = maxNode.size + size;
 				if(newSize > BLOCK_MAX_IDLE_NUMBER){
 					m_idles.insert(m_idles.begin() + max, _NODE_(offset, size));
+					addRun(size);
 				}else{
+					resizeRun(maxNode.size, newSize);
 					maxNode.size = newSize;
 					maxNode.offset = offset;
 				}
@@ -187,14 +211,19 @@ public:
 					newSize = maxNode.size + size;
 					if(newSize > BLOCK_MAX_IDLE_NUMBER){	// 前后都不合并
 						m_idles.insert(m_idles.begin() + max, _NODE_(offset, size));
+						addRun(size);
 					}else{									// 只合并到max节点
+						resizeRun(maxNode.size, newSize);
 						maxNode.size = newSize;
 						maxNode.offset = offset;
 					}
 				}else{
 					if(newSize + maxNode.size > BLOCK_MAX_IDLE_NUMBER){	// 只合并到min节点
+						resizeRun(minNode.size, newSize);
 						minNode.size = newSize;
 					}else{									// 同时合并min和max节点；删除max节点
+						resizeRun(minNode.size, newSize + maxNode.size);
+						removeRun(maxNode.size);
 						minNode.size = newSize + maxNode.size;
 						m_idles.erase(m_idles.begin() + max);
 					}
@@ -211,9 +240,11 @@ public:
 		m_isMaxIdleNew = false;
 		uint64 emptySize = pNode->size;
 		if(emptySize == size){
+			removeRun(emptySize);
 			m_idles.erase(m_idles.begin() + index);
 			m_maxIdleSize = 0;
 		}else if(emptySize > size){
+			resizeRun(emptySize, emptySize - size);
 			pNode->size -= size;
 			pNode->offset += size;
 			m_maxIdleSize = pNode->size;
@@ -228,22 +259,68 @@ public:
 	inline void addIdleNodeAtBegin(uint64 offset, uint64 size){
 		while(size > BLOCK_MAX_IDLE_NUMBER){
 			m_idles.insert(m_idles.begin(), _NODE_(offset, BLOCK_MAX_IDLE_NUMBER));
+			addRun(BLOCK_MAX_IDLE_NUMBER);
 			size -= BLOCK_MAX_IDLE_NUMBER;
 			offset += BLOCK_MAX_IDLE_NUMBER;
 		};
 		m_idles.insert(m_idles.begin(), _NODE_(offset, size));
+		addRun(size);
 	}
 	inline void addIdleNodeAtEnd(uint64 offset, uint64 size){
 		while(size > BLOCK_MAX_IDLE_NUMBER){
 			m_idles.push_back(_NODE_(offset, BLOCK_MAX_IDLE_NUMBER));
+			addRun(BLOCK_MAX_IDLE_NUMBER);
 			size -= BLOCK_MAX_IDLE_NUMBER;
 			offset += BLOCK_MAX_IDLE_NUMBER;
 		};
 		m_idles.push_back(_NODE_(offset, size));
+		addRun(size);
+	}
+	// 空闲段的统计随节点的增删和长度变化更新，不需要遍历
+	inline uint64 getFreeBlocks(void) const { return m_freeBlocks; }
+	inline uint64 getFreeRuns(void) const { return (uint64)m_idles.size(); }
+	inline uint64 getLargestRun(void) const { return m_runSizes.empty() ? 0 : m_runSizes.rbegin()->first; }
+	static inline int getRunBucket(uint64 size){
+		return (0 == size) ? 0 : (63 - __builtin_clzll(size));
 	}
 
 protected:
-	
+	inline void addRun(uint64 size){
+		int bucket = getRunBucket(size);
+		++m_runCounts[bucket];
+		m_runBlocks[bucket] += size;
+		m_freeBlocks += size;
+		++m_runSizes[size];
+	}
+	inline void removeRun(uint64 size){
+		int bucket = getRunBucket(size);
+		--m_runCounts[bucket];
+		m_runBlocks[bucket] -= size;
+		m_freeBlocks -= size;
+		std::map<uint64, uint64>::iterator itCur = m_runSizes.find(size);
+		if(itCur != m_runSizes.end() && 0 == --(itCur->second)){
+			m_runSizes.erase(itCur);
+		}
+	}
+	inline void resizeRun(uint64 oldSize, uint64 newSize){
+		removeRun(oldSize);
+		addRun(newSize);
+	}
+	// 找到包含offset的节点作为最大段；合并只会让节点变大
+	inline void locateMaxIdle(uint64 offset){
+		size_t low = 0;
+		size_t high = m_idles.size();
+		while(high - low > 1){
+			size_t mid = low + (high - low) / 2;
+			if(m_idles[mid].offset <= offset){
+				low = mid;
+			}else{
+				high = mid;
+			}
+		}
+		m_maxIdleIndex = (int64)low;
+		m_maxIdleSize = m_idles[low].size;
+	}
 };
 
 NS_HIVE_END
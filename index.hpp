@@ -10,11 +10,13 @@
 #define index_hpp
 
 #include "file.hpp"
+#include <functional>
 
 NS_HIVE_BEGIN
 
-#define INDEX_HEAD_OFFSET 32
+#define INDEX_HEAD_OFFSET 40				// 头部：value长度、key长度上限、存储单元长度、数据块长度、格式版本
 #define MAX_INDEX_KEY_LENGTH 16
+#define INDEX_SLOT_NUMBER 4096			// 内存索引按key分成的槽数量，每个槽是独立的哈希表
 
 template <typename _TYPE_>
 class Index : public File
@@ -38,15 +40,29 @@ public:
 	typedef std::unordered_map<uint64, KeyValue> KeyValueMap;
 	typedef std::vector<_TYPE_> NodeVector;
 	typedef std::vector<int64> OffsetVector;
+	// 批量写入的记录
+	typedef struct SetEntry {
+		uint64 key;
+		_TYPE_ value;
+		SetEntry(uint64 k, const _TYPE_& v) : key(k), value(v){}
+	}SetEntry;
+	typedef std::vector<SetEntry> SetEntryVector;
+	// 打开数据库时每读取到一条记录的通知
+	typedef std::function<void(uint64 key, const _TYPE_& value)> LoadListener;
+	// 修改或者删除记录之前的通知，pOld为修改前的记录，新增的key为NULL；pNew为修改后的记录，删除的key为NULL
+	typedef std::function<void(uint64 key, const _TYPE_* pOld, const _TYPE_* pNew)> ChangeListener;
 
 	uint64 m_valueSize;					// 保存value的长度
 	uint64 m_keyLength;					// key的长度上限
 	uint64 m_unitSize;					// key存储单元的长度
 	uint64 m_blockSize;					// data存储单元的长度
-	KeyValueMap m_keyMapArray;
+	uint64 m_version;					// 文件格式版本
+	KeyValueMap m_keyMapArray[INDEX_SLOT_NUMBER];
 	OffsetVector m_idleKeys;
+	LoadListener m_loadListener;
+	ChangeListener m_changeListener;
 public:
-	Index(const std::string& name, const std::string& ext) : File(name, ext), m_valueSize(0), m_keyLength(0), m_unitSize(0), m_blockSize(0) {
+	Index(const std::string& name, const std::string& ext) : File(name, ext), m_valueSize(0), m_keyLength(0), m_unitSize(0), m_blockSize(0), m_version(0) {
 //		assert(MAX_KEY_LENGTH < 256 && "too large key length");
 	}
 	virtual ~Index(void){
@@ -54,21 +70,24 @@ public:
 	}
 	inline int set(uint64 key, const _TYPE_& value, bool setNotExist){
 		// 查找是否有老数据，覆盖处理
-		KeyValueMap& kvMap = getKeyValueMap();
+		KeyValueMap& kvMap = getKeyValueMap(key);
 		typename KeyValueMap::iterator itCur = kvMap.find(key);
+		_TYPE_ sealed = value;
+		sealRecord(sealed, &key, sizeof(uint64));
 		if(itCur != kvMap.end()){
 			if(setNotExist){
 				return FERR_KEY_ALREADY_EXIST;
 			}
-			if(!saveData(&value, sizeof(_TYPE_), itCur->second.offset, 0, false)){
+			if(!saveData(&sealed, sizeof(_TYPE_), itCur->second.offset, 0, false)){
 				return FERR_KEY_SET_FAILED;
 			}
-			itCur->second.value = value;
+			notifyChange(key, &(itCur->second.value), &sealed);
+			itCur->second.value = sealed;
 			return FILE_OK;
 		}
 		// 保存新的节点数据
 		IndexStorage keyS;
-		keyS.value = value;
+		keyS.value = sealed;
 		keyS.setKey(key);
 		int64 offset;
 		bool isFromIdle;
@@ -86,11 +105,92 @@ public:
 		if(isFromIdle){
 			idleKeys.pop_back();
 		}
-		kvMap.insert(std::make_pair(key, KeyValue(value, offset)));
+		notifyChange(key, NULL, &sealed);
+		kvMap.insert(std::make_pair(key, KeyValue(sealed, offset)));
+		return FILE_OK;
+	}
+	// 批量写入记录：所有记录的写入合并成少量的向量写入，全部写入成功后才修改内存数据；key不能重复
+	// 不是原子操作：文件中的记录按单条生效，向量写入中途失败时可能已经写入了一部分记录
+	inline int mset(const SetEntryVector& entries){
+		size_t count = entries.size();
+		std::vector<IndexStorage> storages(count);
+		OffsetVector offsets(count, -1);
+		WriteSegmentVector segments;
+		segments.reserve(count);
+		int64 oldLength = m_fileLength;
+		int64 endOffset = m_fileLength;
+		for(size_t i=0; i<count; ++i){
+			const SetEntry& entry = entries[i];
+			KeyValueMap& kvMap = getKeyValueMap(entry.key);
+			typename KeyValueMap::iterator itCur = kvMap.find(entry.key);
+			IndexStorage& keyS = storages[i];
+			keyS.value = entry.value;
+			sealRecord(keyS.value, &(entry.key), sizeof(uint64));
+			if(itCur != kvMap.end()){
+				// 覆盖老数据，只需要写入value
+				segments.push_back(WriteSegment(itCur->second.offset, &(keyS.value), sizeof(_TYPE_)));
+				continue;
+			}
+			keyS.setKey(entry.key);
+			// 优先使用空闲的key位置，没有就追加到文件末尾
+			if(m_idleKeys.empty()){
+				offsets[i] = endOffset;
+				endOffset += sizeof(IndexStorage);
+			}else{
+				offsets[i] = m_idleKeys.back();
+				m_idleKeys.pop_back();
+			}
+			segments.push_back(WriteSegment(offsets[i], &keyS, sizeof(IndexStorage)));
+		}
+		if(!saveSegments(segments)){
+			// 写入失败，归还使用的空闲key位置
+			for(size_t i=0; i<count; ++i){
+				if(offsets[i] >= 0 && offsets[i] < oldLength){
+					m_idleKeys.push_back(offsets[i]);
+				}
+			}
+			return FERR_KEY_SET_FAILED;
+		}
+		for(size_t i=0; i<count; ++i){
+			const SetEntry& entry = entries[i];
+			KeyValueMap& kvMap = getKeyValueMap(entry.key);
+			if(offsets[i] < 0){
+				_TYPE_& value = kvMap[entry.key].value;
+				notifyChange(entry.key, &value, &(storages[i].value));
+				value = storages[i].value;
+			}else{
+				notifyChange(entry.key, NULL, &(storages[i].value));
+				kvMap.insert(std::make_pair(entry.key, KeyValue(storages[i].value, offsets[i])));
+			}
+		}
+		return FILE_OK;
+	}
+	// 批量追加新的记录：记录拼接后一次写入文件末尾，不使用空闲的key位置；调用者保证key不存在并且不重复
+	inline int append(const SetEntryVector& entries){
+		size_t count = entries.size();
+		if(0 == count){
+			return FILE_OK;
+		}
+		std::vector<IndexStorage> storages(count);
+		for(size_t i=0; i<count; ++i){
+			storages[i].value = entries[i].value;
+			sealRecord(storages[i].value, &(entries[i].key), sizeof(uint64));
+			storages[i].setKey(entries[i].key);
+		}
+		int64 offset = m_fileLength;
+		WriteSegmentVector segments;
+		segments.push_back(WriteSegment(offset, storages.data(), (int64)(sizeof(IndexStorage) * count)));
+		if(!saveSegments(segments)){
+			return FERR_KEY_SET_FAILED;
+		}
+		for(size_t i=0; i<count; ++i){
+			notifyChange(entries[i].key, NULL, &(storages[i].value));
+			getKeyValueMap(entries[i].key).insert(std::make_pair(entries[i].key, KeyValue(storages[i].value, offset + (int64)(sizeof(IndexStorage) * i))));
+		}
 		return FILE_OK;
 	}
 	inline int get(uint64 key, _TYPE_& value){
-		KeyValueMap& kvMap = getKeyValueMap();
+		KeyValueMap& kvMap = getKeyValueMap(key);
 		typename KeyValueMap::iterator itCur = kvMap.find(key);
 		if(itCur == kvMap.end()){
 			return FERR_KEY_NOT_FOUND;
@@ -99,7 +199,7 @@ public:
 		return FILE_OK;
 	}
 	inline int get(uint64 key, _TYPE_** value){
-		KeyValueMap& kvMap = getKeyValueMap();
+		KeyValueMap& kvMap = getKeyValueMap(key);
 		typename KeyValueMap::iterator itCur = kvMap.find(key);
 		if(itCur == kvMap.end()){
 			return FERR_KEY_NOT_FOUND;
@@ -108,7 +208,7 @@ public:
 		return FILE_OK;
 	}
 	inline int del(uint64 key, _TYPE_& value){
-		KeyValueMap& kvMap = getKeyValueMap();
+		KeyValueMap& kvMap = getKeyValueMap(key);
 		typename KeyValueMap::iterator itCur = kvMap.find(key);
 		if(itCur == kvMap.end()){
 			return FERR_KEY_NOT_FOUND;
@@ -121,6 +221,7 @@ public:
 			return FERR_KEY_SET_FAILED;
 		}
 		value = itCur->second.value;
+		notifyChange(key, &value, NULL);
 		OffsetVector& idleKeys = m_idleKeys;
 		idleKeys.push_back(itCur->second.offset);
 		kvMap.erase(itCur);
@@ -140,24 +241,29 @@ public:
 		return FILE_OK;
 	}
 	inline int replace(uint64 key, uint64 newKey){
-		KeyValueMap& kvMapOld = getKeyValueMap();
+		KeyValueMap& kvMapOld = getKeyValueMap(key);
 		typename KeyValueMap::iterator itCur = kvMapOld.find(key);
 		if(itCur == kvMapOld.end()){
 			return FERR_KEY_NOT_FOUND;
 		}
-		KeyValueMap& kvMapNew = getKeyValueMap();
+		KeyValueMap& kvMapNew = getKeyValueMap(newKey);
 		typename KeyValueMap::iterator checkItCur = kvMapNew.find(newKey);
 		if(checkItCur != kvMapNew.end()){
 			return FERR_KEY_ALREADY_EXIST;
 		}
+		// 校验码包含key，记录需要和新的key一起写入
+		KeyValue kv = itCur->second;
+		sealRecord(kv.value, &newKey, sizeof(uint64));
 		IndexStorage keyS;
+		keyS.value = kv.value;
 		keyS.setKey(newKey);
-        int64 offset = itCur->second.offset + sizeof(_TYPE_);
-        if(!saveData(&(keyS.key), sizeof(uint64), offset, 0, false)){
-            return FERR_KEY_SET_FAILED;
-        }
+		if(!saveData(&keyS, sizeof(IndexStorage), kv.offset, 0, false)){
+			return FERR_KEY_SET_FAILED;
+		}
+		notifyChange(key, &(itCur->second.value), NULL);
+		notifyChange(newKey, NULL, &(kv.value));
 		kvMapOld.erase(itCur);
-		kvMapNew.insert(std::make_pair(newKey, itCur->second));
+		kvMapNew.insert(std::make_pair(newKey, kv));
 		return FILE_OK;
 	}
 	int openDB(void){
@@ -191,6 +297,12 @@ public:
 		}
 		return FILE_OK;
 	}
+	inline void setLoadListener(const LoadListener& listener){
+		m_loadListener = listener;
+	}
+	inline void setChangeListener(const ChangeListener& listener){
+		m_changeListener = listener;
+	}
 	void closeDB(void){
 #ifdef USE_STREAM_FILE
 		if(NULL != m_pFile){
@@ -201,15 +313,52 @@ public:
 	}
 	void getNotEmptyValues(NodeVector& vec){
 		_TYPE_ zero(0);
-        for(auto &kv : m_keyMapArray){
-            if(kv.second.value != zero){
-                vec.push_back(kv.second.value);
-            }
-        }
+		for(uint64 slot=0; slot<INDEX_SLOT_NUMBER; ++slot){
+			for(auto &kv : m_keyMapArray[slot]){
+				if(kv.second.value != zero){
+					vec.push_back(kv.second.value);
+				}
+			}
+		}
+	}
+	// 按照内存中的记录生成紧凑的文件内容：头部和所有记录，没有空闲的key位置
+	void getFileImage(CharVector& data){
+		uint64 head[5] = {sizeof(_TYPE_), MAX_INDEX_KEY_LENGTH, sizeof(IndexStorage), BLOCK_SIZE, FILE_FORMAT_VERSION};
+		data.resize(INDEX_HEAD_OFFSET + sizeof(IndexStorage) * getKeyCount());
+		memcpy(data.data(), head, INDEX_HEAD_OFFSET);
+		IndexStorage* pKey = (IndexStorage*)(data.data() + INDEX_HEAD_OFFSET);
+		for(uint64 slot=0; slot<INDEX_SLOT_NUMBER; ++slot){
+			for(auto &kv : m_keyMapArray[slot]){
+				pKey->value = kv.second.value;
+				pKey->setKey(kv.first);
+				++pKey;
+			}
+		}
+	}
+	// 已经删除、等待重用的记录数量和占用的文件长度
+	inline void getIdleStat(uint64& count, uint64& bytes) const {
+		count = (uint64)m_idleKeys.size();
+		bytes = count * sizeof(IndexStorage);
+	}
+	inline uint64 getKeyCount(void) const {
+		uint64 count = 0;
+		for(uint64 slot=0; slot<INDEX_SLOT_NUMBER; ++slot){
+			count += m_keyMapArray[slot].size();
+		}
+		return count;
+	}
+	// key所在的槽，同一个槽的记录保存在同一个哈希表中
+	inline uint64 getSlot(uint64 key) const {
+		return key % INDEX_SLOT_NUMBER;
 	}
 protected:
-	inline KeyValueMap& getKeyValueMap(void){
-		return m_keyMapArray;
+	inline void notifyChange(uint64 key, const _TYPE_* pOld, const _TYPE_* pNew){
+		if(m_changeListener){
+			m_changeListener(key, pOld, pNew);
+		}
+	}
+	inline KeyValueMap& getKeyValueMap(uint64 key){
+		return m_keyMapArray[getSlot(key)];
 	}
 	int initializeDB(void){
 		// 写入数据库的头部数据
@@ -217,11 +366,13 @@ protected:
 		m_keyLength = MAX_INDEX_KEY_LENGTH;
 		m_unitSize = sizeof(IndexStorage);
 		m_blockSize = BLOCK_SIZE;
+		m_version = FILE_FORMAT_VERSION;
 		char temp[INDEX_HEAD_OFFSET];
 		memcpy(temp, &m_valueSize, sizeof(uint64));
 		memcpy(temp + sizeof(uint64), &m_keyLength, sizeof(uint64));
 		memcpy(temp + sizeof(uint64)*2, &m_unitSize, sizeof(uint64));
 		memcpy(temp + sizeof(uint64)*3, &m_blockSize, sizeof(uint64));
+		memcpy(temp + sizeof(uint64)*4, &m_version, sizeof(uint64));
 		if(INDEX_HEAD_OFFSET != seekWrite(temp, 1, INDEX_HEAD_OFFSET, 0, SEEK_SET)){
 			fprintf(stderr, "Index::initializeDB write head failed\n");
 			return FERR_INIT_WRITE_FAILED;
@@ -232,22 +383,35 @@ protected:
 	int initializeFromFile(void){
 		// 读取数据库头部数据
 		seekRead(&(m_valueSize), 1, INDEX_HEAD_OFFSET, 0, SEEK_SET);
-		if(m_valueSize != sizeof(_TYPE_)){
-			fprintf(stderr, "Index::initializeFromFile m_valueSize=%lld \n", m_valueSize);
-			return FERR_KEY_VALUE_SIZE_NOT_MATCH;
-		}
 		if(m_keyLength > MAX_INDEX_KEY_LENGTH){
 			fprintf(stderr, "Index::initializeFromFile m_keyLength=%lld \n", m_keyLength);
 			return FERR_KEY_LENGTH_NOT_MATCH;
 		}
-		if(m_unitSize != sizeof(IndexStorage)){
-			fprintf(stderr, "Index::initializeFromFile m_unitSize=%lld \n", m_unitSize);
-			return FERR_UNIT_SIZE_NOT_MATCH;
-		}
 		if(m_blockSize != BLOCK_SIZE){
 			fprintf(stderr, "Index::initializeFromFile m_blockSize=%lld \n", m_blockSize);
 			return FERR_BLOCK_SIZE_NOT_MATCH;
 		}
+		// 没有版本的旧文件（8字节的BlockNode记录）和旧版本的文件先升级到当前的格式
+		bool legacy = (m_valueSize == sizeof(uint64) && m_unitSize == sizeof(uint64) * 2);
+		if(legacy || (m_version < FILE_FORMAT_VERSION && m_unitSize == m_valueSize + sizeof(uint64))){
+			int result = upgradeFile(legacy ? LEGACY_HEAD_OFFSET : INDEX_HEAD_OFFSET);
+			if(FILE_OK != result){
+				return result;
+			}
+			seekRead(&(m_valueSize), 1, INDEX_HEAD_OFFSET, 0, SEEK_SET);
+		}
+		if(m_version != FILE_FORMAT_VERSION){
+			fprintf(stderr, "Index::initializeFromFile m_version=%lld \n", m_version);
+			return FERR_FORMAT_VERSION_NOT_MATCH;
+		}
+		if(m_valueSize != sizeof(_TYPE_)){
+			fprintf(stderr, "Index::initializeFromFile m_valueSize=%lld \n", m_valueSize);
+			return FERR_KEY_VALUE_SIZE_NOT_MATCH;
+		}
+		if(m_unitSize != sizeof(IndexStorage)){
+			fprintf(stderr, "Index::initializeFromFile m_unitSize=%lld \n", m_unitSize);
+			return FERR_UNIT_SIZE_NOT_MATCH;
+		}
 		// 读取key数据
 		int64 initSize = 100000;
 		int64 tempBufferSize = sizeof(IndexStorage)*initSize;
@@ -270,6 +434,41 @@ protected:
 		delete []tempBuffer;
 		return FILE_OK;
 	}
+	// 升级旧格式的文件：旧记录是m_valueSize长度的value + 8字节的key，value为0的是空闲位置；
+	// 转换成当前的记录后生成紧凑的文件，先写临时文件再改名替换，中途失败时旧文件保持不变，下次打开重新升级
+	int upgradeFile(int64 headOffset){
+		int64 unitSize = (int64)m_valueSize + (int64)sizeof(uint64);
+		CharVector oldData(m_fileLength);
+		if(m_fileLength != seekRead(oldData.data(), 1, m_fileLength, 0, SEEK_SET)){
+			fprintf(stderr, "Index::upgradeFile read failed file=%s\n", m_fileName.c_str());
+			return FERR_INVALID_FILE;
+		}
+		uint64 head[5] = {sizeof(_TYPE_), MAX_INDEX_KEY_LENGTH, sizeof(IndexStorage), BLOCK_SIZE, FILE_FORMAT_VERSION};
+		CharVector data((const char*)head, (const char*)head + INDEX_HEAD_OFFSET);
+		IndexStorage keyS;
+		_TYPE_ zero(0);
+		int64 count = 0;
+		for(int64 offset = headOffset; offset + unitSize <= m_fileLength; offset += unitSize){
+			if(!upgradeRecord(keyS.value, oldData.data() + offset, m_valueSize)){
+				fprintf(stderr, "Index::upgradeFile convert record failed file=%s offset=%lld\n", m_fileName.c_str(), offset);
+				return FERR_FORMAT_VERSION_NOT_MATCH;
+			}
+			if(keyS.value == zero){
+				continue;
+			}
+			memcpy(&(keyS.key), oldData.data() + offset + m_valueSize, sizeof(uint64));
+			sealRecord(keyS.value, &(keyS.key), sizeof(uint64));
+			data.insert(data.end(), (const char*)&keyS, (const char*)&keyS + sizeof(IndexStorage));
+			++count;
+		}
+		if(!writeWholeFile(m_fileName, data) || !openReadWrite("rb+")){
+			fprintf(stderr, "Index::upgradeFile write failed file=%s\n", m_fileName.c_str());
+			return FERR_INIT_WRITE_FAILED;
+		}
+		m_fileLength = (int64)data.size();
+		fprintf(stderr, "Index::upgradeFile file=%s keys=%lld\n", m_fileName.c_str(), count);
+		return FILE_OK;
+	}
 	int64 initializeKey(char* pBuffer, int64 bufferSize, int64& offset){
 		int64 parseLength = bufferSize;
 		_TYPE_ zero(0);
@@ -277,9 +476,21 @@ protected:
 		    IndexStorage* pKey = (IndexStorage*)pBuffer;
 		    if(pKey->value == zero){
 		        m_idleKeys.push_back(offset);
+		    }else if(!checkRecord(pKey->value, &(pKey->key), sizeof(uint64))){
+				// 校验失败的记录（写入了一半）当作已经删除
+				fprintf(stderr, "Index::initializeKey checksum mismatch file=%s offset=%lld\n", m_fileName.c_str(), offset);
+				IndexStorage keyS;
+				keyS.value = 0;
+				keyS.setKey(0);
+				if(saveData(&keyS, sizeof(IndexStorage), offset, 0, false)){
+					m_idleKeys.push_back(offset);
+				}
 		    }else{
-                KeyValueMap& kvMap = getKeyValueMap();
+                KeyValueMap& kvMap = getKeyValueMap(pKey->key);
 				kvMap.insert(std::make_pair(pKey->key, KeyValue(pKey->value, offset)));
+				if(m_loadListener){
+					m_loadListener(pKey->key, pKey->value);
+				}
 		    }
 			offset += sizeof(IndexStorage);
 			pBuffer += sizeof(IndexStorage);
@@ -10,6 +10,8 @@
 #define key_hpp
 
 #include "file.hpp"
+#include <functional>
+#include <future>
 
 NS_HIVE_BEGIN
 
@@ -119,7 +121,7 @@ inline uint64_t MurmurHash64B ( const void * key, int len, unsigned int seed )
 #define binary_hash MurmurHash64B
 #endif
 
-#define KEY_HEAD_OFFSET 32
+#define KEY_HEAD_OFFSET 40				// 头部：value长度、key长度上限、存储单元长度、数据块长度、格式版本
 #define MAX_KEY_LENGTH 256
 
 template <typename _TYPE_, uint64 _KEY_SLOT_NUMBER_>
@@ -151,16 +153,31 @@ public:
 	typedef std::vector<_TYPE_> NodeVector;
 	typedef std::vector<int64> OffsetVector;
 	typedef std::vector<OffsetVector> OffsetVectorArray;
+	// 批量写入的记录
+	typedef struct SetEntry {
+		const char* key;
+		uint64 length;
+		_TYPE_ value;
+		SetEntry(const char* k, uint64 l, const _TYPE_& v) : key(k), length(l), value(v){}
+	}SetEntry;
+	typedef std::vector<SetEntry> SetEntryVector;
+	// 打开数据库时每读取到一条记录的通知
+	typedef std::function<void(const std::string& key, const _TYPE_& value)> LoadListener;
+	// 修改或者删除记录之前的通知，pOld为修改前的记录，新增的key为NULL；pNew为修改后的记录，删除的key为NULL
+	typedef std::function<void(const char* key, uint64 length, const _TYPE_* pOld, const _TYPE_* pNew)> ChangeListener;
 	
 	uint64 m_valueSize;					// 保存value的长度
 	uint64 m_keyLength;					// key的长度上限
 	uint64 m_unitSize;					// key存储单元的长度
 	uint64 m_blockSize;					// data存储单元的长度
+	uint64 m_version;					// 文件格式版本
 	KeyValueMap m_keyMapArray[_KEY_SLOT_NUMBER_];
 	OffsetVector m_idleKeysArray[MAX_KEY_LENGTH];
 //	OffsetVector m_idleKeys;
+	LoadListener m_loadListener;
+	ChangeListener m_changeListener;
 public:
-	Key(const std::string& name, const std::string& ext) : File(name, ext), m_valueSize(0), m_keyLength(0), m_unitSize(0), m_blockSize(0) {
+	Key(const std::string& name, const std::string& ext) : File(name, ext), m_valueSize(0), m_keyLength(0), m_unitSize(0), m_blockSize(0), m_version(0) {
 //		assert(MAX_KEY_LENGTH < 256 && "too large key length");
 	}
 	virtual ~Key(void){
@@ -174,19 +191,22 @@ public:
 		std::string keyString(key, length);
 		KeyValueMap& kvMap = findKeyValueMap(key, length);
 		typename KeyValueMap::iterator itCur = kvMap.find(keyString);
+		_TYPE_ sealed = value;
+		sealRecord(sealed, key, length);
 		if(itCur != kvMap.end()){
 			if(setNotExist){
 				return FERR_KEY_ALREADY_EXIST;
 			}
-			if(!saveData(&value, sizeof(_TYPE_), itCur->second.offset, 0, false)){
+			if(!saveData(&sealed, sizeof(_TYPE_), itCur->second.offset, 0, false)){
 				return FERR_KEY_SET_FAILED;
 			}
-			itCur->second.value = value;
+			notifyChange(key, length, &(itCur->second.value), &sealed);
+			itCur->second.value = sealed;
 			return FILE_OK;
 		}
 		// 保存新的节点数据
 		KeyStorage keyS;
-		keyS.value = value;
+		keyS.value = sealed;
 		keyS.setKey(key, (uint8)length);
 		int64 offset;
 		bool isFromIdle;
@@ -204,9 +224,149 @@ public:
 		if(isFromIdle){
 			idleKeys.pop_back();
 		}
-		kvMap.insert(std::make_pair(keyString, KeyValue(value, offset)));
+		notifyChange(key, length, NULL, &sealed);
+		kvMap.insert(std::make_pair(keyString, KeyValue(sealed, offset)));
+		return FILE_OK;
+	}
+	// 批量写入记录：所有记录的写入合并成少量的向量写入，全部写入成功后才修改内存数据；key不能重复
+	// 不是原子操作：文件中的记录按单条生效，向量写入中途失败时可能已经写入了一部分记录
+	inline int mset(const SetEntryVector& entries){
+		size_t count = entries.size();
+		std::vector<KeyStorage> storages(count);
+		OffsetVector offsets(count, -1);
+		WriteSegmentVector segments;
+		segments.reserve(count);
+		int64 oldLength = m_fileLength;
+		int64 endOffset = m_fileLength;
+		for(size_t i=0; i<count; ++i){
+			const SetEntry& entry = entries[i];
+			if(entry.length >= MAX_KEY_LENGTH){
+				return FERR_KEY_IS_TOO_LONG;
+			}
+			KeyValueMap& kvMap = findKeyValueMap(entry.key, entry.length);
+			typename KeyValueMap::iterator itCur = kvMap.find(std::string(entry.key, entry.length));
+			KeyStorage& keyS = storages[i];
+			keyS.value = entry.value;
+			sealRecord(keyS.value, entry.key, entry.length);
+			if(itCur != kvMap.end()){
+				// 覆盖老数据，只需要写入value
+				segments.push_back(WriteSegment(itCur->second.offset, &(keyS.value), sizeof(_TYPE_)));
+				continue;
+			}
+			keyS.setKey(entry.key, (uint8)entry.length);
+			// 优先使用空闲的key位置，没有就追加到文件末尾
+			OffsetVector& idleKeys = m_idleKeysArray[entry.length];
+			if(idleKeys.empty()){
+				offsets[i] = endOffset;
+				endOffset += sizeof(_TYPE_) + 1 + entry.length;
+			}else{
+				offsets[i] = idleKeys.back();
+				idleKeys.pop_back();
+			}
+			segments.push_back(WriteSegment(offsets[i], &keyS, sizeof(_TYPE_) + 1 + entry.length));
+		}
+		if(!saveSegments(segments)){
+			// 写入失败，归还使用的空闲key位置
+			for(size_t i=0; i<count; ++i){
+				if(offsets[i] >= 0 && offsets[i] < oldLength){
+					m_idleKeysArray[entries[i].length].push_back(offsets[i]);
+				}
+			}
+			return FERR_KEY_SET_FAILED;
+		}
+		for(size_t i=0; i<count; ++i){
+			const SetEntry& entry = entries[i];
+			KeyValueMap& kvMap = findKeyValueMap(entry.key, entry.length);
+			if(offsets[i] < 0){
+				_TYPE_& value = kvMap[std::string(entry.key, entry.length)].value;
+				notifyChange(entry.key, entry.length, &value, &(storages[i].value));
+				value = storages[i].value;
+			}else{
+				notifyChange(entry.key, entry.length, NULL, &(storages[i].value));
+				kvMap.insert(std::make_pair(std::string(entry.key, entry.length), KeyValue(storages[i].value, offsets[i])));
+			}
+		}
 		return FILE_OK;
 	}
+	// 批量追加新的记录：记录拼接后一次写入文件末尾，不使用空闲的key位置；
+	// 内存索引按照槽分给threadCount个线程并行建立，每个槽只由一个线程修改；调用者保证key不存在并且不重复
+	inline int append(const SetEntryVector& entries, int threadCount){
+		size_t count = entries.size();
+		if(0 == count){
+			return FILE_OK;
+		}
+		CharVector buffer;
+		OffsetVector offsets(count);
+		NodeVector values(count);
+		buffer.reserve(count * (sizeof(_TYPE_) + 1 + 16));
+		for(size_t i=0; i<count; ++i){
+			const SetEntry& entry = entries[i];
+			if(entry.length >= MAX_KEY_LENGTH){
+				return FERR_KEY_IS_TOO_LONG;
+			}
+			KeyStorage keyS;
+			keyS.value = entry.value;
+			sealRecord(keyS.value, entry.key, entry.length);
+			keyS.setKey(entry.key, (uint8)entry.length);
+			values[i] = keyS.value;
+			offsets[i] = m_fileLength + (int64)buffer.size();
+			buffer.insert(buffer.end(), (const char*)&keyS, (const char*)&keyS + sizeof(_TYPE_) + 1 + entry.length);
+		}
+		WriteSegmentVector segments;
+		segments.push_back(WriteSegment(m_fileLength, buffer.data(), (int64)buffer.size()));
+		if(!saveSegments(segments)){
+			return FERR_KEY_SET_FAILED;
+		}
+		for(size_t i=0; i<count; ++i){
+			notifyChange(entries[i].key, entries[i].length, NULL, &values[i]);
+		}
+		threadCount = std::max(1, std::min(threadCount, (int)std::min((uint64)count, _KEY_SLOT_NUMBER_)));
+		// 先并行计算每条记录的槽，再由每个线程插入自己负责的槽
+		std::vector<uint32> slots(count);
+		auto hashRange = [&](size_t begin, size_t end){
+			for(size_t i=begin; i<end; ++i){
+				slots[i] = (uint32)(binary_hash(entries[i].key, (int)entries[i].length, BINARY_HASH_SEED) % _KEY_SLOT_NUMBER_);
+			}
+		};
+		auto insertSlots = [&](int part){
+			for(size_t i=0; i<count; ++i){
+				if((int)(slots[i] % threadCount) == part){
+					m_keyMapArray[slots[i]].insert(std::make_pair(std::string(entries[i].key, entries[i].length), KeyValue(values[i], offsets[i])));
+				}
+			}
+		};
+		std::vector< std::future<void> > futures;
+		for(int t=1; t<threadCount; ++t){
+			futures.push_back(std::async(std::launch::async, hashRange, count * t / threadCount, count * (t + 1) / threadCount));
+		}
+		hashRange(0, count / threadCount);
+		for(size_t i=0; i<futures.size(); ++i){
+			futures[i].get();
+		}
+		futures.clear();
+		for(int t=1; t<threadCount; ++t){
+			futures.push_back(std::async(std::launch::async, insertSlots, t));
+		}
+		insertSlots(0);
+		for(size_t i=0; i<futures.size(); ++i){
+			futures[i].get();
+		}
+		return FILE_OK;
+	}
+	// 已经删除、等待重用的记录数量和占用的文件长度；按key长度分开保存，只需要累加MAX_KEY_LENGTH个数组的长度
+	inline void getIdleStat(uint64& count, uint64& bytes) const {
+		count = 0;
+		bytes = 0;
+		for(uint64 length = 0; length < MAX_KEY_LENGTH; ++length){
+			uint64 idleCount = (uint64)m_idleKeysArray[length].size();
+			count += idleCount;
+			bytes += idleCount * (sizeof(_TYPE_) + 1 + length);
+		}
+	}
+	// key所在的槽，同一个槽的记录保存在同一个哈希表中
+	inline uint64 getSlot(const char* key, uint64 length) const {
+		return binary_hash(key, (int)length, BINARY_HASH_SEED) % _KEY_SLOT_NUMBER_;
+	}
 	inline int get(const char* key, uint64 length, _TYPE_& value){
 		KeyValueMap& kvMap = findKeyValueMap(key, length);
 		typename KeyValueMap::iterator itCur = kvMap.find(std::string(key, length));
@@ -231,15 +391,11 @@ public:
 		if(itCur == kvMap.end()){
 			return FERR_KEY_NOT_FOUND;
 		}
-		KeyStorage keyS;
-		keyS.setEmptyLength(length);	            // key[1] 保存原始长度
-		keyS.value = 0;
-		keyS.setKeyLength(0);						// key[0] == 0 表示idle状态
-		int64 offset = itCur->second.offset;
-		if(!saveData(&keyS, sizeof(_TYPE_) + 2, offset, 0, false)){
+		if(!saveEmpty(itCur->second.offset, length)){
 			return FERR_KEY_SET_FAILED;
 		}
 		value = itCur->second.value;
+		notifyChange(key, length, &value, NULL);
 		OffsetVector& idleKeys = m_idleKeysArray[length];
 		idleKeys.push_back(itCur->second.offset);
 		kvMap.erase(itCur);
@@ -273,12 +429,14 @@ public:
 		if(checkItCur != kvMapNew.end()){
 			return FERR_KEY_ALREADY_EXIST;
 		}
+		// 校验码包含key，记录需要和新的key一起写入
+		KeyValue kv = itCur->second;
+		sealRecord(kv.value, newKey, newLength);
 		KeyStorage keyS;
+		keyS.value = kv.value;
 		keyS.setKey(newKey, (uint8)newLength);
 		if(length == newLength){
-			int64 offset = itCur->second.offset + sizeof(_TYPE_);
-			int64 saveLength = newLength + 1;
-			if(!saveData(keyS.key, saveLength, offset, 0, false)){
+			if(!saveData(&keyS, sizeof(_TYPE_) + 1 + newLength, kv.offset, 0, false)){
 				return FERR_KEY_SET_FAILED;
 			}
 		}else{
@@ -300,11 +458,15 @@ public:
 				idleKeys.pop_back();
 			}
 			// 回收旧的key空间
+			saveEmpty(kv.offset, length);
 			OffsetVector& idleKeysOld = m_idleKeysArray[length];
-			idleKeysOld.push_back(itCur->second.offset);
+			idleKeysOld.push_back(kv.offset);
+			kv.offset = offset;
 		}
+		notifyChange(key, length, &(itCur->second.value), NULL);
+		notifyChange(newKey, newLength, NULL, &(kv.value));
 		kvMapOld.erase(itCur);
-		kvMapNew.insert(std::make_pair(newKeyString, itCur->second));
+		kvMapNew.insert(std::make_pair(newKeyString, kv));
 		return FILE_OK;
 	}
 	int openDB(void){
@@ -338,6 +500,12 @@ public:
 		}
 		return FILE_OK;
 	}
+	inline void setLoadListener(const LoadListener& listener){
+		m_loadListener = listener;
+	}
+	inline void setChangeListener(const ChangeListener& listener){
+		m_changeListener = listener;
+	}
 	void closeDB(void){
 #ifdef USE_STREAM_FILE
 		if(NULL != m_pFile){
@@ -357,11 +525,35 @@ public:
 			}
 		}
 	}
+	// 按照内存中的记录生成紧凑的文件内容：头部和所有记录，没有空闲的key位置
+	void getFileImage(CharVector& data){
+		uint64 head[5] = {sizeof(_TYPE_), MAX_KEY_LENGTH, sizeof(KeyStorage), BLOCK_SIZE, FILE_FORMAT_VERSION};
+		data.assign((const char*)head, (const char*)head + KEY_HEAD_OFFSET);
+		KeyStorage keyS;
+		for(uint64 index = 0; index < _KEY_SLOT_NUMBER_; ++index){
+			for(auto &kv : m_keyMapArray[index]){
+				keyS.value = kv.second.value;
+				keyS.setKey(kv.first.data(), (uint8)kv.first.length());
+				data.insert(data.end(), (const char*)&keyS, (const char*)&keyS + sizeof(_TYPE_) + 1 + kv.first.length());
+			}
+		}
+	}
 protected:
+	// 把key位置标记为空闲
+	inline bool saveEmpty(int64 offset, uint64 length){
+		KeyStorage keyS;
+		keyS.setEmptyLength(length);	            // key[1] 保存原始长度
+		keyS.value = 0;
+		keyS.setKeyLength(0);						// key[0] == 0 表示idle状态
+		return saveData(&keyS, sizeof(_TYPE_) + 2, offset, 0, false);
+	}
+	inline void notifyChange(const char* key, uint64 length, const _TYPE_* pOld, const _TYPE_* pNew){
+		if(m_changeListener){
+			m_changeListener(key, length, pOld, pNew);
+		}
+	}
 	inline KeyValueMap& findKeyValueMap(const char* key, uint64 length){
-		uint64 hash = binary_hash(key, (int)length, BINARY_HASH_SEED);
-		int index = hash % _KEY_SLOT_NUMBER_;
-		return m_keyMapArray[index];
+		return m_keyMapArray[getSlot(key, length)];
 	}
 	int initializeDB(void){
 		// 写入数据库的头部数据
@@ -369,11 +561,13 @@ protected:
 		m_keyLength = MAX_KEY_LENGTH;
 		m_unitSize = sizeof(KeyStorage);
 		m_blockSize = BLOCK_SIZE;
+		m_version = FILE_FORMAT_VERSION;
 		char temp[KEY_HEAD_OFFSET];
 		memcpy(temp, &m_valueSize, sizeof(uint64));
 		memcpy(temp + sizeof(uint64), &m_keyLength, sizeof(uint64));
 		memcpy(temp + sizeof(uint64)*2, &m_unitSize, sizeof(uint64));
 		memcpy(temp + sizeof(uint64)*3, &m_blockSize, sizeof(uint64));
+		memcpy(temp + sizeof(uint64)*4, &m_version, sizeof(uint64));
 		if(KEY_HEAD_OFFSET != seekWrite(temp, 1, KEY_HEAD_OFFSET, 0, SEEK_SET)){
 			fprintf(stderr, "Key::initializeDB write head failed\n");
 			return FERR_INIT_WRITE_FAILED;
@@ -384,22 +578,35 @@ protected:
 	int initializeFromFile(void){
 		// 读取数据库头部数据
 		seekRead(&(m_valueSize), 1, KEY_HEAD_OFFSET, 0, SEEK_SET);
-		if(m_valueSize != sizeof(_TYPE_)){
-			fprintf(stderr, "Key::initializeFromFile m_valueSize=%lld \n", m_valueSize);
-			return FERR_KEY_VALUE_SIZE_NOT_MATCH;
-		}
 		if(m_keyLength > MAX_KEY_LENGTH){
 			fprintf(stderr, "Key::initializeFromFile m_keyLength=%lld \n", m_keyLength);
 			return FERR_KEY_LENGTH_NOT_MATCH;
 		}
-		if(m_unitSize != sizeof(KeyStorage)){
-			fprintf(stderr, "Key::initializeFromFile m_unitSize=%lld \n", m_unitSize);
-			return FERR_UNIT_SIZE_NOT_MATCH;
-		}
 		if(m_blockSize != BLOCK_SIZE){
 			fprintf(stderr, "Key::initializeFromFile m_blockSize=%lld \n", m_blockSize);
 			return FERR_BLOCK_SIZE_NOT_MATCH;
 		}
+		// 没有版本的旧文件（8字节的BlockNode记录）和旧版本的文件先升级到当前的格式
+		bool legacy = (m_valueSize == sizeof(uint64) && m_unitSize == sizeof(uint64) + MAX_KEY_LENGTH);
+		if(legacy || (m_version < FILE_FORMAT_VERSION && m_unitSize == m_valueSize + MAX_KEY_LENGTH)){
+			int result = upgradeFile(legacy ? LEGACY_HEAD_OFFSET : KEY_HEAD_OFFSET);
+			if(FILE_OK != result){
+				return result;
+			}
+			seekRead(&(m_valueSize), 1, KEY_HEAD_OFFSET, 0, SEEK_SET);
+		}
+		if(m_version != FILE_FORMAT_VERSION){
+			fprintf(stderr, "Key::initializeFromFile m_version=%lld \n", m_version);
+			return FERR_FORMAT_VERSION_NOT_MATCH;
+		}
+		if(m_valueSize != sizeof(_TYPE_)){
+			fprintf(stderr, "Key::initializeFromFile m_valueSize=%lld \n", m_valueSize);
+			return FERR_KEY_VALUE_SIZE_NOT_MATCH;
+		}
+		if(m_unitSize != sizeof(KeyStorage)){
+			fprintf(stderr, "Key::initializeFromFile m_unitSize=%lld \n", m_unitSize);
+			return FERR_UNIT_SIZE_NOT_MATCH;
+		}
 		// 读取key数据
 		int64 initSize = 100000;
 		int64 tempBufferSize = sizeof(KeyStorage)*initSize;
@@ -422,6 +629,46 @@ protected:
 		delete []tempBuffer;
 		return FILE_OK;
 	}
+	// 升级旧格式的文件：旧记录是m_valueSize长度的value + key长度 + key，空闲位置key长度为0，下一个字节是原来的长度；
+	// 转换成当前的记录后生成紧凑的文件，先写临时文件再改名替换，中途失败时旧文件保持不变，下次打开重新升级
+	int upgradeFile(int64 headOffset){
+		int64 valueSize = (int64)m_valueSize;
+		CharVector oldData(m_fileLength);
+		if(m_fileLength != seekRead(oldData.data(), 1, m_fileLength, 0, SEEK_SET)){
+			fprintf(stderr, "Key::upgradeFile read failed file=%s\n", m_fileName.c_str());
+			return FERR_INVALID_FILE;
+		}
+		uint64 head[5] = {sizeof(_TYPE_), MAX_KEY_LENGTH, sizeof(KeyStorage), BLOCK_SIZE, FILE_FORMAT_VERSION};
+		CharVector data((const char*)head, (const char*)head + KEY_HEAD_OFFSET);
+		KeyStorage keyS;
+		int64 count = 0;
+		int64 offset = headOffset;
+		while(offset + valueSize + 2 <= m_fileLength){
+			uint8 length = (uint8)oldData[offset + valueSize];
+			int64 recordLength = valueSize + 1 + (0 == length ? (uint8)oldData[offset + valueSize + 1] : length);
+			if(offset + recordLength > m_fileLength){
+				break;
+			}
+			if(0 != length){
+				if(!upgradeRecord(keyS.value, oldData.data() + offset, (uint64)valueSize)){
+					fprintf(stderr, "Key::upgradeFile convert record failed file=%s offset=%lld\n", m_fileName.c_str(), offset);
+					return FERR_FORMAT_VERSION_NOT_MATCH;
+				}
+				keyS.setKey(oldData.data() + offset + valueSize + 1, length);
+				sealRecord(keyS.value, oldData.data() + offset + valueSize + 1, length);
+				data.insert(data.end(), (const char*)&keyS, (const char*)&keyS + sizeof(_TYPE_) + 1 + length);
+				++count;
+			}
+			offset += recordLength;
+		}
+		if(!writeWholeFile(m_fileName, data) || !openReadWrite("rb+")){
+			fprintf(stderr, "Key::upgradeFile write failed file=%s\n", m_fileName.c_str());
+			return FERR_INIT_WRITE_FAILED;
+		}
+		m_fileLength = (int64)data.size();
+		fprintf(stderr, "Key::upgradeFile file=%s keys=%lld\n", m_fileName.c_str(), count);
+		return FILE_OK;
+	}
 	int64 initializeKey(char* pBuffer, int64 bufferSize, int64& offset){
 		int64 parseLength = bufferSize;
 		int keyLength;
@@ -445,8 +692,19 @@ protected:
 					break;
 				}
 				std::string key(pBuffer + emptyLengthIndex, length);
-				KeyValueMap& kvMap = findKeyValueMap(key.c_str(), key.length());
-				kvMap.insert(std::make_pair(key, KeyValue(*(_TYPE_*)(pBuffer), offset)));
+				if(!checkRecord(*(_TYPE_*)(pBuffer), key.data(), key.length())){
+					// 校验失败的记录（写入了一半）当作已经删除
+					fprintf(stderr, "Key::initializeKey checksum mismatch file=%s offset=%lld\n", m_fileName.c_str(), offset);
+					if(saveEmpty(offset, length)){
+						m_idleKeysArray[length].push_back(offset);
+					}
+				}else{
+					KeyValueMap& kvMap = findKeyValueMap(key.c_str(), key.length());
+					kvMap.insert(std::make_pair(key, KeyValue(*(_TYPE_*)(pBuffer), offset)));
+					if(m_loadListener){
+						m_loadListener(key, *(_TYPE_*)(pBuffer));
+					}
+				}
 			}
 			offset += keyLength;
 			pBuffer += keyLength;
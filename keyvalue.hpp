@@ -12,21 +12,34 @@
 #include "key.hpp"
 #include "index.hpp"
 #include "idle.hpp"
+#include "compress.hpp"
+#include "cache.hpp"
+#include "timer.hpp"
+#include "backup.hpp"
+#include "checksum.hpp"
+#include "lock.hpp"
+#include "replog.hpp"
+#include "stats.hpp"
+#include <functional>
+#include <future>
+#include <deque>
+#include <atomic>
+#include <errno.h>
+#include <ctype.h>
 
 NS_HIVE_BEGIN
 
-typedef std::vector<char> CharVector;
-
 // 同时作为偏移和空闲块的结构
 typedef struct BlockNode{
 	union{
 		struct{
 			uint64 offset		: 40;	// 文件块的偏移（块下标）
-			uint64 size			: 24;	// 连续文件块的数量
+			uint64 size			: 23;	// 连续文件块的数量
+			uint64 large		: 1;	// 为1时数据块中保存的是大数据的分段清单
 		};
 		uint64 value;
 	};
-	BlockNode(uint64 o, uint64 s) : offset(o), size(s){}
+	BlockNode(uint64 o, uint64 s) : value(0){ offset = o; size = s; }
 	BlockNode(uint64 v) : value(v){}
 	BlockNode(void) : value(0) {}
 	inline BlockNode& operator=(uint64 v){ this->value = v; return *this; }
@@ -37,272 +50,2970 @@ typedef struct BlockNode{
 	inline bool operator!=(const BlockNode& other) const { return (other.value != this->value); }
 }BlockNode;
 
+#define VALUE_INLINE_MAX_LENGTH 14		// key记录中可以内联保存的value最大长度，记录总长度为32字节
+#define VALUE_RECORD_INLINE 1			// value保存在记录中，不占用数据块
+#define VALUE_RECORD_CHECKSUM 2			// 记录带有校验码（覆盖key和记录的前28字节）
+
+// key记录中保存的数据：value的数据块和过期时间；小数据直接保存在记录中
+typedef struct ValueRecord{
+	BlockNode node;
+	uint32 expire;				// 过期时间（秒），0表示不过期
+	uint8 flags;
+	uint8 inlineLength;			// 内联value的长度；保存在数据块中的value为最后一个数据块末尾填充的字节数，用于空间统计
+	char inlineData[VALUE_INLINE_MAX_LENGTH];
+	uint32 checksum;			// key和前面字段的CRC32C，写入key文件时计算
+	ValueRecord(const BlockNode& n, uint32 e, int64 padding = 0) : node(n), expire(e), flags(0), inlineLength((uint8)padding), checksum(0){
+		memset(inlineData, 0, sizeof(inlineData));
+	}
+	ValueRecord(const void* data, int64 length, uint32 e) : node(0), expire(e), flags(VALUE_RECORD_INLINE), inlineLength((uint8)length), checksum(0){
+		memset(inlineData, 0, sizeof(inlineData));
+		memcpy(inlineData, data, length);
+	}
+	ValueRecord(uint64 v) : node(v), expire(0), flags(0), inlineLength(0), checksum(0){
+		memset(inlineData, 0, sizeof(inlineData));
+	}
+	ValueRecord(void) : node(0), expire(0), flags(0), inlineLength(0), checksum(0){
+		memset(inlineData, 0, sizeof(inlineData));
+	}
+	inline bool isExpired(uint32 now) const { return (0 != expire && expire <= now); }
+	inline bool isInline(void) const { return (0 != (flags & VALUE_RECORD_INLINE)); }
+	inline uint32 getChecksum(const void* key, uint64 length) const {
+		return crc32c(crc32c(0, key, (int64)length), this, (int64)((const char*)&checksum - (const char*)this));
+	}
+	// 校验码不参与比较
+	inline bool operator==(const ValueRecord& other) const {
+		return (other.node == node && other.expire == expire && ((other.flags ^ flags) & ~VALUE_RECORD_CHECKSUM) == 0 && other.inlineLength == inlineLength
+			&& 0 == memcmp(other.inlineData, inlineData, sizeof(inlineData)));
+	}
+	inline bool operator!=(const ValueRecord& other) const { return !(*this == other); }
+}ValueRecord;
+
+// Key和Index写入记录时调用，计算校验码
+inline void sealRecord(ValueRecord& record, const void* key, uint64 length){
+	record.flags |= VALUE_RECORD_CHECKSUM;
+	record.checksum = record.getChecksum(key, length);
+}
+// Key和Index加载记录时调用；没有校验码的旧记录直接通过
+inline bool checkRecord(const ValueRecord& record, const void* key, uint64 length){
+	return (0 == (record.flags & VALUE_RECORD_CHECKSUM) || record.checksum == record.getChecksum(key, length));
+}
+
+// 升级旧格式的记录：版本2的内联数据最长18字节，现在的记录放不下超过VALUE_INLINE_MAX_LENGTH的内联数据，
+// 这样的记录只转换key文件无法保存，返回false；其它记录的字段位置不变，校验码在升级时重新计算
+inline bool upgradeRecord(ValueRecord& record, const char* data, uint64 size){
+	if(size > sizeof(ValueRecord)){
+		return false;
+	}
+	record = ValueRecord();
+	memcpy((void*)&record, data, size);
+	if(record.isInline() && record.inlineLength > VALUE_INLINE_MAX_LENGTH){
+		return false;
+	}
+	record.flags &= ~VALUE_RECORD_CHECKSUM;
+	record.checksum = 0;
+	return true;
+}
+
+// 批量写入的字符串key数据项
+typedef struct KeySetEntry{
+	const char* key;
+	int64 keyLen;
+	const void* value;
+	int64 valueLen;
+	KeySetEntry(const char* k, int64 kl, const void* v, int64 vl) : key(k), keyLen(kl), value(v), valueLen(vl){}
+}KeySetEntry;
+typedef std::vector<KeySetEntry> KeySetEntryVector;
+
+// 批量写入的数字key数据项
+typedef struct IndexSetEntry{
+	uint64 key;
+	const void* value;
+	int64 valueLen;
+	IndexSetEntry(uint64 k, const void* v, int64 vl) : key(k), value(v), valueLen(vl){}
+}IndexSetEntry;
+typedef std::vector<IndexSetEntry> IndexSetEntryVector;
+
+// 批量读取的字符串key数据项，value写入调用者提供的缓冲区
+typedef struct KeyGetEntry{
+	const char* key;
+	int64 keyLen;
+	char* buffer;				// 调用者提供的缓冲区
+	int64 bufferSize;			// 缓冲区的长度
+	int64 length;				// 返回value的长度
+	int result;					// 返回结果；缓冲区不够时返回FERR_BUFFER_TOO_SMALL，length为需要的长度
+	KeyGetEntry(const char* k, int64 kl, char* b, int64 bs) : key(k), keyLen(kl), buffer(b), bufferSize(bs), length(0), result(FERR_KEY_NOT_FOUND){}
+}KeyGetEntry;
+typedef std::vector<KeyGetEntry> KeyGetEntryVector;
+
+// 批量读取的数字key数据项
+typedef struct IndexGetEntry{
+	uint64 key;
+	char* buffer;
+	int64 bufferSize;
+	int64 length;
+	int result;
+	IndexGetEntry(uint64 k, char* b, int64 bs) : key(k), buffer(b), bufferSize(bs), length(0), result(FERR_KEY_NOT_FOUND){}
+}IndexGetEntry;
+typedef std::vector<IndexGetEntry> IndexGetEntryVector;
+
+// 批量导入的数据项，由BulkReader填充；指针只需要在下一次调用reader之前有效
+typedef struct BulkEntry{
+	const char* key;			// 字符串key，为NULL时使用数字key
+	int64 keyLen;
+	uint64 index;				// 数字key
+	const void* value;
+	int64 valueLen;
+	uint32 expire;				// 过期时间（秒级时间戳），0表示不过期
+	BulkEntry(void) : key(NULL), keyLen(0), index(0), value(NULL), valueLen(0), expire(0){}
+}BulkEntry;
+// 批量导入时获取下一条数据；没有数据时返回false
+typedef std::function<bool(BulkEntry& entry)> BulkReader;
+
+#define MULTI_GET_MERGE_GAP 64			// 批量读取时，间隔不超过这个数量的数据块合并成一次读取
+#define LARGE_VALUE_CHUNK_SIZE 8388608	// 大数据分段保存，每段8M
+#define LARGE_VALUE_READ_THREADS 4		// 读取大数据时并行读取的线程数量
+#ifdef USE_STREAM_FILE
+#define LARGE_VALUE_READ_POLICY std::launch::deferred	// 流式文件共享读写位置，不能并行读取
+#else
+#define LARGE_VALUE_READ_POLICY std::launch::async
+#endif
+
+// 流式写入时获取数据：填充length长度的数据到buffer，失败返回false
+typedef std::function<bool(char* buffer, int64 length)> StreamReader;
+// 流式读取时输出数据：返回false停止读取；回调期间持有这个key所在分段的读取登记，
+// 回调中可以读取，但是不能写入，写操作会一直等待这个登记结束
+typedef std::function<bool(const char* data, int64 length)> StreamWriter;
+
+#define COMPRESS_MIN_LENGTH 128			// 默认小于这个长度的value不压缩
+#define COMPRESS_DICT_MAX_LENGTH 4096	// 设置了字典时，不超过这个长度的value使用字典压缩
+#define COMPRESS_ZLIB_LEVEL 6
+
+#define EXPIRE_CYCLE_WORK 32			// 每次写操作顺带处理的到期key数量上限
+
+#define BULK_LOAD_BUFFER_SIZE 16777216	// 批量导入时value攒够这个长度写入一次
+#define BULK_LOAD_THREADS 4				// 批量导入时并行建立key索引的线程数量
+
+#define ITERATOR_READAHEAD_SIZE 4194304	// 全库遍历时一次顺序读取的最大长度
+#define ITERATOR_MERGE_GAP 256			// 全库遍历时，间隔不超过这个数量的数据块合并成一次读取
+
+#define KEYVALUE_LOCK_STRIPE 256		// 线程安全模式的分段锁数量，key按照记录所在的槽分到各个分段
+
+// 读取value时检查校验码的方式
+enum ChecksumVerify{
+	CHECKSUM_VERIFY_ALWAYS = 0,		// 每次读取都检查
+	CHECKSUM_VERIFY_SAMPLED = 1,	// 每CHECKSUM_SAMPLE_RATE次读取检查一次
+	CHECKSUM_VERIFY_SCAN = 2,		// 读取时不检查，只在全库遍历和后台校验时检查
+};
+#define CHECKSUM_SAMPLE_RATE 64
+
+// 后台校验的结果
+typedef struct ScrubStat{
+	uint64 valueCount;					// 检查通过的value数量
+	uint64 byteCount;					// 检查通过的value长度
+	std::vector<std::string> badKeys;	// 校验失败或者读取失败的字符串key
+	std::vector<uint64> badIndexes;		// 校验失败或者读取失败的数字key
+	ScrubStat(void) : valueCount(0), byteCount(0){}
+}ScrubStat;
+#define LARGE_VALUE_CHECKSUM_FLAG 0x8000000000000000ULL	// 分段清单中分段数量的最高位表示清单末尾有每个分段的校验码
+
 template <uint64 _KEY_SLOT_NUMBER_>
 class KeyValue : public File
 {
 public:
+	class Iterator;
 	typedef BlockNode _TYPE_;
+	typedef ValueRecord RecordType;
 	typedef std::vector<_TYPE_> NodeVector;
-	typedef Key<_TYPE_, _KEY_SLOT_NUMBER_> KeyMap;
-	typedef Index<_TYPE_> IndexMap;
+	typedef Key<RecordType, _KEY_SLOT_NUMBER_> KeyMap;
+	typedef Index<RecordType> IndexMap;
 	typedef Idle<_TYPE_> IdleNode;
+	typedef WriterGuard<KEYVALUE_LOCK_STRIPE> WriterLock;
+	typedef StripeGuard<KEYVALUE_LOCK_STRIPE> SlotLock;
+	typedef ReadGuard<KEYVALUE_LOCK_STRIPE> ReadLock;
 	KeyMap* m_pKeyOffset;					// key对应的偏移值文件
 	IndexMap* m_pIndexOffset;               // 数字key对应的偏移文件
 	IdleNode m_idles;
+	std::string m_name;						// 数据库名称
+	int m_compressCodec;					// 默认的压缩方式
+	int64 m_compressThreshold;				// 小于这个长度的value不压缩
+	CharVector m_dictionary;				// 小数据zlib压缩使用的字典，保存在.d文件
+	ValueCache m_cache;						// value缓存，以数据块节点作为key
+	TimerWheel<std::string> m_keyTimers;	// 字符串key的过期时间轮
+	TimerWheel<uint64> m_indexTimers;		// 数字key的过期时间轮
+	int64 m_inlineLength;					// 不超过这个长度的value内联保存在key记录中，小于0表示不内联
+	int m_checksumVerify;					// 读取value时检查校验码的方式
+	StripeLock<KEYVALUE_LOCK_STRIPE> m_locks;	// 线程安全模式使用的写入锁和分段锁
+	// 快照期间key记录被修改前的内容
+	typedef struct SnapshotUndo{
+		uint64 sequence;					// 这次修改的序号，序号不大于它的快照读取record
+		bool isExist;						// 修改前key是否存在
+		RecordType record;					// 修改前的记录
+		SnapshotUndo(uint64 s, const RecordType* pOld) : sequence(s), isExist(NULL != pOld), record(NULL != pOld ? *pOld : RecordType()){}
+	}SnapshotUndo;
+	typedef std::vector<SnapshotUndo> SnapshotUndoVector;
+	typedef std::unordered_map<std::string, SnapshotUndoVector> KeyUndoMap;
+	typedef std::unordered_map<uint64, SnapshotUndoVector> IndexUndoMap;
+	typedef struct SnapshotInfo{
+		uint32 count;						// 相同序号的快照数量
+		uint32 time;						// 创建时间，快照按这个时间判断过期
+		SnapshotInfo(void) : count(0), time(0){}
+	}SnapshotInfo;
+	typedef std::map<uint64, SnapshotInfo> SnapshotMap;
+	typedef std::deque<std::pair<uint64, _TYPE_> > PendingFreeDeque;
+	uint64 m_sequence;						// 有快照时每次修改key记录加1
+	SnapshotMap m_snapshots;				// 活动的快照，以创建时的序号作为快照句柄
+	KeyUndoMap m_keyUndo;
+	IndexUndoMap m_indexUndo;
+	PendingFreeDeque m_pendingFrees;		// 快照期间释放的数据块和释放时的序号，更早的快照全部释放后才回收
+	std::shared_future<int> m_checkpoint;	// 正在后台执行的在线备份；等待结束的线程复制一份后在锁外等待
+	uint64 m_checkpointSnapshot;			// 备份期间固定的快照，保证复制的数据块不被重用
+	std::string m_checkpointName;			// 正在执行的备份名称
+	std::string m_lastCheckpoint;			// 上一次成功的备份，再次备份到这个位置时可以增量复制
+	std::shared_future<int> m_scrub;		// 正在后台执行的校验；和m_checkpoint一样在锁外等待
+	std::shared_ptr<Iterator> m_pScrubIterator;	// 后台校验使用的迭代器，在调用线程中打开和关闭
+	ScrubStat m_scrubStat;
+	ReplicationLog* m_pReplication;			// 复制日志，没有开启复制时为NULL
+	Stats m_stats;							// 运行统计
+	uint64 m_liveValues;					// 空间统计：key记录引用的数据块value的数量、占用的块和数据长度，随记录的修改更新
+	uint64 m_liveBlocks;
+	uint64 m_liveBytes;
+	// 批量写入时单个value的分配信息
+	typedef struct BatchValue{
+		const void* value;
+		int64 valueLen;
+		_TYPE_ oldNode;						// 原先保存的位置，size为0表示新数据
+		_TYPE_ newNode;						// 本次分配的位置
+		bool isInline;						// 内联保存在key记录中，不分配数据块
+		uint8 padding;						// 最后一个数据块末尾填充的字节数
+		BatchValue(const void* v, int64 l, const _TYPE_& o, bool i) : value(v), valueLen(l), oldNode(o), newNode(0), isInline(i), padding(0){}
+	}BatchValue;
+	typedef std::vector<BatchValue> BatchValueVector;
+	// 批量读取时单个value的读取信息
+	typedef struct BatchRead{
+		_TYPE_ node;
+		char* buffer;
+		int64 bufferSize;
+		int64* pLength;
+		int* pResult;
+		int prefix;							// 读取到的长度记录
+		int64 padding;						// 记录中最后一个数据块末尾填充的字节数
+		int64 copyLength;					// 读入缓冲区的长度
+		int64 tailLength;					// 读入tail的长度
+		char tail[VALUE_CHECKSUM_LENGTH];	// 数据末尾的校验码，不读入调用者的缓冲区
+		BatchRead(const _TYPE_& n, char* b, int64 bs, int64* pl, int* pr, int64 pd) : node(n), buffer(b), bufferSize(bs), pLength(pl), pResult(pr), prefix(0), padding(pd), copyLength(0), tailLength(0){}
+	}BatchRead;
+	typedef std::vector<BatchRead> BatchReadVector;
+	// 批量导入时还没有写入的一批数据
+	typedef struct BulkItem{
+		std::string key;
+		uint64 index;
+		bool isIndex;
+		RecordType record;
+		BulkItem(const std::string& k, uint64 i, bool b, const RecordType& r) : key(k), index(i), isIndex(b), record(r){}
+	}BulkItem;
+	typedef struct BulkBatch{
+		CharVector data;					// 这一批value的数据块，从startBlock开始连续保存
+		uint64 startBlock;
+		std::vector<BulkItem> items;
+		std::unordered_map<std::string, size_t> keyPositions;
+		std::unordered_map<uint64, size_t> indexPositions;
+		NodeVector replaced;				// 同一批中被后面的数据覆盖的数据块
+		BulkBatch(void) : startBlock(0){}
+		inline void clear(void){
+			data.clear();
+			items.clear();
+			keyPositions.clear();
+			indexPositions.clear();
+			replaced.clear();
+		}
+	}BulkBatch;
 public:
-	KeyValue(const std::string& name) : File(name, ".v") {
+	// 全库遍历：打开时复制所有未过期的key记录并固定一个快照，按value在数据文件中的偏移排序；
+	// 相邻的value合并成一大段顺序读取（中间的空洞一起读过），读取当前段的同时在后台预读下一段；
+	// 遍历期间可以继续写入，看到的是打开时的数据；迭代器需要在数据库关闭前close
+	class Iterator
+	{
+	public:
+		typedef struct IterateEntry{
+			std::string key;
+			uint64 index;
+			bool isIndex;						// 为true时是数字key
+			RecordType record;
+			IterateEntry(const std::string& k, const RecordType& r) : key(k), index(0), isIndex(false), record(r){}
+			IterateEntry(uint64 i, const RecordType& r) : index(i), isIndex(true), record(r){}
+		}IterateEntry;
+		typedef std::vector<IterateEntry> IterateEntryVector;
+		// 一次顺序读取覆盖的数据项[begin, end)；blockCount为0表示这一段不需要读取（内联或者大数据）
+		typedef struct IterateRange{
+			uint64 blockOffset;
+			uint64 blockCount;
+			size_t begin;
+			size_t end;
+			IterateRange(uint64 o, uint64 c, size_t b) : blockOffset(o), blockCount(c), begin(b), end(b + 1){}
+		}IterateRange;
+		typedef std::vector<IterateRange> IterateRangeVector;
+
+		KeyValue* m_pDB;
+		uint64 m_snapshot;
+		IterateEntryVector m_entries;
+		IterateRangeVector m_ranges;
+		size_t m_position;					// 当前数据项的下标
+		size_t m_range;						// 当前数据项所在的读取段
+		CharVector m_buffers[2];			// 读取段交替使用两个缓冲区，一个在遍历，另一个在预读
+		std::future<bool> m_prefetch;		// 下一段的预读
+		bool m_isLoaded;					// 当前段的数据是否已经读入
+		int m_rangeResult;					// 当前段的读取结果
+		CharVector m_value;					// 压缩、内联和大数据的value
+		const char* m_pValue;
+		int64 m_valueLength;
+		int m_result;
+	public:
+		Iterator(void) : m_pDB(NULL), m_snapshot(0), m_position(0), m_range(0), m_isLoaded(false), m_rangeResult(FILE_OK), m_pValue(NULL), m_valueLength(0), m_result(FILE_OK) {}
+		virtual ~Iterator(void){
+			close();
+		}
+		inline int open(KeyValue* pDB){
+			close();
+			WriterLock writer(pDB->m_locks);
+			m_pDB = pDB;
+			m_snapshot = pDB->createSnapshot();
+			uint32 now = getTimeSecond();
+			for(uint64 slot=0; slot<_KEY_SLOT_NUMBER_; ++slot){
+				for(auto& kv : pDB->m_pKeyOffset->m_keyMapArray[slot]){
+					if(!kv.second.value.isExpired(now)){
+						m_entries.push_back(IterateEntry(kv.first, kv.second.value));
+					}
+				}
+			}
+			for(uint64 slot=0; slot<INDEX_SLOT_NUMBER; ++slot){
+				for(auto& kv : pDB->m_pIndexOffset->m_keyMapArray[slot]){
+					if(!kv.second.value.isExpired(now)){
+						m_entries.push_back(IterateEntry(kv.first, kv.second.value));
+					}
+				}
+			}
+			std::sort(m_entries.begin(), m_entries.end(), compareEntryOffset);
+			// 间隔不超过ITERATOR_MERGE_GAP个数据块的value合并成一段，每段不超过ITERATOR_READAHEAD_SIZE
+			uint64 maxBlocks = ITERATOR_READAHEAD_SIZE / BLOCK_SIZE;
+			for(size_t i=0; i<m_entries.size(); ++i){
+				const RecordType& record = m_entries[i].record;
+				bool isDirect = (!record.isInline() && !record.node.large && record.node.size > 0);
+				if(!m_ranges.empty()){
+					IterateRange& last = m_ranges.back();
+					if(!isDirect && 0 == last.blockCount){
+						last.end = i + 1;
+						continue;
+					}
+					uint64 lastEnd = last.blockOffset + last.blockCount;
+					if(isDirect && last.blockCount > 0 && record.node.offset >= lastEnd && record.node.offset - lastEnd <= ITERATOR_MERGE_GAP
+						&& record.node.offset + record.node.size - last.blockOffset <= maxBlocks){
+						last.blockCount = record.node.offset + record.node.size - last.blockOffset;
+						last.end = i + 1;
+						continue;
+					}
+				}
+				m_ranges.push_back(isDirect ? IterateRange(record.node.offset, record.node.size, i) : IterateRange(0, 0, i));
+			}
+			m_position = (size_t)-1;
+			m_range = 0;
+			m_isLoaded = false;
+			m_rangeResult = FILE_OK;
+			m_result = FILE_OK;
+			return FILE_OK;
+		}
+		inline void close(void){
+			if(m_prefetch.valid()){
+				m_prefetch.wait();
+			}
+			if(NULL != m_pDB){
+				m_pDB->releaseSnapshot(m_snapshot);
+				m_pDB = NULL;
+			}
+			m_entries.clear();
+			m_ranges.clear();
+			m_value.clear();
+			m_pValue = NULL;
+			m_valueLength = 0;
+		}
+		// 移动到下一个数据项并读取value；遍历结束或者出错时返回false，出错时getResult不是FILE_OK；
+		// 出错之后可以继续调用next跳过出错的数据项，isEnd为true时遍历结束
+		inline bool next(void){
+			if(NULL == m_pDB || isEnd()){
+				return false;
+			}
+			++m_position;
+			if(m_position >= m_entries.size()){
+				m_result = FILE_OK;
+				return false;
+			}
+			if(m_position >= m_ranges[m_range].end){
+				++m_range;
+				m_isLoaded = false;
+			}
+			if(!m_isLoaded){
+				m_rangeResult = loadRange();
+			}
+			m_result = (FILE_OK == m_rangeResult) ? readEntry(m_entries[m_position]) : m_rangeResult;
+			return (FILE_OK == m_result);
+		}
+		inline bool isEnd(void) const { return (m_position != (size_t)-1 && m_position >= m_entries.size()); }
+		inline int getResult(void) const { return m_result; }
+		inline bool isIndex(void) const { return m_entries[m_position].isIndex; }
+		inline const std::string& getKey(void) const { return m_entries[m_position].key; }
+		inline uint64 getIndex(void) const { return m_entries[m_position].index; }
+		inline uint32 getExpire(void) const { return m_entries[m_position].record.expire; }
+		// value指向迭代器内部的缓冲区，下一次next之后失效
+		inline const char* getValue(void) const { return m_pValue; }
+		inline int64 getValueLength(void) const { return m_valueLength; }
+		inline uint64 size(void) const { return m_entries.size(); }
+	protected:
+		static bool compareEntryOffset(const IterateEntry& a, const IterateEntry& b){
+			// 内联的value不需要读取文件，放在最前面
+			uint64 aOffset = a.record.isInline() ? 0 : (uint64)a.record.node.offset + 1;
+			uint64 bOffset = b.record.isInline() ? 0 : (uint64)b.record.node.offset + 1;
+			return (aOffset < bOffset);
+		}
+		inline bool loadBuffer(size_t range){
+			const IterateRange& r = m_ranges[range];
+			CharVector& buffer = m_buffers[range % 2];
+			buffer.resize(r.blockCount * BLOCK_SIZE);
+			ReadSegmentVector segments;
+			segments.push_back(ReadSegment(r.blockOffset * BLOCK_SIZE, buffer.data(), (int64)buffer.size()));
+			return m_pDB->loadSegments(segments);
+		}
+		// 进入新的一段：等待预读完成（没有预读就直接读取），然后开始预读下一段需要读取文件的数据
+		inline int loadRange(void){
+			bool ok = true;
+			if(m_ranges[m_range].blockCount > 0){
+				if(m_prefetch.valid()){
+					ok = m_prefetch.get();
+				}else{
+					ok = loadBuffer(m_range);
+				}
+			}
+			m_isLoaded = true;
+			// 下一段使用另一个缓冲区，不会覆盖正在遍历的数据
+			size_t nextRange = m_range + 1;
+			if(nextRange < m_ranges.size() && m_ranges[nextRange].blockCount > 0 && !m_prefetch.valid()){
+				m_prefetch = std::async(LARGE_VALUE_READ_POLICY, &Iterator::loadBuffer, this, nextRange);
+			}
+			return ok ? FILE_OK : FERR_BLOCK_READ_FAIL;
+		}
+		inline int readEntry(const IterateEntry& entry){
+			const RecordType& record = entry.record;
+			if(record.isInline()){
+				m_pValue = record.inlineData;
+				m_valueLength = (int64)record.inlineLength;
+				return FILE_OK;
+			}
+			const IterateRange& r = m_ranges[m_range];
+			if(0 == r.blockCount){
+				int result = m_pDB->loadValue(record.node, m_value, true, record.inlineLength);
+				m_pValue = m_value.data();
+				m_valueLength = (int64)m_value.size();
+				return result;
+			}
+			// 从段缓冲区中取出长度记录和数据
+			const char* ptr = m_buffers[m_range % 2].data() + (record.node.offset - r.blockOffset) * BLOCK_SIZE;
+			int prefix = 0;
+			memcpy(&prefix, ptr, 4);
+			int64 storedLength = (int64)HiveNS::getValueLength(prefix) - 4;
+			if(storedLength < 0 || storedLength > m_pDB->getStoredLimit(record.node, prefix)){
+				return FERR_BLOCK_READ_FAIL;
+			}
+			// 遍历总是检查校验码
+			if(hasValueChecksum(prefix)){
+				int result = m_pDB->verifyValue(record.node, prefix, ptr + 4, storedLength, ptr + 4 + storedLength);
+				if(FILE_OK != result){
+					return result;
+				}
+			}
+			if(VALUE_CODEC_NONE == getValueCodec(prefix)){
+				m_pValue = ptr + 4;
+				m_valueLength = storedLength;
+				return FILE_OK;
+			}
+			m_value.resize(m_pDB->getDecodedLength(ptr + 4, storedLength));
+			int result = m_pDB->decodeValue(prefix, ptr + 4, storedLength, m_value.data(), (int64)m_value.size(), &m_valueLength);
+			m_pValue = m_value.data();
+			return result;
+		}
+	};
+	KeyValue(const std::string& name) : File(name, ".v"), m_name(name), m_compressCodec(VALUE_CODEC_NONE), m_compressThreshold(COMPRESS_MIN_LENGTH), m_inlineLength(VALUE_INLINE_MAX_LENGTH), m_checksumVerify(CHECKSUM_VERIFY_ALWAYS), m_sequence(0), m_checkpointSnapshot(0), m_pReplication(NULL), m_liveValues(0), m_liveBlocks(0), m_liveBytes(0) {
 		m_pKeyOffset = new KeyMap(name, ".k");
 		m_pIndexOffset = new IndexMap(name, ".i");
 	}
-	virtual ~KeyValue(void){
-		closeDB();
+	virtual ~KeyValue(void){
+		closeDB();
+	}
+	// recordLength 是否记录四个字节(int)的数据长度
+	// setNotExist 为true时，如果已经存在，就直接返回错误
+	// expire 过期时间（秒级时间戳），0表示不过期；覆盖写入时同时覆盖原来的过期时间
+	inline int set(const char* key, int64 keyLen, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec = VALUE_CODEC_DEFAULT, uint32 expire = 0){
+		StatScope stat(m_stats, STAT_OP_SET);
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key, keyLen));
+		int result = setKey(key, keyLen, value, valueLen, recordLength, setNotExist, codec, expire);
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_SET, key, keyLen);
+			op.value.assign((const char*)value, (const char*)value + valueLen);
+			op.recordLength = recordLength;
+			op.expire = expire;
+			m_pReplication->append(op);
+		}
+		return stat.done(result);
+	}
+	// 兼容旧接口：按照旧的数据文件格式（长度记录+数据）返回value；
+	// 压缩、校验码和大数据的分段都已经处理，不返回数据块中的原始内容
+	inline int get(const char* key, int64 keyLen, CharVector& data){
+		int result = getValue(key, keyLen, data);
+		if(FILE_OK == result){
+			addLengthRecord(data);
+		}
+		return result;
+	}
+	inline int del(const char* key, int64 keyLen){
+		StatScope stat(m_stats, STAT_OP_DEL);
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key, keyLen));
+		int result = removeKey(key, keyLen);
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_DEL, key, keyLen);
+			m_pReplication->append(op);
+		}
+		return stat.done(result);
+	}
+	inline int replace(const char* key, uint64 length, const char* newKey, uint64 newLength){
+		WriterLock writer(m_locks);
+		SlotLock slot(m_locks, true);
+		std::vector<uint32> stripes;
+		stripes.push_back(getStripe(key, length));
+		stripes.push_back(getStripe(newKey, newLength));
+		slot.lock(stripes);
+		RecordType record;
+		int result = getRecord(key, length, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		// 目标key已经过期时先回收
+		RecordType target;
+		if(FILE_OK == m_pKeyOffset->get(newKey, newLength, target) && target.isExpired(getTimeSecond())){
+			removeKey(newKey, newLength);
+		}
+		result = m_pKeyOffset->replace(key, length, newKey, newLength);
+		if(FILE_OK == result && 0 != record.expire){
+			m_keyTimers.add(std::string(newKey, newLength), record.expire);
+		}
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_REPLACE, key, (int64)length);
+			op.newKey.assign(newKey, newLength);
+			m_pReplication->append(op);
+		}
+		return result;
+	}
+	// apis for number key -> value
+	inline int set(uint64 key, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec = VALUE_CODEC_DEFAULT, uint32 expire = 0){
+		StatScope stat(m_stats, STAT_OP_SET);
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key));
+		int result = setKey(key, value, valueLen, recordLength, setNotExist, codec, expire);
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_SET, key);
+			op.value.assign((const char*)value, (const char*)value + valueLen);
+			op.recordLength = recordLength;
+			op.expire = expire;
+			m_pReplication->append(op);
+		}
+		return stat.done(result);
+	}
+	inline int get(uint64 key, CharVector& data){
+		int result = getValue(key, data);
+		if(FILE_OK == result){
+			addLengthRecord(data);
+		}
+		return result;
+	}
+	inline int del(uint64 key){
+		StatScope stat(m_stats, STAT_OP_DEL);
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key));
+		int result = removeKey(key);
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_DEL, key);
+			m_pReplication->append(op);
+		}
+		return stat.done(result);
+	}
+	inline int replace(uint64 key, uint64 newKey){
+		WriterLock writer(m_locks);
+		SlotLock slot(m_locks, true);
+		std::vector<uint32> stripes;
+		stripes.push_back(getStripe(key));
+		stripes.push_back(getStripe(newKey));
+		slot.lock(stripes);
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		RecordType target;
+		if(FILE_OK == m_pIndexOffset->get(newKey, target) && target.isExpired(getTimeSecond())){
+			removeKey(newKey);
+		}
+		result = m_pIndexOffset->replace(key, newKey);
+		if(FILE_OK == result && 0 != record.expire){
+			m_indexTimers.add(newKey, record.expire);
+		}
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_REPLACE, key);
+			op.newIndex = newKey;
+			m_pReplication->append(op);
+		}
+		return result;
+	}
+	// 流式写入大数据：数据按LARGE_VALUE_CHUNK_SIZE分段写入，reader每次提供一段数据，不需要整个数据都在内存中
+	inline int setStream(const char* key, int64 keyLen, int64 totalLength, const StreamReader& reader, bool setNotExist){
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key, keyLen));
+		int result = setLarge(key, keyLen, NULL, &reader, totalLength, setNotExist, 0);
+		if(FILE_OK == result && NULL != m_pReplication){
+			// 数据是流式提供的，写入后读回完整的value记录到日志
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_SET, key, keyLen);
+			RecordType record;
+			if(FILE_OK == getRecord(key, keyLen, record) && FILE_OK == readRecord(record, op.value)){
+				m_pReplication->append(op);
+			}
+		}
+		return result;
+	}
+	inline int setStream(uint64 key, int64 totalLength, const StreamReader& reader, bool setNotExist){
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key));
+		int result = setLarge(key, NULL, &reader, totalLength, setNotExist, 0);
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_SET, key);
+			RecordType record;
+			if(FILE_OK == getRecord(key, record) && FILE_OK == readRecord(record, op.value)){
+				m_pReplication->append(op);
+			}
+		}
+		return result;
+	}
+	// 流式读取：大数据按分段输出，读取下一段和输出当前段同时进行
+	inline int getStream(const char* key, int64 keyLen, const StreamWriter& writer){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		return streamValue(record, writer);
+	}
+	inline int getStream(uint64 key, const StreamWriter& writer){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		return streamValue(record, writer);
+	}
+	// 设置过期时间（秒级时间戳），0表示不过期
+	inline int setExpire(const char* key, int64 keyLen, uint32 expire){
+		WriterLock writer(m_locks);
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		if(record.expire == expire){
+			return FILE_OK;
+		}
+		record.expire = expire;
+		result = m_pKeyOffset->set(key, keyLen, record, false);
+		if(FILE_OK == result && 0 != expire){
+			m_keyTimers.add(std::string(key, keyLen), expire);
+		}
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_EXPIRE, key, keyLen);
+			op.expire = expire;
+			m_pReplication->append(op);
+		}
+		return result;
+	}
+	inline int setExpire(uint64 key, uint32 expire){
+		WriterLock writer(m_locks);
+		SlotLock slot(m_locks, true);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		if(record.expire == expire){
+			return FILE_OK;
+		}
+		record.expire = expire;
+		result = m_pIndexOffset->set(key, record, false);
+		if(FILE_OK == result && 0 != expire){
+			m_indexTimers.add(key, expire);
+		}
+		if(FILE_OK == result && NULL != m_pReplication){
+			ReplicaOp op = makeReplicaOp(REPLICA_OP_EXPIRE, key);
+			op.expire = expire;
+			m_pReplication->append(op);
+		}
+		return result;
+	}
+	inline int getExpire(const char* key, int64 keyLen, uint32& expire){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		expire = record.expire;
+		return FILE_OK;
+	}
+	inline int getExpire(uint64 key, uint32& expire){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		expire = record.expire;
+		return FILE_OK;
+	}
+	// 把value当作十进制整数加上delta后写回，value为写回的结果；key不存在时从0开始，保留原来的过期时间；
+	// value不是整数或者结果溢出时返回FERR_VALUE_NOT_INTEGER；读取和写回期间持有写入锁，和其它写操作不会交错
+	inline int incrby(const char* key, int64 keyLen, int64 delta, int64& value){
+		WriterLock writer(m_locks);
+		CharVector data;
+		uint32 expire = 0;
+		int result = getValue(key, keyLen, data);
+		if(FILE_OK == result){
+			result = getExpire(key, keyLen, expire);
+		}
+		result = addInteger(result, data, delta, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		std::string text = std::to_string(value);
+		return set(key, keyLen, text.data(), (int64)text.size(), true, false, VALUE_CODEC_DEFAULT, expire);
+	}
+	inline int incrby(uint64 key, int64 delta, int64& value){
+		WriterLock writer(m_locks);
+		CharVector data;
+		uint32 expire = 0;
+		int result = getValue(key, data);
+		if(FILE_OK == result){
+			result = getExpire(key, expire);
+		}
+		result = addInteger(result, data, delta, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		std::string text = std::to_string(value);
+		return set(key, text.data(), (int64)text.size(), true, false, VALUE_CODEC_DEFAULT, expire);
+	}
+	// 回收到期的key，最多处理maxCount个时间轮数据，返回回收的key数量；
+	// 写操作会顺带调用，没有写操作的时候可以由调用者定时调用
+	inline int64 expireCycle(int64 maxCount){
+		WriterLock writer(m_locks);
+		uint32 now = getTimeSecond();
+		m_keyTimers.advance(now);
+		m_indexTimers.advance(now);
+		int64 work = 0;
+		int64 count = 0;
+		std::string key;
+		uint32 expire;
+		while(work < maxCount && m_keyTimers.pop(key, expire)){
+			++work;
+			SlotLock slot(m_locks, true);
+			slot.lock(getStripe(key.data(), key.length()));
+			// 过期时间已经修改或者key已经删除的数据直接忽略
+			RecordType record;
+			if(FILE_OK != m_pKeyOffset->get(key.data(), key.length(), record) || record.expire != expire){
+				continue;
+			}
+			if(FILE_OK == m_pKeyOffset->del(key.data(), key.length(), record)){
+				releaseNode(record.node);
+				++count;
+			}
+		}
+		uint64 index;
+		while(work < maxCount && m_indexTimers.pop(index, expire)){
+			++work;
+			SlotLock slot(m_locks, true);
+			slot.lock(getStripe(index));
+			RecordType record;
+			if(FILE_OK != m_pIndexOffset->get(index, record) || record.expire != expire){
+				continue;
+			}
+			if(FILE_OK == m_pIndexOffset->del(index, record)){
+				releaseNode(record.node);
+				++count;
+			}
+		}
+		return count;
+	}
+	// 设置内联保存的value最大长度（不超过VALUE_INLINE_MAX_LENGTH），小于0表示不内联；只影响之后写入的数据
+	inline void setInlineLength(int64 length){
+		WriterLock writer(m_locks);
+		m_inlineLength = std::min(length, (int64)VALUE_INLINE_MAX_LENGTH);
+	}
+	// 打开或者关闭线程安全模式：单个key的读取不加锁，只在读取线程自己的缓存行中登记分段；批量读取共享锁住相关的分段；
+	// 所有写操作先获取同一个全局的写锁（数据块分配、文件长度、时间轮和快照都由它保护），再独占分段并等待分段中的读取结束后才修改，
+	// 所以不同key的写操作仍然是串行的，写多的场景不会因为开启这个模式变快；打开value缓存时读取需要取得缓存的锁
+	// 需要在多个线程开始使用之前设置；只支持使用pread/pwrite的平台（非USE_STREAM_FILE）
+	inline void setThreadSafe(bool enable){
+		m_locks.setEnabled(enable);
+	}
+	// 设置读取value时检查校验码的方式（ChecksumVerify）；全库遍历和后台校验总是检查
+	inline void setChecksumVerify(int mode){
+		m_checksumVerify = mode;
+	}
+	// 设置value缓存的内存上限，0表示关闭缓存
+	inline void setCacheSize(int64 capacity){
+		m_cache.setCapacity(capacity);
+	}
+	inline CacheStat getCacheStat(void){
+		return m_cache.getStat();
+	}
+	// 运行统计：各种操作的次数、未找到和出错的次数、采样的延迟，以及数据块分配、文件扩展和缓存的计数；
+	// 读取不阻塞读写，各线程的数据可能相差一次操作
+	inline void getStats(StatSnapshot& snapshot){
+		m_stats.collect(snapshot);
+		snapshot.counters[STAT_VALUE_FILE_EXTEND] = m_extendCount.load(std::memory_order_relaxed);
+		snapshot.counters[STAT_VALUE_FILE_EXTEND_BYTES] = m_extendBytes.load(std::memory_order_relaxed);
+		snapshot.counters[STAT_KEY_FILE_EXTEND] = m_pKeyOffset->m_extendCount.load(std::memory_order_relaxed);
+		snapshot.counters[STAT_KEY_FILE_EXTEND_BYTES] = m_pKeyOffset->m_extendBytes.load(std::memory_order_relaxed);
+		snapshot.counters[STAT_INDEX_FILE_EXTEND] = m_pIndexOffset->m_extendCount.load(std::memory_order_relaxed);
+		snapshot.counters[STAT_INDEX_FILE_EXTEND_BYTES] = m_pIndexOffset->m_extendBytes.load(std::memory_order_relaxed);
+		snapshot.cache = m_cache.getStat();
+	}
+	// 文本格式的运行统计，每行一个"名称:数值"
+	inline void dumpStats(std::string& text){
+		StatSnapshot snapshot;
+		getStats(snapshot);
+		snapshot.toText(text);
+	}
+	// 默认开启；关闭后每次操作只多一次判断
+	inline void setStatsEnabled(bool enabled){
+		m_stats.setEnabled(enabled);
+	}
+	// 空间统计：数据文件的有效数据、空闲块的分布和填充浪费，key和index文件中已经删除的记录；
+	// 都是随修改更新的计数，读取时不扫描文件，只短暂地阻塞写入
+	inline void getSpaceStat(SpaceStat& stat){
+		WriterLock writer(m_locks);
+		stat.valueFileBytes = (uint64)m_fileLength;
+		stat.valueFileBlocks = getBlockOffsetAtEnd();
+		stat.freeBlocks = m_idles.getFreeBlocks();
+		stat.freeRuns = m_idles.getFreeRuns();
+		stat.largestFreeRun = m_idles.getLargestRun();
+		memcpy(stat.freeRunCounts, m_idles.m_runCounts, sizeof(stat.freeRunCounts));
+		memcpy(stat.freeRunBlocks, m_idles.m_runBlocks, sizeof(stat.freeRunBlocks));
+		stat.allocatedBlocks = (stat.valueFileBlocks > stat.freeBlocks) ? stat.valueFileBlocks - stat.freeBlocks : 0;
+		stat.liveValues = m_liveValues;
+		stat.liveBlocks = m_liveBlocks;
+		stat.liveBytes = m_liveBytes;
+		stat.roundingWaste = m_liveBlocks * BLOCK_SIZE - m_liveBytes;
+		stat.unreclaimedBlocks = (stat.allocatedBlocks > m_liveBlocks) ? stat.allocatedBlocks - m_liveBlocks : 0;
+		stat.keyFileBytes = (uint64)m_pKeyOffset->m_fileLength;
+		m_pKeyOffset->getIdleStat(stat.deadKeys, stat.deadKeyBytes);
+		stat.indexFileBytes = (uint64)m_pIndexOffset->m_fileLength;
+		m_pIndexOffset->getIdleStat(stat.deadIndexes, stat.deadIndexBytes);
+	}
+	inline void dumpSpaceStat(std::string& text){
+		SpaceStat stat;
+		getSpaceStat(stat);
+		stat.toText(text);
+	}
+	// 设置默认的压缩方式，小于threshold长度的value不压缩
+	inline void setCompress(int codec, int64 threshold){
+		WriterLock writer(m_locks);
+		m_compressCodec = codec;
+		m_compressThreshold = threshold;
+	}
+	// 设置小数据压缩使用的字典，保存到.d文件；字典设置后不能再修改，否则已经压缩的数据无法解压
+	inline int setDictionary(const void* dict, int64 length){
+		WriterLock writer(m_locks);
+		if(!m_dictionary.empty()){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		File dictFile(m_name, ".d");
+		if(FILE_OK != dictFile.touchFile(NULL, 0) || !dictFile.openReadWrite("rb+")){
+			return FERR_OPENRW_FAILED;
+		}
+		if(!dictFile.saveData(dict, length, 0, 0, false)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		dictFile.flush();
+		m_dictionary.assign((const char*)dict, (const char*)dict + length);
+		return FILE_OK;
+	}
+	// 创建快照：之后的修改不影响通过快照读取到的数据；返回快照句柄，用完需要releaseSnapshot
+	inline uint64 createSnapshot(void){
+		WriterLock writer(m_locks);
+		SnapshotInfo& info = m_snapshots[m_sequence];
+		if(0 == info.count){
+			info.time = getTimeSecond();
+		}
+		++info.count;
+		return m_sequence;
+	}
+	// 开启复制日志：之后每次成功的修改（set/del/replace/setExpire/mset/bulkLoad，包括数字key）按顺序记录并分配序号；
+	// 内存中保留最近maxBytes长度的日志，到期回收的key不记录，副本按照过期时间自己回收
+	inline void enableReplication(uint64 maxBytes = REPLICA_LOG_MAX_BYTES){
+		WriterLock writer(m_locks);
+		if(NULL == m_pReplication){
+			m_pReplication = new ReplicationLog(maxBytes);
+		}
+	}
+	inline ReplicationLog* getReplicationLog(void){
+		return m_pReplication;
+	}
+	// 创建用于初始化副本的快照，sequence为快照包含的最后一条日志的序号，副本从sequence之后继续同步
+	inline uint64 createReplicaSnapshot(uint64& sequence){
+		WriterLock writer(m_locks);
+		sequence = (NULL == m_pReplication) ? 0 : m_pReplication->getSequence();
+		return createSnapshot();
+	}
+	// 释放快照：回收不再被任何快照使用的旧记录和数据块
+	inline void releaseSnapshot(uint64 snapshot){
+		WriterLock writer(m_locks);
+		typename SnapshotMap::iterator itCur = m_snapshots.find(snapshot);
+		if(itCur == m_snapshots.end()){
+			return;
+		}
+		if(--(itCur->second.count) > 0){
+			return;
+		}
+		m_snapshots.erase(itCur);
+		uint64 oldest = m_snapshots.empty() ? (uint64)-1 : m_snapshots.begin()->first;
+		while(!m_pendingFrees.empty() && m_pendingFrees.front().first <= oldest){
+			_TYPE_ node = m_pendingFrees.front().second;
+			m_pendingFrees.pop_front();
+			freeNode(node);
+		}
+		if(m_snapshots.empty()){
+			m_keyUndo.clear();
+			m_indexUndo.clear();
+			return;
+		}
+		trimUndo(m_keyUndo, oldest);
+		trimUndo(m_indexUndo, oldest);
+	}
+	// 读取快照中的value；pExpire不为NULL时同时返回快照中的过期时间
+	inline int getSnapshotValue(uint64 snapshot, const char* key, int64 keyLen, CharVector& value, uint32* pExpire = NULL){
+		WriterLock writer(m_locks);
+		RecordType record;
+		int result = getSnapshotRecord(snapshot, key, keyLen, record);
+		if(FILE_OK != result){
+			return result;
+		}
+		if(NULL != pExpire){
+			*pExpire = record.expire;
+		}
+		return readRecord(record, value);
+	}
+	inline int getSnapshotValue(uint64 snapshot, uint64 key, CharVector& value, uint32* pExpire = NULL){
+		WriterLock writer(m_locks);
+		RecordType record;
+		int result = getSnapshotRecord(snapshot, key, record);
+		if(FILE_OK != result){
+			return result;
+		}
+		if(NULL != pExpire){
+			*pExpire = record.expire;
+		}
+		return readRecord(record, value);
+	}
+	// 快照中的所有key；返回之后可以继续写入，逐个通过getSnapshotValue读取
+	inline int getSnapshotKeys(uint64 snapshot, std::vector<std::string>& keys, std::vector<uint64>& indexes){
+		WriterLock writer(m_locks);
+		typename SnapshotMap::iterator itSnapshot = m_snapshots.find(snapshot);
+		if(itSnapshot == m_snapshots.end()){
+			return FERR_SNAPSHOT_NOT_FOUND;
+		}
+		uint32 time = itSnapshot->second.time;
+		RecordType record;
+		for(uint64 slot=0; slot<_KEY_SLOT_NUMBER_; ++slot){
+			for(auto& kv : m_pKeyOffset->m_keyMapArray[slot]){
+				typename KeyUndoMap::iterator itUndo = m_keyUndo.find(kv.first);
+				if(itUndo == m_keyUndo.end() || !findUndo(itUndo->second, snapshot, record)){
+					record = kv.second.value;
+				}else if(!isUndoExist(itUndo->second, snapshot)){
+					continue;
+				}
+				if(!record.isExpired(time)){
+					keys.push_back(kv.first);
+				}
+			}
+		}
+		// 快照之后删除的key
+		for(typename KeyUndoMap::iterator it = m_keyUndo.begin(); it != m_keyUndo.end(); ++it){
+			if(FILE_OK != m_pKeyOffset->get(it->first.data(), it->first.length(), record) && isUndoExist(it->second, snapshot)
+				&& findUndo(it->second, snapshot, record) && !record.isExpired(time)){
+				keys.push_back(it->first);
+			}
+		}
+		for(uint64 slot=0; slot<INDEX_SLOT_NUMBER; ++slot){
+			for(auto& kv : m_pIndexOffset->m_keyMapArray[slot]){
+				typename IndexUndoMap::iterator itUndo = m_indexUndo.find(kv.first);
+				if(itUndo == m_indexUndo.end() || !findUndo(itUndo->second, snapshot, record)){
+					record = kv.second.value;
+				}else if(!isUndoExist(itUndo->second, snapshot)){
+					continue;
+				}
+				if(!record.isExpired(time)){
+					indexes.push_back(kv.first);
+				}
+			}
+		}
+		for(typename IndexUndoMap::iterator it = m_indexUndo.begin(); it != m_indexUndo.end(); ++it){
+			if(FILE_OK != m_pIndexOffset->get(it->first, record) && isUndoExist(it->second, snapshot)
+				&& findUndo(it->second, snapshot, record) && !record.isExpired(time)){
+				indexes.push_back(it->first);
+			}
+		}
+		return FILE_OK;
+	}
+	// 开始在线备份到name（name.v/.k/.i/.d）：固定一个快照，key记录按当前内容生成新的.k/.i文件，数据文件在后台复制；
+	// incremental为true并且上一次成功备份到同一个位置时，只复制之后写入过的区域；需要调用finishCheckpoint结束
+	inline int startCheckpoint(const std::string& name, bool incremental){
+		WriterLock writer(m_locks);
+		if(m_checkpoint.valid()){
+			return FERR_CHECKPOINT_RUNNING;
+		}
+		std::shared_ptr<CheckpointJob> pJob(new CheckpointJob());
+		pJob->source = m_fileName;
+		pJob->target = name;
+		pJob->length = m_fileLength;
+		pJob->isIncremental = (incremental && isTrackDirty() && name == m_lastCheckpoint);
+		// 第一次备份开始记录写入的区域，给之后的增量备份使用
+		takeDirtyBits(pJob->dirtyBits);
+		if(!isTrackDirty()){
+			setTrackDirty(true);
+		}
+		m_pKeyOffset->getFileImage(pJob->keyImage);
+		m_pIndexOffset->getFileImage(pJob->indexImage);
+		pJob->dictionary = m_dictionary;
+		m_checkpointSnapshot = createSnapshot();
+		m_checkpointName = name;
+		m_checkpoint = std::async(std::launch::async, runCheckpoint, pJob);
+		return FILE_OK;
+	}
+	inline bool isCheckpointDone(void){
+		WriterLock writer(m_locks);
+		return (!m_checkpoint.valid() || std::future_status::ready == m_checkpoint.wait_for(std::chrono::seconds(0)));
+	}
+	// 等待后台备份完成并释放快照；失败时下一次备份做全量复制
+	// 复制可能需要很长时间，等待时不持有写入锁；m_checkpoint保持有效，期间不能开始新的备份
+	inline int finishCheckpoint(void){
+		std::shared_future<int> checkpoint;
+		{
+			WriterLock writer(m_locks);
+			if(!m_checkpoint.valid()){
+				return FILE_OK;
+			}
+			checkpoint = m_checkpoint;
+		}
+		int result = checkpoint.get();
+		WriterLock writer(m_locks);
+		// 其它线程已经结束了这次备份
+		if(!m_checkpoint.valid()){
+			return result;
+		}
+		m_checkpoint = std::shared_future<int>();
+		releaseSnapshot(m_checkpointSnapshot);
+		m_lastCheckpoint = (FILE_OK == result) ? m_checkpointName : std::string();
+		return result;
+	}
+	// 后台校验：按数据文件的顺序遍历所有value并检查校验码；期间可以继续读写，检查的是开始时的数据
+	inline int startScrub(void){
+		WriterLock writer(m_locks);
+		if(m_scrub.valid()){
+			return FERR_SCRUB_RUNNING;
+		}
+		m_pScrubIterator = std::make_shared<Iterator>();
+		int result = m_pScrubIterator->open(this);
+		if(FILE_OK != result){
+			m_pScrubIterator.reset();
+			return result;
+		}
+		m_scrubStat = ScrubStat();
+		m_scrub = std::async(LARGE_VALUE_READ_POLICY, &KeyValue::runScrub, this, m_pScrubIterator.get(), &m_scrubStat);
+		return FILE_OK;
+	}
+	inline bool isScrubDone(void){
+		WriterLock writer(m_locks);
+		return (!m_scrub.valid() || std::future_status::ready == m_scrub.wait_for(std::chrono::seconds(0)));
+	}
+	// 等待后台校验完成并返回结果；有value出错时返回第一个错误；等待时不持有写入锁
+	inline int finishScrub(ScrubStat& stat){
+		std::shared_future<int> scrub;
+		{
+			WriterLock writer(m_locks);
+			if(!m_scrub.valid()){
+				return FILE_OK;
+			}
+			scrub = m_scrub;
+			// 流式文件的校验延迟到这里执行，和写入共享文件的读写位置，只能在锁内执行
+			if(std::future_status::deferred == scrub.wait_for(std::chrono::seconds(0))){
+				scrub.wait();
+			}
+		}
+		int result = scrub.get();
+		WriterLock writer(m_locks);
+		stat = m_scrubStat;
+		if(m_scrub.valid()){
+			m_scrub = std::shared_future<int>();
+			m_pScrubIterator.reset();
+		}
+		return result;
+	}
+	// 批量导入：value按顺序追加到数据文件末尾，攒够BULK_LOAD_BUFFER_SIZE后一次写入，不查找空闲数据块；
+	// 新的key记录整批追加到key文件并且并行建立内存索引，已经存在的key按批量写入覆盖；重复的key以最后一次为准
+	// 出错时已经写入的批次保留，当前批次丢弃
+	inline int bulkLoad(const BulkReader& reader, int codec = VALUE_CODEC_DEFAULT){
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		slot.lockAll();
+		BulkBatch batch;
+		BulkEntry entry;
+		ReplicaOpVector ops;			// 当前批次的复制日志，批次写入成功后才追加
+		while(reader(entry)){
+			int result = addBulkEntry(batch, entry, codec);
+			if(FILE_OK != result){
+				return result;
+			}
+			if(NULL != m_pReplication){
+				ops.push_back(NULL == entry.key ? makeReplicaOp(REPLICA_OP_SET, entry.index) : makeReplicaOp(REPLICA_OP_SET, entry.key, entry.keyLen));
+				ops.back().value.assign((const char*)entry.value, (const char*)entry.value + entry.valueLen);
+				ops.back().expire = entry.expire;
+			}
+			if((int64)batch.data.size() >= BULK_LOAD_BUFFER_SIZE){
+				result = flushBulk(batch);
+				if(FILE_OK != result){
+					return result;
+				}
+				appendReplicaOps(ops);
+			}
+			entry = BulkEntry();
+		}
+		int result = flushBulk(batch);
+		if(FILE_OK == result){
+			appendReplicaOps(ops);
+		}
+		return result;
+	}
+	// 批量写入：为整批数据分配数据块，value和key记录分别合并成少量的向量写入；重复的key以最后一个为准
+	// 数据总是写入新分配的数据块，key记录写入成功后才修改内存索引和回收旧的数据块；
+	// 不是原子操作：key记录按单条生效，向量写入中途失败时文件中可能已经有一部分key被修改，重新打开后这部分key是新的value
+	// 超过单个数据块上限的value和set一样分段保存
+	inline int mset(const KeySetEntryVector& entries, bool setNotExist, int codec = VALUE_CODEC_DEFAULT){
+		StatScope stat(m_stats, STAT_OP_MSET);
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		if(slot.m_pLock){
+			std::vector<uint32> stripes;
+			for(size_t i=0; i<entries.size(); ++i){
+				stripes.push_back(getStripe(entries[i].key, entries[i].keyLen));
+			}
+			slot.lock(stripes);
+		}
+		uint32 now = getTimeSecond();
+		BatchValueVector values;
+		typename KeyMap::SetEntryVector records;
+		std::unordered_set<std::string> keys;
+		values.reserve(entries.size());
+		records.reserve(entries.size());
+		for(size_t i=entries.size(); i>0; --i){
+			const KeySetEntry& entry = entries[i-1];
+			if(entry.keyLen >= MAX_KEY_LENGTH){
+				return stat.done(FERR_KEY_IS_TOO_LONG);
+			}
+			if(!keys.insert(std::string(entry.key, entry.keyLen)).second){
+				continue;
+			}
+			RecordType record;
+			_TYPE_ node;
+			if(FILE_OK == m_pKeyOffset->get(entry.key, entry.keyLen, record)){
+				if(setNotExist && !record.isExpired(now)){
+					return stat.done(FERR_KEY_ALREADY_EXIST);
+				}
+				node = record.node;
+			}else{
+				node = 0;
+			}
+			values.push_back(BatchValue(entry.value, entry.valueLen, node, entry.valueLen <= m_inlineLength));
+			records.push_back(typename KeyMap::SetEntry(entry.key, entry.keyLen, RecordType(node, 0)));
+		}
+		int result = saveBatchValues(values, codec);
+		if(FILE_OK != result){
+			return stat.done(result);
+		}
+		for(size_t i=0; i<values.size(); ++i){
+			const BatchValue& bv = values[i];
+			records[i].value = bv.isInline ? RecordType(bv.value, bv.valueLen, 0) : RecordType(bv.newNode, 0, bv.padding);
+		}
+		result = m_pKeyOffset->mset(records);
+		if(FILE_OK != result){
+			releaseBatchValues(values, true);
+			return stat.done(result);
+		}
+		releaseBatchValues(values, false);
+		if(NULL != m_pReplication){
+			for(size_t i=0; i<entries.size(); ++i){
+				ReplicaOp op = makeReplicaOp(REPLICA_OP_SET, entries[i].key, entries[i].keyLen);
+				op.value.assign((const char*)entries[i].value, (const char*)entries[i].value + entries[i].valueLen);
+				m_pReplication->append(op);
+			}
+		}
+		return stat.done(FILE_OK);
+	}
+	inline int mset(const IndexSetEntryVector& entries, bool setNotExist, int codec = VALUE_CODEC_DEFAULT){
+		StatScope stat(m_stats, STAT_OP_MSET);
+		WriterLock writer(m_locks);
+		expireTick();
+		SlotLock slot(m_locks, true);
+		if(slot.m_pLock){
+			std::vector<uint32> stripes;
+			for(size_t i=0; i<entries.size(); ++i){
+				stripes.push_back(getStripe(entries[i].key));
+			}
+			slot.lock(stripes);
+		}
+		uint32 now = getTimeSecond();
+		BatchValueVector values;
+		typename IndexMap::SetEntryVector records;
+		std::unordered_set<uint64> keys;
+		values.reserve(entries.size());
+		records.reserve(entries.size());
+		for(size_t i=entries.size(); i>0; --i){
+			const IndexSetEntry& entry = entries[i-1];
+			if(!keys.insert(entry.key).second){
+				continue;
+			}
+			RecordType record;
+			_TYPE_ node;
+			if(FILE_OK == m_pIndexOffset->get(entry.key, record)){
+				if(setNotExist && !record.isExpired(now)){
+					return stat.done(FERR_KEY_ALREADY_EXIST);
+				}
+				node = record.node;
+			}else{
+				node = 0;
+			}
+			values.push_back(BatchValue(entry.value, entry.valueLen, node, entry.valueLen <= m_inlineLength));
+			records.push_back(typename IndexMap::SetEntry(entry.key, RecordType(node, 0)));
+		}
+		int result = saveBatchValues(values, codec);
+		if(FILE_OK != result){
+			return stat.done(result);
+		}
+		for(size_t i=0; i<values.size(); ++i){
+			const BatchValue& bv = values[i];
+			records[i].value = bv.isInline ? RecordType(bv.value, bv.valueLen, 0) : RecordType(bv.newNode, 0, bv.padding);
+		}
+		result = m_pIndexOffset->mset(records);
+		if(FILE_OK != result){
+			releaseBatchValues(values, true);
+			return stat.done(result);
+		}
+		releaseBatchValues(values, false);
+		if(NULL != m_pReplication){
+			for(size_t i=0; i<entries.size(); ++i){
+				ReplicaOp op = makeReplicaOp(REPLICA_OP_SET, entries[i].key);
+				op.value.assign((const char*)entries[i].value, (const char*)entries[i].value + entries[i].valueLen);
+				m_pReplication->append(op);
+			}
+		}
+		return stat.done(FILE_OK);
+	}
+	// 读取value到调用者的缓冲区：使用定位读取，不修改共享的状态；缓冲区不够时返回FERR_BUFFER_TOO_SMALL，length为需要的长度
+	inline int get(const char* key, int64 keyLen, char* buffer, int64 bufferSize, int64* length){
+		StatScope stat(m_stats, STAT_OP_GET);
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return stat.done(result);
+		}
+		return stat.done(readRecord(record, buffer, bufferSize, length));
+	}
+	inline int get(uint64 key, char* buffer, int64 bufferSize, int64* length){
+		StatScope stat(m_stats, STAT_OP_GET);
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return stat.done(result);
+		}
+		return stat.done(readRecord(record, buffer, bufferSize, length));
+	}
+	// 只在内存中读取：内联的value和缓存中的value直接返回，需要读取数据文件时返回FERR_VALUE_NOT_IN_MEMORY，不访问磁盘
+	inline int getMemoryValue(const char* key, int64 keyLen, char* buffer, int64 bufferSize, int64* length){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		return readMemoryRecord(record, buffer, bufferSize, length);
+	}
+	inline int getMemoryValue(uint64 key, char* buffer, int64 bufferSize, int64* length){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		return readMemoryRecord(record, buffer, bufferSize, length);
+	}
+	inline int getMemoryValue(const char* key, int64 keyLen, CharVector& value){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		return readMemoryRecord(record, value);
+	}
+	inline int getMemoryValue(uint64 key, CharVector& value){
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		return readMemoryRecord(record, value);
+	}
+	// 读取value到调用者持有的数组，数组的长度就是value的长度
+	inline int getValue(const char* key, int64 keyLen, CharVector& value){
+		StatScope stat(m_stats, STAT_OP_GET);
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key, keyLen));
+		RecordType record;
+		int result = getRecord(key, keyLen, record);
+		if(result != FILE_OK){
+			return stat.done(result);
+		}
+		return stat.done(readRecord(record, value));
+	}
+	inline int getValue(uint64 key, CharVector& value){
+		StatScope stat(m_stats, STAT_OP_GET);
+		ReadLock slot(m_locks);
+		slot.lock(getStripe(key));
+		RecordType record;
+		int result = getRecord(key, record);
+		if(result != FILE_OK){
+			return stat.done(result);
+		}
+		return stat.done(readRecord(record, value));
+	}
+	// 批量读取：查找所有key的数据块，按偏移排序，相邻或者间隔较小的数据块合并成一次向量读取
+	// value直接读入调用者的缓冲区；数据需要带有长度记录（recordLength）
+	inline int mget(KeyGetEntryVector& entries){
+		StatScope stat(m_stats, STAT_OP_MGET);
+		SlotLock slot(m_locks, false);
+		if(slot.m_pLock){
+			std::vector<uint32> stripes;
+			for(size_t i=0; i<entries.size(); ++i){
+				stripes.push_back(getStripe(entries[i].key, entries[i].keyLen));
+			}
+			slot.lock(stripes);
+		}
+		BatchReadVector reads;
+		reads.reserve(entries.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			KeyGetEntry& entry = entries[i];
+			RecordType record;
+			entry.length = 0;
+			entry.result = getRecord(entry.key, entry.keyLen, record);
+			if(FILE_OK != entry.result){
+				continue;
+			}
+			if(record.isInline()){
+				entry.result = readRecord(record, entry.buffer, entry.bufferSize, &(entry.length));
+				continue;
+			}
+			const _TYPE_& node = record.node;
+			if(node.size == 0){
+				entry.result = FERR_BLOCK_EMPTY;
+				continue;
+			}
+			if(node.large){
+				entry.result = readValue(node, entry.buffer, entry.bufferSize, &(entry.length));
+				continue;
+			}
+			if(m_cache.isEnabled()){
+				int cacheResult = m_cache.get(node.value, entry.buffer, entry.bufferSize, &(entry.length));
+				if(FERR_KEY_NOT_FOUND != cacheResult){
+					entry.result = cacheResult;
+					continue;
+				}
+			}
+			reads.push_back(BatchRead(node, entry.buffer, entry.bufferSize, &(entry.length), &(entry.result), record.inlineLength));
+		}
+		return stat.done(loadBatchValues(reads));
+	}
+	inline int mget(IndexGetEntryVector& entries){
+		StatScope stat(m_stats, STAT_OP_MGET);
+		SlotLock slot(m_locks, false);
+		if(slot.m_pLock){
+			std::vector<uint32> stripes;
+			for(size_t i=0; i<entries.size(); ++i){
+				stripes.push_back(getStripe(entries[i].key));
+			}
+			slot.lock(stripes);
+		}
+		BatchReadVector reads;
+		reads.reserve(entries.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			IndexGetEntry& entry = entries[i];
+			RecordType record;
+			entry.length = 0;
+			entry.result = getRecord(entry.key, record);
+			if(FILE_OK != entry.result){
+				continue;
+			}
+			if(record.isInline()){
+				entry.result = readRecord(record, entry.buffer, entry.bufferSize, &(entry.length));
+				continue;
+			}
+			const _TYPE_& node = record.node;
+			if(node.size == 0){
+				entry.result = FERR_BLOCK_EMPTY;
+				continue;
+			}
+			if(node.large){
+				entry.result = readValue(node, entry.buffer, entry.bufferSize, &(entry.length));
+				continue;
+			}
+			if(m_cache.isEnabled()){
+				int cacheResult = m_cache.get(node.value, entry.buffer, entry.bufferSize, &(entry.length));
+				if(FERR_KEY_NOT_FOUND != cacheResult){
+					entry.result = cacheResult;
+					continue;
+				}
+			}
+			reads.push_back(BatchRead(node, entry.buffer, entry.bufferSize, &(entry.length), &(entry.result), record.inlineLength));
+		}
+		return stat.done(loadBatchValues(reads));
+	}
+protected:
+	// 解析读取到的十进制整数并加上delta；readResult为读取value的结果，key不存在时从0开始
+	inline int addInteger(int readResult, const CharVector& data, int64 delta, int64& value){
+		int64 current = 0;
+		if(FILE_OK == readResult){
+			std::string text(data.begin(), data.end());
+			char* end = NULL;
+			errno = 0;
+			current = (int64)strtoll(text.c_str(), &end, 10);
+			if(text.empty() || isspace((unsigned char)text[0]) || 0 != errno || end != text.c_str() + text.size()){
+				return FERR_VALUE_NOT_INTEGER;
+			}
+		}else if(FERR_KEY_NOT_FOUND != readResult){
+			return readResult;
+		}
+		if(__builtin_add_overflow(current, delta, &value)){
+			return FERR_VALUE_NOT_INTEGER;
+		}
+		return FILE_OK;
+	}
+	// 写入一个字符串key，调用者已经取得写入锁并锁住key所在的分段
+	inline int setKey(const char* key, int64 keyLen, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec, uint32 expire){
+		if(0 != expire){
+			m_keyTimers.add(std::string(key, keyLen), expire);
+		}
+		// 小数据直接保存在key记录中，不写数据文件
+		if(recordLength && valueLen <= m_inlineLength){
+			m_stats.addCounter(STAT_SET_INLINE);
+			return setInline(key, keyLen, value, valueLen, setNotExist, expire);
+		}
+		// 超过单个数据块上限的数据分段保存
+		if(recordLength && getBlockSize(valueLen + 4 + VALUE_CHECKSUM_LENGTH) > BLOCK_MAX_SAVE_NUMBER){
+			m_stats.addCounter(STAT_SET_LARGE);
+			return setLarge(key, keyLen, (const char*)value, NULL, valueLen, setNotExist, expire);
+		}
+		// 打包后的数据已经包含长度记录和校验码
+		CharVector packed;
+		if(recordLength){
+			packValue(value, valueLen, codec, packed);
+			value = packed.data();
+			valueLen = (int64)packed.size();
+			recordLength = false;
+		}
+		int64 saveLength;
+		if(recordLength){
+			saveLength = valueLen + 4;
+		}else{
+			saveLength = valueLen;
+		}
+		// 查找原先是否存在这个index的数据
+		uint64 blockSize = getBlockSize(saveLength);
+		// 检查数据块是否太大
+		if(blockSize > BLOCK_MAX_SAVE_NUMBER){
+			return FERR_BLOCK_TOO_LARGE;
+		}
+		RecordType record;
+		int result = m_pKeyOffset->get(key, keyLen, record);
+		_TYPE_ node = record.node;
+		if(result != FILE_OK || node.size == 0){
+			// 原先是内联保存的value
+			if(FILE_OK == result && setNotExist && !record.isExpired(getTimeSecond())){
+				return FERR_KEY_ALREADY_EXIST;
+			}
+			m_stats.addCounter(STAT_SET_NEW);
+			// 获取一个空闲的存储节点来保存数据
+			uint64 idleIndex, blockOffset;
+			_TYPE_* pIdleNode = findIdleNode(blockSize, &idleIndex);
+			// 没有空闲的存储节点，就保存到文件的末尾
+			if(NULL == pIdleNode){
+				blockOffset = getBlockOffsetAtEnd();
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				return m_pKeyOffset->set(key, keyLen, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+			}else{
+				blockOffset = pIdleNode->offset;
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				result = m_pKeyOffset->set(key, keyLen, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+				if(result != FILE_OK){
+					return result;
+				}
+				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
+				return FILE_OK;
+			}
+		}
+		// 已经过期的key当作不存在
+		if(setNotExist && !record.isExpired(getTimeSecond())){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		// 如果数据块更改，那么需要为数据块寻找新的存储位置；同时，修改index下面该数据记录的占用数据块offset和size
+		uint64 nodeOffset = node.offset;
+		uint64 nodeSize = node.size;
+		// 有快照时不能原地覆盖，快照还需要读取原来的数据块
+		if(blockSize != nodeSize || node.large || !m_snapshots.empty()){
+			m_stats.addCounter(STAT_SET_RELOCATE);
+			// 获取一个空闲的存储节点来保存数据
+			uint64 idleIndex, blockOffset;
+			_TYPE_* pIdleNode = findIdleNode(blockSize, &idleIndex);
+			// 没有空闲的存储节点，就保存到文件的末尾
+			if(NULL == pIdleNode){
+				blockOffset = getBlockOffsetAtEnd();
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				result = m_pKeyOffset->set(key, keyLen, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+				if(result != FILE_OK){
+					return result;
+				}
+			}else{
+				blockOffset = pIdleNode->offset;
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				result = m_pKeyOffset->set(key, keyLen, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+				if(result != FILE_OK){
+					return result;
+				}
+				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
+			}
+			// 原先保存的位置将作为新的空闲数据加入
+			releaseNode(node);
+			
+			return FILE_OK;
+		}else{
+			// 直接保存内容到原来的偏移位置
+			m_stats.addCounter(STAT_SET_INPLACE);
+			m_cache.remove(node.value);
+			int64 offset = nodeOffset * BLOCK_SIZE;
+			if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+				return FERR_BLOCK_SET_FAILED;
+			}
+			// 长度变化时记录中的填充字节数也要修改
+			uint8 padding = (uint8)(blockSize * BLOCK_SIZE - saveLength);
+			if(record.expire != expire || record.inlineLength != padding){
+				return m_pKeyOffset->set(key, keyLen, RecordType(node, expire, padding), false);
+			}
+		}
+		return FILE_OK;
+	}
+	inline int setKey(uint64 key, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec, uint32 expire){
+		if(0 != expire){
+			m_indexTimers.add(key, expire);
+		}
+		if(recordLength && valueLen <= m_inlineLength){
+			m_stats.addCounter(STAT_SET_INLINE);
+			return setInline(key, value, valueLen, setNotExist, expire);
+		}
+		// 超过单个数据块上限的数据分段保存
+		if(recordLength && getBlockSize(valueLen + 4 + VALUE_CHECKSUM_LENGTH) > BLOCK_MAX_SAVE_NUMBER){
+			m_stats.addCounter(STAT_SET_LARGE);
+			return setLarge(key, (const char*)value, NULL, valueLen, setNotExist, expire);
+		}
+		// 打包后的数据已经包含长度记录和校验码
+		CharVector packed;
+		if(recordLength){
+			packValue(value, valueLen, codec, packed);
+			value = packed.data();
+			valueLen = (int64)packed.size();
+			recordLength = false;
+		}
+		int64 saveLength;
+		if(recordLength){
+			saveLength = valueLen + 4;
+		}else{
+			saveLength = valueLen;
+		}
+		// 查找原先是否存在这个index的数据
+		uint64 blockSize = getBlockSize(saveLength);
+		// 检查数据块是否太大
+		if(blockSize > BLOCK_MAX_SAVE_NUMBER){
+			return FERR_BLOCK_TOO_LARGE;
+		}
+		RecordType record;
+		int result = m_pIndexOffset->get(key, record);
+		_TYPE_ node = record.node;
+		if(result != FILE_OK || node.size == 0){
+			// 原先是内联保存的value
+			if(FILE_OK == result && setNotExist && !record.isExpired(getTimeSecond())){
+				return FERR_KEY_ALREADY_EXIST;
+			}
+			m_stats.addCounter(STAT_SET_NEW);
+			// 获取一个空闲的存储节点来保存数据
+			uint64 idleIndex, blockOffset;
+			_TYPE_* pIdleNode = findIdleNode(blockSize, &idleIndex);
+			// 没有空闲的存储节点，就保存到文件的末尾
+			if(NULL == pIdleNode){
+				blockOffset = getBlockOffsetAtEnd();
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				return m_pIndexOffset->set(key, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+			}else{
+				blockOffset = pIdleNode->offset;
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				result = m_pIndexOffset->set(key, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+				if(result != FILE_OK){
+					return result;
+				}
+				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
+				return FILE_OK;
+			}
+		}
+		// 已经过期的key当作不存在
+		if(setNotExist && !record.isExpired(getTimeSecond())){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		// 如果数据块更改，那么需要为数据块寻找新的存储位置；同时，修改index下面该数据记录的占用数据块offset和size
+		uint64 nodeOffset = node.offset;
+		uint64 nodeSize = node.size;
+		// 有快照时不能原地覆盖，快照还需要读取原来的数据块
+		if(blockSize != nodeSize || node.large || !m_snapshots.empty()){
+			m_stats.addCounter(STAT_SET_RELOCATE);
+			// 获取一个空闲的存储节点来保存数据
+			uint64 idleIndex, blockOffset;
+			_TYPE_* pIdleNode = findIdleNode(blockSize, &idleIndex);
+			// 没有空闲的存储节点，就保存到文件的末尾
+			if(NULL == pIdleNode){
+				blockOffset = getBlockOffsetAtEnd();
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				result = m_pIndexOffset->set(key, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+				if(result != FILE_OK){
+					return result;
+				}
+			}else{
+				blockOffset = pIdleNode->offset;
+				int64 offset = blockOffset * BLOCK_SIZE;
+				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+					return FERR_BLOCK_SET_FAILED;
+				}
+				result = m_pIndexOffset->set(key, RecordType(_TYPE_(blockOffset, blockSize), expire, blockSize * BLOCK_SIZE - saveLength), false);
+				if(result != FILE_OK){
+					return result;
+				}
+				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
+			}
+			// 原先保存的位置将作为新的空闲数据加入
+			releaseNode(node);
+
+			return FILE_OK;
+		}else{
+			// 直接保存内容到原来的偏移位置
+			m_stats.addCounter(STAT_SET_INPLACE);
+			m_cache.remove(node.value);
+			int64 offset = nodeOffset * BLOCK_SIZE;
+			if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
+				return FERR_BLOCK_SET_FAILED;
+			}
+			// 长度变化时记录中的填充字节数也要修改
+			uint8 padding = (uint8)(blockSize * BLOCK_SIZE - saveLength);
+			if(record.expire != expire || record.inlineLength != padding){
+				return m_pIndexOffset->set(key, RecordType(node, expire, padding), false);
+			}
+		}
+		return FILE_OK;
+	}
+	// 复制日志的一条记录，key之外的内容由调用者填写；追加需要在写入锁中进行，日志的顺序就是修改的顺序
+	inline ReplicaOp makeReplicaOp(uint8 type, const char* key, int64 keyLen){
+		ReplicaOp op;
+		op.type = type;
+		op.key.assign(key, (size_t)keyLen);
+		return op;
+	}
+	inline ReplicaOp makeReplicaOp(uint8 type, uint64 key){
+		ReplicaOp op;
+		op.type = type;
+		op.isIndex = true;
+		op.index = key;
+		return op;
+	}
+	inline void appendReplicaOps(ReplicaOpVector& ops){
+		if(NULL != m_pReplication){
+			for(size_t i=0; i<ops.size(); ++i){
+				m_pReplication->append(ops[i]);
+			}
+		}
+		ops.clear();
+	}
+	// 删除key并回收数据块；调用者已经锁住key所在的分段
+	inline int removeKey(const char* key, int64 keyLen){
+		RecordType record;
+		int result;
+		result = m_pKeyOffset->del(key, keyLen, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		// 原先保存的位置将作为新的空闲数据加入
+		releaseNode(record.node);
+		// 已经过期的key也会被回收，但是对调用者来说是不存在的
+		if(record.isExpired(getTimeSecond())){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return FILE_OK;
+	}
+	inline int removeKey(uint64 key){
+		RecordType record;
+		int result;
+		result = m_pIndexOffset->del(key, record);
+		if(result != FILE_OK){
+			return result;
+		}
+		// 原先保存的位置将作为新的空闲数据加入
+		releaseNode(record.node);
+		if(record.isExpired(getTimeSecond())){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return FILE_OK;
+	}
+	// key所在的锁分段：按照key记录所在的槽划分，同一个槽的记录总是在同一个分段
+	inline uint32 getStripe(const char* key, int64 keyLen) const {
+		return (uint32)(m_pKeyOffset->getSlot(key, (uint64)keyLen) % KEYVALUE_LOCK_STRIPE);
+	}
+	inline uint32 getStripe(uint64 key) const {
+		return (uint32)(m_pIndexOffset->getSlot(key) % KEYVALUE_LOCK_STRIPE);
+	}
+	// 查找key的记录，已经过期的key当作不存在
+	inline int getRecord(const char* key, int64 keyLen, RecordType& record){
+		int result = m_pKeyOffset->get(key, keyLen, record);
+		if(FILE_OK == result && record.isExpired(getTimeSecond())){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return result;
+	}
+	inline int getRecord(uint64 key, RecordType& record){
+		int result = m_pIndexOffset->get(key, record);
+		if(FILE_OK == result && record.isExpired(getTimeSecond())){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return result;
+	}
+	// 读取记录对应的value：内联的value直接从记录复制，否则读取数据文件
+	inline int readRecord(const RecordType& record, char* buffer, int64 bufferSize, int64* length){
+		if(record.isInline()){
+			*length = (int64)record.inlineLength;
+			if(*length > bufferSize){
+				return FERR_BUFFER_TOO_SMALL;
+			}
+			memcpy(buffer, record.inlineData, record.inlineLength);
+			return FILE_OK;
+		}
+		return readCachedValue(record.node, buffer, bufferSize, length, record.inlineLength);
+	}
+	inline int readRecord(const RecordType& record, CharVector& value){
+		if(record.isInline()){
+			value.assign(record.inlineData, record.inlineData + record.inlineLength);
+			return FILE_OK;
+		}
+		return readCachedValue(record.node, value, record.inlineLength);
+	}
+	// 只读取内联的value和缓存中的value，其它的返回FERR_VALUE_NOT_IN_MEMORY
+	inline int readMemoryRecord(const RecordType& record, char* buffer, int64 bufferSize, int64* length){
+		if(record.isInline()){
+			return readRecord(record, buffer, bufferSize, length);
+		}
+		if(record.node.size == 0){
+			return FERR_BLOCK_EMPTY;
+		}
+		if(m_cache.isEnabled() && !record.node.large){
+			int result = m_cache.get(record.node.value, buffer, bufferSize, length);
+			if(FERR_KEY_NOT_FOUND != result){
+				return result;
+			}
+		}
+		return FERR_VALUE_NOT_IN_MEMORY;
+	}
+	inline int readMemoryRecord(const RecordType& record, CharVector& value){
+		if(record.isInline()){
+			return readRecord(record, value);
+		}
+		if(record.node.size == 0){
+			return FERR_BLOCK_EMPTY;
+		}
+		if(m_cache.isEnabled() && !record.node.large && m_cache.get(record.node.value, value)){
+			return FILE_OK;
+		}
+		return FERR_VALUE_NOT_IN_MEMORY;
+	}
+	// 在value前面加上旧格式的长度记录（value的长度+4）
+	static void addLengthRecord(CharVector& data){
+		int prefix = (int)(data.size() + 4);
+		data.insert(data.begin(), (const char*)&prefix, (const char*)&prefix + 4);
+	}
+	// 内联保存value：只需要写入一条key记录；原先保存在数据文件中的value回收
+	inline int setInline(const char* key, int64 keyLen, const void* value, int64 valueLen, bool setNotExist, uint32 expire){
+		RecordType record;
+		int result = m_pKeyOffset->get(key, keyLen, record);
+		if(FILE_OK == result && setNotExist && !record.isExpired(getTimeSecond())){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		result = m_pKeyOffset->set(key, keyLen, RecordType(value, valueLen, expire), false);
+		if(FILE_OK != result){
+			return result;
+		}
+		releaseNode(record.node);
+		return FILE_OK;
+	}
+	inline int setInline(uint64 key, const void* value, int64 valueLen, bool setNotExist, uint32 expire){
+		RecordType record;
+		int result = m_pIndexOffset->get(key, record);
+		if(FILE_OK == result && setNotExist && !record.isExpired(getTimeSecond())){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		result = m_pIndexOffset->set(key, RecordType(value, valueLen, expire), false);
+		if(FILE_OK != result){
+			return result;
+		}
+		releaseNode(record.node);
+		return FILE_OK;
+	}
+	// 时间轮中有到期的数据时，回收少量到期的key
+	inline void expireTick(void){
+		uint32 now = getTimeSecond();
+		if(m_keyTimers.hasReady(now) || m_indexTimers.hasReady(now)){
+			expireCycle(EXPIRE_CYCLE_WORK);
+		}
+	}
+	inline int setLarge(const char* key, int64 keyLen, const char* data, const StreamReader* reader, int64 totalLength, bool setNotExist, uint32 expire){
+		if(keyLen >= MAX_KEY_LENGTH){
+			return FERR_KEY_IS_TOO_LONG;
+		}
+		RecordType oldRecord;
+		_TYPE_ oldNode;
+		if(FILE_OK == m_pKeyOffset->get(key, keyLen, oldRecord)){
+			oldNode = oldRecord.node;
+			if(setNotExist && !oldRecord.isExpired(getTimeSecond())){
+				return FERR_KEY_ALREADY_EXIST;
+			}
+		}else{
+			oldNode = 0;
+		}
+		_TYPE_ node;
+		int result = saveLargeValue(data, reader, totalLength, node);
+		if(FILE_OK != result){
+			return result;
+		}
+		result = m_pKeyOffset->set(key, keyLen, RecordType(node, expire), false);
+		if(FILE_OK != result){
+			releaseNode(node);
+			return result;
+		}
+		if(oldNode.size != 0){
+			releaseNode(oldNode);
+		}
+		return FILE_OK;
+	}
+	inline int setLarge(uint64 key, const char* data, const StreamReader* reader, int64 totalLength, bool setNotExist, uint32 expire){
+		RecordType oldRecord;
+		_TYPE_ oldNode;
+		if(FILE_OK == m_pIndexOffset->get(key, oldRecord)){
+			oldNode = oldRecord.node;
+			if(setNotExist && !oldRecord.isExpired(getTimeSecond())){
+				return FERR_KEY_ALREADY_EXIST;
+			}
+		}else{
+			oldNode = 0;
+		}
+		_TYPE_ node;
+		int result = saveLargeValue(data, reader, totalLength, node);
+		if(FILE_OK != result){
+			return result;
+		}
+		result = m_pIndexOffset->set(key, RecordType(node, expire), false);
+		if(FILE_OK != result){
+			releaseNode(node);
+			return result;
+		}
+		if(oldNode.size != 0){
+			releaseNode(oldNode);
+		}
+		return FILE_OK;
+	}
+	// 分段写入大数据，最后写入分段清单；清单格式：总长度(8字节) + 分段数量(8字节) + 每个分段的BlockNode + 每个分段的校验码(8字节)
+	// data不为空时直接写入data，否则每段数据从reader读取
+	inline int saveLargeValue(const char* data, const StreamReader* reader, int64 totalLength, _TYPE_& node){
+		NodeVector extents;
+		std::vector<uint64> checksums;
+		CharVector chunk;
+		if(NULL == data){
+			chunk.resize(std::min(totalLength, (int64)LARGE_VALUE_CHUNK_SIZE));
+		}
+		int64 position = 0;
+		while(position < totalLength){
+			int64 length = std::min(totalLength - position, (int64)LARGE_VALUE_CHUNK_SIZE);
+			const char* ptr;
+			if(NULL != data){
+				ptr = data + position;
+			}else{
+				if(!(*reader)(chunk.data(), length)){
+					releaseExtents(extents);
+					return FERR_BLOCK_SET_FAILED;
+				}
+				ptr = chunk.data();
+			}
+			uint64 blockSize = getBlockSize(length);
+			uint64 blockOffset = allocateBlocks(blockSize);
+			if(!saveData(ptr, length, blockOffset * BLOCK_SIZE, BLOCK_SIZE, false)){
+				extents.push_back(_TYPE_(blockOffset, blockSize));
+				releaseExtents(extents);
+				return FERR_BLOCK_SET_FAILED;
+			}
+			extents.push_back(_TYPE_(blockOffset, blockSize));
+			checksums.push_back(crc32c(0, ptr, length));
+			position += length;
+		}
+		std::vector<uint64> manifest;
+		manifest.reserve(extents.size() * 2 + 2);
+		manifest.push_back((uint64)totalLength);
+		manifest.push_back((uint64)extents.size() | LARGE_VALUE_CHECKSUM_FLAG);
+		for(size_t i=0; i<extents.size(); ++i){
+			manifest.push_back(extents[i].value);
+		}
+		manifest.insert(manifest.end(), checksums.begin(), checksums.end());
+		CharVector packed;
+		packValue(manifest.data(), (int64)(manifest.size() * sizeof(uint64)), VALUE_CODEC_NONE, packed);
+		uint64 blockSize = getBlockSize((int64)packed.size());
+		if(blockSize > BLOCK_MAX_SAVE_NUMBER){
+			releaseExtents(extents);
+			return FERR_BLOCK_TOO_LARGE;
+		}
+		uint64 blockOffset = allocateBlocks(blockSize);
+		if(!saveData(packed.data(), (int64)packed.size(), blockOffset * BLOCK_SIZE, BLOCK_SIZE, false)){
+			extents.push_back(_TYPE_(blockOffset, blockSize));
+			releaseExtents(extents);
+			return FERR_BLOCK_SET_FAILED;
+		}
+		node = _TYPE_(blockOffset, blockSize);
+		node.large = 1;
+		return FILE_OK;
+	}
+	// 读取分段清单；pChecksums不为空时返回每个分段的校验码（旧格式的清单没有校验码）
+	inline int readManifest(const _TYPE_& node, NodeVector& extents, int64& totalLength, std::vector<uint64>* pChecksums = NULL){
+		CharVector manifest;
+		int result = readValue(_TYPE_(node.offset, node.size), manifest);
+		if(FILE_OK != result){
+			return result;
+		}
+		if(manifest.size() < sizeof(uint64) * 2){
+			return FERR_BLOCK_DECODE_FAILED;
+		}
+		const uint64* ptr = (const uint64*)manifest.data();
+		bool hasChecksum = (0 != (ptr[1] & LARGE_VALUE_CHECKSUM_FLAG));
+		uint64 count = ptr[1] & ~LARGE_VALUE_CHECKSUM_FLAG;
+		if(manifest.size() != sizeof(uint64) * ((hasChecksum ? count * 2 : count) + 2)){
+			return FERR_BLOCK_DECODE_FAILED;
+		}
+		totalLength = (int64)ptr[0];
+		extents.reserve(count);
+		for(uint64 i=0; i<count; ++i){
+			extents.push_back(_TYPE_(ptr[i + 2]));
+		}
+		if(NULL != pChecksums && hasChecksum){
+			pChecksums->assign(ptr + count + 2, ptr + count * 2 + 2);
+		}
+		return FILE_OK;
+	}
+	inline int readLargeValue(const _TYPE_& node, char* buffer, int64 bufferSize, int64* length, bool isVerify){
+		NodeVector extents;
+		std::vector<uint64> checksums;
+		int64 totalLength = 0;
+		int result = readManifest(node, extents, totalLength, &checksums);
+		if(FILE_OK != result){
+			return result;
+		}
+		*length = totalLength;
+		if(totalLength > bufferSize){
+			return FERR_BUFFER_TOO_SMALL;
+		}
+		if(!isVerify){
+			checksums.clear();
+		}
+		return readExtents(extents, checksums, totalLength, buffer);
+	}
+	// 检查一个分段的校验码
+	inline int verifyExtent(const std::vector<uint64>& checksums, size_t i, const char* data, int64 length){
+		if(i < checksums.size() && (uint32)checksums[i] != crc32c(0, data, length)){
+			fprintf(stderr, "KeyValue extent checksum mismatch file=%s extent=%llu\n", m_fileName.c_str(), (uint64)i);
+			return FERR_CHECKSUM_MISMATCH;
+		}
+		return FILE_OK;
+	}
+	// 读取所有分段到buffer：分段分成几组并行读取，每组内相邻的分段合并读取；checksums不为空时读取后检查每个分段
+	inline int readExtents(const NodeVector& extents, const std::vector<uint64>& checksums, int64 totalLength, char* buffer){
+		size_t count = extents.size();
+		size_t groupCount = std::min(count, (size_t)LARGE_VALUE_READ_THREADS);
+		std::vector<ReadSegmentVector> groups(groupCount);
+		int64 position = 0;
+		for(size_t i=0; i<count; ++i){
+			int64 length = std::min(totalLength - position, (int64)(extents[i].size * BLOCK_SIZE));
+			groups[i * groupCount / count].push_back(ReadSegment(extents[i].offset * BLOCK_SIZE, buffer + position, length));
+			position += length;
+		}
+		std::vector< std::future<bool> > futures;
+		for(size_t i=1; i<groupCount; ++i){
+			futures.push_back(std::async(LARGE_VALUE_READ_POLICY, &KeyValue::loadSegments, this, std::ref(groups[i])));
+		}
+		bool ok = (0 == groupCount) || loadSegments(groups[0]);
+		for(size_t i=0; i<futures.size(); ++i){
+			ok = futures[i].get() && ok;
+		}
+		if(!ok){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		position = 0;
+		for(size_t i=0; i<checksums.size() && i<count; ++i){
+			int64 length = std::min(totalLength - position, (int64)(extents[i].size * BLOCK_SIZE));
+			int result = verifyExtent(checksums, i, buffer + position, length);
+			if(FILE_OK != result){
+				return result;
+			}
+			position += length;
+		}
+		return FILE_OK;
+	}
+	// 流式输出value；大数据在输出当前分段的时候预读下一个分段
+	inline int streamValue(const RecordType& record, const StreamWriter& writer){
+		if(record.isInline()){
+			writer(record.inlineData, (int64)record.inlineLength);
+			return FILE_OK;
+		}
+		const _TYPE_& node = record.node;
+		if(!node.large){
+			CharVector value;
+			int result = readValue(node, value, record.inlineLength);
+			if(FILE_OK != result){
+				return result;
+			}
+			writer(value.data(), (int64)value.size());
+			return FILE_OK;
+		}
+		NodeVector extents;
+		std::vector<uint64> checksums;
+		int64 totalLength = 0;
+		int result = readManifest(node, extents, totalLength, &checksums);
+		if(FILE_OK != result){
+			return result;
+		}
+		if(!isVerifyRead()){
+			checksums.clear();
+		}
+		size_t count = extents.size();
+		std::vector<ReadSegmentVector> segments(count);
+		CharVector buffers[2];
+		int64 position = 0;
+		for(size_t i=0; i<count; ++i){
+			int64 length = std::min(totalLength - position, (int64)(extents[i].size * BLOCK_SIZE));
+			CharVector& buffer = buffers[i % 2];
+			if((int64)buffer.size() < length){
+				buffer.resize(length);
+			}
+			segments[i].push_back(ReadSegment(extents[i].offset * BLOCK_SIZE, buffer.data(), length));
+			position += length;
+		}
+		if(0 == count){
+			return FILE_OK;
+		}
+		std::future<bool> pending = std::async(LARGE_VALUE_READ_POLICY, &KeyValue::loadSegments, this, std::ref(segments[0]));
+		for(size_t i=0; i<count; ++i){
+			if(!pending.get()){
+				return FERR_BLOCK_READ_FAIL;
+			}
+			if(i + 1 < count){
+				pending = std::async(LARGE_VALUE_READ_POLICY, &KeyValue::loadSegments, this, std::ref(segments[i + 1]));
+			}
+			const ReadSegment& current = segments[i].front();
+			result = verifyExtent(checksums, i, (const char*)current.ptr, current.length);
+			if(FILE_OK != result){
+				if(pending.valid()){
+					pending.get();
+				}
+				return result;
+			}
+			if(!writer((const char*)current.ptr, current.length)){
+				if(pending.valid()){
+					pending.get();
+				}
+				return FILE_OK;
+			}
+		}
+		return FILE_OK;
+	}
+	// 查找空闲的数据块并记录是否找到，没有找到时调用者在文件末尾分配
+	inline _TYPE_* findIdleNode(uint64 blockSize, uint64* pIdleIndex){
+		_TYPE_* pIdleNode = m_idles.getIdleNode(blockSize, pIdleIndex);
+		m_stats.addCounter((NULL == pIdleNode) ? STAT_IDLE_MISS : STAT_IDLE_HIT);
+		return pIdleNode;
+	}
+	// 空间统计：记录引用的数据块加入（delta为1）或者移除（delta为-1）；大数据读取分段清单，包括清单和所有分段
+	inline void countLive(const RecordType* pRecord, int64 delta){
+		if(NULL == pRecord || pRecord->isInline() || 0 == pRecord->node.size){
+			return;
+		}
+		const _TYPE_& node = pRecord->node;
+		int64 blocks = (int64)node.size;
+		int64 bytes = 0;
+		if(node.large){
+			NodeVector extents;
+			int64 totalLength = 0;
+			if(FILE_OK == readManifest(node, extents, totalLength)){
+				for(size_t i=0; i<extents.size(); ++i){
+					blocks += (int64)extents[i].size;
+				}
+				bytes = totalLength;
+			}
+		}else{
+			// 数据块中保存了长度记录、数据和校验码，最后一个数据块末尾的填充字节数在记录中
+			bytes = std::max(blocks * BLOCK_SIZE - (int64)pRecord->inlineLength - 4 - VALUE_CHECKSUM_LENGTH, (int64)0);
+		}
+		m_liveValues += (uint64)delta;
+		m_liveBlocks += (uint64)(delta * blocks);
+		m_liveBytes += (uint64)(delta * bytes);
+	}
+	// 分配连续的数据块：优先使用空闲的数据块，否则在文件末尾分配（需要马上写入）
+	inline uint64 allocateBlocks(uint64 blockSize){
+		uint64 idleIndex;
+		_TYPE_* pIdleNode = findIdleNode(blockSize, &idleIndex);
+		if(NULL == pIdleNode){
+			return getBlockOffsetAtEnd();
+		}
+		uint64 blockOffset = pIdleNode->offset;
+		m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
+		return blockOffset;
+	}
+	inline void releaseExtents(const NodeVector& extents){
+		uint64 endBlock = getBlockOffsetAtEnd();
+		for(size_t i=0; i<extents.size(); ++i){
+			if(extents[i].offset + extents[i].size <= endBlock){
+				m_idles.setIdleNode(extents[i].offset, extents[i].size);
+			}
+		}
+	}
+	// 回收一个value占用的数据块，大数据同时回收所有分段；有快照时等快照释放后再回收
+	inline void releaseNode(const _TYPE_& node){
+		// 内联保存的value没有数据块
+		if(0 == node.size){
+			return;
+		}
+		if(!m_snapshots.empty()){
+			m_pendingFrees.push_back(std::make_pair(m_sequence, node));
+			return;
+		}
+		freeNode(node);
+	}
+	inline void freeNode(const _TYPE_& node){
+		m_cache.remove(node.value);
+		if(node.large){
+			NodeVector extents;
+			int64 totalLength = 0;
+			if(FILE_OK == readManifest(node, extents, totalLength)){
+				releaseExtents(extents);
+			}
+		}
+		m_idles.setIdleNode(node.offset, node.size);
+	}
+	// 先查找缓存，没有命中时读取文件并加入缓存；大数据不缓存
+	inline int readCachedValue(const _TYPE_& node, char* buffer, int64 bufferSize, int64* length, int64 padding){
+		if(!m_cache.isEnabled() || node.large){
+			return readValue(node, buffer, bufferSize, length, padding);
+		}
+		int result = m_cache.get(node.value, buffer, bufferSize, length);
+		if(FERR_KEY_NOT_FOUND != result){
+			return result;
+		}
+		result = readValue(node, buffer, bufferSize, length, padding);
+		if(FILE_OK == result){
+			m_cache.put(node.value, buffer, *length);
+		}
+		return result;
+	}
+	inline int readCachedValue(const _TYPE_& node, CharVector& value, int64 padding){
+		if(!m_cache.isEnabled() || node.large){
+			return readValue(node, value, padding);
+		}
+		if(m_cache.get(node.value, value)){
+			return FILE_OK;
+		}
+		int result = readValue(node, value, padding);
+		if(FILE_OK == result){
+			m_cache.put(node.value, value.data(), (int64)value.size());
+		}
+		return result;
+	}
+	// 读取一个带长度记录的value：长度记录和数据一次读取，读取的长度不超过缓冲区和value实际保存的长度
+	inline int readValue(const _TYPE_& node, char* buffer, int64 bufferSize, int64* length, int64 padding = 0){
+		if(node.size == 0){
+			return FERR_BLOCK_EMPTY;
+		}
+		bool isVerify = isVerifyRead();
+		if(node.large){
+			return readLargeValue(node, buffer, bufferSize, length, isVerify);
+		}
+		int64 dataLength = getDataLength(node, padding);
+		int64 copyLength = getCopyLength(bufferSize, dataLength);
+		int64 tailLength = getTailLength(copyLength, dataLength);
+		char tail[VALUE_CHECKSUM_LENGTH];
+		int prefix = 0;
+		int64 offset = node.offset * BLOCK_SIZE;
+		ReadSegmentVector segments;
+		segments.push_back(ReadSegment(offset, &prefix, 4));
+		if(copyLength > 0){
+			segments.push_back(ReadSegment(offset + 4, buffer, copyLength));
+		}
+		if(tailLength > 0){
+			segments.push_back(ReadSegment(offset + 4 + copyLength, tail, tailLength));
+		}
+		if(!loadSegments(segments)){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		int64 storedLength = (int64)getValueLength(prefix) - 4;
+		if(storedLength < 0 || storedLength > getStoredLimit(dataLength, prefix)){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		isVerify = isVerify && hasValueChecksum(prefix);
+		const char* trailer = placeTail(prefix, storedLength, buffer, bufferSize, copyLength, tail, tailLength);
+		if(VALUE_CODEC_NONE != getValueCodec(prefix)){
+			// 压缩的数据先取出来，再解压到调用者的缓冲区
+			CharVector stored(storedLength);
+			if(storedLength <= copyLength){
+				memcpy(stored.data(), buffer, storedLength);
+			}else if(!loadStoredValue(node, NULL, stored.data(), storedLength)){
+				return FERR_BLOCK_READ_FAIL;
+			}
+			if(isVerify){
+				int result = verifyValue(node, prefix, stored.data(), storedLength, trailer);
+				if(FILE_OK != result){
+					return result;
+				}
+			}
+			return decodeValue(prefix, stored.data(), storedLength, buffer, bufferSize, length);
+		}
+		*length = storedLength;
+		if(storedLength > bufferSize){
+			return FERR_BUFFER_TOO_SMALL;
+		}
+		if(isVerify){
+			return verifyValue(node, prefix, buffer, storedLength, trailer);
+		}
+		return FILE_OK;
+	}
+	inline int readValue(const _TYPE_& node, CharVector& value, int64 padding = 0){
+		return loadValue(node, value, isVerifyRead(), padding);
+	}
+	// 读取value；isVerify为true时检查校验码，padding为记录中最后一个数据块末尾填充的字节数
+	inline int loadValue(const _TYPE_& node, CharVector& value, bool isVerify, int64 padding = 0){
+		if(node.size == 0){
+			return FERR_BLOCK_EMPTY;
+		}
+		if(node.large){
+			NodeVector extents;
+			std::vector<uint64> checksums;
+			int64 totalLength = 0;
+			int result = readManifest(node, extents, totalLength, &checksums);
+			if(FILE_OK != result){
+				return result;
+			}
+			if(!isVerify){
+				checksums.clear();
+			}
+			value.resize(totalLength);
+			result = readExtents(extents, checksums, totalLength, value.data());
+			if(FILE_OK != result){
+				value.clear();
+			}
+			return result;
+		}
+		int64 dataLength = getDataLength(node, padding);
+		int prefix = 0;
+		value.resize(dataLength);
+		if(!loadStoredValue(node, &prefix, value.data(), dataLength)){
+			value.clear();
+			return FERR_BLOCK_READ_FAIL;
+		}
+		int64 storedLength = (int64)getValueLength(prefix) - 4;
+		if(storedLength < 0 || storedLength > getStoredLimit(dataLength, prefix)){
+			value.clear();
+			return FERR_BLOCK_READ_FAIL;
+		}
+		if(isVerify && hasValueChecksum(prefix)){
+			int result = verifyValue(node, prefix, value.data(), storedLength, value.data() + storedLength);
+			if(FILE_OK != result){
+				value.clear();
+				return result;
+			}
+		}
+		if(VALUE_CODEC_NONE == getValueCodec(prefix)){
+			value.resize(storedLength);
+			return FILE_OK;
+		}
+		CharVector stored;
+		stored.swap(value);
+		int64 length = 0;
+		value.resize(getDecodedLength(stored.data(), storedLength));
+		int result = decodeValue(prefix, stored.data(), storedLength, value.data(), (int64)value.size(), &length);
+		if(FILE_OK != result){
+			value.clear();
+		}
+		return result;
+	}
+	// 长度记录后面的数据可以占用的最大长度：数据块减去长度记录和校验码
+	inline int64 getStoredLimit(const _TYPE_& node, int prefix) const {
+		return getStoredLimit((int64)(node.size * BLOCK_SIZE) - 4, prefix);
+	}
+	inline int64 getStoredLimit(int64 dataLength, int prefix) const {
+		return dataLength - (hasValueChecksum(prefix) ? VALUE_CHECKSUM_LENGTH : 0);
+	}
+	// 长度记录后面需要读取的长度（数据和校验码）：按照记录中的填充字节数只读取实际保存的部分；
+	// 旧版本的记录没有填充字节数（为0），读取全部数据块
+	inline int64 getDataLength(const _TYPE_& node, int64 padding) const {
+		int64 dataLength = (int64)(node.size * BLOCK_SIZE) - 4;
+		return (padding > 0 && padding < dataLength) ? dataLength - padding : dataLength;
+	}
+	// 读入调用者缓冲区的长度：末尾校验码的位置不读入缓冲区
+	static int64 getCopyLength(int64 bufferSize, int64 dataLength){
+		int64 limit = (dataLength > VALUE_CHECKSUM_LENGTH) ? dataLength - VALUE_CHECKSUM_LENGTH : 0;
+		return std::min(std::max(bufferSize, (int64)0), limit);
+	}
+	// 缓冲区放得下数据时，剩下的最多VALUE_CHECKSUM_LENGTH字节单独读入tail，否则不读
+	static int64 getTailLength(int64 copyLength, int64 dataLength){
+		int64 tailLength = dataLength - copyLength;
+		return (tailLength <= VALUE_CHECKSUM_LENGTH) ? tailLength : 0;
+	}
+	// 读取之后处理tail：有校验码时返回校验码的位置（不在已经读取的数据中时返回NULL，单独读取）；
+	// 没有校验码的value末尾的数据在tail中，放得下时复制到缓冲区并增加copyLength
+	static const char* placeTail(int prefix, int64 storedLength, char* buffer, int64 bufferSize, int64& copyLength, const char* tail, int64 tailLength){
+		if(hasValueChecksum(prefix)){
+			if(storedLength + VALUE_CHECKSUM_LENGTH <= copyLength){
+				return buffer + storedLength;
+			}
+			return (storedLength == copyLength && VALUE_CHECKSUM_LENGTH == tailLength) ? tail : NULL;
+		}
+		if(storedLength > copyLength && storedLength <= copyLength + tailLength && storedLength <= bufferSize){
+			memcpy(buffer + copyLength, tail, storedLength - copyLength);
+			copyLength = storedLength;
+		}
+		return NULL;
+	}
+	// 按照校验方式决定这次读取是否检查校验码
+	inline bool isVerifyRead(void){
+		if(CHECKSUM_VERIFY_ALWAYS == m_checksumVerify){
+			return true;
+		}
+		if(CHECKSUM_VERIFY_SAMPLED == m_checksumVerify){
+			// 每个线程自己计数，读取时不写共享的数据
+			static thread_local uint32 counter = 0;
+			return (0 == counter++ % CHECKSUM_SAMPLE_RATE);
+		}
+		return false;
+	}
+	static uint32 getValueChecksum(int prefix, const void* stored, int64 storedLength){
+		return crc32c(crc32c(0, &prefix, 4), stored, storedLength);
+	}
+	// 检查value的校验码：校验码覆盖长度记录和数据；trailer为NULL时从文件读取校验码
+	inline int verifyValue(const _TYPE_& node, int prefix, const char* stored, int64 storedLength, const char* trailer){
+		uint32 expected = 0;
+		if(NULL != trailer){
+			memcpy(&expected, trailer, VALUE_CHECKSUM_LENGTH);
+		}else{
+			ReadSegmentVector segments;
+			segments.push_back(ReadSegment(node.offset * BLOCK_SIZE + 4 + storedLength, &expected, VALUE_CHECKSUM_LENGTH));
+			if(!loadSegments(segments)){
+				return FERR_BLOCK_READ_FAIL;
+			}
+		}
+		if(expected != getValueChecksum(prefix, stored, storedLength)){
+			fprintf(stderr, "KeyValue value checksum mismatch file=%s block=%llu\n", m_fileName.c_str(), (uint64)node.offset);
+			return FERR_CHECKSUM_MISMATCH;
+		}
+		return FILE_OK;
+	}
+	// 把value打包成数据文件中的格式：长度记录 + 数据（压缩后的数据包含原始长度） + 校验码
+	inline void packValue(const void* value, int64 valueLen, int codec, CharVector& packed){
+		if(!encodeValue(value, valueLen, codec, packed)){
+			int prefix = (int)(valueLen + 4);
+			packed.reserve(valueLen + 4 + VALUE_CHECKSUM_LENGTH);
+			packed.resize(valueLen + 4);
+			memcpy(packed.data(), &prefix, 4);
+			memcpy(packed.data() + 4, value, valueLen);
+		}
+		sealValue(packed);
+	}
+	// 后台校验的执行：遍历器读取出错的value记录下来，继续检查后面的value
+	inline int runScrub(Iterator* pIterator, ScrubStat* pStat){
+		int result = FILE_OK;
+		while(true){
+			if(pIterator->next()){
+				++(pStat->valueCount);
+				pStat->byteCount += (uint64)pIterator->getValueLength();
+				continue;
+			}
+			if(pIterator->isEnd()){
+				break;
+			}
+			if(FILE_OK == result){
+				result = pIterator->getResult();
+			}
+			if(pIterator->isIndex()){
+				pStat->badIndexes.push_back(pIterator->getIndex());
+			}else{
+				pStat->badKeys.push_back(pIterator->getKey());
+			}
+		}
+		return result;
+	}
+	// 在长度记录中标记校验码，并在数据后面追加校验码
+	inline void sealValue(CharVector& packed){
+		int prefix = 0;
+		memcpy(&prefix, packed.data(), 4);
+		prefix = (int)((uint32)prefix | VALUE_CHECKSUM_FLAG);
+		memcpy(packed.data(), &prefix, 4);
+		uint32 checksum = getValueChecksum(prefix, packed.data() + 4, (int64)packed.size() - 4);
+		packed.insert(packed.end(), (const char*)&checksum, (const char*)&checksum + VALUE_CHECKSUM_LENGTH);
 	}
-	// recordLength 是否记录四个字节(int)的数据长度
-	// setNotExist 为true时，如果已经存在，就直接返回错误
-	inline int set(const char* key, int64 keyLen, const void* value, int64 valueLen, bool recordLength, bool setNotExist){
-		int64 saveLength;
-		if(recordLength){
-			saveLength = valueLen + 4;
+	// 读取长度记录（pPrefix不为空时）和length长度的数据
+	inline bool loadStoredValue(const _TYPE_& node, int* pPrefix, char* buffer, int64 length){
+		int64 offset = node.offset * BLOCK_SIZE;
+		ReadSegmentVector segments;
+		if(NULL != pPrefix){
+			segments.push_back(ReadSegment(offset, pPrefix, 4));
+		}
+		if(length > 0){
+			segments.push_back(ReadSegment(offset + 4, buffer, length));
+		}
+		return loadSegments(segments);
+	}
+	// 压缩value：压缩后能减少数据块时返回true，encoded为包含长度记录的完整数据
+	// 格式：长度记录(高位为压缩方式) + 原始长度(4字节) + 压缩数据
+	inline bool encodeValue(const void* value, int64 valueLen, int codec, CharVector& encoded){
+		if(VALUE_CODEC_DEFAULT == codec){
+			codec = m_compressCodec;
+		}
+		if(VALUE_CODEC_NONE == codec || valueLen < m_compressThreshold){
+			return false;
+		}
+		if(!m_dictionary.empty() && valueLen <= COMPRESS_DICT_MAX_LENGTH){
+			codec = VALUE_CODEC_ZLIB_DICT;
+		}
+		// 压缩数据的空间只保留到比原始数据少一个数据块，不能减少数据块时提前放弃
+		int64 capacity = (getBlockSize(valueLen + 4 + VALUE_CHECKSUM_LENGTH) - 1) * BLOCK_SIZE - 8 - VALUE_CHECKSUM_LENGTH;
+		if(capacity <= 0){
+			return false;
+		}
+		encoded.resize(8 + capacity + VALUE_CHECKSUM_LENGTH);
+		int64 compressLength;
+		if(VALUE_CODEC_LZ == codec){
+			compressLength = lzCompress((const char*)value, valueLen, encoded.data() + 8, capacity);
+		}else if(VALUE_CODEC_ZLIB_DICT == codec){
+			compressLength = zlibCompress((const char*)value, valueLen, encoded.data() + 8, capacity, m_dictionary.data(), (int64)m_dictionary.size(), COMPRESS_ZLIB_LEVEL);
 		}else{
-			saveLength = valueLen;
+			compressLength = zlibCompress((const char*)value, valueLen, encoded.data() + 8, capacity, NULL, 0, COMPRESS_ZLIB_LEVEL);
 		}
-		// 查找原先是否存在这个index的数据
-		uint64 blockSize = getBlockSize(saveLength);
-		// 检查数据块是否太大
-		if(blockSize > BLOCK_MAX_SAVE_NUMBER){
-			return FERR_BLOCK_TOO_LARGE;
+		if(0 == compressLength){
+			encoded.clear();
+			return false;
 		}
-		_TYPE_ node;
-		int result = m_pKeyOffset->get(key, keyLen, node);
-		if(result != FILE_OK || node.size == 0){
-			// 获取一个空闲的存储节点来保存数据
-			uint64 idleIndex, blockOffset;
-			_TYPE_* pIdleNode = m_idles.getIdleNode(blockSize, &idleIndex);
-			// 没有空闲的存储节点，就保存到文件的末尾
-			if(NULL == pIdleNode){
-				blockOffset = getBlockOffsetAtEnd();
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
+		int prefix = makeValuePrefix(codec, (int)(8 + compressLength));
+		uint32 rawLength = (uint32)valueLen;
+		memcpy(encoded.data(), &prefix, 4);
+		memcpy(encoded.data() + 4, &rawLength, 4);
+		encoded.resize(8 + compressLength);
+		return true;
+	}
+	inline int64 getDecodedLength(const char* stored, int64 storedLength){
+		uint32 rawLength = 0;
+		if(storedLength >= 4){
+			memcpy(&rawLength, stored, 4);
+		}
+		return (int64)rawLength;
+	}
+	// 解压value到调用者的缓冲区，stored为长度记录后面的数据
+	inline int decodeValue(int prefix, const char* stored, int64 storedLength, char* buffer, int64 bufferSize, int64* length){
+		if(storedLength < 4){
+			return FERR_BLOCK_DECODE_FAILED;
+		}
+		int64 rawLength = getDecodedLength(stored, storedLength);
+		*length = rawLength;
+		if(rawLength > bufferSize){
+			return FERR_BUFFER_TOO_SMALL;
+		}
+		bool ok;
+		int codec = getValueCodec(prefix);
+		if(VALUE_CODEC_LZ == codec){
+			ok = lzDecompress(stored + 4, storedLength - 4, buffer, rawLength);
+		}else if(VALUE_CODEC_ZLIB_DICT == codec){
+			ok = zlibDecompress(stored + 4, storedLength - 4, buffer, rawLength, m_dictionary.data(), (int64)m_dictionary.size());
+		}else if(VALUE_CODEC_ZLIB == codec){
+			ok = zlibDecompress(stored + 4, storedLength - 4, buffer, rawLength, NULL, 0);
+		}else{
+			ok = false;
+		}
+		return ok ? FILE_OK : FERR_BLOCK_DECODE_FAILED;
+	}
+	static bool compareBatchReadOffset(const BatchRead& a, const BatchRead& b){
+		return (a.node.offset < b.node.offset);
+	}
+	// 构造批量读取的数据段：每个value读取长度记录和数据，超出缓冲区的部分和中间的间隔读入临时缓冲区丢弃
+	inline int loadBatchValues(BatchReadVector& reads){
+		if(reads.empty()){
+			return FILE_OK;
+		}
+		std::sort(reads.begin(), reads.end(), compareBatchReadOffset);
+		// 间隔包括前一个value最后一个数据块末尾的填充
+		int64 gapLimit = (MULTI_GET_MERGE_GAP + 1) * BLOCK_SIZE;
+		int64 scratchSize = gapLimit;
+		for(size_t i=0; i<reads.size(); ++i){
+			BatchRead& r = reads[i];
+			int64 dataLength = getDataLength(r.node, r.padding);
+			r.copyLength = getCopyLength(r.bufferSize, dataLength);
+			r.tailLength = getTailLength(r.copyLength, dataLength);
+			scratchSize = std::max(scratchSize, dataLength - r.copyLength);
+		}
+		CharVector scratch(scratchSize);
+		ReadSegmentVector segments;
+		segments.reserve(reads.size() * 3);
+		int64 lastEnd = (int64)(reads.front().node.offset * BLOCK_SIZE);
+		for(size_t i=0; i<reads.size(); ++i){
+			BatchRead& r = reads[i];
+			int64 offset = (int64)(r.node.offset * BLOCK_SIZE);
+			if(offset > lastEnd && offset - lastEnd < gapLimit){
+				segments.push_back(ReadSegment(lastEnd, scratch.data(), offset - lastEnd));
+			}
+			int64 dataLength = getDataLength(r.node, r.padding);
+			segments.push_back(ReadSegment(offset, &(r.prefix), 4));
+			if(r.copyLength > 0){
+				segments.push_back(ReadSegment(offset + 4, r.buffer, r.copyLength));
+			}
+			if(r.tailLength > 0){
+				segments.push_back(ReadSegment(offset + 4 + r.copyLength, r.tail, r.tailLength));
+			}else if(dataLength > r.copyLength){
+				segments.push_back(ReadSegment(offset + 4 + r.copyLength, scratch.data(), dataLength - r.copyLength));
+			}
+			lastEnd = std::max(lastEnd, offset + 4 + dataLength);
+		}
+		if(!loadSegments(segments)){
+			for(size_t i=0; i<reads.size(); ++i){
+				*(reads[i].pResult) = FERR_BLOCK_READ_FAIL;
+			}
+			return FERR_BLOCK_READ_FAIL;
+		}
+		for(size_t i=0; i<reads.size(); ++i){
+			BatchRead& r = reads[i];
+			int64 length = (int64)getValueLength(r.prefix) - 4;
+			int64 dataLength = getDataLength(r.node, r.padding);
+			if(length < 0 || length > getStoredLimit(dataLength, r.prefix)){
+				*(r.pResult) = FERR_BLOCK_READ_FAIL;
+				continue;
+			}
+			bool isVerify = hasValueChecksum(r.prefix) && isVerifyRead();
+			const char* trailer = placeTail(r.prefix, length, r.buffer, r.bufferSize, r.copyLength, r.tail, r.tailLength);
+			if(VALUE_CODEC_NONE != getValueCodec(r.prefix)){
+				// 压缩数据完整的读入了缓冲区就直接解压，否则单独读取
+				if(length <= r.copyLength){
+					CharVector stored(r.buffer, r.buffer + length);
+					*(r.pResult) = isVerify ? verifyValue(r.node, r.prefix, stored.data(), length, trailer) : FILE_OK;
+					if(FILE_OK == *(r.pResult)){
+						*(r.pResult) = decodeValue(r.prefix, stored.data(), length, r.buffer, r.bufferSize, r.pLength);
+					}
+				}else{
+					*(r.pResult) = readValue(r.node, r.buffer, r.bufferSize, r.pLength, r.padding);
 				}
-				return m_pKeyOffset->set(key, keyLen, _TYPE_(blockOffset, blockSize), false);
+				continue;
+			}
+			*(r.pLength) = length;
+			if(length > r.bufferSize){
+				*(r.pResult) = FERR_BUFFER_TOO_SMALL;
 			}else{
-				blockOffset = pIdleNode->offset;
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
-				}
-				result = m_pKeyOffset->set(key, keyLen, _TYPE_(blockOffset, blockSize), false);
-				if(result != FILE_OK){
-					return result;
+				*(r.pResult) = isVerify ? verifyValue(r.node, r.prefix, r.buffer, length, trailer) : FILE_OK;
+			}
+		}
+		if(m_cache.isEnabled()){
+			for(size_t i=0; i<reads.size(); ++i){
+				BatchRead& r = reads[i];
+				if(FILE_OK == *(r.pResult)){
+					m_cache.put(r.node.value, r.buffer, *(r.pLength));
 				}
-				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
-				return FILE_OK;
 			}
 		}
-		if(setNotExist){
-			return FERR_KEY_ALREADY_EXIST;
+		return FILE_OK;
+	}
+	// 为整批value分配数据块并写入：每个value写入长度+数据+对齐填充，相邻的数据块合并为一次写入；
+	// 只写入新分配的数据块，失败时回收这些数据块，key记录由调用者在之后修改
+	inline int saveBatchValues(BatchValueVector& values, int codec){
+		static const char zeroBlock[BLOCK_SIZE] = {0};
+		size_t count = values.size();
+		// 超过单个数据块上限的数据先分段保存，之后再在文件末尾为其它数据分配数据块，两者不会重叠
+		std::vector<bool> larges(count, false);
+		for(size_t i=0; i<count; ++i){
+			BatchValue& bv = values[i];
+			if(bv.isInline || getBlockSize(bv.valueLen + 4 + VALUE_CHECKSUM_LENGTH) <= BLOCK_MAX_SAVE_NUMBER){
+				continue;
+			}
+			m_stats.addCounter(STAT_SET_LARGE);
+			int result = saveLargeValue((const char*)bv.value, NULL, bv.valueLen, bv.newNode);
+			if(FILE_OK != result){
+				bv.newNode = 0;
+				releaseBatchValues(values, true);
+				return result;
+			}
+			larges[i] = true;
 		}
-		// 如果数据块更改，那么需要为数据块寻找新的存储位置；同时，修改index下面该数据记录的占用数据块offset和size
-		uint64 nodeOffset = node.offset;
-		uint64 nodeSize = node.size;
-		if(blockSize != nodeSize){
-			// 获取一个空闲的存储节点来保存数据
+		std::vector<CharVector> encoded(count);
+		std::vector<int> lengths(count);
+		std::vector<uint32> checksums(count);
+		WriteSegmentVector segments;
+		segments.reserve(count * 4);
+		uint64 endBlock = getBlockOffsetAtEnd();
+		for(size_t i=0; i<count; ++i){
+			BatchValue& bv = values[i];
+			if(bv.isInline || larges[i]){
+				continue;
+			}
+			bool isEncoded = encodeValue(bv.value, bv.valueLen, codec, encoded[i]);
+			if(isEncoded){
+				sealValue(encoded[i]);
+			}
+			int64 saveLength = isEncoded ? (int64)encoded[i].size() : bv.valueLen + 4 + VALUE_CHECKSUM_LENGTH;
+			uint64 blockSize = getBlockSize(saveLength);
 			uint64 idleIndex, blockOffset;
-			_TYPE_* pIdleNode = m_idles.getIdleNode(blockSize, &idleIndex);
-			// 没有空闲的存储节点，就保存到文件的末尾
+			_TYPE_* pIdleNode = findIdleNode(blockSize, &idleIndex);
 			if(NULL == pIdleNode){
-				blockOffset = getBlockOffsetAtEnd();
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
-				}
-				result = m_pKeyOffset->set(key, keyLen, _TYPE_(blockOffset, blockSize), false);
-				if(result != FILE_OK){
-					return result;
-				}
+				blockOffset = endBlock;
+				endBlock += blockSize;
 			}else{
 				blockOffset = pIdleNode->offset;
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
-				}
-				result = m_pKeyOffset->set(key, keyLen, _TYPE_(blockOffset, blockSize), false);
-				if(result != FILE_OK){
-					return result;
-				}
 				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
 			}
-			// 原先保存的位置将作为新的空闲数据加入
-			m_idles.setIdleNode(nodeOffset, nodeSize);
-			
-			return FILE_OK;
-		}else{
-			// 直接保存内容到原来的偏移位置
-			int64 offset = nodeOffset * BLOCK_SIZE;
-			if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-				return FERR_BLOCK_SET_FAILED;
+			bv.newNode = _TYPE_(blockOffset, blockSize);
+			bv.padding = (uint8)(blockSize * BLOCK_SIZE - saveLength);
+			int64 offset = blockOffset * BLOCK_SIZE;
+			if(isEncoded){
+				segments.push_back(WriteSegment(offset, encoded[i].data(), saveLength));
+			}else{
+				lengths[i] = (int)((uint32)(bv.valueLen + 4) | VALUE_CHECKSUM_FLAG);
+				checksums[i] = getValueChecksum(lengths[i], bv.value, bv.valueLen);
+				segments.push_back(WriteSegment(offset, &lengths[i], 4));
+				segments.push_back(WriteSegment(offset + 4, bv.value, bv.valueLen));
+				segments.push_back(WriteSegment(offset + 4 + bv.valueLen, &checksums[i], VALUE_CHECKSUM_LENGTH));
+			}
+			int64 alignLength = blockSize * BLOCK_SIZE - saveLength;
+			if(alignLength > 0){
+				segments.push_back(WriteSegment(offset + saveLength, zeroBlock, alignLength));
 			}
 		}
-		return FILE_OK;
-	}
-	inline int get(const char* key, int64 keyLen, CharVector& data){
-		int result;
-		_TYPE_ node;
-		result = m_pKeyOffset->get(key, keyLen, node);
-		if(result != FILE_OK){
-			return result;
-		}
-		uint64 nodeSize = node.size;
-		if(nodeSize == 0){
-			return FERR_BLOCK_EMPTY;
-		}
-		uint64 nodeOffset = node.offset;
-		int64 saveOffset = nodeOffset * BLOCK_SIZE;
-		int64 saveLength = nodeSize * BLOCK_SIZE;
-		data.resize(saveLength, 0);
-		if(saveLength != seekRead(data.data(), 1, saveLength, saveOffset, SEEK_SET)){
-			return FERR_BLOCK_READ_FAIL;
+		if(!saveSegments(segments)){
+			releaseBatchValues(values, true);
+			return FERR_BLOCK_SET_FAILED;
 		}
 		return FILE_OK;
 	}
-	inline int del(const char* key, int64 keyLen){
-		_TYPE_ node;
-		int result;
-		result = m_pKeyOffset->del(key, keyLen, node);
-		if(result != FILE_OK){
-			return result;
+	// 回收批量写入的数据块：failed为true时回收新分配的数据块，否则回收被替换的旧数据块
+	inline void releaseBatchValues(BatchValueVector& values, bool failed){
+		uint64 endBlock = getBlockOffsetAtEnd();
+		for(size_t i=0; i<values.size(); ++i){
+			_TYPE_& node = failed ? values[i].newNode : values[i].oldNode;
+			if(node.size != 0 && node.offset + node.size <= endBlock){
+				releaseNode(node);
+			}
 		}
-		// 原先保存的位置将作为新的空闲数据加入
-		m_idles.setIdleNode(node.offset, node.size);
-		return FILE_OK;
-	}
-	inline int replace(const char* key, uint64 length, const char* newKey, uint64 newLength){
-		return m_pKeyOffset->replace(key, length, newKey, newLength);
 	}
-	// apis for number key -> value
-	inline int set(uint64 key, const void* value, int64 valueLen, bool recordLength, bool setNotExist){
-		int64 saveLength;
-		if(recordLength){
-			saveLength = valueLen + 4;
-		}else{
-			saveLength = valueLen;
+	// 把一条数据加入批次：内联的value只保存在记录中，其余的编码后追加到批次的数据块
+	inline int addBulkEntry(BulkBatch& batch, const BulkEntry& entry, int codec){
+		static const char zeroBlock[BLOCK_SIZE] = {0};
+		bool isIndex = (NULL == entry.key);
+		if(!isIndex && entry.keyLen >= MAX_KEY_LENGTH){
+			return FERR_KEY_IS_TOO_LONG;
 		}
-		// 查找原先是否存在这个index的数据
-		uint64 blockSize = getBlockSize(saveLength);
-		// 检查数据块是否太大
-		if(blockSize > BLOCK_MAX_SAVE_NUMBER){
-			return FERR_BLOCK_TOO_LARGE;
+		// 超过单个数据块上限的数据先写入这一批，再按普通的方式分段保存；
+		// bulkLoad已经持有全部的锁，不能调用加锁的set，复制日志也只由bulkLoad记录
+		if(getBlockSize(entry.valueLen + 4 + VALUE_CHECKSUM_LENGTH) > BLOCK_MAX_SAVE_NUMBER){
+			int result = flushBulk(batch);
+			if(FILE_OK != result){
+				return result;
+			}
+			if(isIndex){
+				return setKey(entry.index, entry.value, entry.valueLen, true, false, codec, entry.expire);
+			}
+			return setKey(entry.key, entry.keyLen, entry.value, entry.valueLen, true, false, codec, entry.expire);
 		}
-		_TYPE_ node;
-		int result = m_pIndexOffset->get(key, node);
-		if(result != FILE_OK || node.size == 0){
-			// 获取一个空闲的存储节点来保存数据
-			uint64 idleIndex, blockOffset;
-			_TYPE_* pIdleNode = m_idles.getIdleNode(blockSize, &idleIndex);
-			// 没有空闲的存储节点，就保存到文件的末尾
-			if(NULL == pIdleNode){
-				blockOffset = getBlockOffsetAtEnd();
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
-				}
-				return m_pIndexOffset->set(key, _TYPE_(blockOffset, blockSize), false);
+		RecordType record;
+		if(entry.valueLen <= m_inlineLength){
+			record = RecordType(entry.value, entry.valueLen, entry.expire);
+		}else{
+			if(batch.data.empty()){
+				batch.startBlock = getBlockOffsetAtEnd();
+			}
+			CharVector encoded;
+			const char* ptr;
+			int64 saveLength;
+			int prefix = 0;
+			if(encodeValue(entry.value, entry.valueLen, codec, encoded)){
+				sealValue(encoded);
+				ptr = encoded.data();
+				saveLength = (int64)encoded.size();
 			}else{
-				blockOffset = pIdleNode->offset;
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
-				}
-				result = m_pIndexOffset->set(key, _TYPE_(blockOffset, blockSize), false);
-				if(result != FILE_OK){
-					return result;
-				}
-				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
-				return FILE_OK;
+				prefix = (int)((uint32)(entry.valueLen + 4) | VALUE_CHECKSUM_FLAG);
+				ptr = (const char*)entry.value;
+				saveLength = entry.valueLen + 4 + VALUE_CHECKSUM_LENGTH;
 			}
+			uint64 blockSize = getBlockSize(saveLength);
+			record = RecordType(_TYPE_(batch.startBlock + batch.data.size() / BLOCK_SIZE, blockSize), entry.expire, blockSize * BLOCK_SIZE - saveLength);
+			if(0 != prefix){
+				uint32 checksum = getValueChecksum(prefix, ptr, entry.valueLen);
+				batch.data.insert(batch.data.end(), (const char*)&prefix, (const char*)&prefix + 4);
+				batch.data.insert(batch.data.end(), ptr, ptr + entry.valueLen);
+				batch.data.insert(batch.data.end(), (const char*)&checksum, (const char*)&checksum + VALUE_CHECKSUM_LENGTH);
+			}else{
+				batch.data.insert(batch.data.end(), ptr, ptr + saveLength);
+			}
+			int64 alignLength = blockSize * BLOCK_SIZE - saveLength;
+			batch.data.insert(batch.data.end(), zeroBlock, zeroBlock + alignLength);
 		}
-		if(setNotExist){
-			return FERR_KEY_ALREADY_EXIST;
+		// 同一批中重复的key，覆盖前面的记录
+		size_t position = batch.items.size();
+		if(isIndex){
+			std::pair<std::unordered_map<uint64, size_t>::iterator, bool> ret = batch.indexPositions.insert(std::make_pair(entry.index, position));
+			position = ret.first->second;
+		}else{
+			std::pair<std::unordered_map<std::string, size_t>::iterator, bool> ret = batch.keyPositions.insert(std::make_pair(std::string(entry.key, entry.keyLen), position));
+			position = ret.first->second;
 		}
-		// 如果数据块更改，那么需要为数据块寻找新的存储位置；同时，修改index下面该数据记录的占用数据块offset和size
-		uint64 nodeOffset = node.offset;
-		uint64 nodeSize = node.size;
-		if(blockSize != nodeSize){
-			// 获取一个空闲的存储节点来保存数据
-			uint64 idleIndex, blockOffset;
-			_TYPE_* pIdleNode = m_idles.getIdleNode(blockSize, &idleIndex);
-			// 没有空闲的存储节点，就保存到文件的末尾
-			if(NULL == pIdleNode){
-				blockOffset = getBlockOffsetAtEnd();
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
+		if(position < batch.items.size()){
+			if(!batch.items[position].record.isInline()){
+				batch.replaced.push_back(batch.items[position].record.node);
+			}
+			batch.items[position].record = record;
+		}else if(isIndex){
+			batch.items.push_back(BulkItem(std::string(), entry.index, true, record));
+		}else{
+			batch.items.push_back(BulkItem(std::string(entry.key, entry.keyLen), 0, false, record));
+		}
+		return FILE_OK;
+	}
+	// 写入一批数据：数据块一次写入文件末尾，然后写入key记录；key记录写入失败的部分回收数据块
+	inline int flushBulk(BulkBatch& batch){
+		if(batch.items.empty()){
+			batch.clear();
+			return FILE_OK;
+		}
+		if(!batch.data.empty()){
+			WriteSegmentVector segments;
+			segments.push_back(WriteSegment(batch.startBlock * BLOCK_SIZE, batch.data.data(), (int64)batch.data.size()));
+			if(!saveSegments(segments)){
+				batch.clear();
+				return FERR_BLOCK_SET_FAILED;
+			}
+		}
+		// 区分新的key和已经存在的key，新的key直接追加，存在的key覆盖后回收原来的数据块
+		typename KeyMap::SetEntryVector newKeys, oldKeys;
+		typename IndexMap::SetEntryVector newIndexes, oldIndexes;
+		NodeVector nodes[4];				// 每组新写入的数据块
+		NodeVector oldNodes[4];				// 每组被覆盖的数据块
+		for(size_t i=0; i<batch.items.size(); ++i){
+			const BulkItem& item = batch.items[i];
+			RecordType old;
+			int group;
+			if(item.isIndex){
+				if(FILE_OK == m_pIndexOffset->get(item.index, old)){
+					oldIndexes.push_back(typename IndexMap::SetEntry(item.index, item.record));
+					oldNodes[3].push_back(old.node);
+					group = 3;
+				}else{
+					newIndexes.push_back(typename IndexMap::SetEntry(item.index, item.record));
+					group = 2;
 				}
-				result = m_pIndexOffset->set(key, _TYPE_(blockOffset, blockSize), false);
-				if(result != FILE_OK){
-					return result;
+				if(0 != item.record.expire){
+					m_indexTimers.add(item.index, item.record.expire);
 				}
 			}else{
-				blockOffset = pIdleNode->offset;
-				int64 offset = blockOffset * BLOCK_SIZE;
-				if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-					return FERR_BLOCK_SET_FAILED;
+				if(FILE_OK == m_pKeyOffset->get(item.key.data(), item.key.length(), old)){
+					oldKeys.push_back(typename KeyMap::SetEntry(item.key.data(), item.key.length(), item.record));
+					oldNodes[1].push_back(old.node);
+					group = 1;
+				}else{
+					newKeys.push_back(typename KeyMap::SetEntry(item.key.data(), item.key.length(), item.record));
+					group = 0;
 				}
-				result = m_pIndexOffset->set(key, _TYPE_(blockOffset, blockSize), false);
-				if(result != FILE_OK){
-					return result;
+				if(0 != item.record.expire){
+					m_keyTimers.add(item.key, item.record.expire);
 				}
-				m_idles.useIdleNode(pIdleNode, idleIndex, blockSize);
 			}
-			// 原先保存的位置将作为新的空闲数据加入
-			m_idles.setIdleNode(nodeOffset, nodeSize);
-
-			return FILE_OK;
-		}else{
-			// 直接保存内容到原来的偏移位置
-			int64 offset = nodeOffset * BLOCK_SIZE;
-			if(!saveData(value, valueLen, offset, BLOCK_SIZE, recordLength)){
-				return FERR_BLOCK_SET_FAILED;
+			if(!item.record.isInline()){
+				nodes[group].push_back(item.record.node);
 			}
 		}
-		return FILE_OK;
+		int results[4];
+		results[0] = m_pKeyOffset->append(newKeys, BULK_LOAD_THREADS);
+		results[1] = (FILE_OK == results[0]) ? m_pKeyOffset->mset(oldKeys) : FERR_KEY_SET_FAILED;
+		results[2] = (FILE_OK == results[1]) ? m_pIndexOffset->append(newIndexes) : FERR_KEY_SET_FAILED;
+		results[3] = (FILE_OK == results[2]) ? m_pIndexOffset->mset(oldIndexes) : FERR_KEY_SET_FAILED;
+		// 写入成功的组回收被覆盖的数据块，失败的组回收新写入的数据块
+		int result = FILE_OK;
+		for(int group=0; group<4; ++group){
+			NodeVector& release = (FILE_OK == results[group]) ? oldNodes[group] : nodes[group];
+			for(size_t i=0; i<release.size(); ++i){
+				releaseNode(release[i]);
+			}
+			if(FILE_OK == result){
+				result = results[group];
+			}
+		}
+		for(size_t i=0; i<batch.replaced.size(); ++i){
+			releaseNode(batch.replaced[i]);
+		}
+		batch.clear();
+		return result;
 	}
-	inline int get(uint64 key, CharVector& data){
-		int result;
-		_TYPE_ node;
-		result = m_pIndexOffset->get(key, node);
-		if(result != FILE_OK){
-			return result;
+	// 快照期间key记录修改前保存旧记录
+	inline void addUndo(SnapshotUndoVector& undo, const RecordType* pOld){
+		undo.push_back(SnapshotUndo(++m_sequence, pOld));
+	}
+	// 快照之后的第一次修改保存了快照看到的记录；没有修改返回false，快照看到的是当前记录
+	inline bool findUndo(const SnapshotUndoVector& undo, uint64 snapshot, RecordType& record){
+		for(size_t i=0; i<undo.size(); ++i){
+			if(undo[i].sequence > snapshot){
+				record = undo[i].record;
+				return true;
+			}
 		}
-		uint64 nodeSize = node.size;
-		if(nodeSize == 0){
-			return FERR_BLOCK_EMPTY;
+		return false;
+	}
+	inline bool isUndoExist(const SnapshotUndoVector& undo, uint64 snapshot){
+		for(size_t i=0; i<undo.size(); ++i){
+			if(undo[i].sequence > snapshot){
+				return undo[i].isExist;
+			}
 		}
-		uint64 nodeOffset = node.offset;
-		int64 saveOffset = nodeOffset * BLOCK_SIZE;
-		int64 saveLength = nodeSize * BLOCK_SIZE;
-		data.resize(saveLength, 0);
-		if(saveLength != seekRead(data.data(), 1, saveLength, saveOffset, SEEK_SET)){
-			return FERR_BLOCK_READ_FAIL;
+		return true;
+	}
+	template <typename _MAP_>
+	inline void trimUndo(_MAP_& undoMap, uint64 oldest){
+		for(typename _MAP_::iterator it = undoMap.begin(); it != undoMap.end();){
+			SnapshotUndoVector& undo = it->second;
+			size_t count = 0;
+			while(count < undo.size() && undo[count].sequence <= oldest){
+				++count;
+			}
+			undo.erase(undo.begin(), undo.begin() + count);
+			if(undo.empty()){
+				it = undoMap.erase(it);
+			}else{
+				++it;
+			}
 		}
-		return FILE_OK;
 	}
-	inline int del(uint64 key){
-		_TYPE_ node;
-		int result;
-		result = m_pIndexOffset->del(key, node);
-		if(result != FILE_OK){
-			return result;
+	inline int getSnapshotRecord(uint64 snapshot, const char* key, int64 keyLen, RecordType& record){
+		typename SnapshotMap::iterator itSnapshot = m_snapshots.find(snapshot);
+		if(itSnapshot == m_snapshots.end()){
+			return FERR_SNAPSHOT_NOT_FOUND;
 		}
-		// 原先保存的位置将作为新的空闲数据加入
-		m_idles.setIdleNode(node.offset, node.size);
-		return FILE_OK;
+		typename KeyUndoMap::iterator itUndo = m_keyUndo.find(std::string(key, keyLen));
+		if(itUndo != m_keyUndo.end() && findUndo(itUndo->second, snapshot, record)){
+			if(!isUndoExist(itUndo->second, snapshot)){
+				return FERR_KEY_NOT_FOUND;
+			}
+		}else if(FILE_OK != m_pKeyOffset->get(key, keyLen, record)){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return record.isExpired(itSnapshot->second.time) ? FERR_KEY_NOT_FOUND : FILE_OK;
 	}
-	inline int replace(uint64 key, uint64 newKey){
-	    return m_pIndexOffset->replace(key, newKey);
+	inline int getSnapshotRecord(uint64 snapshot, uint64 key, RecordType& record){
+		typename SnapshotMap::iterator itSnapshot = m_snapshots.find(snapshot);
+		if(itSnapshot == m_snapshots.end()){
+			return FERR_SNAPSHOT_NOT_FOUND;
+		}
+		typename IndexUndoMap::iterator itUndo = m_indexUndo.find(key);
+		if(itUndo != m_indexUndo.end() && findUndo(itUndo->second, snapshot, record)){
+			if(!isUndoExist(itUndo->second, snapshot)){
+				return FERR_KEY_NOT_FOUND;
+			}
+		}else if(FILE_OK != m_pIndexOffset->get(key, record)){
+			return FERR_KEY_NOT_FOUND;
+		}
+		return record.isExpired(itSnapshot->second.time) ? FERR_KEY_NOT_FOUND : FILE_OK;
 	}
-protected:
 	inline int64 getBlockSize(int64 length){
 		uint64 blockSize;
 		blockSize = length / BLOCK_SIZE;
@@ -323,6 +3034,36 @@ public:
 	}
 	int openDB(void){
 		int result;
+		// 读取key的时候把设置了过期时间的key加入时间轮，不需要另外扫描
+		uint32 now = getTimeSecond();
+		m_keyTimers.reset(now);
+		m_indexTimers.reset(now);
+		m_pKeyOffset->setLoadListener([this](const std::string& key, const RecordType& record){
+			if(0 != record.expire){
+				m_keyTimers.add(key, record.expire);
+			}
+		});
+		m_pIndexOffset->setLoadListener([this](uint64 key, const RecordType& record){
+			if(0 != record.expire){
+				m_indexTimers.add(key, record.expire);
+			}
+		});
+		// 有快照时记录key修改前的内容
+		// 同时更新空间统计
+		m_pKeyOffset->setChangeListener([this](const char* key, uint64 length, const RecordType* pOld, const RecordType* pNew){
+			if(!m_snapshots.empty()){
+				addUndo(m_keyUndo[std::string(key, length)], pOld);
+			}
+			countLive(pOld, -1);
+			countLive(pNew, 1);
+		});
+		m_pIndexOffset->setChangeListener([this](uint64 key, const RecordType* pOld, const RecordType* pNew){
+			if(!m_snapshots.empty()){
+				addUndo(m_indexUndo[key], pOld);
+			}
+			countLive(pOld, -1);
+			countLive(pNew, 1);
+		});
 		// 尝试创建Index的文件
 		result = m_pKeyOffset->openDB();
 		if(FILE_OK != result){
@@ -342,10 +3083,41 @@ public:
 			fprintf(stderr, "Array openDB failed openReadWrite rb+\n");
 			return FERR_OPENRW_FAILED;
 		}
+		// 读取压缩字典
+		File dictFile(m_name, ".d");
+		if(0 == access(dictFile.m_fileName.c_str(), F_OK) && FILE_OK == dictFile.touchFile(NULL, 0) && dictFile.m_fileLength > 0 && dictFile.openReadWrite("rb+")){
+			m_dictionary.resize(dictFile.m_fileLength);
+			if(dictFile.m_fileLength != dictFile.seekRead(m_dictionary.data(), 1, dictFile.m_fileLength, 0, SEEK_SET)){
+				m_dictionary.clear();
+				return FERR_BLOCK_READ_FAIL;
+			}
+		}
 		// 计算空闲数据块：将index数据按照offset从小到大排序，依次统计中间缺失的数据，该数据为空闲数据
+		std::vector<RecordType> records;
+		m_pKeyOffset->getNotEmptyValues(records);
+		m_pIndexOffset->getNotEmptyValues(records);
 		NodeVector dataNode;
-		m_pKeyOffset->getNotEmptyValues(dataNode);
-		m_pIndexOffset->getNotEmptyValues(dataNode);
+		dataNode.reserve(records.size());
+		m_liveValues = 0;
+		m_liveBlocks = 0;
+		m_liveBytes = 0;
+		for(size_t i=0; i<records.size(); ++i){
+			if(records[i].node.size != 0){
+				dataNode.push_back(records[i].node);
+				countLive(&records[i], 1);
+			}
+		}
+		// 大数据的分段也是占用的数据块
+		size_t recordCount = dataNode.size();
+		for(size_t i=0; i<recordCount; ++i){
+			if(dataNode[i].large){
+				NodeVector extents;
+				int64 totalLength = 0;
+				if(FILE_OK == readManifest(dataNode[i], extents, totalLength)){
+					dataNode.insert(dataNode.end(), extents.begin(), extents.end());
+				}
+			}
+		}
 		if( dataNode.size() > 0 ){
 			std::sort(dataNode.begin(), dataNode.end(), compareNodeOffset);
 			// 检查文件头部到第一个数据节点间的空闲数据块
@@ -380,6 +3152,14 @@ public:
 		return FILE_OK;
 	}
 	void closeDB(void){
+		finishCheckpoint();
+		ScrubStat scrubStat;
+		finishScrub(scrubStat);
+		// 发送日志的线程需要在关闭之前停止
+		if(NULL != m_pReplication){
+			delete m_pReplication;
+			m_pReplication = NULL;
+		}
 #ifdef USE_STREAM_FILE
 		if(NULL != m_pFile){
 			flush();
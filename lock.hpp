@@ -0,0 +1,276 @@
+//
+//  lock.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/15.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef lock_hpp
+#define lock_hpp
+
+#include "file.hpp"
+#include <pthread.h>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+NS_HIVE_BEGIN
+
+#define LOCK_CACHE_LINE_SIZE 64			// 每个分段锁单独占用缓存行，避免不同分段之间的伪共享
+#define LOCK_READER_SLOT_NUMBER 256		// 无锁读取的线程数量上限，超出的线程读取时使用读写锁
+
+// 读写锁：C++11没有shared_mutex，直接使用pthread的读写锁
+class RWLock
+{
+public:
+	pthread_rwlock_t m_lock;
+	char m_padding[LOCK_CACHE_LINE_SIZE - sizeof(pthread_rwlock_t) % LOCK_CACHE_LINE_SIZE];
+public:
+	RWLock(void){
+		pthread_rwlock_init(&m_lock, NULL);
+	}
+	~RWLock(void){
+		pthread_rwlock_destroy(&m_lock);
+	}
+	inline void lockRead(void){
+		pthread_rwlock_rdlock(&m_lock);
+	}
+	inline void lockWrite(void){
+		pthread_rwlock_wrlock(&m_lock);
+	}
+	inline void unlock(void){
+		pthread_rwlock_unlock(&m_lock);
+	}
+};
+
+// 单独占用缓存行的原子变量
+typedef struct PaddedAtomic{
+	std::atomic<uint32> value;
+	char padding[LOCK_CACHE_LINE_SIZE - sizeof(std::atomic<uint32>)];
+	PaddedAtomic(void) : value(0){}
+}PaddedAtomic;
+
+// 读取线程的编号：每个线程第一次读取时分配，线程结束时归还；编号用完之后新的线程得到-1
+class ReaderId
+{
+public:
+	int m_id;
+public:
+	ReaderId(void) : m_id(-1){
+		std::lock_guard<std::mutex> guard(getMutex());
+		std::vector<bool>& used = getUsed();
+		for(int i=0; i<LOCK_READER_SLOT_NUMBER; ++i){
+			if(!used[i]){
+				used[i] = true;
+				m_id = i;
+				break;
+			}
+		}
+		if(m_id >= getCount().load()){
+			getCount().store(m_id + 1);
+		}
+	}
+	~ReaderId(void){
+		if(m_id >= 0){
+			std::lock_guard<std::mutex> guard(getMutex());
+			getUsed()[m_id] = false;
+		}
+	}
+	static int get(void){
+		static thread_local ReaderId readerId;
+		return readerId.m_id;
+	}
+	// 分配过的最大编号加1，写操作只需要检查这个范围内的读取线程
+	static std::atomic<int>& getCount(void){
+		static std::atomic<int> count(0);
+		return count;
+	}
+protected:
+	static std::mutex& getMutex(void){
+		static std::mutex mutex;
+		return mutex;
+	}
+	static std::vector<bool>& getUsed(void){
+		static std::vector<bool> used(LOCK_READER_SLOT_NUMBER, false);
+		return used;
+	}
+};
+
+// 分段锁：读操作共享锁住key所在的分段，不同分段的读取完全并行；
+// 写操作先取得写入锁串行执行（数据块分配、文件扩展等共享状态由它保护），再独占锁住修改的分段；
+// 写入锁可以重入，写操作内部可以调用其它写操作；关闭时所有的加锁都不执行；
+// 单个key的读取不加锁（ReadGuard）：读取线程只在自己的缓存行中登记正在读取的分段，不写共享的数据；
+// 写操作先标记分段正在写入，再等待登记了这个分段的读取线程结束，之后才修改key记录和回收数据块
+template <uint32 _STRIPE_NUMBER_>
+class StripeLock
+{
+public:
+	RWLock m_locks[_STRIPE_NUMBER_];
+	PaddedAtomic m_writing[_STRIPE_NUMBER_];			// 分段正在写入，新的读取使用读写锁
+	PaddedAtomic m_readers[LOCK_READER_SLOT_NUMBER];	// 每个读取线程正在读取的分段加1，0表示没有读取
+	std::recursive_mutex m_writeMutex;
+	bool m_isEnabled;
+public:
+	StripeLock(void) : m_isEnabled(false){}
+	virtual ~StripeLock(void){}
+	inline void setEnabled(bool enable){
+		m_isEnabled = enable;
+	}
+	inline bool isEnabled(void) const {
+		return m_isEnabled;
+	}
+	inline RWLock& getLock(uint32 stripe){
+		return m_locks[stripe % _STRIPE_NUMBER_];
+	}
+	// 独占分段：标记写入，取得读写锁，再等待无锁读取的线程离开这个分段
+	inline void lockWrite(uint32 stripe){
+		m_writing[stripe].value.store(1);
+		m_locks[stripe].lockWrite();
+		uint32 mark = stripe + 1;
+		int count = ReaderId::getCount().load();
+		for(int i=0; i<count; ++i){
+			while(m_readers[i].value.load() == mark){
+				std::this_thread::yield();
+			}
+		}
+	}
+	inline void unlockWrite(uint32 stripe){
+		m_locks[stripe].unlock();
+		m_writing[stripe].value.store(0);
+	}
+};
+
+// 单个分段的读取：登记成功时不加锁，分段正在写入或者没有读取编号时使用读写锁；
+// 每个线程只有一个登记位置，嵌套的读取（例如流式读取的回调中再读取）不覆盖外层的登记：
+// 同一个分段已经被外层登记保护，其它分段使用读写锁
+template <uint32 _STRIPE_NUMBER_>
+class ReadGuard
+{
+public:
+	StripeLock<_STRIPE_NUMBER_>* m_pLock;
+	int m_readerId;				// 登记使用的读取编号，-1表示没有登记
+	uint32 m_stripe;
+	bool m_isLocked;			// 使用了读写锁
+public:
+	ReadGuard(StripeLock<_STRIPE_NUMBER_>& lock) : m_pLock(lock.isEnabled() ? &lock : NULL), m_readerId(-1), m_stripe(0), m_isLocked(false){}
+	virtual ~ReadGuard(void){
+		if(m_readerId >= 0){
+			m_pLock->m_readers[m_readerId].value.store(0, std::memory_order_release);
+		}else if(m_isLocked){
+			m_pLock->getLock(m_stripe).unlock();
+		}
+	}
+	inline void lock(uint32 stripe){
+		if(NULL == m_pLock){
+			return;
+		}
+		m_stripe = stripe % _STRIPE_NUMBER_;
+		int id = ReaderId::get();
+		if(id >= 0){
+			// 先登记再检查写入标记，和写操作的先标记再检查登记对应，两边至少有一边能看到对方
+			std::atomic<uint32>& reader = m_pLock->m_readers[id].value;
+			uint32 previous = reader.load(std::memory_order_relaxed);
+			if(previous == m_stripe + 1){
+				return;
+			}
+			if(0 != previous){
+				m_pLock->getLock(m_stripe).lockRead();
+				m_isLocked = true;
+				return;
+			}
+			reader.store(m_stripe + 1);
+			if(0 == m_pLock->m_writing[m_stripe].value.load()){
+				m_readerId = id;
+				return;
+			}
+			reader.store(0, std::memory_order_release);
+		}
+		m_pLock->getLock(m_stripe).lockRead();
+		m_isLocked = true;
+	}
+};
+
+// 写入锁的自动加锁和释放
+template <uint32 _STRIPE_NUMBER_>
+class WriterGuard
+{
+public:
+	StripeLock<_STRIPE_NUMBER_>* m_pLock;
+public:
+	WriterGuard(StripeLock<_STRIPE_NUMBER_>& lock) : m_pLock(lock.isEnabled() ? &lock : NULL){
+		if(NULL != m_pLock){
+			m_pLock->m_writeMutex.lock();
+		}
+	}
+	virtual ~WriterGuard(void){
+		if(NULL != m_pLock){
+			m_pLock->m_writeMutex.unlock();
+		}
+	}
+};
+
+// 一组分段的自动加锁和释放；多个分段按从小到大的顺序加锁，避免死锁
+template <uint32 _STRIPE_NUMBER_>
+class StripeGuard
+{
+public:
+	StripeLock<_STRIPE_NUMBER_>* m_pLock;
+	bool m_isWrite;
+	std::vector<uint32> m_stripes;		// 已经锁住的分段
+public:
+	StripeGuard(StripeLock<_STRIPE_NUMBER_>& lock, bool isWrite) : m_pLock(lock.isEnabled() ? &lock : NULL), m_isWrite(isWrite){}
+	virtual ~StripeGuard(void){
+		unlock();
+	}
+	inline void lock(uint32 stripe){
+		if(NULL == m_pLock){
+			return;
+		}
+		lockStripe(stripe % _STRIPE_NUMBER_);
+	}
+	inline void lock(std::vector<uint32>& stripes){
+		if(NULL == m_pLock){
+			return;
+		}
+		for(size_t i=0; i<stripes.size(); ++i){
+			stripes[i] %= _STRIPE_NUMBER_;
+		}
+		std::sort(stripes.begin(), stripes.end());
+		stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+		for(size_t i=0; i<stripes.size(); ++i){
+			lockStripe(stripes[i]);
+		}
+	}
+	inline void lockAll(void){
+		if(NULL == m_pLock){
+			return;
+		}
+		for(uint32 stripe=0; stripe<_STRIPE_NUMBER_; ++stripe){
+			lockStripe(stripe);
+		}
+	}
+	inline void unlock(void){
+		for(size_t i=m_stripes.size(); i>0; --i){
+			if(m_isWrite){
+				m_pLock->unlockWrite(m_stripes[i-1]);
+			}else{
+				m_pLock->getLock(m_stripes[i-1]).unlock();
+			}
+		}
+		m_stripes.clear();
+	}
+protected:
+	inline void lockStripe(uint32 stripe){
+		if(m_isWrite){
+			m_pLock->lockWrite(stripe);
+		}else{
+			m_pLock->getLock(stripe).lockRead();
+		}
+		m_stripes.push_back(stripe);
+	}
+};
+
+NS_HIVE_END
+
+#endif /* lock_hpp */
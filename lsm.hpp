@@ -0,0 +1,1404 @@
+//
+//  lsm.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/10.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef lsm_hpp
+#define lsm_hpp
+
+#include "keyvalue.hpp"
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+NS_HIVE_BEGIN
+
+#define LSM_MEMTABLE_SIZE 8388608			// 内存表超过这个长度后转为只读，由后台线程写入第0层
+#define LSM_TABLE_SIZE 8388608				// 合并时输出的每个数据表的长度
+#define LSM_BLOCK_SIZE 4096					// 数据表中数据块的长度，每个数据块在索引中占一项
+#define LSM_BLOOM_BITS 10					// 布隆过滤器每个key使用的位数
+#define LSM_MAX_LEVEL 7
+#define LSM_L0_COMPACT_TRIGGER 4			// 第0层的数据表达到这个数量时合并到第1层
+#define LSM_L0_STOP_WRITES 12				// 第0层的数据表达到这个数量时写入等待合并
+#define LSM_LEVEL1_TABLES 8					// 第1层的容量为8个数据表，之后每层是上一层的10倍
+#define LSM_LEVEL_MULTIPLIER 10
+#define LSM_SCAN_READAHEAD 262144			// 顺序读取数据表时每次读取的长度
+#define LSM_COMPACT_INTERVAL 1000			// 后台合并线程的检查间隔（毫秒）
+#define LSM_TABLE_MAGIC 0x4C534D5441424C45ULL
+#define LSM_TABLE_EXT ".sst"
+#define LSM_LOG_EXT ".log"
+#define LSM_MANIFEST_EXT ".lsm"
+
+enum LsmRecordType{
+	LSM_PUT = 1,
+	LSM_DEL = 2,
+};
+
+// 范围查询的结果
+typedef std::vector<std::pair<std::string, std::string> > KeyScanVector;
+typedef std::vector<std::pair<uint64, std::string> > IndexScanVector;
+
+// 内存表和数据表中一个key的数据；删除的key保留一条删除标记，合并到最底层时才丢弃
+typedef struct LsmValue{
+	std::string data;
+	uint32 expire;
+	uint8 type;
+	LsmValue(void) : expire(0), type(LSM_DEL){}
+	LsmValue(const char* d, int64 l, uint32 e, uint8 t) : data(d, l), expire(e), type(t){}
+	// 删除标记和过期的数据都视为不存在
+	inline bool isLive(uint32 now) const { return (LSM_PUT == type && (0 == expire || expire > now)); }
+}LsmValue;
+typedef std::map<std::string, LsmValue> LsmValueMap;
+typedef std::vector<std::pair<std::string, LsmValue> > LsmRecordVector;
+
+// 数据表和日志中每条记录的头部，后面紧跟key和value
+typedef struct LsmRecordHeader{
+	uint32 valueLength;
+	uint32 expire;
+	uint16 keyLength;
+	uint8 type;
+	uint8 reserved;
+}LsmRecordHeader;
+
+// 数据表的索引项：每个数据块的最后一个key和位置
+typedef struct LsmBlockIndex{
+	std::string lastKey;
+	int64 offset;
+	uint32 length;
+	uint32 crc;
+}LsmBlockIndex;
+typedef std::vector<LsmBlockIndex> LsmBlockIndexVector;
+
+// 数据表末尾的固定长度尾部
+typedef struct LsmTableFooter{
+	uint64 indexOffset;
+	uint64 indexLength;
+	uint64 bloomOffset;
+	uint64 bloomLength;
+	uint64 entryCount;
+	uint64 magic;
+}LsmTableFooter;
+
+// 内存表：有序的key和value；写满后转为只读，不再修改
+typedef struct LsmMemTable{
+	LsmValueMap values;
+	int64 size;
+	uint32 logId;				// 对应的预写日志编号，写入数据表之后删除
+	LsmMemTable(uint32 id) : size(0), logId(id){}
+	inline void put(const std::string& key, const LsmValue& value){
+		std::pair<LsmValueMap::iterator, bool> result = values.insert(std::make_pair(key, value));
+		if(!result.second){
+			size -= (int64)result.first->second.data.size();
+			result.first->second = value;
+		}else{
+			size += (int64)key.size() + sizeof(LsmRecordHeader) + 48;
+		}
+		size += (int64)value.data.size();
+	}
+}LsmMemTable;
+typedef std::shared_ptr<LsmMemTable> LsmMemTablePtr;
+
+// 解析数据块或者日志中的一条记录；数据不完整返回false
+inline bool lsmDecodeRecord(const char* data, int64 length, int64& position, const char*& key, LsmRecordHeader& header){
+	if(position + (int64)sizeof(LsmRecordHeader) > length){
+		return false;
+	}
+	memcpy(&header, data + position, sizeof(LsmRecordHeader));
+	int64 recordLength = (int64)sizeof(LsmRecordHeader) + header.keyLength + header.valueLength;
+	if(position + recordLength > length){
+		return false;
+	}
+	key = data + position + sizeof(LsmRecordHeader);
+	position += recordLength;
+	return true;
+}
+inline void lsmEncodeRecord(CharVector& buffer, const std::string& key, const LsmValue& value){
+	LsmRecordHeader header;
+	header.valueLength = (uint32)value.data.size();
+	header.expire = value.expire;
+	header.keyLength = (uint16)key.size();
+	header.type = value.type;
+	header.reserved = 0;
+	buffer.insert(buffer.end(), (const char*)&header, (const char*)&header + sizeof(LsmRecordHeader));
+	buffer.insert(buffer.end(), key.begin(), key.end());
+	buffer.insert(buffer.end(), value.data.begin(), value.data.end());
+}
+inline int compareKey(const char* a, int64 aLen, const std::string& b){
+	int result = memcmp(a, b.data(), (size_t)std::min(aLen, (int64)b.size()));
+	if(0 != result){
+		return result;
+	}
+	return (aLen < (int64)b.size()) ? -1 : (aLen > (int64)b.size() ? 1 : 0);
+}
+
+// 只读的有序数据表：数据块 + 块索引 + 布隆过滤器 + 尾部；索引和过滤器常驻内存，数据块按需读取
+class LsmTable : public File
+{
+public:
+	uint32 m_id;
+	LsmBlockIndexVector m_index;
+	std::string m_bloom;				// 布隆过滤器的位数组，最后一个字节是哈希次数
+	std::string m_smallest;
+	std::string m_largest;
+	uint64 m_entryCount;
+	bool m_isObsolete;					// 已经被合并掉，最后一个引用释放时删除文件
+#ifdef USE_STREAM_FILE
+	std::mutex m_readMutex;				// 流文件共享读写位置
+#endif
+public:
+	LsmTable(const std::string& name, uint32 id) : File(name, getNumberExt(id, LSM_TABLE_EXT)), m_id(id), m_entryCount(0), m_isObsolete(false) {}
+	virtual ~LsmTable(void){
+		closeReadWrite();
+		if(m_isObsolete){
+			unlink(m_fileName.c_str());
+		}
+	}
+	inline int64 getSize(void) const { return m_fileLength; }
+	inline bool isOverlap(const std::string& smallest, const std::string& largest) const {
+		return !(m_largest < smallest || largest < m_smallest);
+	}
+	int openTable(void){
+		if(FILE_OK != touchFile(NULL, 0) || !openReadWrite("rb+")){
+			return FERR_OPENRW_FAILED;
+		}
+		LsmTableFooter footer;
+		if(m_fileLength < (int64)sizeof(LsmTableFooter) || !readRange(m_fileLength - sizeof(LsmTableFooter), &footer, sizeof(LsmTableFooter))){
+			return FERR_INVALID_FILE;
+		}
+		if(LSM_TABLE_MAGIC != footer.magic || footer.bloomOffset + footer.bloomLength > (uint64)m_fileLength){
+			fprintf(stderr, "LsmTable::openTable invalid table file=%s\n", m_fileName.c_str());
+			return FERR_INVALID_FILE;
+		}
+		CharVector index(footer.indexLength);
+		m_bloom.resize(footer.bloomLength);
+		if(!readRange(footer.indexOffset, index.data(), footer.indexLength) || !readRange(footer.bloomOffset, &m_bloom[0], footer.bloomLength)){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		int64 position = 0;
+		while(position < (int64)index.size()){
+			LsmBlockIndex block;
+			uint16 keyLength;
+			memcpy(&keyLength, index.data() + position, 2);
+			memcpy(&block.offset, index.data() + position + 2, 8);
+			memcpy(&block.length, index.data() + position + 10, 4);
+			memcpy(&block.crc, index.data() + position + 14, 4);
+			block.lastKey.assign(index.data() + position + 18, keyLength);
+			position += 18 + keyLength;
+			m_index.push_back(block);
+		}
+		m_entryCount = footer.entryCount;
+		if(m_index.empty()){
+			return FERR_INVALID_FILE;
+		}
+		m_largest = m_index.back().lastKey;
+		// 第一个key从第一个数据块中取得
+		CharVector block;
+		if(!readBlock(0, block)){
+			return FERR_BLOCK_READ_FAIL;
+		}
+		int64 blockPosition = 0;
+		const char* key;
+		LsmRecordHeader header;
+		if(!lsmDecodeRecord(block.data(), (int64)block.size(), blockPosition, key, header)){
+			return FERR_INVALID_FILE;
+		}
+		m_smallest.assign(key, header.keyLength);
+		return FILE_OK;
+	}
+	inline bool mayContain(const std::string& key) const {
+		return lsmBloomCheck(m_bloom, key.data(), (int64)key.size());
+	}
+	// 第一个lastKey不小于key的数据块
+	inline size_t findBlock(const std::string& key) const {
+		size_t low = 0;
+		size_t high = m_index.size();
+		while(low < high){
+			size_t mid = (low + high) / 2;
+			if(m_index[mid].lastKey < key){
+				low = mid + 1;
+			}else{
+				high = mid;
+			}
+		}
+		return low;
+	}
+	inline bool readBlock(size_t blockIndex, CharVector& block){
+		const LsmBlockIndex& index = m_index[blockIndex];
+		block.resize(index.length);
+		if(!readRange(index.offset, block.data(), index.length)){
+			return false;
+		}
+		if(index.crc != (uint32)crc32(0L, (const Bytef*)block.data(), index.length)){
+			fprintf(stderr, "LsmTable::readBlock crc error file=%s offset=%lld\n", m_fileName.c_str(), index.offset);
+			return false;
+		}
+		return true;
+	}
+	// 使用定位读取，多个线程可以同时读取
+	inline bool readRange(int64 offset, void* ptr, int64 length){
+		if(0 == length){
+			return true;
+		}
+		ReadSegmentVector segments;
+		segments.push_back(ReadSegment(offset, ptr, length));
+#ifdef USE_STREAM_FILE
+		std::lock_guard<std::mutex> lock(m_readMutex);
+#endif
+		return loadSegments(segments);
+	}
+	static inline bool lsmBloomCheck(const std::string& bloom, const char* key, int64 keyLength){
+		if(bloom.size() < 2){
+			return true;
+		}
+		uint64 bits = (bloom.size() - 1) * 8;
+		int hashCount = (uint8)bloom[bloom.size() - 1];
+		uint64 hash = binary_hash(key, (int)keyLength, BINARY_HASH_SEED);
+		uint64 delta = (hash >> 33) | (hash << 31);
+		for(int i=0; i<hashCount; ++i){
+			uint64 bit = hash % bits;
+			if(0 == (bloom[bit / 8] & (1 << (bit % 8)))){
+				return false;
+			}
+			hash += delta;
+		}
+		return true;
+	}
+};
+typedef std::shared_ptr<LsmTable> LsmTablePtr;
+typedef std::vector<LsmTablePtr> LsmTableVector;
+
+// 数据表的写入：数据块写满后追加到文件，最后写入索引、布隆过滤器和尾部
+class LsmTableBuilder
+{
+public:
+	LsmTablePtr m_pTable;
+	CharVector m_block;
+	CharVector m_pending;				// 等待写入文件的数据，攒够一批再写入
+	std::vector<uint64> m_hashes;
+	std::string m_lastKey;
+	int64 m_offset;
+	bool m_isOk;
+public:
+	LsmTableBuilder(const std::string& name, uint32 id) : m_pTable(new LsmTable(name, id)), m_offset(0), m_isOk(true) {
+		m_pTable->m_isObsolete = true;		// 写入完成之前失败的话删除文件
+		unlink(m_pTable->m_fileName.c_str());
+		if(FILE_OK != m_pTable->touchFile(NULL, 0) || !m_pTable->openReadWrite("rb+")){
+			m_isOk = false;
+		}
+	}
+	virtual ~LsmTableBuilder(void){}
+	inline void add(const std::string& key, const LsmValue& value){
+		if(m_pTable->m_smallest.empty() && 0 == m_pTable->m_entryCount){
+			m_pTable->m_smallest = key;
+		}
+		lsmEncodeRecord(m_block, key, value);
+		m_hashes.push_back(binary_hash(key.data(), (int)key.size(), BINARY_HASH_SEED));
+		m_lastKey = key;
+		++m_pTable->m_entryCount;
+		if((int64)m_block.size() >= LSM_BLOCK_SIZE){
+			finishBlock();
+		}
+	}
+	inline int64 getSize(void) const {
+		return m_offset + (int64)m_block.size();
+	}
+	inline uint64 getEntryCount(void) const {
+		return m_pTable->m_entryCount;
+	}
+	// 写入剩余的数据并打开数据表；失败返回空指针
+	LsmTablePtr finish(void){
+		if(!m_block.empty()){
+			finishBlock();
+		}
+		LsmTableFooter footer;
+		CharVector index;
+		for(size_t i=0; i<m_pTable->m_index.size(); ++i){
+			const LsmBlockIndex& block = m_pTable->m_index[i];
+			uint16 keyLength = (uint16)block.lastKey.size();
+			index.insert(index.end(), (const char*)&keyLength, (const char*)&keyLength + 2);
+			index.insert(index.end(), (const char*)&block.offset, (const char*)&block.offset + 8);
+			index.insert(index.end(), (const char*)&block.length, (const char*)&block.length + 4);
+			index.insert(index.end(), (const char*)&block.crc, (const char*)&block.crc + 4);
+			index.insert(index.end(), block.lastKey.begin(), block.lastKey.end());
+		}
+		footer.indexOffset = m_offset;
+		footer.indexLength = index.size();
+		append(index.data(), (int64)index.size());
+		buildBloom();
+		footer.bloomOffset = m_offset;
+		footer.bloomLength = m_pTable->m_bloom.size();
+		append(m_pTable->m_bloom.data(), (int64)m_pTable->m_bloom.size());
+		footer.entryCount = m_pTable->m_entryCount;
+		footer.magic = LSM_TABLE_MAGIC;
+		append(&footer, sizeof(LsmTableFooter));
+		flushPending();
+		if(!m_isOk || m_pTable->m_index.empty()){
+			return LsmTablePtr();
+		}
+		m_pTable->flush();
+		m_pTable->m_largest = m_lastKey;
+		m_pTable->m_isObsolete = false;
+		return m_pTable;
+	}
+protected:
+	inline void finishBlock(void){
+		LsmBlockIndex block;
+		block.lastKey = m_lastKey;
+		block.offset = m_offset;
+		block.length = (uint32)m_block.size();
+		block.crc = (uint32)crc32(0L, (const Bytef*)m_block.data(), (uInt)m_block.size());
+		m_pTable->m_index.push_back(block);
+		append(m_block.data(), (int64)m_block.size());
+		m_block.clear();
+	}
+	inline void append(const void* ptr, int64 length){
+		m_pending.insert(m_pending.end(), (const char*)ptr, (const char*)ptr + length);
+		m_offset += length;
+		if((int64)m_pending.size() >= LSM_SCAN_READAHEAD){
+			flushPending();
+		}
+	}
+	inline void flushPending(void){
+		if(m_pending.empty() || !m_isOk){
+			return;
+		}
+		WriteSegmentVector segments;
+		segments.push_back(WriteSegment(m_pTable->m_fileLength, m_pending.data(), (int64)m_pending.size()));
+		if(!m_pTable->saveSegments(segments)){
+			m_isOk = false;
+		}
+		m_pending.clear();
+	}
+	inline void buildBloom(void){
+		uint64 bits = std::max((uint64)m_hashes.size() * LSM_BLOOM_BITS, (uint64)64);
+		uint64 bytes = (bits + 7) / 8;
+		bits = bytes * 8;
+		// k = bits/n * ln2
+		int hashCount = std::min(std::max((int)(LSM_BLOOM_BITS * 69 / 100), 1), 30);
+		std::string& bloom = m_pTable->m_bloom;
+		bloom.assign(bytes, 0);
+		for(size_t i=0; i<m_hashes.size(); ++i){
+			uint64 hash = m_hashes[i];
+			uint64 delta = (hash >> 33) | (hash << 31);
+			for(int j=0; j<hashCount; ++j){
+				uint64 bit = hash % bits;
+				bloom[bit / 8] |= (char)(1 << (bit % 8));
+				hash += delta;
+			}
+		}
+		bloom.push_back((char)hashCount);
+	}
+};
+
+// 有序遍历的数据来源：内存表、数据表或者一层的多个数据表
+class LsmIterator
+{
+public:
+	virtual ~LsmIterator(void){}
+	virtual bool valid(void) const = 0;
+	virtual const std::string& key(void) const = 0;
+	virtual const LsmValue& value(void) const = 0;
+	virtual void next(void) = 0;
+};
+
+class LsmRecordIterator : public LsmIterator
+{
+public:
+	LsmRecordVector m_records;
+	size_t m_position;
+public:
+	LsmRecordIterator(void) : m_position(0) {}
+	virtual bool valid(void) const { return m_position < m_records.size(); }
+	virtual const std::string& key(void) const { return m_records[m_position].first; }
+	virtual const LsmValue& value(void) const { return m_records[m_position].second; }
+	virtual void next(void){ ++m_position; }
+};
+
+// 遍历只读的内存表，内存表由共享指针保持
+class LsmMemIterator : public LsmIterator
+{
+public:
+	LsmMemTablePtr m_pMem;
+	LsmValueMap::const_iterator m_current;
+public:
+	LsmMemIterator(const LsmMemTablePtr& pMem, const std::string& start) : m_pMem(pMem) {
+		m_current = m_pMem->values.lower_bound(start);
+	}
+	virtual bool valid(void) const { return m_current != m_pMem->values.end(); }
+	virtual const std::string& key(void) const { return m_current->first; }
+	virtual const LsmValue& value(void) const { return m_current->second; }
+	virtual void next(void){ ++m_current; }
+};
+
+// 顺序遍历一层中按key排列、互不重叠的数据表；一次读取多个相邻的数据块
+class LsmLevelIterator : public LsmIterator
+{
+public:
+	LsmTableVector m_tables;
+	size_t m_tableIndex;
+	size_t m_blockIndex;				// 下一个要读取的数据块
+	CharVector m_buffer;
+	LsmRecordVector m_records;
+	size_t m_position;
+	bool m_isError;
+public:
+	LsmLevelIterator(const LsmTableVector& tables, const std::string& start) : m_tables(tables), m_tableIndex(0), m_blockIndex(0), m_position(0), m_isError(false) {
+		while(m_tableIndex < m_tables.size() && m_tables[m_tableIndex]->m_largest < start){
+			++m_tableIndex;
+		}
+		if(m_tableIndex < m_tables.size()){
+			m_blockIndex = m_tables[m_tableIndex]->findBlock(start);
+		}
+		loadRecords();
+		while(valid() && key() < start){
+			next();
+		}
+	}
+	virtual bool valid(void) const { return m_position < m_records.size(); }
+	virtual const std::string& key(void) const { return m_records[m_position].first; }
+	virtual const LsmValue& value(void) const { return m_records[m_position].second; }
+	virtual void next(void){
+		if(++m_position >= m_records.size()){
+			loadRecords();
+		}
+	}
+protected:
+	inline void loadRecords(void){
+		m_records.clear();
+		m_position = 0;
+		while(m_records.empty() && m_tableIndex < m_tables.size() && !m_isError){
+			LsmTable* pTable = m_tables[m_tableIndex].get();
+			if(m_blockIndex >= pTable->m_index.size()){
+				++m_tableIndex;
+				m_blockIndex = 0;
+				continue;
+			}
+			// 相邻的数据块合并成一次读取
+			size_t endBlock = m_blockIndex;
+			int64 offset = pTable->m_index[m_blockIndex].offset;
+			int64 length = 0;
+			while(endBlock < pTable->m_index.size() && (0 == length || length + pTable->m_index[endBlock].length <= LSM_SCAN_READAHEAD)){
+				length += pTable->m_index[endBlock].length;
+				++endBlock;
+			}
+			m_buffer.resize(length);
+			if(!pTable->readRange(offset, m_buffer.data(), length)){
+				m_isError = true;
+				break;
+			}
+			for(size_t b=m_blockIndex; b<endBlock; ++b){
+				const LsmBlockIndex& block = pTable->m_index[b];
+				const char* data = m_buffer.data() + (block.offset - offset);
+				if(block.crc != (uint32)crc32(0L, (const Bytef*)data, block.length)){
+					fprintf(stderr, "LsmLevelIterator crc error file=%s offset=%lld\n", pTable->m_fileName.c_str(), block.offset);
+					m_isError = true;
+					break;
+				}
+				int64 position = 0;
+				const char* key;
+				LsmRecordHeader header;
+				while(lsmDecodeRecord(data, block.length, position, key, header)){
+					m_records.push_back(std::make_pair(std::string(key, header.keyLength), LsmValue(key + header.keyLength, header.valueLength, header.expire, header.type)));
+				}
+			}
+			m_blockIndex = endBlock;
+		}
+	}
+};
+
+// 多路归并：相同的key只输出优先级最高（下标最小）来源的数据
+class LsmMergeIterator
+{
+public:
+	std::vector<LsmIterator*> m_children;
+	int m_current;
+public:
+	LsmMergeIterator(void) : m_current(-1) {}
+	virtual ~LsmMergeIterator(void){
+		for(size_t i=0; i<m_children.size(); ++i){
+			delete m_children[i];
+		}
+	}
+	inline void add(LsmIterator* pIterator){
+		m_children.push_back(pIterator);
+	}
+	inline void seekFirst(void){
+		findSmallest();
+	}
+	inline bool valid(void) const { return m_current >= 0; }
+	inline const std::string& key(void) const { return m_children[m_current]->key(); }
+	inline const LsmValue& value(void) const { return m_children[m_current]->value(); }
+	inline void next(void){
+		std::string current = key();
+		for(size_t i=0; i<m_children.size(); ++i){
+			LsmIterator* pChild = m_children[i];
+			if(pChild->valid() && pChild->key() == current){
+				pChild->next();
+			}
+		}
+		findSmallest();
+	}
+protected:
+	inline void findSmallest(void){
+		m_current = -1;
+		for(size_t i=0; i<m_children.size(); ++i){
+			LsmIterator* pChild = m_children[i];
+			if(pChild->valid() && (m_current < 0 || pChild->key() < m_children[m_current]->key())){
+				m_current = (int)i;
+			}
+		}
+	}
+};
+
+// 每层的数据表列表；修改时复制一份新的，读取和合并持有旧版本不受影响
+typedef struct LsmVersion{
+	LsmTableVector levels[LSM_MAX_LEVEL];		// 第0层按编号从新到旧排列，其它层按key排列
+	inline int64 getLevelSize(int level) const {
+		int64 size = 0;
+		for(size_t i=0; i<levels[level].size(); ++i){
+			size += levels[level][i]->getSize();
+		}
+		return size;
+	}
+}LsmVersion;
+typedef std::shared_ptr<LsmVersion> LsmVersionPtr;
+
+// LSM树存储引擎：写入先记录预写日志再放入内存表，内存表写满后由后台线程写成第0层的有序数据表，
+// 另一个后台线程按层合并数据表；key不需要全部常驻内存，内存中只有数据块索引和布隆过滤器
+template <uint64 _KEY_SLOT_NUMBER_>
+class Lsm
+{
+public:
+	std::string m_name;
+	LsmMemTablePtr m_pMem;					// 当前写入的内存表
+	LsmMemTablePtr m_pImmutable;			// 等待写入第0层的内存表
+	File* m_pLog;							// 当前内存表的预写日志
+	LsmVersionPtr m_pVersion;
+	uint32 m_nextId;						// 数据表和日志共用的编号
+	std::string m_compactPointer[LSM_MAX_LEVEL];	// 每层下一次合并开始的key，轮流合并整层
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::thread m_flushThread;
+	std::thread m_compactThread;
+	bool m_isRunning;
+	int64 m_memTableSize;
+	int64 m_tableSize;
+	ValueCache m_cache;						// 数据块缓存
+	std::mutex m_cacheMutex;
+public:
+	Lsm(const std::string& name) : m_name(name), m_pLog(NULL), m_nextId(1), m_isRunning(false),
+		m_memTableSize(LSM_MEMTABLE_SIZE), m_tableSize(LSM_TABLE_SIZE) {}
+	virtual ~Lsm(void){
+		closeDB();
+	}
+	// 设置内存表和数据表的长度，在openDB之前调用
+	inline void setTableSize(int64 memTableSize, int64 tableSize){
+		m_memTableSize = std::max(memTableSize, (int64)LSM_BLOCK_SIZE);
+		m_tableSize = std::max(tableSize, (int64)LSM_BLOCK_SIZE);
+	}
+	// 设置数据块缓存的内存上限，0表示关闭
+	inline void setCacheSize(int64 capacity){
+		std::lock_guard<std::mutex> lock(m_cacheMutex);
+		m_cache.setCapacity(capacity);
+	}
+	inline CacheStat getCacheStat(void){
+		std::lock_guard<std::mutex> lock(m_cacheMutex);
+		return m_cache.getStat();
+	}
+	// LSM模式不做value压缩，recordLength和codec参数忽略
+	inline int set(const char* key, int64 keyLen, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec = VALUE_CODEC_DEFAULT, uint32 expire = 0){
+		if(keyLen >= MAX_KEY_LENGTH){
+			return FERR_KEY_IS_TOO_LONG;
+		}
+		return put(makeKey(key, keyLen), value, valueLen, setNotExist, expire);
+	}
+	inline int set(uint64 key, const void* value, int64 valueLen, bool recordLength, bool setNotExist, int codec = VALUE_CODEC_DEFAULT, uint32 expire = 0){
+		return put(makeKey(key), value, valueLen, setNotExist, expire);
+	}
+	inline int get(const char* key, int64 keyLen, char* buffer, int64 bufferSize, int64* length){
+		return copyValue(makeKey(key, keyLen), buffer, bufferSize, length);
+	}
+	inline int get(uint64 key, char* buffer, int64 bufferSize, int64* length){
+		return copyValue(makeKey(key), buffer, bufferSize, length);
+	}
+	inline int getValue(const char* key, int64 keyLen, CharVector& value){
+		return getValue(makeKey(key, keyLen), value);
+	}
+	inline int getValue(uint64 key, CharVector& value){
+		return getValue(makeKey(key), value);
+	}
+	inline int del(const char* key, int64 keyLen){
+		return remove(makeKey(key, keyLen));
+	}
+	inline int del(uint64 key){
+		return remove(makeKey(key));
+	}
+	inline int replace(const char* key, uint64 length, const char* newKey, uint64 newLength){
+		if(newLength >= MAX_KEY_LENGTH){
+			return FERR_KEY_IS_TOO_LONG;
+		}
+		return rename(makeKey(key, length), makeKey(newKey, newLength));
+	}
+	inline int replace(uint64 key, uint64 newKey){
+		return rename(makeKey(key), makeKey(newKey));
+	}
+	// 批量写入：整批记录一次写入预写日志
+	inline int mset(const KeySetEntryVector& entries, bool setNotExist, int codec = VALUE_CODEC_DEFAULT){
+		LsmRecordVector records;
+		records.reserve(entries.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			const KeySetEntry& entry = entries[i];
+			if(entry.keyLen >= MAX_KEY_LENGTH){
+				return FERR_KEY_IS_TOO_LONG;
+			}
+			records.push_back(std::make_pair(makeKey(entry.key, entry.keyLen), LsmValue((const char*)entry.value, entry.valueLen, 0, LSM_PUT)));
+		}
+		return write(records, setNotExist);
+	}
+	inline int mset(const IndexSetEntryVector& entries, bool setNotExist, int codec = VALUE_CODEC_DEFAULT){
+		LsmRecordVector records;
+		records.reserve(entries.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			const IndexSetEntry& entry = entries[i];
+			records.push_back(std::make_pair(makeKey(entry.key), LsmValue((const char*)entry.value, entry.valueLen, 0, LSM_PUT)));
+		}
+		return write(records, setNotExist);
+	}
+	inline int mget(KeyGetEntryVector& entries){
+		for(size_t i=0; i<entries.size(); ++i){
+			KeyGetEntry& entry = entries[i];
+			entry.length = 0;
+			entry.result = copyValue(makeKey(entry.key, entry.keyLen), entry.buffer, entry.bufferSize, &(entry.length));
+		}
+		return FILE_OK;
+	}
+	inline int mget(IndexGetEntryVector& entries){
+		for(size_t i=0; i<entries.size(); ++i){
+			IndexGetEntry& entry = entries[i];
+			entry.length = 0;
+			entry.result = copyValue(makeKey(entry.key), entry.buffer, entry.bufferSize, &(entry.length));
+		}
+		return FILE_OK;
+	}
+	inline int setExpire(const char* key, int64 keyLen, uint32 expire){
+		return updateExpire(makeKey(key, keyLen), expire);
+	}
+	inline int setExpire(uint64 key, uint32 expire){
+		return updateExpire(makeKey(key), expire);
+	}
+	inline int getExpire(const char* key, int64 keyLen, uint32& expire){
+		LsmValue value;
+		int result = lookup(makeKey(key, keyLen), value);
+		expire = value.expire;
+		return result;
+	}
+	inline int getExpire(uint64 key, uint32& expire){
+		LsmValue value;
+		int result = lookup(makeKey(key), value);
+		expire = value.expire;
+		return result;
+	}
+	// key不常驻内存，过期的数据在读取时视为不存在，合并时丢弃；这里没有需要处理的工作
+	inline int64 expireCycle(int64 maxCount){
+		return 0;
+	}
+	// 范围查询[start, end)，end为空表示不限制；limit为0表示不限制数量
+	inline int scan(const char* start, int64 startLen, const char* end, int64 endLen, int64 limit, KeyScanVector& result){
+		LsmRecordVector records;
+		std::string endKey = (endLen > 0) ? makeKey(end, endLen) : std::string(1, 's' + 1);
+		int ret = scanRange(makeKey(start, startLen), endKey, limit, records);
+		for(size_t i=0; i<records.size(); ++i){
+			result.push_back(std::make_pair(records[i].first.substr(1), records[i].second.data));
+		}
+		return ret;
+	}
+	inline int scan(uint64 start, uint64 end, int64 limit, IndexScanVector& result){
+		LsmRecordVector records;
+		int ret = scanRange(makeKey(start), makeKey(end), limit, records);
+		for(size_t i=0; i<records.size(); ++i){
+			result.push_back(std::make_pair(getIndex(records[i].first), records[i].second.data));
+		}
+		return ret;
+	}
+	// 等待只读内存表写入和所有需要的合并完成
+	inline void waitCompact(void){
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(m_isRunning && (NULL != m_pImmutable || pickCompactLevel(*m_pVersion) >= 0)){
+			m_condition.wait_for(lock, std::chrono::milliseconds(10));
+		}
+	}
+	int openDB(void){
+		m_pVersion.reset(new LsmVersion());
+		uint32 logNumber = 0;
+		int result = loadManifest(logNumber);
+		if(FILE_OK != result){
+			return result;
+		}
+		// 删除没有记录在清单里的数据表（合并或者写入中途退出留下的）
+		std::vector<uint32> tables;
+		if(!listFileNumbers(m_name, LSM_TABLE_EXT, tables)){
+			return FERR_OPENRW_FAILED;
+		}
+		for(size_t i=0; i<tables.size(); ++i){
+			m_nextId = std::max(m_nextId, tables[i] + 1);
+			if(!isTableInVersion(*m_pVersion, tables[i])){
+				unlink((m_name + getNumberExt(tables[i], LSM_TABLE_EXT)).c_str());
+			}
+		}
+		// 重放没有写入数据表的预写日志
+		std::vector<uint32> logs;
+		if(!listFileNumbers(m_name, LSM_LOG_EXT, logs)){
+			return FERR_OPENRW_FAILED;
+		}
+		LsmMemTablePtr pMem(new LsmMemTable(0));
+		for(size_t i=0; i<logs.size(); ++i){
+			m_nextId = std::max(m_nextId, logs[i] + 1);
+			if(logs[i] >= logNumber){
+				replayLog(logs[i], *pMem);
+			}
+		}
+		if(!pMem->values.empty()){
+			LsmTablePtr pTable = writeMemTable(pMem);
+			if(!pTable){
+				return FERR_BLOCK_SET_FAILED;
+			}
+			m_pVersion->levels[0].insert(m_pVersion->levels[0].begin(), pTable);
+		}
+		if(!newLog()){
+			return FERR_OPENRW_FAILED;
+		}
+		if(!saveManifest(*m_pVersion)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		for(size_t i=0; i<logs.size(); ++i){
+			unlink((m_name + getNumberExt(logs[i], LSM_LOG_EXT)).c_str());
+		}
+		m_isRunning = true;
+		m_flushThread = std::thread(&Lsm::flushLoop, this);
+		m_compactThread = std::thread(&Lsm::compactLoop, this);
+		return FILE_OK;
+	}
+	void closeDB(void){
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_isRunning = false;
+		}
+		m_condition.notify_all();
+		if(m_flushThread.joinable()){
+			m_flushThread.join();
+		}
+		if(m_compactThread.joinable()){
+			m_compactThread.join();
+		}
+		// 内存表中的数据保存在预写日志中，下次打开时重放
+		if(NULL != m_pLog){
+			m_pLog->flush();
+			delete m_pLog;
+			m_pLog = NULL;
+		}
+		m_pMem.reset();
+		m_pImmutable.reset();
+		m_pVersion.reset();
+	}
+protected:
+	// 字符串key和数字key放在同一个有序空间：前缀's'加字符串，前缀'i'加大端的数字，保证数字按大小排列
+	inline std::string makeKey(const char* key, int64 keyLen){
+		std::string result(1, 's');
+		result.append(key, keyLen);
+		return result;
+	}
+	inline std::string makeKey(uint64 key){
+		std::string result(9, 'i');
+		for(int i=0; i<8; ++i){
+			result[8 - i] = (char)((key >> (i * 8)) & 0xFF);
+		}
+		return result;
+	}
+	inline uint64 getIndex(const std::string& key){
+		uint64 result = 0;
+		for(int i=1; i<9 && i<(int)key.size(); ++i){
+			result = (result << 8) | (uint8)key[i];
+		}
+		return result;
+	}
+	inline int put(const std::string& key, const void* value, int64 valueLen, bool setNotExist, uint32 expire){
+		LsmRecordVector records;
+		records.push_back(std::make_pair(key, LsmValue((const char*)value, valueLen, expire, LSM_PUT)));
+		return write(records, setNotExist);
+	}
+	inline int remove(const std::string& key){
+		LsmValue value;
+		int result = lookup(key, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		LsmRecordVector records;
+		records.push_back(std::make_pair(key, LsmValue()));
+		return write(records, false);
+	}
+	inline int rename(const std::string& key, const std::string& newKey){
+		LsmValue value;
+		int result = lookup(key, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		LsmValue exist;
+		if(FILE_OK == lookup(newKey, exist)){
+			return FERR_KEY_ALREADY_EXIST;
+		}
+		LsmRecordVector records;
+		records.push_back(std::make_pair(newKey, value));
+		records.push_back(std::make_pair(key, LsmValue()));
+		return write(records, false);
+	}
+	inline int updateExpire(const std::string& key, uint32 expire){
+		LsmValue value;
+		int result = lookup(key, value);
+		if(FILE_OK != result){
+			return result;
+		}
+		if(value.expire == expire){
+			return FILE_OK;
+		}
+		value.expire = expire;
+		LsmRecordVector records;
+		records.push_back(std::make_pair(key, value));
+		return write(records, false);
+	}
+	// 写入一批记录：先追加到预写日志，再放入内存表；内存表写满时切换，后台线程来不及写入时等待
+	inline int write(const LsmRecordVector& records, bool setNotExist){
+		if(setNotExist){
+			for(size_t i=0; i<records.size(); ++i){
+				LsmValue value;
+				if(FILE_OK == lookup(records[i].first, value)){
+					return FERR_KEY_ALREADY_EXIST;
+				}
+			}
+		}
+		CharVector buffer;
+		for(size_t i=0; i<records.size(); ++i){
+			lsmEncodeRecord(buffer, records[i].first, records[i].second);
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if(!makeRoom(lock)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		// 日志记录：crc + 长度 + 整批记录，重放时整批生效或者整批丢弃
+		uint32 header[2];
+		header[0] = (uint32)crc32(0L, (const Bytef*)buffer.data(), (uInt)buffer.size());
+		header[1] = (uint32)buffer.size();
+		WriteSegmentVector segments;
+		segments.push_back(WriteSegment(m_pLog->m_fileLength, header, sizeof(header)));
+		segments.push_back(WriteSegment(m_pLog->m_fileLength + sizeof(header), buffer.data(), (int64)buffer.size()));
+		if(!m_pLog->saveSegments(segments)){
+			return FERR_BLOCK_SET_FAILED;
+		}
+		for(size_t i=0; i<records.size(); ++i){
+			m_pMem->put(records[i].first, records[i].second);
+		}
+		return FILE_OK;
+	}
+	inline bool makeRoom(std::unique_lock<std::mutex>& lock){
+		while(m_isRunning){
+			if(m_pMem->size < m_memTableSize){
+				return true;
+			}
+			// 上一个内存表还没有写完，或者第0层太多，等待后台线程
+			if(NULL != m_pImmutable || (int)m_pVersion->levels[0].size() >= LSM_L0_STOP_WRITES){
+				m_condition.wait(lock);
+				continue;
+			}
+			m_pImmutable = m_pMem;
+			if(!newLog()){
+				return false;
+			}
+			m_condition.notify_all();
+		}
+		return false;
+	}
+	// 创建新的预写日志和对应的内存表
+	inline bool newLog(void){
+		uint32 id = m_nextId++;
+		File* pLog = new File(m_name, getNumberExt(id, LSM_LOG_EXT));
+		if(FILE_OK != pLog->touchFile(NULL, 0) || !pLog->openReadWrite("rb+")){
+			delete pLog;
+			return false;
+		}
+		if(NULL != m_pLog){
+			m_pLog->flush();
+			delete m_pLog;
+		}
+		m_pLog = pLog;
+		m_pMem.reset(new LsmMemTable(id));
+		return true;
+	}
+	inline void replayLog(uint32 id, LsmMemTable& mem){
+		File log(m_name, getNumberExt(id, LSM_LOG_EXT));
+		if(FILE_OK != log.touchFile(NULL, 0) || !log.openReadWrite("rb+")){
+			return;
+		}
+		CharVector data(log.m_fileLength);
+		if(log.m_fileLength != log.seekRead(data.data(), 1, log.m_fileLength, 0, SEEK_SET)){
+			return;
+		}
+		int64 position = 0;
+		int64 length = (int64)data.size();
+		while(position + 8 <= length){
+			uint32 header[2];
+			memcpy(header, data.data() + position, sizeof(header));
+			if(position + 8 + header[1] > length || header[0] != (uint32)crc32(0L, (const Bytef*)data.data() + position + 8, header[1])){
+				fprintf(stderr, "Lsm::replayLog file=%s broken at offset=%lld\n", log.m_fileName.c_str(), position);
+				break;
+			}
+			const char* batch = data.data() + position + 8;
+			int64 batchPosition = 0;
+			const char* key;
+			LsmRecordHeader record;
+			while(lsmDecodeRecord(batch, header[1], batchPosition, key, record)){
+				mem.put(std::string(key, record.keyLength), LsmValue(key + record.keyLength, record.valueLength, record.expire, record.type));
+			}
+			position += 8 + header[1];
+		}
+	}
+	// 查找key的最新数据：内存表 -> 只读内存表 -> 第0层从新到旧 -> 其它层
+	inline int lookup(const std::string& key, LsmValue& value){
+		LsmVersionPtr pVersion;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(NULL == m_pVersion){
+				return FERR_KEY_NOT_FOUND;
+			}
+			if(findMem(m_pMem, key, value) || findMem(m_pImmutable, key, value)){
+				return value.isLive(getTimeSecond()) ? FILE_OK : FERR_KEY_NOT_FOUND;
+			}
+			pVersion = m_pVersion;
+		}
+		for(int level=0; level<LSM_MAX_LEVEL; ++level){
+			const LsmTableVector& tables = pVersion->levels[level];
+			if(0 == level){
+				for(size_t i=0; i<tables.size(); ++i){
+					int result = findTable(tables[i].get(), key, value);
+					if(FERR_KEY_NOT_FOUND != result){
+						return (FILE_OK == result && !value.isLive(getTimeSecond())) ? FERR_KEY_NOT_FOUND : result;
+					}
+				}
+				continue;
+			}
+			size_t index = findLevelTable(tables, key);
+			if(index < tables.size()){
+				int result = findTable(tables[index].get(), key, value);
+				if(FERR_KEY_NOT_FOUND != result){
+					return (FILE_OK == result && !value.isLive(getTimeSecond())) ? FERR_KEY_NOT_FOUND : result;
+				}
+			}
+		}
+		return FERR_KEY_NOT_FOUND;
+	}
+	inline int getValue(const std::string& key, CharVector& value){
+		LsmValue record;
+		int result = lookup(key, record);
+		if(FILE_OK == result){
+			value.assign(record.data.begin(), record.data.end());
+		}
+		return result;
+	}
+	inline int copyValue(const std::string& key, char* buffer, int64 bufferSize, int64* length){
+		LsmValue record;
+		int result = lookup(key, record);
+		if(FILE_OK != result){
+			return result;
+		}
+		*length = (int64)record.data.size();
+		if(*length > bufferSize){
+			return FERR_BUFFER_TOO_SMALL;
+		}
+		memcpy(buffer, record.data.data(), record.data.size());
+		return FILE_OK;
+	}
+	inline bool findMem(const LsmMemTablePtr& pMem, const std::string& key, LsmValue& value){
+		if(NULL == pMem){
+			return false;
+		}
+		LsmValueMap::const_iterator itCur = pMem->values.find(key);
+		if(itCur == pMem->values.end()){
+			return false;
+		}
+		value = itCur->second;
+		return true;
+	}
+	// 找到删除标记也返回FILE_OK，由调用者判断；FERR_KEY_NOT_FOUND表示需要继续查找下一层
+	inline int findTable(LsmTable* pTable, const std::string& key, LsmValue& value){
+		if(key < pTable->m_smallest || pTable->m_largest < key || !pTable->mayContain(key)){
+			return FERR_KEY_NOT_FOUND;
+		}
+		size_t blockIndex = pTable->findBlock(key);
+		if(blockIndex >= pTable->m_index.size()){
+			return FERR_KEY_NOT_FOUND;
+		}
+		CharVector block;
+		uint64 cacheKey = ((uint64)pTable->m_id << 32) | (uint64)blockIndex;
+		bool isCached;
+		{
+			std::lock_guard<std::mutex> lock(m_cacheMutex);
+			isCached = m_cache.get(cacheKey, block);
+		}
+		if(!isCached){
+			if(!pTable->readBlock(blockIndex, block)){
+				return FERR_BLOCK_READ_FAIL;
+			}
+			std::lock_guard<std::mutex> lock(m_cacheMutex);
+			m_cache.put(cacheKey, block.data(), (int64)block.size());
+		}
+		int64 position = 0;
+		const char* recordKey;
+		LsmRecordHeader header;
+		while(lsmDecodeRecord(block.data(), (int64)block.size(), position, recordKey, header)){
+			int cmp = compareKey(recordKey, header.keyLength, key);
+			if(0 == cmp){
+				value = LsmValue(recordKey + header.keyLength, header.valueLength, header.expire, header.type);
+				return FILE_OK;
+			}
+			if(cmp > 0){
+				break;
+			}
+		}
+		return FERR_KEY_NOT_FOUND;
+	}
+	// 有序层中第一个largest不小于key的数据表
+	inline size_t findLevelTable(const LsmTableVector& tables, const std::string& key){
+		size_t low = 0;
+		size_t high = tables.size();
+		while(low < high){
+			size_t mid = (low + high) / 2;
+			if(tables[mid]->m_largest < key){
+				low = mid + 1;
+			}else{
+				high = mid;
+			}
+		}
+		return low;
+	}
+	// 内存表中的数据复制出来（写入的内存表会被修改）；复制到limit个有效数据为止，之后的数据不会出现在结果里
+	inline int scanRange(const std::string& start, const std::string& end, int64 limit, LsmRecordVector& result){
+		LsmMergeIterator merge;
+		uint32 now = getTimeSecond();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(NULL == m_pVersion){
+				return FERR_KEY_NOT_FOUND;
+			}
+			LsmRecordIterator* pMem = new LsmRecordIterator();
+			int64 liveCount = 0;
+			for(LsmValueMap::const_iterator it = m_pMem->values.lower_bound(start); it != m_pMem->values.end() && it->first < end; ++it){
+				pMem->m_records.push_back(*it);
+				if(LSM_PUT == it->second.type && limit > 0 && ++liveCount >= limit){
+					break;
+				}
+			}
+			merge.add(pMem);
+			if(NULL != m_pImmutable){
+				merge.add(new LsmMemIterator(m_pImmutable, start));
+			}
+			LsmVersionPtr pVersion = m_pVersion;
+			for(size_t i=0; i<pVersion->levels[0].size(); ++i){
+				merge.add(new LsmLevelIterator(LsmTableVector(1, pVersion->levels[0][i]), start));
+			}
+			for(int level=1; level<LSM_MAX_LEVEL; ++level){
+				if(!pVersion->levels[level].empty()){
+					merge.add(new LsmLevelIterator(pVersion->levels[level], start));
+				}
+			}
+		}
+		for(merge.seekFirst(); merge.valid() && merge.key() < end; merge.next()){
+			if(merge.value().isLive(now)){
+				result.push_back(std::make_pair(merge.key(), merge.value()));
+				if(limit > 0 && (int64)result.size() >= limit){
+					break;
+				}
+			}
+		}
+		return FILE_OK;
+	}
+	inline LsmTablePtr writeMemTable(const LsmMemTablePtr& pMem){
+		uint32 id;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			id = m_nextId++;
+		}
+		LsmTableBuilder builder(m_name, id);
+		for(LsmValueMap::const_iterator it = pMem->values.begin(); it != pMem->values.end(); ++it){
+			builder.add(it->first, it->second);
+		}
+		return builder.finish();
+	}
+	void flushLoop(void){
+		while(true){
+			LsmMemTablePtr pImmutable;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				while(m_isRunning && NULL == m_pImmutable){
+					m_condition.wait(lock);
+				}
+				if(!m_isRunning){
+					return;
+				}
+				pImmutable = m_pImmutable;
+			}
+			LsmTablePtr pTable = writeMemTable(pImmutable);
+			if(!pTable){
+				fprintf(stderr, "Lsm::flushLoop write level 0 table failed\n");
+				std::this_thread::sleep_for(std::chrono::milliseconds(LSM_COMPACT_INTERVAL));
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			LsmVersionPtr pVersion(new LsmVersion(*m_pVersion));
+			pVersion->levels[0].insert(pVersion->levels[0].begin(), pTable);
+			m_pImmutable.reset();
+			installVersion(pVersion);
+			unlink((m_name + getNumberExt(pImmutable->logId, LSM_LOG_EXT)).c_str());
+			m_condition.notify_all();
+		}
+	}
+	// 需要合并的层：第0层按数据表数量，其它层按容量比例选分数最高的；不需要返回-1
+	inline int pickCompactLevel(const LsmVersion& version){
+		if((int)version.levels[0].size() >= LSM_L0_COMPACT_TRIGGER){
+			return 0;
+		}
+		int bestLevel = -1;
+		double bestScore = 1.0;
+		int64 maxSize = m_tableSize * LSM_LEVEL1_TABLES;
+		for(int level=1; level<LSM_MAX_LEVEL - 1; ++level){
+			double score = (double)version.getLevelSize(level) / (double)maxSize;
+			if(score >= bestScore){
+				bestScore = score;
+				bestLevel = level;
+			}
+			maxSize *= LSM_LEVEL_MULTIPLIER;
+		}
+		return bestLevel;
+	}
+	void compactLoop(void){
+		while(true){
+			LsmVersionPtr pVersion;
+			int level;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_condition.wait_for(lock, std::chrono::milliseconds(LSM_COMPACT_INTERVAL));
+				if(!m_isRunning){
+					return;
+				}
+				pVersion = m_pVersion;
+				level = pickCompactLevel(*pVersion);
+			}
+			while(level >= 0 && compactLevel(pVersion, level)){
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if(!m_isRunning){
+					return;
+				}
+				pVersion = m_pVersion;
+				level = pickCompactLevel(*pVersion);
+			}
+		}
+	}
+	// 合并level层的输入和level+1层重叠的数据表，输出到level+1层；输出层以下没有数据时丢弃删除标记和过期数据
+	inline bool compactLevel(const LsmVersionPtr& pVersion, int level){
+		LsmTableVector inputs;
+		if(0 == level){
+			inputs = pVersion->levels[0];
+		}else{
+			const LsmTableVector& tables = pVersion->levels[level];
+			size_t index = 0;
+			while(index < tables.size() && tables[index]->m_largest <= m_compactPointer[level]){
+				++index;
+			}
+			if(index >= tables.size()){
+				index = 0;
+			}
+			inputs.push_back(tables[index]);
+		}
+		std::string smallest = inputs[0]->m_smallest;
+		std::string largest = inputs[0]->m_largest;
+		for(size_t i=1; i<inputs.size(); ++i){
+			smallest = std::min(smallest, inputs[i]->m_smallest);
+			largest = std::max(largest, inputs[i]->m_largest);
+		}
+		LsmTableVector overlaps;
+		const LsmTableVector& nextTables = pVersion->levels[level + 1];
+		for(size_t i=0; i<nextTables.size(); ++i){
+			if(nextTables[i]->isOverlap(smallest, largest)){
+				overlaps.push_back(nextTables[i]);
+			}
+		}
+		bool isBottom = true;
+		for(int deeper=level + 2; deeper<LSM_MAX_LEVEL; ++deeper){
+			if(!pVersion->levels[deeper].empty()){
+				isBottom = false;
+				break;
+			}
+		}
+		LsmMergeIterator merge;
+		for(size_t i=0; i<inputs.size(); ++i){
+			merge.add(new LsmLevelIterator(LsmTableVector(1, inputs[i]), std::string()));
+		}
+		merge.add(new LsmLevelIterator(overlaps, std::string()));
+		LsmTableVector outputs;
+		LsmTableBuilder* pBuilder = NULL;
+		uint32 now = getTimeSecond();
+		bool isOk = true;
+		for(merge.seekFirst(); merge.valid(); merge.next()){
+			const LsmValue& value = merge.value();
+			if(!value.isLive(now)){
+				if(isBottom){
+					continue;
+				}
+				// 过期的数据改成删除标记，继续覆盖更深层的旧数据
+				if(LSM_PUT == value.type){
+					if(NULL == pBuilder){
+						pBuilder = newBuilder();
+					}
+					pBuilder->add(merge.key(), LsmValue());
+					continue;
+				}
+			}
+			if(NULL == pBuilder){
+				pBuilder = newBuilder();
+			}
+			pBuilder->add(merge.key(), value);
+			if(pBuilder->getSize() >= m_tableSize){
+				isOk = finishBuilder(pBuilder, outputs) && isOk;
+				pBuilder = NULL;
+				if(!m_isRunning){
+					isOk = false;
+					break;
+				}
+			}
+		}
+		if(NULL != pBuilder){
+			isOk = finishBuilder(pBuilder, outputs) && isOk;
+		}
+		if(!isOk){
+			for(size_t i=0; i<outputs.size(); ++i){
+				outputs[i]->m_isObsolete = true;
+			}
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		LsmVersionPtr pNewVersion(new LsmVersion(*m_pVersion));
+		removeTables(pNewVersion->levels[level], inputs);
+		removeTables(pNewVersion->levels[level + 1], overlaps);
+		LsmTableVector& target = pNewVersion->levels[level + 1];
+		target.insert(target.end(), outputs.begin(), outputs.end());
+		std::sort(target.begin(), target.end(), compareTableKey);
+		if(level > 0){
+			m_compactPointer[level] = largest;
+		}
+		installVersion(pNewVersion);
+		for(size_t i=0; i<inputs.size(); ++i){
+			inputs[i]->m_isObsolete = true;
+		}
+		for(size_t i=0; i<overlaps.size(); ++i){
+			overlaps[i]->m_isObsolete = true;
+		}
+		m_condition.notify_all();
+		return true;
+	}
+	inline LsmTableBuilder* newBuilder(void){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return new LsmTableBuilder(m_name, m_nextId++);
+	}
+	inline bool finishBuilder(LsmTableBuilder* pBuilder, LsmTableVector& outputs){
+		LsmTablePtr pTable = pBuilder->finish();
+		delete pBuilder;
+		if(!pTable){
+			return false;
+		}
+		outputs.push_back(pTable);
+		return true;
+	}
+	static bool isTableInVersion(const LsmVersion& version, uint32 id){
+		for(int level=0; level<LSM_MAX_LEVEL; ++level){
+			for(size_t i=0; i<version.levels[level].size(); ++i){
+				if(version.levels[level][i]->m_id == id){
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+	static bool compareTableKey(const LsmTablePtr& a, const LsmTablePtr& b){
+		return (a->m_smallest < b->m_smallest);
+	}
+	inline void removeTables(LsmTableVector& tables, const LsmTableVector& removes){
+		for(size_t i=0; i<removes.size(); ++i){
+			tables.erase(std::remove(tables.begin(), tables.end(), removes[i]), tables.end());
+		}
+	}
+	// 保存新版本：先写清单文件再切换，清单文件通过改名原子替换
+	inline void installVersion(const LsmVersionPtr& pVersion){
+		if(!saveManifest(*pVersion)){
+			fprintf(stderr, "Lsm::installVersion save manifest failed\n");
+		}
+		m_pVersion = pVersion;
+	}
+	// 清单文件：下一个编号、需要重放的最小日志编号、每层的数据表编号
+	inline bool saveManifest(const LsmVersion& version){
+		std::string fileName = m_name + LSM_MANIFEST_EXT;
+		std::string tempName = fileName + ".tmp";
+		FILE* pFile = fopen(tempName.c_str(), "wb");
+		if(NULL == pFile){
+			return false;
+		}
+		fprintf(pFile, "next %u\nlog %u\n", m_nextId, (NULL != m_pImmutable) ? m_pImmutable->logId : m_pMem->logId);
+		for(int level=0; level<LSM_MAX_LEVEL; ++level){
+			for(size_t i=0; i<version.levels[level].size(); ++i){
+				fprintf(pFile, "table %d %u\n", level, version.levels[level][i]->m_id);
+			}
+		}
+		bool isOk = (0 == fflush(pFile));
+		fclose(pFile);
+		return isOk && (0 == ::rename(tempName.c_str(), fileName.c_str()));
+	}
+	inline int loadManifest(uint32& logNumber){
+		FILE* pFile = fopen((m_name + LSM_MANIFEST_EXT).c_str(), "rb");
+		if(NULL == pFile){
+			return FILE_OK;
+		}
+		char type[16];
+		int result = FILE_OK;
+		while(1 == fscanf(pFile, "%15s", type)){
+			if(0 == strcmp(type, "next")){
+				if(1 != fscanf(pFile, "%u", &m_nextId)){
+					break;
+				}
+			}else if(0 == strcmp(type, "log")){
+				if(1 != fscanf(pFile, "%u", &logNumber)){
+					break;
+				}
+			}else if(0 == strcmp(type, "table")){
+				int level;
+				uint32 id;
+				if(2 != fscanf(pFile, "%d %u", &level, &id) || level < 0 || level >= LSM_MAX_LEVEL){
+					result = FERR_INVALID_FILE;
+					break;
+				}
+				LsmTablePtr pTable(new LsmTable(m_name, id));
+				result = pTable->openTable();
+				if(FILE_OK != result){
+					break;
+				}
+				m_pVersion->levels[level].push_back(pTable);
+			}
+		}
+		fclose(pFile);
+		return result;
+	}
+};
+
+NS_HIVE_END
+
+#endif /* lsm_hpp */
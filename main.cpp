@@ -6,80 +6,457 @@
 //  Copyright © 2017年 AppleTree. All rights reserved.
 //
 
-#include <iostream>
-#include <chrono>
+// YCSB风格的压力测试：先导入recordcount条数据，再依次执行选定的负载，
+// 每种操作的延迟记录在直方图中，输出p50/p99/p99.9/max；-o json/csv输出便于不同版本之间对比
+
 #include <thread>
-#include <time.h>
+#include <atomic>
+#include <random>
+#include <cmath>
+#include <unistd.h>
 #include "alphakv.hpp"
+#include "histogram.hpp"
 USING_NS_HIVE;
 
-inline int64 get_time_us(void){
-	std::chrono::time_point<std::chrono::system_clock> p = std::chrono::system_clock::now();
-	return (int64)std::chrono::duration_cast<std::chrono::microseconds>(p.time_since_epoch()).count();
-}
-inline int64 get_time_ms(void){
-	std::chrono::time_point<std::chrono::system_clock> p = std::chrono::system_clock::now();
-	return (int64)std::chrono::duration_cast<std::chrono::milliseconds>(p.time_since_epoch()).count();
+typedef KeyValue<ALPHAKV_HASH_SLOT> BenchDB;
+
+#define BENCH_KEY_MIN_LENGTH 20			// key为"user"加16位十六进制的哈希，更长的部分用'x'补齐
+
+enum BenchOp{
+	BENCH_READ = 0,
+	BENCH_UPDATE,
+	BENCH_INSERT,
+	BENCH_SCAN,
+	BENCH_RMW,					// 读取后写回
+	BENCH_DELETE,
+	BENCH_OP_COUNT,
+};
+static const char* BENCH_OP_NAMES[BENCH_OP_COUNT] = {"read", "update", "insert", "scan", "rmw", "delete"};
+
+enum BenchDistribution{
+	BENCH_ZIPFIAN = 0,			// 热点分散到整个key空间的zipf分布
+	BENCH_UNIFORM,
+	BENCH_LATEST,				// 越新插入的key越热
+};
+
+// 负载：各种操作的比例和选择key的分布
+typedef struct BenchWorkload{
+	const char* name;
+	double ratios[BENCH_OP_COUNT];
+	int distribution;
+	bool isLargeValue;			// 写入使用-l指定的大value
+}BenchWorkload;
+
+// all按这个顺序执行：YCSB建议的A、B、C、F、D、E，之后是会改变数据量的负载
+static const BenchWorkload BENCH_WORKLOADS[] = {
+	{"a",      {0.5,  0.5,  0,    0,    0,   0  }, BENCH_ZIPFIAN, false},
+	{"b",      {0.95, 0.05, 0,    0,    0,   0  }, BENCH_ZIPFIAN, false},
+	{"c",      {1.0,  0,    0,    0,    0,   0  }, BENCH_ZIPFIAN, false},
+	{"f",      {0.5,  0,    0,    0,    0.5, 0  }, BENCH_ZIPFIAN, false},
+	{"d",      {0.95, 0,    0.05, 0,    0,   0  }, BENCH_LATEST,  false},
+	{"e",      {0,    0,    0.05, 0.95, 0,   0  }, BENCH_ZIPFIAN, false},
+	{"large",  {0.5,  0.5,  0,    0,    0,   0  }, BENCH_ZIPFIAN, true },
+	{"ingest", {0,    0,    1.0,  0,    0,   0  }, BENCH_UNIFORM, false},
+	{"delete", {0.2,  0,    0.3,  0,    0,   0.5}, BENCH_UNIFORM, false},
+};
+static const BenchWorkload BENCH_LOAD = {"load", {0, 0, 1.0, 0, 0, 0}, BENCH_UNIFORM, false};
+
+// 长度范围，"100"或者"64-1024"，在范围内均匀分布
+typedef struct SizeRange{
+	uint32 low;
+	uint32 high;
+	SizeRange(uint32 l, uint32 h) : low(l), high(h){}
+	inline uint32 pick(uint64 random) const {
+		return low + (uint32)(random % (uint64)(high - low + 1));
+	}
+	inline bool parse(const char* text){
+		unsigned int l = 0, h = 0;
+		int n = sscanf(text, "%u-%u", &l, &h);
+		if(n < 1){
+			return false;
+		}
+		low = l;
+		high = (n < 2) ? l : h;
+		return (low > 0 && low <= high);
+	}
+}SizeRange;
+
+typedef struct BenchConfig{
+	std::string name;
+	std::string workloads;
+	std::string format;
+	std::string label;
+	uint64 recordCount;
+	uint64 operationCount;
+	uint32 threadCount;
+	uint32 scanLength;
+	double theta;
+	uint64 seed;
+	bool isStatsEnabled;
+	bool isStatsPrinted;
+	SizeRange keySize;
+	SizeRange valueSize;
+	SizeRange largeSize;
+	BenchConfig(void) : name("benchdb"), workloads("all"), format("text"), recordCount(100000), operationCount(100000), threadCount(1),
+		scanLength(100), theta(0.99), seed(1), isStatsEnabled(true), isStatsPrinted(false), keySize(BENCH_KEY_MIN_LENGTH, BENCH_KEY_MIN_LENGTH), valueSize(100, 100), largeSize(65536, 262144){}
+}BenchConfig;
+
+inline uint64 fnvHash64(uint64 value){
+	uint64 hash = 0xCBF29CE484222325ULL;
+	for(int i=0; i<8; ++i){
+		hash ^= (value & 0xFF);
+		value >>= 8;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
-int main(int argc, const char * argv[]) {
-	// insert code here...
-	std::cout << "Hello, World!\n";
-	
-	AlphaKV* pKey = new AlphaKV();
-	int64 openT = get_time_us();
-	bool result = pKey->openDB("mydb");
-	int64 openE = get_time_us();
-	fprintf(stderr, "open key cost time us = %lld\n", openE-openT);
-	if(true == result){
-		CharVector value;
-		int64 s = get_time_us();
-		fprintf(stderr, "s=%lld\n", s);
-		int64 getFailedCount = 0;
-		int64 setFailedCount = 0;
-		char key[32] = {0};
-		for(int64 i=100000;i>=0;--i){
-			sprintf(key, "%08lld", i);
-			result = pKey->set(key, 8, (char*)&i, sizeof(int64));
-			if(false == result){
-				++setFailedCount;
+// zipf分布的随机数（Gray等人的算法，与YCSB相同），返回[0, items)，0最热
+class ZipfGenerator
+{
+public:
+	uint64 m_items;
+	double m_theta;
+	double m_zetan;
+	double m_alpha;
+	double m_eta;
+	double m_second;			// 1 + 0.5^theta
+public:
+	ZipfGenerator(uint64 items, double theta) : m_items(std::max(items, (uint64)2)), m_theta(theta){
+		m_zetan = 0;
+		for(uint64 i=1; i<=m_items; ++i){
+			m_zetan += 1.0 / std::pow((double)i, m_theta);
+		}
+		double zeta2 = 1.0 + 1.0 / std::pow(2.0, m_theta);
+		m_alpha = 1.0 / (1.0 - m_theta);
+		m_eta = (1.0 - std::pow(2.0 / (double)m_items, 1.0 - m_theta)) / (1.0 - zeta2 / m_zetan);
+		m_second = 1.0 + std::pow(0.5, m_theta);
+	}
+	inline uint64 next(std::mt19937_64& random) const {
+		double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+		double uz = u * m_zetan;
+		if(uz < 1.0){
+			return 0;
+		}
+		if(uz < m_second){
+			return 1;
+		}
+		return std::min((uint64)((double)m_items * std::pow(m_eta * u - m_eta + 1.0, m_alpha)), m_items - 1);
+	}
+};
+
+// 每个线程的状态，结束后合并
+typedef struct BenchThread{
+	std::mt19937_64 random;
+	LatencyHistogram histograms[BENCH_OP_COUNT];
+	uint64 errors[BENCH_OP_COUNT];
+	uint64 notFounds[BENCH_OP_COUNT];
+	std::string key;
+	std::vector<std::string> keys;
+	KeyGetEntryVector entries;
+	CharVector value;
+	CharVector data;				// 写入的内容，取前面需要的长度
+	CharVector scanBuffer;
+	BenchThread(uint64 seed) : random(seed){
+		memset(errors, 0, sizeof(errors));
+		memset(notFounds, 0, sizeof(notFounds));
+	}
+}BenchThread;
+
+class Benchmark
+{
+public:
+	BenchConfig m_config;
+	BenchDB* m_pDB;
+	ZipfGenerator* m_pZipf;
+	std::atomic<uint64> m_insertCount;		// 已经分配的key编号，读取在[0, m_insertCount)中选择
+	bool m_isHeaderPrinted;
+public:
+	Benchmark(const BenchConfig& config) : m_config(config), m_pDB(NULL), m_pZipf(NULL), m_insertCount(0), m_isHeaderPrinted(false){}
+	virtual ~Benchmark(void){
+		if(NULL != m_pDB){
+			m_pDB->closeDB();
+			delete m_pDB;
+		}
+		delete m_pZipf;
+	}
+	bool open(void){
+		// 每次从空的数据库开始
+		const char* exts[] = {".k", ".i", ".v", ".d"};
+		for(size_t i=0; i<sizeof(exts)/sizeof(exts[0]); ++i){
+			unlink((m_config.name + exts[i]).c_str());
+		}
+		m_pDB = new BenchDB(m_config.name);
+		if(FILE_OK != m_pDB->openDB()){
+			fprintf(stderr, "open db failed name=%s\n", m_config.name.c_str());
+			return false;
+		}
+		m_pDB->setThreadSafe(m_config.threadCount > 1);
+		m_pDB->setStatsEnabled(m_config.isStatsEnabled);
+		if(m_config.theta > 0){
+			m_pZipf = new ZipfGenerator(m_config.recordCount, m_config.theta);
+		}
+		return true;
+	}
+	void runAll(void){
+		run(BENCH_LOAD, m_config.recordCount);
+		for(size_t i=0; i<sizeof(BENCH_WORKLOADS)/sizeof(BENCH_WORKLOADS[0]); ++i){
+			if(isSelected(BENCH_WORKLOADS[i].name)){
+				run(BENCH_WORKLOADS[i], m_config.operationCount);
 			}
-			uint32 length;
-			char* ptr = pKey->get(key, 8, &length);
-			if(NULL == ptr){
-				++getFailedCount;
+		}
+		if(m_config.isStatsPrinted){
+			std::string text;
+			m_pDB->dumpStats(text);
+			fprintf(stderr, "%s", text.c_str());
+		}
+	}
+protected:
+	inline bool isSelected(const char* name) const {
+		if("all" == m_config.workloads){
+			return true;
+		}
+		std::string list = "," + m_config.workloads + ",";
+		return (std::string::npos != list.find(std::string(",") + name + ","));
+	}
+	// 执行一个负载：操作平均分给每个线程，吞吐量按所有线程的总时间计算
+	void run(const BenchWorkload& workload, uint64 operationCount){
+		std::vector<BenchThread*> threads;
+		std::vector<std::thread> runners;
+		uint64 seed = m_config.seed * 1000003ULL + (uint64)std::hash<std::string>()(workload.name);
+		for(uint32 i=0; i<m_config.threadCount; ++i){
+			threads.push_back(new BenchThread(fnvHash64(seed + i)));
+			initThread(workload, *threads.back());
+		}
+		uint64 start = getTimeNanosecond();
+		for(uint32 i=0; i<m_config.threadCount; ++i){
+			uint64 count = operationCount / m_config.threadCount + ((i < operationCount % m_config.threadCount) ? 1 : 0);
+			runners.push_back(std::thread(&Benchmark::runThread, this, &workload, threads[i], count));
+		}
+		for(size_t i=0; i<runners.size(); ++i){
+			runners[i].join();
+		}
+		double seconds = (double)(getTimeNanosecond() - start) / 1e9;
+		BenchThread total(0);
+		for(size_t i=0; i<threads.size(); ++i){
+			for(int op=0; op<BENCH_OP_COUNT; ++op){
+				total.histograms[op].merge(threads[i]->histograms[op]);
+				total.errors[op] += threads[i]->errors[op];
+				total.notFounds[op] += threads[i]->notFounds[op];
 			}
-
-			result = pKey->set((uint64)i, (char*)&i, sizeof(int64));
-            if(false == result){
-                ++setFailedCount;
-            }
-            ptr = pKey->get(i, &length);
-            if(NULL == ptr){
-                ++getFailedCount;
-            }
-		}
-		int64 e = get_time_us();
-		fprintf(stderr, "Key e=%lld getFailedCount=%lld setFailedCount=%lld\n", e, getFailedCount, setFailedCount);
-		fprintf(stderr, "Key cost us = %lld\n", e-s);
-		
-		std::string mykey = "welcome";
-		std::string myvalue = "hello world!";
-		result = pKey->set(mykey.c_str(), (uint32)mykey.length(), myvalue.c_str(), (uint32)myvalue.length());
-		fprintf(stderr, "set result = %d\n", (int)result);
-		uint32 myvaluelen;
-		char* ptr = pKey->get(mykey.c_str(), (uint32)mykey.length(), &myvaluelen);
-		if(NULL == ptr){
-			fprintf(stderr, "get mykey failed = %s\n", mykey.c_str());
+			delete threads[i];
+		}
+		report(workload, total, seconds);
+	}
+	void initThread(const BenchWorkload& workload, BenchThread& thread){
+		const SizeRange& size = workload.isLargeValue ? m_config.largeSize : m_config.valueSize;
+		thread.data.resize(size.high);
+		for(size_t i=0; i<thread.data.size(); ++i){
+			thread.data[i] = (char)('a' + thread.random() % 26);
+		}
+		if(workload.ratios[BENCH_SCAN] > 0){
+			thread.scanBuffer.resize((size_t)m_config.scanLength * m_config.valueSize.high);
+		}
+	}
+	void runThread(const BenchWorkload* pWorkload, BenchThread* pThread, uint64 count){
+		std::uniform_real_distribution<double> choose(0.0, 1.0);
+		for(uint64 i=0; i<count; ++i){
+			double r = choose(pThread->random);
+			int op = 0;
+			for(; op<BENCH_OP_COUNT-1; ++op){
+				r -= pWorkload->ratios[op];
+				if(r < 0){
+					break;
+				}
+			}
+			while(0 == pWorkload->ratios[op]){
+				--op;
+			}
+			// 生成key不计入延迟
+			prepare(*pWorkload, *pThread, op);
+			uint64 start = getTimeNanosecond();
+			int result = execute(*pWorkload, *pThread, op);
+			pThread->histograms[op].record(getTimeNanosecond() - start);
+			if(FERR_KEY_NOT_FOUND == result){
+				++pThread->notFounds[op];
+			}else if(FILE_OK != result){
+				++pThread->errors[op];
+			}
+		}
+	}
+	inline uint64 chooseKey(const BenchWorkload& workload, BenchThread& thread){
+		uint64 count = m_insertCount.load();
+		if(0 == count){
+			return 0;
+		}
+		if(BENCH_UNIFORM == workload.distribution || NULL == m_pZipf){
+			return thread.random() % count;
+		}
+		uint64 rank = m_pZipf->next(thread.random);
+		if(BENCH_LATEST == workload.distribution){
+			return count - 1 - (rank % count);
+		}
+		return fnvHash64(rank) % count;
+	}
+	inline void makeKey(uint64 number, std::string& key){
+		char head[32];
+		int n = snprintf(head, sizeof(head), "user%016llx", (unsigned long long)fnvHash64(number));
+		key.assign(head, (size_t)n);
+		key.resize(std::max((size_t)m_config.keySize.pick(fnvHash64(~number)), key.size()), 'x');
+	}
+	void prepare(const BenchWorkload& workload, BenchThread& thread, int op){
+		if(BENCH_INSERT == op){
+			makeKey(m_insertCount.fetch_add(1), thread.key);
+			return;
+		}
+		uint64 number = chooseKey(workload, thread);
+		if(BENCH_SCAN != op){
+			makeKey(number, thread.key);
+			return;
+		}
+		// 哈希存储没有有序的范围扫描，scan读取编号连续的一组key
+		uint64 length = 1 + thread.random() % m_config.scanLength;
+		thread.keys.resize((size_t)length);
+		thread.entries.clear();
+		for(uint64 i=0; i<length; ++i){
+			makeKey(number + i, thread.keys[i]);
+			thread.entries.push_back(KeyGetEntry(thread.keys[i].data(), (int64)thread.keys[i].size(), thread.scanBuffer.data() + i * m_config.valueSize.high, (int64)m_config.valueSize.high));
+		}
+	}
+	int execute(const BenchWorkload& workload, BenchThread& thread, int op){
+		const SizeRange& size = workload.isLargeValue ? m_config.largeSize : m_config.valueSize;
+		const char* key = thread.key.data();
+		int64 keyLen = (int64)thread.key.size();
+		int result;
+		switch(op){
+		case BENCH_READ:
+			return m_pDB->getValue(key, keyLen, thread.value);
+		case BENCH_UPDATE:
+		case BENCH_INSERT:
+			return m_pDB->set(key, keyLen, thread.data.data(), (int64)size.pick(thread.random()), true, false);
+		case BENCH_SCAN:
+			result = m_pDB->mget(thread.entries);
+			for(size_t i=0; FILE_OK == result && i<thread.entries.size(); ++i){
+				int r = thread.entries[i].result;
+				if(FILE_OK != r && FERR_KEY_NOT_FOUND != r && FERR_BUFFER_TOO_SMALL != r){
+					result = r;
+				}
+			}
+			return result;
+		case BENCH_RMW:
+			result = m_pDB->getValue(key, keyLen, thread.value);
+			if(FILE_OK != result){
+				return result;
+			}
+			return m_pDB->set(key, keyLen, thread.data.data(), (int64)size.pick(thread.random()), true, false);
+		case BENCH_DELETE:
+			return m_pDB->del(key, keyLen);
+		default:
+			return FILE_OK;
+		}
+	}
+	void report(const BenchWorkload& workload, const BenchThread& total, double seconds){
+		uint64 operations = 0;
+		for(int op=0; op<BENCH_OP_COUNT; ++op){
+			operations += total.histograms[op].getCount();
+		}
+		double throughput = (seconds > 0) ? (double)operations / seconds : 0;
+		if("text" == m_config.format){
+			printf("[%s] operations=%llu seconds=%.3f ops/s=%.0f\n", workload.name, (unsigned long long)operations, seconds, throughput);
+		}
+		for(int op=0; op<BENCH_OP_COUNT; ++op){
+			const LatencyHistogram& h = total.histograms[op];
+			if(0 == h.getCount()){
+				continue;
+			}
+			double opThroughput = (seconds > 0) ? (double)h.getCount() / seconds : 0;
+			printLine(workload.name, BENCH_OP_NAMES[op], h, total.errors[op], total.notFounds[op], opThroughput);
+		}
+		fflush(stdout);
+	}
+	void printLine(const char* workload, const char* op, const LatencyHistogram& h, uint64 errors, uint64 notFounds, double throughput){
+		double p50 = h.getPercentile(50) / 1000.0;
+		double p99 = h.getPercentile(99) / 1000.0;
+		double p999 = h.getPercentile(99.9) / 1000.0;
+		double maxUs = h.getMax() / 1000.0;
+		double mean = h.getMean() / 1000.0;
+		unsigned long long count = (unsigned long long)h.getCount();
+		if("json" == m_config.format){
+			printf("{\"label\":\"%s\",\"workload\":\"%s\",\"op\":\"%s\",\"threads\":%u,\"records\":%llu,\"count\":%llu,\"errors\":%llu,\"not_found\":%llu,"
+				"\"ops_per_sec\":%.1f,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+				m_config.label.c_str(), workload, op, m_config.threadCount, (unsigned long long)m_config.recordCount, count,
+				(unsigned long long)errors, (unsigned long long)notFounds, throughput, mean, p50, p99, p999, maxUs);
+		}else if("csv" == m_config.format){
+			if(!m_isHeaderPrinted){
+				printf("label,workload,op,threads,records,count,errors,not_found,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+				m_isHeaderPrinted = true;
+			}
+			printf("%s,%s,%s,%u,%llu,%llu,%llu,%llu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+				m_config.label.c_str(), workload, op, m_config.threadCount, (unsigned long long)m_config.recordCount, count,
+				(unsigned long long)errors, (unsigned long long)notFounds, throughput, mean, p50, p99, p999, maxUs);
 		}else{
-			fprintf(stderr, "get myvalue length=%d data=%s\n", myvaluelen, ptr);
+			printf("  %-7s count=%llu errors=%llu not_found=%llu mean=%.2fus p50=%.2fus p99=%.2fus p99.9=%.2fus max=%.2fus\n",
+				op, count, (unsigned long long)errors, (unsigned long long)notFounds, mean, p50, p99, p999, maxUs);
 		}
-		
 	}
-	std::chrono::milliseconds timespan(10*1000); // or whatever
-	std::this_thread::sleep_for(timespan);
-	
-	delete pKey;
-	
-    return 0;
+};
+
+static void usage(const char* name){
+	fprintf(stderr, "usage: %s [options]\n"
+		"  -w workloads   comma separated a,b,c,d,e,f,large,ingest,delete or all (default all)\n"
+		"  -r records     records loaded before the workloads (default 100000)\n"
+		"  -n operations  operations per workload (default 100000)\n"
+		"  -t threads     client threads (default 1)\n"
+		"  -k size        key length or range, at least %d (default %d)\n"
+		"  -v size        value length or range such as 64-1024 (default 100)\n"
+		"  -l size        value length or range of the large workload (default 65536-262144)\n"
+		"  -z theta       zipfian constant below 1, 0 for uniform (default 0.99)\n"
+		"  -s length      max scan length of workload e (default 100)\n"
+		"  -S seed        random seed (default 1)\n"
+		"  -d name        database name, existing files are removed (default benchdb)\n"
+		"  -o format      text, json or csv (default text)\n"
+		"  -L label       label written to every json/csv line, such as a version\n"
+		"  -P             print the runtime statistics of the database to stderr at the end\n"
+		"  -X             disable the runtime statistics, to measure their overhead\n",
+		name, BENCH_KEY_MIN_LENGTH, BENCH_KEY_MIN_LENGTH);
+}
+
+int main(int argc, char * argv[]) {
+	BenchConfig config;
+	int opt;
+	while(-1 != (opt = getopt(argc, argv, "w:r:n:t:k:v:l:z:s:S:d:o:L:PXh"))){
+		bool ok = true;
+		switch(opt){
+		case 'w': config.workloads = optarg; break;
+		case 'r': config.recordCount = strtoull(optarg, NULL, 10); break;
+		case 'n': config.operationCount = strtoull(optarg, NULL, 10); break;
+		case 't': config.threadCount = (uint32)std::max(atoi(optarg), 1); break;
+		case 'k': ok = config.keySize.parse(optarg); break;
+		case 'v': ok = config.valueSize.parse(optarg); break;
+		case 'l': ok = config.largeSize.parse(optarg); break;
+		case 'z': config.theta = atof(optarg); ok = (config.theta >= 0 && config.theta < 1.0); break;
+		case 's': config.scanLength = (uint32)std::max(atoi(optarg), 1); break;
+		case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+		case 'd': config.name = optarg; break;
+		case 'o': config.format = optarg; ok = ("text" == config.format || "json" == config.format || "csv" == config.format); break;
+		case 'L': config.label = optarg; break;
+		case 'P': config.isStatsPrinted = true; break;
+		case 'X': config.isStatsEnabled = false; break;
+		default: ok = false; break;
+		}
+		if(!ok){
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	fprintf(stderr, "records=%llu operations=%llu threads=%u key=%u-%u value=%u-%u large=%u-%u theta=%.2f workloads=%s\n",
+		(unsigned long long)config.recordCount, (unsigned long long)config.operationCount, config.threadCount,
+		config.keySize.low, config.keySize.high, config.valueSize.low, config.valueSize.high,
+		config.largeSize.low, config.largeSize.high, config.theta, config.workloads.c_str());
+	Benchmark benchmark(config);
+	if(!benchmark.open()){
+		return 1;
+	}
+	benchmark.runAll();
+	return 0;
 }
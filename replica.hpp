@@ -0,0 +1,465 @@
+//
+//  replica.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/20.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef replica_hpp
+#define replica_hpp
+
+#include "keyvalue.hpp"
+#include <thread>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+NS_HIVE_BEGIN
+
+#define REPLICA_MAGIC 0x524B5641			// 握手的标记
+#define REPLICA_BATCH_COUNT 1024			// 每次发送的最大日志条数
+#define REPLICA_WAIT_MS 100					// 等待新日志和检查停止的间隔
+#define REPLICA_RETRY_MS 1000				// 副本断开后重新连接的间隔
+#define REPLICA_MAX_OP_LENGTH 2147483647	// 单条日志的最大长度
+#define REPLICA_META_EXT ".r"				// 副本的同步位置文件，记录replicationId和已经执行的序号
+
+// 副本连接后发送的握手：副本上次同步到的位置，replicationId为0表示需要全量同步
+typedef struct ReplicaHandshake{
+	uint32 magic;
+	uint32 reserved;
+	uint64 replicationId;
+	uint64 sequence;
+	ReplicaHandshake(void) : magic(REPLICA_MAGIC), reserved(0), replicationId(0), sequence(0){}
+}ReplicaHandshake;
+
+// 发送全部数据，被打断时继续；失败返回false
+inline bool sendReplicaData(int fd, const char* data, size_t length){
+	while(length > 0){
+		ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+		if(n > 0){
+			data += n;
+			length -= (size_t)n;
+		}else if(n < 0 && EINTR == errno){
+			continue;
+		}else{
+			return false;
+		}
+	}
+	return true;
+}
+// 读取length长度的数据；等待期间每REPLICA_WAIT_MS检查一次isStop，停止或者连接断开时返回false
+inline bool recvReplicaData(int fd, char* data, size_t length, const std::atomic<bool>& isStop){
+	while(length > 0){
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int ret = poll(&pfd, 1, REPLICA_WAIT_MS);
+		if(isStop){
+			return false;
+		}
+		if(ret <= 0){
+			if(ret < 0 && EINTR != errno){
+				return false;
+			}
+			continue;
+		}
+		ssize_t n = recv(fd, data, length, 0);
+		if(n > 0){
+			data += n;
+			length -= (size_t)n;
+		}else if(n < 0 && (EINTR == errno || EAGAIN == errno)){
+			continue;
+		}else{
+			return false;
+		}
+	}
+	return true;
+}
+
+// 主节点的复制服务：监听端口，每个副本一个发送线程；
+// 副本的位置还在日志中时从下一条日志开始发送，否则先发送快照（全量同步），再从快照对应的序号继续发送日志；
+// 存储引擎需要先调用enableReplication，stop需要在关闭存储引擎之前调用
+template <typename _DB_>
+class ReplicationServer
+{
+public:
+	typedef _DB_ KeyValueData;
+	KeyValueData* m_pDB;
+	int m_listenFd;
+	std::thread m_acceptThread;
+	std::vector<std::thread> m_replicaThreads;
+	std::mutex m_mutex;					// 保护m_replicaThreads
+	std::atomic<bool> m_isStop;
+	std::atomic<uint32> m_replicaCount;	// 当前连接的副本数量
+public:
+	ReplicationServer(KeyValueData* pDB) : m_pDB(pDB), m_listenFd(-1), m_isStop(false), m_replicaCount(0){}
+	virtual ~ReplicationServer(void){
+		stop();
+	}
+	// 开始在port上接受副本的连接
+	bool start(int port){
+		if(-1 != m_listenFd || NULL == m_pDB->getReplicationLog()){
+			return false;
+		}
+		m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(-1 == m_listenFd){
+			fprintf(stderr, "ReplicationServer socket failed errno=%d\n", errno);
+			return false;
+		}
+		int on = 1;
+		setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((uint16_t)port);
+		if(0 != bind(m_listenFd, (struct sockaddr*)&addr, sizeof(addr)) || 0 != listen(m_listenFd, SOMAXCONN)){
+			fprintf(stderr, "ReplicationServer bind or listen failed port=%d errno=%d\n", port, errno);
+			close(m_listenFd);
+			m_listenFd = -1;
+			return false;
+		}
+		m_isStop = false;
+		m_acceptThread = std::thread(&ReplicationServer::acceptReplicas, this);
+		return true;
+	}
+	void stop(void){
+		if(-1 == m_listenFd){
+			return;
+		}
+		m_isStop = true;
+		m_acceptThread.join();
+		close(m_listenFd);
+		m_listenFd = -1;
+		for(size_t i=0; i<m_replicaThreads.size(); ++i){
+			m_replicaThreads[i].join();
+		}
+		m_replicaThreads.clear();
+	}
+	inline uint32 getReplicaCount(void) const {
+		return m_replicaCount.load();
+	}
+protected:
+	void acceptReplicas(void){
+		while(!m_isStop){
+			struct pollfd pfd;
+			pfd.fd = m_listenFd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if(poll(&pfd, 1, REPLICA_WAIT_MS) <= 0){
+				continue;
+			}
+			int fd = accept4(m_listenFd, NULL, NULL, SOCK_CLOEXEC);
+			if(-1 == fd){
+				continue;
+			}
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_replicaThreads.push_back(std::thread(&ReplicationServer::serveReplica, this, fd));
+		}
+	}
+	// 一个副本的发送线程：读取握手，需要时先全量同步，之后持续发送新的日志
+	void serveReplica(int fd){
+		++m_replicaCount;
+		ReplicationLog* pLog = m_pDB->getReplicationLog();
+		ReplicaHandshake handshake;
+		bool ok = recvReplicaData(fd, (char*)&handshake, sizeof(handshake), m_isStop) && REPLICA_MAGIC == handshake.magic;
+		uint64 sequence = handshake.sequence;
+		bool isFull = (handshake.replicationId != pLog->getReplicationId());
+		ReplicaOpVector ops;
+		CharVector data;
+		while(ok && !m_isStop){
+			if(isFull){
+				ok = sendSnapshot(fd, pLog->getReplicationId(), sequence);
+				isFull = false;
+				continue;
+			}
+			ops.clear();
+			int result = pLog->read(sequence, REPLICA_BATCH_COUNT, REPLICA_WAIT_MS, ops);
+			if(FERR_REPLICA_LOG_TRIMMED == result){
+				// 副本落后太多，需要的日志已经淘汰
+				isFull = true;
+				continue;
+			}
+			if(FILE_OK != result){
+				break;
+			}
+			if(ops.empty()){
+				continue;
+			}
+			data.clear();
+			for(size_t i=0; i<ops.size(); ++i){
+				encodeReplicaOp(ops[i], data);
+			}
+			sequence = ops.back().sequence;
+			ok = sendReplicaData(fd, data.data(), data.size());
+		}
+		close(fd);
+		--m_replicaCount;
+	}
+	// 全量同步：固定一个快照，发送快照中所有的key，结束标记中带有快照对应的日志序号
+	bool sendSnapshot(int fd, uint64 replicationId, uint64& sequence){
+		uint64 snapshot = m_pDB->createReplicaSnapshot(sequence);
+		std::vector<std::string> keys;
+		std::vector<uint64> indexes;
+		m_pDB->getSnapshotKeys(snapshot, keys, indexes);
+		ReplicaOp begin;
+		begin.type = REPLICA_OP_SNAPSHOT_BEGIN;
+		begin.index = replicationId;
+		CharVector data;
+		encodeReplicaOp(begin, data);
+		bool ok = true;
+		for(size_t i=0; ok && i<keys.size() + indexes.size(); ++i){
+			ReplicaOp op;
+			op.type = REPLICA_OP_SET;
+			int result;
+			if(i < keys.size()){
+				op.key = keys[i];
+				result = m_pDB->getSnapshotValue(snapshot, op.key.data(), (int64)op.key.size(), op.value, &(op.expire));
+			}else{
+				op.isIndex = true;
+				op.index = indexes[i - keys.size()];
+				result = m_pDB->getSnapshotValue(snapshot, op.index, op.value, &(op.expire));
+			}
+			if(FILE_OK == result){
+				encodeReplicaOp(op, data);
+			}
+			if(data.size() >= BULK_LOAD_BUFFER_SIZE){
+				ok = sendReplicaData(fd, data.data(), data.size()) && !m_isStop;
+				data.clear();
+			}
+		}
+		m_pDB->releaseSnapshot(snapshot);
+		ReplicaOp end;
+		end.type = REPLICA_OP_SNAPSHOT_END;
+		end.index = replicationId;
+		end.sequence = sequence;
+		encodeReplicaOp(end, data);
+		return ok && sendReplicaData(fd, data.data(), data.size());
+	}
+};
+
+// 副本：连接主节点，执行收到的日志，同时可以在其它线程中读取存储引擎（需要打开线程安全模式）；
+// 同步位置保存在name.r文件中，重新启动后从上次的位置继续；主节点重启或者副本落后太多时重新全量同步；
+// 副本上不应该直接写入，写入的数据会被之后的同步覆盖
+template <typename _DB_>
+class ReplicaClient
+{
+public:
+	typedef _DB_ KeyValueData;
+	KeyValueData* m_pDB;
+	File* m_pMeta;
+	std::string m_host;
+	int m_port;
+	std::thread m_thread;
+	std::atomic<bool> m_isStop;
+	std::atomic<bool> m_isConnected;
+	std::atomic<uint64> m_sequence;			// 已经执行的最后一条日志的序号
+	uint64 m_replicationId;
+	bool m_isSyncing;						// 正在接收全量同步
+	std::unordered_set<std::string> m_syncKeys;		// 全量同步收到的key，结束时删除其它的key
+	std::unordered_set<uint64> m_syncIndexes;
+public:
+	ReplicaClient(KeyValueData* pDB) : m_pDB(pDB), m_pMeta(NULL), m_port(0), m_isStop(false), m_isConnected(false), m_sequence(0), m_replicationId(0), m_isSyncing(false){}
+	virtual ~ReplicaClient(void){
+		stop();
+	}
+	// 开始从host:port同步，name为副本数据库的名称，同步位置保存在name.r
+	bool start(const std::string& host, int port, const std::string& name){
+		if(NULL != m_pMeta){
+			return false;
+		}
+		m_pMeta = new File(name, REPLICA_META_EXT);
+		if(FILE_OK != m_pMeta->touchFile(NULL, 0) || !m_pMeta->openReadWrite("rb+")){
+			delete m_pMeta;
+			m_pMeta = NULL;
+			return false;
+		}
+		uint64 meta[2] = {0, 0};
+		if(m_pMeta->m_fileLength >= (int64)sizeof(meta) && (int64)sizeof(meta) == m_pMeta->seekRead(meta, 1, sizeof(meta), 0, SEEK_SET)){
+			m_replicationId = meta[0];
+			m_sequence = meta[1];
+		}
+		m_host = host;
+		m_port = port;
+		m_isStop = false;
+		m_thread = std::thread(&ReplicaClient::run, this);
+		return true;
+	}
+	void stop(void){
+		if(NULL == m_pMeta){
+			return;
+		}
+		m_isStop = true;
+		m_thread.join();
+		delete m_pMeta;
+		m_pMeta = NULL;
+	}
+	inline uint64 getSequence(void) const {
+		return m_sequence.load();
+	}
+	inline bool isConnected(void) const {
+		return m_isConnected.load();
+	}
+protected:
+	// 连接断开后每REPLICA_RETRY_MS重新连接
+	void run(void){
+		while(!m_isStop){
+			int fd = connectPrimary();
+			if(-1 != fd){
+				m_isConnected = true;
+				receive(fd);
+				m_isConnected = false;
+				close(fd);
+			}
+			for(int waited=0; waited<REPLICA_RETRY_MS && !m_isStop; waited+=REPLICA_WAIT_MS){
+				std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_WAIT_MS));
+			}
+		}
+	}
+	int connectPrimary(void){
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo* pResult = NULL;
+		if(0 != getaddrinfo(m_host.c_str(), std::to_string(m_port).c_str(), &hints, &pResult)){
+			fprintf(stderr, "ReplicaClient resolve failed host=%s\n", m_host.c_str());
+			return -1;
+		}
+		int fd = socket(pResult->ai_family, pResult->ai_socktype | SOCK_CLOEXEC, pResult->ai_protocol);
+		if(-1 != fd && 0 != connect(fd, pResult->ai_addr, pResult->ai_addrlen)){
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(pResult);
+		if(-1 == fd){
+			return -1;
+		}
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		ReplicaHandshake handshake;
+		handshake.replicationId = m_replicationId;
+		handshake.sequence = m_sequence.load();
+		if(!sendReplicaData(fd, (const char*)&handshake, sizeof(handshake))){
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	// 接收并执行日志，连接断开或者停止时返回
+	void receive(int fd){
+		CharVector body;
+		ReplicaOp op;
+		while(!m_isStop){
+			uint32 length = 0;
+			if(!recvReplicaData(fd, (char*)&length, 4, m_isStop) || length > REPLICA_MAX_OP_LENGTH){
+				return;
+			}
+			body.resize(length);
+			if(!recvReplicaData(fd, body.data(), length, m_isStop) || !decodeReplicaOp(body.data(), length, op)){
+				return;
+			}
+			applyOp(op);
+		}
+	}
+	void applyOp(const ReplicaOp& op){
+		switch(op.type){
+		case REPLICA_OP_SNAPSHOT_BEGIN:
+			m_isSyncing = true;
+			m_syncKeys.clear();
+			m_syncIndexes.clear();
+			return;
+		case REPLICA_OP_SNAPSHOT_END:
+			finishSync(op.index, op.sequence);
+			return;
+		default:
+			break;
+		}
+		int result = op.isIndex ? applyIndexOp(op) : applyKeyOp(op);
+		if(FILE_OK != result && FERR_KEY_NOT_FOUND != result){
+			fprintf(stderr, "ReplicaClient apply failed sequence=%llu type=%d result=%d\n", (unsigned long long)op.sequence, (int)op.type, result);
+		}
+		if(m_isSyncing){
+			if(op.isIndex){
+				m_syncIndexes.insert(op.index);
+			}else{
+				m_syncKeys.insert(op.key);
+			}
+			return;
+		}
+		m_sequence = op.sequence;
+		saveMeta();
+	}
+	inline int applyKeyOp(const ReplicaOp& op){
+		const char* key = op.key.data();
+		int64 keyLen = (int64)op.key.size();
+		switch(op.type){
+		case REPLICA_OP_SET:
+			return m_pDB->set(key, keyLen, op.value.data(), (int64)op.value.size(), op.recordLength, false, VALUE_CODEC_DEFAULT, op.expire);
+		case REPLICA_OP_DEL:
+			return m_pDB->del(key, keyLen);
+		case REPLICA_OP_REPLACE:
+			// 主节点上修改成功说明目标key不存在或者已经过期，副本上同样先删除目标key
+			m_pDB->del(op.newKey.data(), (int64)op.newKey.size());
+			return m_pDB->replace(key, (uint64)keyLen, op.newKey.data(), (uint64)op.newKey.size());
+		case REPLICA_OP_EXPIRE:
+			return m_pDB->setExpire(key, keyLen, op.expire);
+		default:
+			return FILE_OK;
+		}
+	}
+	inline int applyIndexOp(const ReplicaOp& op){
+		switch(op.type){
+		case REPLICA_OP_SET:
+			return m_pDB->set(op.index, op.value.data(), (int64)op.value.size(), op.recordLength, false, VALUE_CODEC_DEFAULT, op.expire);
+		case REPLICA_OP_DEL:
+			return m_pDB->del(op.index);
+		case REPLICA_OP_REPLACE:
+			m_pDB->del(op.newIndex);
+			return m_pDB->replace(op.index, op.newIndex);
+		case REPLICA_OP_EXPIRE:
+			return m_pDB->setExpire(op.index, op.expire);
+		default:
+			return FILE_OK;
+		}
+	}
+	// 全量同步结束：删除快照中没有的key，记录新的同步位置
+	void finishSync(uint64 replicationId, uint64 sequence){
+		std::vector<std::string> keys;
+		std::vector<uint64> indexes;
+		uint64 snapshot = m_pDB->createSnapshot();
+		m_pDB->getSnapshotKeys(snapshot, keys, indexes);
+		m_pDB->releaseSnapshot(snapshot);
+		for(size_t i=0; i<keys.size(); ++i){
+			if(0 == m_syncKeys.count(keys[i])){
+				m_pDB->del(keys[i].data(), (int64)keys[i].size());
+			}
+		}
+		for(size_t i=0; i<indexes.size(); ++i){
+			if(0 == m_syncIndexes.count(indexes[i])){
+				m_pDB->del(indexes[i]);
+			}
+		}
+		m_syncKeys.clear();
+		m_syncIndexes.clear();
+		m_isSyncing = false;
+		m_replicationId = replicationId;
+		m_sequence = sequence;
+		saveMeta();
+	}
+	// 同步位置在执行日志之后保存，重新连接时可能重复执行最后保存之后的日志，重复执行的结果相同
+	inline void saveMeta(void){
+		uint64 meta[2] = {m_replicationId, m_sequence.load()};
+		m_pMeta->saveData(meta, sizeof(meta), 0, 0, false);
+	}
+};
+
+NS_HIVE_END
+
+#endif /* replica_hpp */
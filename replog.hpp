@@ -0,0 +1,189 @@
+//
+//  replog.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/20.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef replog_hpp
+#define replog_hpp
+
+#include "file.hpp"
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <condition_variable>
+
+NS_HIVE_BEGIN
+
+#define REPLICA_LOG_MAX_BYTES 67108864		// 内存中保留的复制日志长度，落后更多的副本需要重新从快照同步
+#define REPLICA_OP_HEAD_LENGTH 46			// 编码后每条日志固定部分的长度
+
+// 复制日志的操作类型
+enum ReplicaOpType{
+	REPLICA_OP_SET = 1,				// 写入，value为新的数据
+	REPLICA_OP_DEL = 2,
+	REPLICA_OP_REPLACE = 3,			// 修改key，newKey/newIndex为新的key
+	REPLICA_OP_EXPIRE = 4,			// 修改过期时间
+	REPLICA_OP_SNAPSHOT_BEGIN = 5,	// 开始全量同步，副本需要清除已有的数据
+	REPLICA_OP_SNAPSHOT_END = 6,	// 全量同步结束，sequence为快照对应的日志序号
+};
+
+// 一条复制日志
+typedef struct ReplicaOp{
+	uint64 sequence;
+	uint8 type;
+	bool isIndex;					// 数字key
+	bool recordLength;				// 写入时的recordLength参数，为false时value是数据文件中的原始格式
+	uint32 expire;					// 过期时间（秒级时间戳），0表示不过期
+	uint64 index;
+	uint64 newIndex;
+	std::string key;
+	std::string newKey;
+	CharVector value;
+	ReplicaOp(void) : sequence(0), type(0), isIndex(false), recordLength(true), expire(0), index(0), newIndex(0){}
+	inline uint64 getByteSize(void) const {
+		return REPLICA_OP_HEAD_LENGTH + key.size() + newKey.size() + value.size();
+	}
+}ReplicaOp;
+typedef std::vector<ReplicaOp> ReplicaOpVector;
+
+// 编码一条日志追加到data：总长度(4) 序号(8) 类型(1) 标记(1) 过期时间(4) 数字key(8) 新数字key(8) key长度(4)+key 新key长度(4)+新key value长度(4)+value；
+// 所有整数使用本机字节序，主从两端需要相同的字节序
+inline void encodeReplicaOp(const ReplicaOp& op, CharVector& data){
+	uint32 keyLength = (uint32)op.key.size();
+	uint32 newKeyLength = (uint32)op.newKey.size();
+	uint32 valueLength = (uint32)op.value.size();
+	uint32 total = 8 + 1 + 1 + 4 + 8 + 8 + 4 + keyLength + 4 + newKeyLength + 4 + valueLength;
+	uint8 flags = (op.isIndex ? 1 : 0) | (op.recordLength ? 2 : 0);
+	size_t start = data.size();
+	data.resize(start + 4 + total);
+	char* ptr = data.data() + start;
+	memcpy(ptr, &total, 4); ptr += 4;
+	memcpy(ptr, &(op.sequence), 8); ptr += 8;
+	memcpy(ptr, &(op.type), 1); ptr += 1;
+	memcpy(ptr, &flags, 1); ptr += 1;
+	memcpy(ptr, &(op.expire), 4); ptr += 4;
+	memcpy(ptr, &(op.index), 8); ptr += 8;
+	memcpy(ptr, &(op.newIndex), 8); ptr += 8;
+	memcpy(ptr, &keyLength, 4); ptr += 4;
+	memcpy(ptr, op.key.data(), keyLength); ptr += keyLength;
+	memcpy(ptr, &newKeyLength, 4); ptr += 4;
+	memcpy(ptr, op.newKey.data(), newKeyLength); ptr += newKeyLength;
+	memcpy(ptr, &valueLength, 4); ptr += 4;
+	memcpy(ptr, op.value.data(), valueLength);
+}
+// 解码一条日志，data为去掉总长度之后的内容；格式错误时返回false
+inline bool decodeReplicaOp(const char* data, uint32 length, ReplicaOp& op){
+	const char* ptr = data;
+	const char* end = data + length;
+	uint8 flags = 0;
+	uint32 fieldLength = 0;
+	if(length < 8 + 1 + 1 + 4 + 8 + 8 + 4){
+		return false;
+	}
+	memcpy(&(op.sequence), ptr, 8); ptr += 8;
+	memcpy(&(op.type), ptr, 1); ptr += 1;
+	memcpy(&flags, ptr, 1); ptr += 1;
+	memcpy(&(op.expire), ptr, 4); ptr += 4;
+	memcpy(&(op.index), ptr, 8); ptr += 8;
+	memcpy(&(op.newIndex), ptr, 8); ptr += 8;
+	op.isIndex = (0 != (flags & 1));
+	op.recordLength = (0 != (flags & 2));
+	memcpy(&fieldLength, ptr, 4); ptr += 4;
+	if(end - ptr < (int64)fieldLength + 4){
+		return false;
+	}
+	op.key.assign(ptr, fieldLength); ptr += fieldLength;
+	memcpy(&fieldLength, ptr, 4); ptr += 4;
+	if(end - ptr < (int64)fieldLength + 4){
+		return false;
+	}
+	op.newKey.assign(ptr, fieldLength); ptr += fieldLength;
+	memcpy(&fieldLength, ptr, 4); ptr += 4;
+	if(end - ptr != (int64)fieldLength){
+		return false;
+	}
+	op.value.assign(ptr, ptr + fieldLength);
+	return true;
+}
+
+// 复制日志：每次修改按顺序分配序号，内存中保留最近REPLICA_LOG_MAX_BYTES长度的日志；
+// 由存储引擎在写入锁中追加，发送线程按序号读取；replicationId在每次启动时随机生成，副本用它判断序号是否还有效
+class ReplicationLog
+{
+public:
+	std::deque<ReplicaOp> m_ops;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	uint64 m_replicationId;
+	uint64 m_sequence;				// 最后一条日志的序号
+	uint64 m_bytes;
+	uint64 m_maxBytes;
+	bool m_isClosed;
+public:
+	ReplicationLog(uint64 maxBytes) : m_sequence(0), m_bytes(0), m_maxBytes(maxBytes), m_isClosed(false){
+		std::random_device device;
+		m_replicationId = ((uint64)device() << 32) | (uint64)device();
+		m_replicationId ^= (uint64)std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+	virtual ~ReplicationLog(void){
+		close();
+	}
+	inline uint64 getReplicationId(void) const {
+		return m_replicationId;
+	}
+	inline uint64 getSequence(void){
+		std::lock_guard<std::mutex> guard(m_mutex);
+		return m_sequence;
+	}
+	// 追加一条日志并分配序号，超过长度上限时淘汰最早的日志
+	inline void append(ReplicaOp& op){
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			op.sequence = ++m_sequence;
+			m_bytes += op.getByteSize();
+			m_ops.push_back(ReplicaOp());
+			std::swap(m_ops.back(), op);
+			while(m_bytes > m_maxBytes && m_ops.size() > 1){
+				m_bytes -= m_ops.front().getByteSize();
+				m_ops.pop_front();
+			}
+		}
+		m_condition.notify_all();
+	}
+	// 读取序号大于from的日志，最多maxCount条；没有新的日志时最多等待waitMs毫秒；
+	// from之后的日志已经淘汰时返回FERR_REPLICA_LOG_TRIMMED，关闭后返回FERR_REPLICA_CLOSED
+	inline int read(uint64 from, uint64 maxCount, int64 waitMs, ReplicaOpVector& ops){
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_condition.wait_for(lock, std::chrono::milliseconds(waitMs), [this, from](){ return m_isClosed || m_sequence > from; });
+		if(m_isClosed){
+			return FERR_REPLICA_CLOSED;
+		}
+		if(from > m_sequence){
+			return FERR_REPLICA_LOG_TRIMMED;
+		}
+		uint64 first = m_sequence - (uint64)m_ops.size() + 1;
+		if(from + 1 < first){
+			return FERR_REPLICA_LOG_TRIMMED;
+		}
+		for(uint64 seq=from+1; seq<=m_sequence && ops.size()<maxCount; ++seq){
+			ops.push_back(m_ops[(size_t)(seq - first)]);
+		}
+		return FILE_OK;
+	}
+	// 唤醒所有等待的读取，之后的读取都返回FERR_REPLICA_CLOSED
+	inline void close(void){
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_isClosed = true;
+		}
+		m_condition.notify_all();
+	}
+};
+
+NS_HIVE_END
+
+#endif /* replog_hpp */
@@ -0,0 +1,601 @@
+//
+//  server.cpp
+//  test
+//
+//  Created by AppleTree on 17/4/19.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+//  RESP协议（redis协议）的网络服务器，可以直接使用redis-cli和redis-benchmark访问：
+//  每个线程一个epoll事件循环，各自使用SO_REUSEPORT监听同一个端口，由内核把连接分配到不同的线程，连接只在自己的线程中处理；
+//  所有线程共享一个线程安全模式的AlphaKV；支持管道，一次读取到的多个命令依次执行，回复合并后一次写出；
+//  支持GET/SET/DEL/MGET/MSET/INCRBY/INCR/DECR/DECRBY/RENAME/PING/QUIT；
+//  #开头并且后面全是数字的key（例如#123）使用数字key，其它的使用字符串key
+//  用法：./server [-p 端口] [-d 数据库名] [-t 线程数]
+//
+
+#include <iostream>
+#include <thread>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "alphakv.hpp"
+USING_NS_HIVE;
+
+#define SERVER_DEFAULT_PORT 6379
+#define SERVER_DEFAULT_DB "serverdb"
+#define SERVER_MAX_EVENTS 256				// 每次epoll_wait最多处理的事件
+#define SERVER_WAIT_MS 100					// epoll_wait的超时时间，用于检查退出和定时回收过期的key
+#define SERVER_READ_SIZE 65536				// 每次读取的长度
+#define SERVER_MAX_BULK_LENGTH 536870912	// 单个参数的最大长度（512M），和redis一致
+#define SERVER_MAX_ARGUMENTS 1048576		// 单个命令的最大参数数量
+#define SERVER_MAX_INLINE_LENGTH 65536		// 不使用RESP格式的内联命令的最大长度
+#define SERVER_EXPIRE_COUNT 1000			// 每次定时回收过期key的最大数量
+
+typedef std::vector<std::string> ArgumentVector;
+
+// 一个客户端连接，只在所属的事件循环线程中访问
+typedef struct Connection{
+	int fd;
+	std::string input;				// 还没有处理的输入
+	std::string output;				// 还没有写出的回复
+	size_t outputOffset;			// output中已经写出的长度
+	bool isWriting;					// 已经注册了EPOLLOUT
+	bool isClosing;					// 写完回复后关闭（QUIT或者协议错误）
+	Connection(int f) : fd(f), outputOffset(0), isWriting(false), isClosing(false){}
+}Connection;
+
+static std::atomic<bool> g_isStop(false);
+
+inline void onStopSignal(int sig){
+	g_isStop = true;
+}
+
+// 回复
+inline void appendStatus(std::string& output, const char* status){
+	output.append("+").append(status).append("\r\n");
+}
+inline void appendError(std::string& output, const std::string& error){
+	output.append("-").append(error).append("\r\n");
+}
+inline void appendInteger(std::string& output, int64 value){
+	output.append(":").append(std::to_string(value)).append("\r\n");
+}
+inline void appendBulk(std::string& output, const char* data, size_t length){
+	output.append("$").append(std::to_string(length)).append("\r\n");
+	output.append(data, length).append("\r\n");
+}
+inline void appendNull(std::string& output){
+	output.append("$-1\r\n");
+}
+inline void appendArray(std::string& output, size_t count){
+	output.append("*").append(std::to_string(count)).append("\r\n");
+}
+inline void appendResultError(std::string& output, int result){
+	appendError(output, "ERR alphaKV error " + std::to_string(result));
+}
+
+// 解析一行，offset指向行的开始；成功时offset移到下一行，line不包含\r\n
+inline int parseLine(const std::string& input, size_t& offset, std::string& line, size_t maxLength){
+	size_t end = input.find("\r\n", offset);
+	if(std::string::npos == end){
+		return (input.size() - offset > maxLength) ? -1 : 0;
+	}
+	line.assign(input, offset, end - offset);
+	offset = end + 2;
+	return 1;
+}
+// 解析十进制整数，整个字符串都是数字才成功
+inline bool parseInteger(const std::string& text, int64& value){
+	if(text.empty() || text.size() > 20){
+		return false;
+	}
+	char* end = NULL;
+	errno = 0;
+	value = (int64)strtoll(text.c_str(), &end, 10);
+	return (0 == errno && end == text.c_str() + text.size() && !isspace((unsigned char)text[0]));
+}
+// 解析一个命令：返回1表示得到一个命令，0表示数据还不完整，-1表示协议错误；得到命令时offset移到命令之后
+inline int parseCommand(const std::string& input, size_t& offset, ArgumentVector& args){
+	args.clear();
+	size_t pos = offset;
+	std::string line;
+	if('*' != input[pos]){
+		// 内联命令：一行以空格分隔的参数，redis-cli的telnet方式使用
+		int ret = parseLine(input, pos, line, SERVER_MAX_INLINE_LENGTH);
+		if(1 != ret){
+			return ret;
+		}
+		size_t start = 0;
+		while(start < line.size()){
+			size_t end = line.find(' ', start);
+			if(std::string::npos == end){
+				end = line.size();
+			}
+			if(end > start){
+				args.push_back(line.substr(start, end - start));
+			}
+			start = end + 1;
+		}
+		offset = pos;
+		return 1;
+	}
+	++pos;
+	int ret = parseLine(input, pos, line, 32);
+	if(1 != ret){
+		return ret;
+	}
+	int64 count = 0;
+	if(!parseInteger(line, count) || count > SERVER_MAX_ARGUMENTS){
+		return -1;
+	}
+	for(int64 i=0; i<count; ++i){
+		if(pos >= input.size()){
+			return 0;
+		}
+		if('$' != input[pos]){
+			return -1;
+		}
+		++pos;
+		ret = parseLine(input, pos, line, 32);
+		if(1 != ret){
+			return ret;
+		}
+		int64 length = 0;
+		if(!parseInteger(line, length) || length < 0 || length > SERVER_MAX_BULK_LENGTH){
+			return -1;
+		}
+		if(input.size() - pos < (size_t)length + 2){
+			return 0;
+		}
+		if('\r' != input[pos + length] || '\n' != input[pos + length + 1]){
+			return -1;
+		}
+		args.push_back(input.substr(pos, (size_t)length));
+		pos += (size_t)length + 2;
+	}
+	offset = pos;
+	return 1;
+}
+
+// 命令的执行：key是#加数字时使用数字key
+class CommandHandler
+{
+public:
+	AlphaKV* m_pDB;
+public:
+	CommandHandler(AlphaKV* pDB) : m_pDB(pDB){}
+	// 执行一个命令，回复追加到output；返回false表示执行后关闭连接
+	bool execute(ArgumentVector& args, std::string& output){
+		if(args.empty()){
+			return true;
+		}
+		std::string& name = args[0];
+		std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+		size_t argc = args.size();
+		if("GET" == name && 2 == argc){
+			onGet(args, output);
+		}else if("SET" == name && (3 == argc || 5 == argc)){
+			onSet(args, output);
+		}else if("DEL" == name && argc >= 2){
+			onDel(args, output);
+		}else if("MGET" == name && argc >= 2){
+			onMget(args, output);
+		}else if("MSET" == name && argc >= 3 && 1 == argc % 2){
+			onMset(args, output);
+		}else if(("INCRBY" == name || "DECRBY" == name) && 3 == argc){
+			int64 delta = 0;
+			if(!parseInteger(args[2], delta) || ("DECRBY" == name && INT64_MIN == delta)){
+				appendError(output, "ERR value is not an integer or out of range");
+			}else{
+				onIncrby(args[1], ("DECRBY" == name) ? -delta : delta, output);
+			}
+		}else if("INCR" == name && 2 == argc){
+			onIncrby(args[1], 1, output);
+		}else if("DECR" == name && 2 == argc){
+			onIncrby(args[1], -1, output);
+		}else if("RENAME" == name && 3 == argc){
+			onRename(args, output);
+		}else if("PING" == name && argc <= 2){
+			if(2 == argc){
+				appendBulk(output, args[1].data(), args[1].size());
+			}else{
+				appendStatus(output, "PONG");
+			}
+		}else if("INFO" == name && argc <= 2){
+			// 存储引擎的运行统计和空间统计；INFO space只返回空间统计
+			std::string section = (2 == argc) ? args[1] : "";
+			std::transform(section.begin(), section.end(), section.begin(), ::tolower);
+			std::string text;
+			if("space" != section){
+				text = m_pDB->dumpStats();
+			}
+			text.append(m_pDB->dumpSpaceStat());
+			appendBulk(output, text.data(), text.size());
+		}else if("QUIT" == name){
+			appendStatus(output, "OK");
+			return false;
+		}else if("CONFIG" == name || "COMMAND" == name){
+			// redis-benchmark和redis-cli启动时会查询，返回空的结果
+			appendArray(output, 0);
+		}else{
+			appendError(output, "ERR unknown command or wrong number of arguments for '" + name + "'");
+		}
+		return true;
+	}
+protected:
+	// #开头并且后面全是数字的key为数字key
+	static bool parseIndexKey(const std::string& key, uint64& index){
+		if(key.size() < 2 || key.size() > 21 || '#' != key[0]){
+			return false;
+		}
+		for(size_t i=1; i<key.size(); ++i){
+			if(!isdigit((unsigned char)key[i])){
+				return false;
+			}
+		}
+		char* end = NULL;
+		errno = 0;
+		index = (uint64)strtoull(key.c_str() + 1, &end, 10);
+		return (0 == errno);
+	}
+	void onGet(const ArgumentVector& args, std::string& output){
+		CharVector value;
+		uint64 index = 0;
+		bool ok = parseIndexKey(args[1], index) ? m_pDB->get(index, value) : m_pDB->get(args[1].data(), (uint32)args[1].size(), value);
+		if(ok){
+			appendBulk(output, value.data(), value.size());
+		}else{
+			appendNull(output);
+		}
+	}
+	// SET key value [EX seconds]
+	void onSet(const ArgumentVector& args, std::string& output){
+		int64 seconds = 0;
+		if(5 == args.size()){
+			std::string option = args[3];
+			std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+			if("EX" != option || !parseInteger(args[4], seconds) || seconds <= 0 || seconds > UINT_MAX){
+				appendError(output, "ERR syntax error");
+				return;
+			}
+		}
+		const std::string& key = args[1];
+		const std::string& value = args[2];
+		uint64 index = 0;
+		bool isIndex = parseIndexKey(key, index);
+		bool ok;
+		if(seconds > 0){
+			ok = isIndex ? m_pDB->setex(index, value.data(), (uint32)value.size(), (uint32)seconds) : m_pDB->setex(key.data(), (uint32)key.size(), value.data(), (uint32)value.size(), (uint32)seconds);
+		}else{
+			ok = isIndex ? m_pDB->set(index, value.data(), (uint32)value.size()) : m_pDB->set(key.data(), (uint32)key.size(), value.data(), (uint32)value.size());
+		}
+		if(ok){
+			appendStatus(output, "OK");
+		}else{
+			appendError(output, "ERR set failed");
+		}
+	}
+	void onDel(const ArgumentVector& args, std::string& output){
+		int64 count = 0;
+		for(size_t i=1; i<args.size(); ++i){
+			uint64 index = 0;
+			bool ok = parseIndexKey(args[i], index) ? m_pDB->del(index) : m_pDB->del(args[i].data(), (uint32)args[i].size());
+			if(ok){
+				++count;
+			}
+		}
+		appendInteger(output, count);
+	}
+	void onMget(const ArgumentVector& args, std::string& output){
+		appendArray(output, args.size() - 1);
+		CharVector value;
+		for(size_t i=1; i<args.size(); ++i){
+			uint64 index = 0;
+			bool ok = parseIndexKey(args[i], index) ? m_pDB->get(index, value) : m_pDB->get(args[i].data(), (uint32)args[i].size(), value);
+			if(ok){
+				appendBulk(output, value.data(), value.size());
+			}else{
+				appendNull(output);
+			}
+		}
+	}
+	// 字符串key和数字key各自批量写入
+	void onMset(const ArgumentVector& args, std::string& output){
+		KeySetEntryVector keyEntries;
+		IndexSetEntryVector indexEntries;
+		for(size_t i=1; i+1<args.size(); i+=2){
+			const std::string& key = args[i];
+			const std::string& value = args[i+1];
+			uint64 index = 0;
+			if(parseIndexKey(key, index)){
+				indexEntries.push_back(IndexSetEntry(index, value.data(), (int64)value.size()));
+			}else{
+				keyEntries.push_back(KeySetEntry(key.data(), (int64)key.size(), value.data(), (int64)value.size()));
+			}
+		}
+		bool ok = (keyEntries.empty() || m_pDB->mset(keyEntries)) && (indexEntries.empty() || m_pDB->mset(indexEntries));
+		if(ok){
+			appendStatus(output, "OK");
+		}else{
+			appendError(output, "ERR mset failed");
+		}
+	}
+	void onIncrby(const std::string& key, int64 delta, std::string& output){
+		int64 value = 0;
+		uint64 index = 0;
+		int result = parseIndexKey(key, index) ? m_pDB->m_pDB->incrby(index, delta, value) : m_pDB->m_pDB->incrby(key.data(), (int64)key.size(), delta, value);
+		if(FILE_OK == result){
+			appendInteger(output, value);
+		}else if(FERR_VALUE_NOT_INTEGER == result){
+			appendError(output, "ERR value is not an integer or out of range");
+		}else{
+			appendResultError(output, result);
+		}
+	}
+	// 目标key已经存在时返回错误，不覆盖
+	void onRename(const ArgumentVector& args, std::string& output){
+		uint64 index = 0;
+		uint64 newIndex = 0;
+		bool isIndex = parseIndexKey(args[1], index);
+		if(isIndex != parseIndexKey(args[2], newIndex)){
+			appendError(output, "ERR string key and number key can not rename to each other");
+			return;
+		}
+		int result;
+		if(isIndex){
+			result = m_pDB->m_pDB->replace(index, newIndex);
+		}else{
+			result = m_pDB->m_pDB->replace(args[1].data(), (uint64)args[1].size(), args[2].data(), (uint64)args[2].size());
+		}
+		if(FILE_OK == result){
+			appendStatus(output, "OK");
+		}else if(FERR_KEY_NOT_FOUND == result){
+			appendError(output, "ERR no such key");
+		}else if(FERR_KEY_ALREADY_EXIST == result){
+			appendError(output, "ERR target key already exists");
+		}else{
+			appendResultError(output, result);
+		}
+	}
+};
+
+// 一个事件循环：自己监听端口，接受的连接只在这个线程中处理
+class EventLoop
+{
+public:
+	typedef std::unordered_map<int, Connection*> ConnectionMap;
+	CommandHandler m_handler;
+	int m_port;
+	int m_listenFd;
+	int m_epollFd;
+	bool m_isExpire;				// 负责定时回收过期的key
+	uint32 m_lastExpire;			// 上一次回收的时间（秒）
+	ConnectionMap m_connections;
+	ArgumentVector m_args;
+public:
+	EventLoop(AlphaKV* pDB, int port, bool isExpire) : m_handler(pDB), m_port(port), m_listenFd(-1), m_epollFd(-1), m_isExpire(isExpire), m_lastExpire(0){}
+	virtual ~EventLoop(void){
+		for(ConnectionMap::iterator it=m_connections.begin(); it!=m_connections.end(); ++it){
+			close(it->first);
+			delete it->second;
+		}
+		if(-1 != m_listenFd){
+			close(m_listenFd);
+		}
+		if(-1 != m_epollFd){
+			close(m_epollFd);
+		}
+	}
+	bool initialize(void){
+		m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(-1 == m_listenFd){
+			fprintf(stderr, "EventLoop socket failed errno=%d\n", errno);
+			return false;
+		}
+		int on = 1;
+		setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(0 != setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))){
+			fprintf(stderr, "EventLoop SO_REUSEPORT failed errno=%d\n", errno);
+			return false;
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((uint16_t)m_port);
+		if(0 != bind(m_listenFd, (struct sockaddr*)&addr, sizeof(addr)) || 0 != listen(m_listenFd, SOMAXCONN)){
+			fprintf(stderr, "EventLoop bind or listen failed port=%d errno=%d\n", m_port, errno);
+			return false;
+		}
+		m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if(-1 == m_epollFd){
+			fprintf(stderr, "EventLoop epoll_create1 failed errno=%d\n", errno);
+			return false;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = m_listenFd;
+		return (0 == epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &ev));
+	}
+	void run(void){
+		struct epoll_event events[SERVER_MAX_EVENTS];
+		while(!g_isStop){
+			int n = epoll_wait(m_epollFd, events, SERVER_MAX_EVENTS, SERVER_WAIT_MS);
+			for(int i=0; i<n; ++i){
+				int fd = events[i].data.fd;
+				if(fd == m_listenFd){
+					onAccept();
+					continue;
+				}
+				ConnectionMap::iterator it = m_connections.find(fd);
+				if(it == m_connections.end()){
+					continue;
+				}
+				Connection* pConn = it->second;
+				bool ok = true;
+				if(events[i].events & (EPOLLERR | EPOLLHUP)){
+					ok = false;
+				}
+				if(ok && (events[i].events & EPOLLIN)){
+					ok = onRead(pConn);
+				}
+				if(ok && (events[i].events & EPOLLOUT)){
+					ok = onWrite(pConn);
+				}
+				if(!ok){
+					closeConnection(pConn);
+				}
+			}
+			// 每秒回收一次过期的key
+			if(m_isExpire && getTimeSecond() != m_lastExpire){
+				m_lastExpire = getTimeSecond();
+				m_handler.m_pDB->expireCycle(SERVER_EXPIRE_COUNT);
+			}
+		}
+	}
+protected:
+	void onAccept(void){
+		while(true){
+			int fd = accept4(m_listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(-1 == fd){
+				return;
+			}
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			if(0 != epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev)){
+				close(fd);
+				continue;
+			}
+			m_connections[fd] = new Connection(fd);
+		}
+	}
+	// 读完当前可读的数据，执行其中所有完整的命令，回复合并后写出
+	bool onRead(Connection* pConn){
+		char buffer[SERVER_READ_SIZE];
+		while(true){
+			ssize_t n = read(pConn->fd, buffer, sizeof(buffer));
+			if(n > 0){
+				pConn->input.append(buffer, (size_t)n);
+				continue;
+			}
+			if(0 == n){
+				return false;
+			}
+			if(EINTR == errno){
+				continue;
+			}
+			if(EAGAIN == errno || EWOULDBLOCK == errno){
+				break;
+			}
+			return false;
+		}
+		size_t offset = 0;
+		while(!pConn->isClosing && offset < pConn->input.size()){
+			int ret = parseCommand(pConn->input, offset, m_args);
+			if(0 == ret){
+				break;
+			}
+			if(-1 == ret){
+				appendError(pConn->output, "ERR Protocol error");
+				pConn->isClosing = true;
+				break;
+			}
+			if(!m_handler.execute(m_args, pConn->output)){
+				pConn->isClosing = true;
+			}
+		}
+		pConn->input.erase(0, offset);
+		return onWrite(pConn);
+	}
+	// 写出回复，写不完时注册EPOLLOUT等待可写；返回false表示需要关闭连接
+	bool onWrite(Connection* pConn){
+		while(pConn->outputOffset < pConn->output.size()){
+			ssize_t n = write(pConn->fd, pConn->output.data() + pConn->outputOffset, pConn->output.size() - pConn->outputOffset);
+			if(n > 0){
+				pConn->outputOffset += (size_t)n;
+				continue;
+			}
+			if(n < 0 && EINTR == errno){
+				continue;
+			}
+			if(n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)){
+				return setWriting(pConn, true);
+			}
+			return false;
+		}
+		pConn->output.clear();
+		pConn->outputOffset = 0;
+		if(pConn->isClosing){
+			return false;
+		}
+		return setWriting(pConn, false);
+	}
+	bool setWriting(Connection* pConn, bool isWriting){
+		if(pConn->isWriting == isWriting){
+			return true;
+		}
+		struct epoll_event ev;
+		ev.events = isWriting ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+		ev.data.fd = pConn->fd;
+		pConn->isWriting = isWriting;
+		return (0 == epoll_ctl(m_epollFd, EPOLL_CTL_MOD, pConn->fd, &ev));
+	}
+	void closeConnection(Connection* pConn){
+		epoll_ctl(m_epollFd, EPOLL_CTL_DEL, pConn->fd, NULL);
+		close(pConn->fd);
+		m_connections.erase(pConn->fd);
+		delete pConn;
+	}
+};
+
+int main(int argc, const char * argv[]) {
+	int port = SERVER_DEFAULT_PORT;
+	std::string name = SERVER_DEFAULT_DB;
+	int threadCount = (int)std::thread::hardware_concurrency();
+	for(int i=1; i+1<argc; i+=2){
+		if(0 == strcmp(argv[i], "-p")){
+			port = atoi(argv[i+1]);
+		}else if(0 == strcmp(argv[i], "-d")){
+			name = argv[i+1];
+		}else if(0 == strcmp(argv[i], "-t")){
+			threadCount = atoi(argv[i+1]);
+		}
+	}
+	threadCount = std::max(threadCount, 1);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, onStopSignal);
+	signal(SIGTERM, onStopSignal);
+
+	AlphaKV* pDB = new AlphaKV();
+	if(!pDB->openDB(name.c_str())){
+		fprintf(stderr, "server open db failed name=%s\n", name.c_str());
+		return 1;
+	}
+	pDB->setThreadSafe(true);
+	std::vector<EventLoop*> loops;
+	for(int i=0; i<threadCount; ++i){
+		EventLoop* pLoop = new EventLoop(pDB, port, (0 == i));
+		loops.push_back(pLoop);
+		if(!pLoop->initialize()){
+			return 1;
+		}
+	}
+	fprintf(stderr, "server listen port=%d db=%s threads=%d\n", port, name.c_str(), threadCount);
+	std::vector<std::thread> threads;
+	for(size_t i=0; i<loops.size(); ++i){
+		threads.push_back(std::thread(&EventLoop::run, loops[i]));
+	}
+	for(size_t i=0; i<threads.size(); ++i){
+		threads[i].join();
+		delete loops[i];
+	}
+	pDB->closeDB();
+	delete pDB;
+	fprintf(stderr, "server stopped\n");
+	return 0;
+}
@@ -0,0 +1,413 @@
+//
+//  shard.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/16.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef shard_hpp
+#define shard_hpp
+
+#include "keyvalue.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+NS_HIVE_BEGIN
+
+#define SHARD_HASH_SEED 0x9E3779B9		// 分片使用的哈希种子，和分片内部分槽的哈希不同，避免每个分片只用到一部分槽
+#define SHARD_META_EXT ".s"				// 每个分片的标记文件，记录分片编号和分片数量
+
+// 分片的工作线程：按顺序执行投递过来的任务，分片的数据只由这个线程访问
+class ShardWorker
+{
+public:
+	typedef std::function<void(void)> Task;
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<Task> m_tasks;
+	bool m_isStop;
+public:
+	ShardWorker(void) : m_isStop(false){
+		m_thread = std::thread(&ShardWorker::run, this);
+	}
+	virtual ~ShardWorker(void){
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_isStop = true;
+		}
+		m_condition.notify_one();
+		m_thread.join();
+	}
+	inline void post(const Task& task){
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_tasks.push_back(task);
+		}
+		m_condition.notify_one();
+	}
+protected:
+	// 停止时先执行完已经投递的任务
+	void run(void){
+		while(true){
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_condition.wait(lock, [this](){ return m_isStop || !m_tasks.empty(); });
+				if(m_tasks.empty()){
+					return;
+				}
+				task = m_tasks.front();
+				m_tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+// 分片数据库：key按哈希分到N个独立的存储引擎，每个分片有自己的文件、空闲块分配和缓存，分片可以放在不同的目录或者磁盘上；
+// 使用工作线程时每个分片由自己的线程访问（不共享数据，通过投递任务通信），多个线程可以同时调用；
+// 不使用工作线程时在调用线程中直接执行，批量操作按分片拆开后并行执行；
+// 分片的数量和顺序决定key的位置，打开时检查每个分片的标记文件，不能改变
+template <typename _DB_>
+class ShardDB
+{
+public:
+	typedef _DB_ KeyValueData;
+	typedef std::vector<KeyValueData*> ShardVector;
+	typedef std::vector<ShardWorker*> WorkerVector;
+	typedef std::function<int(KeyValueData* pDB)> ShardCall;
+	typedef std::function<int(size_t shard, KeyValueData* pDB)> ShardBatchCall;
+	ShardVector m_shards;
+	WorkerVector m_workers;				// 每个分片一个工作线程，不使用工作线程时为空
+public:
+	ShardDB(void){}
+	virtual ~ShardDB(void){
+		closeDB();
+	}
+	// 打开count个分片，分片的文件名为name.00000000 - name.(count-1)
+	bool openDB(const char* name, uint32 count, bool isThreaded){
+		std::vector<std::string> names;
+		for(uint32 i=0; i<count; ++i){
+			names.push_back(std::string(name) + getNumberExt(i, ""));
+		}
+		return openDB(names, isThreaded);
+	}
+	// 按names打开分片，每个分片可以指定不同的目录；isThreaded为true时每个分片使用自己的工作线程
+	bool openDB(const std::vector<std::string>& names, bool isThreaded){
+		if(!m_shards.empty() || names.empty()){
+			return false;
+		}
+		for(size_t i=0; i<names.size(); ++i){
+			KeyValueData* pDB = new KeyValueData(names[i]);
+			m_shards.push_back(pDB);
+			if(FILE_OK != checkShardMeta(names[i], (uint32)i, (uint32)names.size()) || FILE_OK != pDB->openDB()){
+				closeDB();
+				return false;
+			}
+		}
+		if(isThreaded){
+			for(size_t i=0; i<m_shards.size(); ++i){
+				m_workers.push_back(new ShardWorker());
+			}
+		}
+		return true;
+	}
+	void closeDB(void){
+		// 先停止工作线程，等待已经投递的任务执行完
+		for(size_t i=0; i<m_workers.size(); ++i){
+			delete m_workers[i];
+		}
+		m_workers.clear();
+		for(size_t i=0; i<m_shards.size(); ++i){
+			m_shards[i]->closeDB();
+			delete m_shards[i];
+		}
+		m_shards.clear();
+	}
+	inline size_t getShardCount(void) const {
+		return m_shards.size();
+	}
+	inline KeyValueData* getShard(size_t index){
+		return m_shards[index];
+	}
+	// key所在的分片
+	inline size_t getShardIndex(const char* key, uint32 keyLength) const {
+		return (size_t)(binary_hash(key, (int)keyLength, SHARD_HASH_SEED) % m_shards.size());
+	}
+	inline size_t getShardIndex(uint64 key) const {
+		uint64 h = key * 0x9E3779B97F4A7C15ULL;
+		return (size_t)((h ^ (h >> 32)) % m_shards.size());
+	}
+	// 不使用工作线程时，多个线程同时调用需要打开每个分片的线程安全模式
+	void setThreadSafe(bool enable){
+		callAll([enable](KeyValueData* pDB){ pDB->setThreadSafe(enable); return (int)FILE_OK; });
+	}
+	// 缓存的内存上限平均分给每个分片
+	void setCacheSize(uint64 capacity){
+		int64 shardCapacity = (int64)(capacity / m_shards.size());
+		callAll([shardCapacity](KeyValueData* pDB){ pDB->setCacheSize(shardCapacity); return (int)FILE_OK; });
+	}
+	void setInlineLength(int32 length){
+		callAll([length](KeyValueData* pDB){ pDB->setInlineLength((int64)length); return (int)FILE_OK; });
+	}
+	void setCompress(int codec, uint32 threshold){
+		callAll([codec, threshold](KeyValueData* pDB){ pDB->setCompress(codec, threshold); return (int)FILE_OK; });
+	}
+	// 回收到期的key，每个分片最多处理maxCount个
+	int64 expireCycle(int64 maxCount){
+		std::vector<int64> counts(m_shards.size(), 0);
+		callAll([&counts, maxCount, this](KeyValueData* pDB){
+			counts[getShardPosition(pDB)] = pDB->expireCycle(maxCount);
+			return (int)FILE_OK;
+		});
+		int64 total = 0;
+		for(size_t i=0; i<counts.size(); ++i){
+			total += counts[i];
+		}
+		return total;
+	}
+
+	bool get(const char* key, uint32 keyLength, CharVector& value){
+		int result = callShard(getShardIndex(key, keyLength), [&](KeyValueData* pDB){ return pDB->getValue(key, keyLength, value); });
+		return (FILE_OK == result);
+	}
+	bool get(const char* key, uint32 keyLength, char* buffer, uint32 bufferSize, uint32* length){
+		int64 valueLength = 0;
+		int result = callShard(getShardIndex(key, keyLength), [&](KeyValueData* pDB){ return pDB->get(key, keyLength, buffer, bufferSize, &valueLength); });
+		*length = (uint32)valueLength;
+		return (FILE_OK == result);
+	}
+	bool set(const char* key, uint32 keyLength, const char* value, uint32 valueLength){
+		int result = callShard(getShardIndex(key, keyLength), [&](KeyValueData* pDB){ return pDB->set(key, keyLength, value, valueLength, true, false); });
+		return (FILE_OK == result);
+	}
+	bool setex(const char* key, uint32 keyLength, const char* value, uint32 valueLength, uint32 seconds){
+		uint32 expire = getTimeSecond() + seconds;
+		int result = callShard(getShardIndex(key, keyLength), [&](KeyValueData* pDB){ return pDB->set(key, keyLength, value, valueLength, true, false, VALUE_CODEC_DEFAULT, expire); });
+		return (FILE_OK == result);
+	}
+	bool del(const char* key, uint32 keyLength){
+		int result = callShard(getShardIndex(key, keyLength), [&](KeyValueData* pDB){ return pDB->del(key, keyLength); });
+		return (FILE_OK == result);
+	}
+	// 两个key在同一个分片时直接修改key记录；不在同一个分片时复制value到新的分片再删除，这种情况不是原子操作
+	bool replace(const char* key, uint32 length, const char* newKey, uint32 newLength){
+		size_t from = getShardIndex(key, length);
+		size_t to = getShardIndex(newKey, newLength);
+		if(from == to){
+			int result = callShard(from, [&](KeyValueData* pDB){ return pDB->replace(key, length, newKey, newLength); });
+			return (FILE_OK == result);
+		}
+		uint32 expire = 0;
+		int result = callShard(to, [&](KeyValueData* pDB){ return pDB->getExpire(newKey, newLength, expire); });
+		if(FILE_OK == result){
+			return false;
+		}
+		CharVector value;
+		result = callShard(from, [&](KeyValueData* pDB){
+			int ret = pDB->getExpire(key, length, expire);
+			return (FILE_OK == ret) ? pDB->getValue(key, length, value) : ret;
+		});
+		if(FILE_OK != result){
+			return false;
+		}
+		result = callShard(to, [&](KeyValueData* pDB){ return pDB->set(newKey, newLength, value.data(), (int64)value.size(), true, true, VALUE_CODEC_DEFAULT, expire); });
+		if(FILE_OK != result){
+			return false;
+		}
+		result = callShard(from, [&](KeyValueData* pDB){ return pDB->del(key, length); });
+		return (FILE_OK == result);
+	}
+	// 批量写入：按分片拆开并行写入；不是原子操作，每个key各自生效，失败时其它分片和同一个分片中的一部分key可能已经写入
+	bool mset(const KeySetEntryVector& entries){
+		std::vector<KeySetEntryVector> groups(m_shards.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			groups[getShardIndex(entries[i].key, (uint32)entries[i].keyLen)].push_back(entries[i]);
+		}
+		int result = callGroups(groups, [&groups](size_t shard, KeyValueData* pDB){ return pDB->mset(groups[shard], false); });
+		return (FILE_OK == result);
+	}
+	// 批量读取：按分片拆开并行读取，value直接写入每个数据项的缓冲区
+	bool mget(KeyGetEntryVector& entries){
+		std::vector<KeyGetEntryVector> groups(m_shards.size());
+		std::vector< std::vector<size_t> > positions(m_shards.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			size_t shard = getShardIndex(entries[i].key, (uint32)entries[i].keyLen);
+			groups[shard].push_back(entries[i]);
+			positions[shard].push_back(i);
+		}
+		int result = callGroups(groups, [&groups](size_t shard, KeyValueData* pDB){ return pDB->mget(groups[shard]); });
+		copyResults(groups, positions, entries);
+		return (FILE_OK == result);
+	}
+
+	bool get(uint64 key, CharVector& value){
+		int result = callShard(getShardIndex(key), [&](KeyValueData* pDB){ return pDB->getValue(key, value); });
+		return (FILE_OK == result);
+	}
+	bool get(uint64 key, char* buffer, uint32 bufferSize, uint32* length){
+		int64 valueLength = 0;
+		int result = callShard(getShardIndex(key), [&](KeyValueData* pDB){ return pDB->get(key, buffer, bufferSize, &valueLength); });
+		*length = (uint32)valueLength;
+		return (FILE_OK == result);
+	}
+	bool set(uint64 key, const char* value, uint32 valueLength){
+		int result = callShard(getShardIndex(key), [&](KeyValueData* pDB){ return pDB->set(key, value, valueLength, true, false); });
+		return (FILE_OK == result);
+	}
+	bool setex(uint64 key, const char* value, uint32 valueLength, uint32 seconds){
+		uint32 expire = getTimeSecond() + seconds;
+		int result = callShard(getShardIndex(key), [&](KeyValueData* pDB){ return pDB->set(key, value, valueLength, true, false, VALUE_CODEC_DEFAULT, expire); });
+		return (FILE_OK == result);
+	}
+	bool del(uint64 key){
+		int result = callShard(getShardIndex(key), [&](KeyValueData* pDB){ return pDB->del(key); });
+		return (FILE_OK == result);
+	}
+	bool replace(uint64 key, uint64 newKey){
+		size_t from = getShardIndex(key);
+		size_t to = getShardIndex(newKey);
+		if(from == to){
+			int result = callShard(from, [&](KeyValueData* pDB){ return pDB->replace(key, newKey); });
+			return (FILE_OK == result);
+		}
+		uint32 expire = 0;
+		int result = callShard(to, [&](KeyValueData* pDB){ return pDB->getExpire(newKey, expire); });
+		if(FILE_OK == result){
+			return false;
+		}
+		CharVector value;
+		result = callShard(from, [&](KeyValueData* pDB){
+			int ret = pDB->getExpire(key, expire);
+			return (FILE_OK == ret) ? pDB->getValue(key, value) : ret;
+		});
+		if(FILE_OK != result){
+			return false;
+		}
+		result = callShard(to, [&](KeyValueData* pDB){ return pDB->set(newKey, value.data(), (int64)value.size(), true, true, VALUE_CODEC_DEFAULT, expire); });
+		if(FILE_OK != result){
+			return false;
+		}
+		result = callShard(from, [&](KeyValueData* pDB){ return pDB->del(key); });
+		return (FILE_OK == result);
+	}
+	bool mset(const IndexSetEntryVector& entries){
+		std::vector<IndexSetEntryVector> groups(m_shards.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			groups[getShardIndex(entries[i].key)].push_back(entries[i]);
+		}
+		int result = callGroups(groups, [&groups](size_t shard, KeyValueData* pDB){ return pDB->mset(groups[shard], false); });
+		return (FILE_OK == result);
+	}
+	bool mget(IndexGetEntryVector& entries){
+		std::vector<IndexGetEntryVector> groups(m_shards.size());
+		std::vector< std::vector<size_t> > positions(m_shards.size());
+		for(size_t i=0; i<entries.size(); ++i){
+			size_t shard = getShardIndex(entries[i].key);
+			groups[shard].push_back(entries[i]);
+			positions[shard].push_back(i);
+		}
+		int result = callGroups(groups, [&groups](size_t shard, KeyValueData* pDB){ return pDB->mget(groups[shard]); });
+		copyResults(groups, positions, entries);
+		return (FILE_OK == result);
+	}
+protected:
+	// 在分片上执行call：使用工作线程时投递给分片的线程并等待结果，否则直接执行
+	inline int callShard(size_t index, const ShardCall& call){
+		if(m_workers.empty()){
+			return call(m_shards[index]);
+		}
+		std::future<int> result = postShard(index, std::bind(call, m_shards[index]));
+		return result.get();
+	}
+	inline std::future<int> postShard(size_t index, const std::function<int(void)>& call){
+		std::shared_ptr< std::packaged_task<int(void)> > pTask = std::make_shared< std::packaged_task<int(void)> >(call);
+		std::future<int> result = pTask->get_future();
+		m_workers[index]->post([pTask](){ (*pTask)(); });
+		return result;
+	}
+	// 有数据的分片并行执行call，返回第一个错误
+	template <typename _GROUP_>
+	inline int callGroups(const std::vector<_GROUP_>& groups, const ShardBatchCall& call){
+		std::vector<size_t> shards;
+		for(size_t i=0; i<groups.size(); ++i){
+			if(!groups[i].empty()){
+				shards.push_back(i);
+			}
+		}
+		return callShards(shards, call);
+	}
+	inline int callAll(const ShardCall& call){
+		std::vector<size_t> shards;
+		for(size_t i=0; i<m_shards.size(); ++i){
+			shards.push_back(i);
+		}
+		return callShards(shards, [&call](size_t shard, KeyValueData* pDB){ return call(pDB); });
+	}
+	// 使用工作线程时投递到各自的线程；否则第一个分片在调用线程中执行，其余的使用新的线程
+	inline int callShards(const std::vector<size_t>& shards, const ShardBatchCall& call){
+		if(shards.empty()){
+			return FILE_OK;
+		}
+		std::vector< std::future<int> > futures;
+		int result = FILE_OK;
+		if(m_workers.empty()){
+			for(size_t i=1; i<shards.size(); ++i){
+				futures.push_back(std::async(std::launch::async, call, shards[i], m_shards[shards[i]]));
+			}
+			result = call(shards[0], m_shards[shards[0]]);
+		}else{
+			for(size_t i=0; i<shards.size(); ++i){
+				futures.push_back(postShard(shards[i], std::bind(call, shards[i], m_shards[shards[i]])));
+			}
+		}
+		for(size_t i=0; i<futures.size(); ++i){
+			int ret = futures[i].get();
+			if(FILE_OK == result){
+				result = ret;
+			}
+		}
+		return result;
+	}
+	inline size_t getShardPosition(const KeyValueData* pDB) const {
+		return (size_t)(std::find(m_shards.begin(), m_shards.end(), pDB) - m_shards.begin());
+	}
+	// 批量读取的结果复制回调用者的数据项，value已经直接写入了调用者的缓冲区
+	template <typename _ENTRY_VECTOR_>
+	inline void copyResults(const std::vector<_ENTRY_VECTOR_>& groups, const std::vector< std::vector<size_t> >& positions, _ENTRY_VECTOR_& entries){
+		for(size_t shard=0; shard<groups.size(); ++shard){
+			for(size_t i=0; i<groups[shard].size(); ++i){
+				entries[positions[shard][i]].length = groups[shard][i].length;
+				entries[positions[shard][i]].result = groups[shard][i].result;
+			}
+		}
+	}
+	// 检查分片的标记文件：新的分片写入编号和数量，已有的分片必须和打开时的位置一致
+	inline int checkShardMeta(const std::string& name, uint32 index, uint32 count){
+		File meta(name, SHARD_META_EXT);
+		if(FILE_OK != meta.touchFile(NULL, 0) || !meta.openReadWrite("rb+")){
+			return FERR_OPENRW_FAILED;
+		}
+		uint32 info[2] = {index, count};
+		if(0 == meta.m_fileLength){
+			if(!meta.saveData(info, sizeof(info), 0, 0, false)){
+				return FERR_BLOCK_SET_FAILED;
+			}
+			meta.flush();
+			return FILE_OK;
+		}
+		uint32 saved[2] = {0, 0};
+		if((int64)sizeof(saved) != meta.seekRead(saved, 1, sizeof(saved), 0, SEEK_SET) || saved[0] != index || saved[1] != count){
+			fprintf(stderr, "ShardDB shard mismatch file=%s index=%u/%u count=%u/%u\n", meta.m_fileName.c_str(), saved[0], index, saved[1], count);
+			return FERR_SHARD_MISMATCH;
+		}
+		return FILE_OK;
+	}
+};
+
+NS_HIVE_END
+
+#endif /* shard_hpp */
@@ -0,0 +1,344 @@
+//
+//  stats.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/21.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef stats_hpp
+#define stats_hpp
+
+#include "lock.hpp"
+#include "cache.hpp"
+#include "histogram.hpp"
+#include "idle.hpp"
+
+NS_HIVE_BEGIN
+
+#define STATS_HISTOGRAM_SUB_BITS 5			// 运行统计的直方图精度：每个数量级16个子桶，相对误差不超过1/16，每个线程每种操作约8KB
+#define STATS_LATENCY_SAMPLE_RATE 64		// 每个线程每64次操作记录一次延迟（读时钟比一次内存中的读取还慢）；操作次数不采样
+
+typedef Histogram<STATS_HISTOGRAM_SUB_BITS> StatHistogram;
+
+// 记录次数和延迟的操作
+enum StatOp{
+	STAT_OP_GET = 0,
+	STAT_OP_SET,
+	STAT_OP_DEL,
+	STAT_OP_MGET,
+	STAT_OP_MSET,
+	STAT_OP_COUNT,
+};
+static const char* STAT_OP_NAMES[STAT_OP_COUNT] = {"get", "set", "del", "mget", "mset"};
+
+// 存储引擎内部的计数
+enum StatCounter{
+	STAT_SET_INLINE = 0,			// value内联保存在key记录中
+	STAT_SET_LARGE,					// 大数据分段保存
+	STAT_SET_NEW,					// key原来没有数据块，分配新的数据块
+	STAT_SET_INPLACE,				// 数据块大小不变，原地覆盖
+	STAT_SET_RELOCATE,				// 数据块大小变化或者有快照，写到新的位置并回收原来的数据块
+	STAT_IDLE_HIT,					// 分配数据块时使用了空闲数据块
+	STAT_IDLE_MISS,					// 没有合适的空闲数据块，在文件末尾分配
+	STAT_VALUE_FILE_EXTEND,			// 以下由文件记录：数据文件变长的次数和长度
+	STAT_VALUE_FILE_EXTEND_BYTES,
+	STAT_KEY_FILE_EXTEND,
+	STAT_KEY_FILE_EXTEND_BYTES,
+	STAT_INDEX_FILE_EXTEND,
+	STAT_INDEX_FILE_EXTEND_BYTES,
+	STAT_COUNTER_COUNT,
+};
+static const char* STAT_COUNTER_NAMES[STAT_COUNTER_COUNT] = {
+	"set_inline", "set_large", "set_new", "set_inplace", "set_relocate", "idle_hit", "idle_miss",
+	"value_file_extend", "value_file_extend_bytes", "key_file_extend", "key_file_extend_bytes", "index_file_extend", "index_file_extend_bytes",
+};
+
+// 只有一个线程写入的原子计数：不需要原子加法，统计读取只会看到稍旧的值
+inline void addStat(std::atomic<uint64>& stat, uint64 value){
+	stat.store(stat.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// 一个线程写入、其它线程读取的延迟直方图，分桶与StatHistogram相同
+class AtomicHistogram
+{
+public:
+	std::atomic<uint64> m_counts[StatHistogram::BUCKET_COUNT];
+	std::atomic<uint64> m_sum;
+	std::atomic<uint64> m_min;
+	std::atomic<uint64> m_max;
+public:
+	AtomicHistogram(void) : m_sum(0), m_min((uint64)-1), m_max(0){
+		for(size_t i=0; i<StatHistogram::BUCKET_COUNT; ++i){
+			m_counts[i].store(0, std::memory_order_relaxed);
+		}
+	}
+	inline void record(uint64 value){
+		addStat(m_counts[StatHistogram::getBucket(value)], 1);
+		addStat(m_sum, value);
+		if(value < m_min.load(std::memory_order_relaxed)){
+			m_min.store(value, std::memory_order_relaxed);
+		}
+		if(value > m_max.load(std::memory_order_relaxed)){
+			m_max.store(value, std::memory_order_relaxed);
+		}
+	}
+	// 合并到histogram
+	inline void collect(StatHistogram& histogram) const {
+		uint64 count = 0;
+		for(size_t i=0; i<StatHistogram::BUCKET_COUNT; ++i){
+			uint64 n = m_counts[i].load(std::memory_order_relaxed);
+			histogram.m_counts[i] += n;
+			count += n;
+		}
+		if(0 == count){
+			return;
+		}
+		histogram.m_count += count;
+		histogram.m_sum += m_sum.load(std::memory_order_relaxed);
+		histogram.m_min = std::min(histogram.m_min, m_min.load(std::memory_order_relaxed));
+		histogram.m_max = std::max(histogram.m_max, m_max.load(std::memory_order_relaxed));
+	}
+};
+
+// 一个线程的统计，只由这个线程写入
+typedef struct StatShard{
+	std::atomic<uint64> counts[STAT_OP_COUNT];
+	std::atomic<uint64> misses[STAT_OP_COUNT];		// 返回FERR_KEY_NOT_FOUND
+	std::atomic<uint64> errors[STAT_OP_COUNT];		// 返回其它错误
+	std::atomic<uint64> counters[STAT_COUNTER_COUNT];
+	AtomicHistogram latencies[STAT_OP_COUNT];
+	uint32 sample;									// 延迟采样的计数
+	StatShard(void) : sample(0){
+		for(int i=0; i<STAT_OP_COUNT; ++i){
+			counts[i].store(0, std::memory_order_relaxed);
+			misses[i].store(0, std::memory_order_relaxed);
+			errors[i].store(0, std::memory_order_relaxed);
+		}
+		for(int i=0; i<STAT_COUNTER_COUNT; ++i){
+			counters[i].store(0, std::memory_order_relaxed);
+		}
+	}
+}StatShard;
+
+// 某一时刻的统计，各线程的数据相加
+typedef struct StatSnapshot{
+	uint64 counts[STAT_OP_COUNT];
+	uint64 misses[STAT_OP_COUNT];
+	uint64 errors[STAT_OP_COUNT];
+	uint64 counters[STAT_COUNTER_COUNT];
+	StatHistogram latencies[STAT_OP_COUNT];		// 采样的延迟，单位纳秒
+	CacheStat cache;
+	StatSnapshot(void){
+		memset(counts, 0, sizeof(counts));
+		memset(misses, 0, sizeof(misses));
+		memset(errors, 0, sizeof(errors));
+		memset(counters, 0, sizeof(counters));
+	}
+	// 文本格式，每行一个"名称:数值"
+	void toText(std::string& text) const {
+		char line[256];
+		text.append("# operations\n");
+		for(int op=0; op<STAT_OP_COUNT; ++op){
+			const StatHistogram& h = latencies[op];
+			snprintf(line, sizeof(line), "%s_count:%llu\n%s_miss:%llu\n%s_error:%llu\n"
+				"%s_latency_us:samples=%llu,mean=%.2f,p50=%.2f,p99=%.2f,p999=%.2f,max=%.2f\n",
+				STAT_OP_NAMES[op], (unsigned long long)counts[op], STAT_OP_NAMES[op], (unsigned long long)misses[op],
+				STAT_OP_NAMES[op], (unsigned long long)errors[op], STAT_OP_NAMES[op], (unsigned long long)h.getCount(),
+				h.getMean() / 1000.0, h.getPercentile(50) / 1000.0, h.getPercentile(99) / 1000.0, h.getPercentile(99.9) / 1000.0, h.getMax() / 1000.0);
+			text.append(line);
+		}
+		text.append("# engine\n");
+		for(int i=0; i<STAT_COUNTER_COUNT; ++i){
+			snprintf(line, sizeof(line), "%s:%llu\n", STAT_COUNTER_NAMES[i], (unsigned long long)counters[i]);
+			text.append(line);
+		}
+		text.append("# cache\n");
+		snprintf(line, sizeof(line), "cache_hit:%llu\ncache_miss:%llu\ncache_evict:%llu\ncache_reject:%llu\ncache_entries:%llu\ncache_used:%lld\ncache_capacity:%lld\n",
+			(unsigned long long)cache.hitCount, (unsigned long long)cache.missCount, (unsigned long long)cache.evictCount,
+			(unsigned long long)cache.rejectCount, (unsigned long long)cache.entryCount, (long long)cache.usedSize, (long long)cache.capacity);
+		text.append(line);
+	}
+}StatSnapshot;
+
+// 空间统计：数据文件的有效数据和碎片、key和index文件中已经删除的记录；长度为字节，块为BLOCK_SIZE字节
+typedef struct SpaceStat{
+	uint64 valueFileBytes;				// 数据文件长度
+	uint64 valueFileBlocks;				// 数据文件的块数量
+	uint64 allocatedBlocks;				// 已分配的块：文件的块减去空闲块
+	uint64 freeBlocks;					// 空闲块
+	uint64 freeRuns;					// 空闲段（连续的空闲块）的数量
+	uint64 largestFreeRun;				// 最大的空闲段的块数量
+	uint64 freeRunCounts[IDLE_RUN_BUCKET_NUMBER];	// 按长度分桶的空闲段数量，第i个桶为[2^i, 2^(i+1))块
+	uint64 freeRunBlocks[IDLE_RUN_BUCKET_NUMBER];	// 按长度分桶的空闲块数量
+	uint64 liveValues;					// key记录引用的保存在数据块中的value数量，不包括内联的value
+	uint64 liveBlocks;					// 这些value占用的块，大数据包括分段清单
+	uint64 liveBytes;					// 这些value的数据长度（压缩后），不包括长度记录和校验码
+	uint64 roundingWaste;				// liveBlocks中不是value数据的部分：长度记录、校验码、对齐到块的填充和大数据的分段清单
+	uint64 unreclaimedBlocks;			// 已分配但是没有key引用的块：快照释放后才回收的数据块
+	uint64 keyFileBytes;				// key文件长度
+	uint64 deadKeys;					// key文件中已经删除、等待重用的记录
+	uint64 deadKeyBytes;
+	uint64 indexFileBytes;				// index文件长度
+	uint64 deadIndexes;					// index文件中已经删除、等待重用的记录
+	uint64 deadIndexBytes;
+	SpaceStat(void){
+		memset(this, 0, sizeof(SpaceStat));
+	}
+	// 数据文件长度和有效数据长度的比值
+	inline double getSpaceAmplification(void) const {
+		return (0 == liveBytes) ? 0.0 : (double)valueFileBytes / (double)liveBytes;
+	}
+	// 空闲块的碎片程度：0表示所有空闲块连续，接近1表示空闲块分散成很多小段
+	inline double getFragmentation(void) const {
+		return (0 == freeBlocks) ? 0.0 : 1.0 - (double)largestFreeRun / (double)freeBlocks;
+	}
+	// 文本格式，每行一个"名称:数值"
+	void toText(std::string& text) const {
+		char line[256];
+		text.append("# space\n");
+		snprintf(line, sizeof(line), "value_file_bytes:%llu\nvalue_file_blocks:%llu\nallocated_blocks:%llu\nfree_blocks:%llu\nfree_runs:%llu\nlargest_free_run:%llu\n",
+			(unsigned long long)valueFileBytes, (unsigned long long)valueFileBlocks, (unsigned long long)allocatedBlocks,
+			(unsigned long long)freeBlocks, (unsigned long long)freeRuns, (unsigned long long)largestFreeRun);
+		text.append(line);
+		for(int i=0; i<IDLE_RUN_BUCKET_NUMBER; ++i){
+			if(0 == freeRunCounts[i]){
+				continue;
+			}
+			snprintf(line, sizeof(line), "free_runs_%llu:runs=%llu,blocks=%llu\n", 1ULL << i, (unsigned long long)freeRunCounts[i], (unsigned long long)freeRunBlocks[i]);
+			text.append(line);
+		}
+		snprintf(line, sizeof(line), "live_values:%llu\nlive_blocks:%llu\nlive_bytes:%llu\nrounding_waste:%llu\nunreclaimed_blocks:%llu\n",
+			(unsigned long long)liveValues, (unsigned long long)liveBlocks, (unsigned long long)liveBytes,
+			(unsigned long long)roundingWaste, (unsigned long long)unreclaimedBlocks);
+		text.append(line);
+		snprintf(line, sizeof(line), "space_amplification:%.2f\nfragmentation:%.4f\n", getSpaceAmplification(), getFragmentation());
+		text.append(line);
+		snprintf(line, sizeof(line), "key_file_bytes:%llu\ndead_keys:%llu\ndead_key_bytes:%llu\nindex_file_bytes:%llu\ndead_indexes:%llu\ndead_index_bytes:%llu\n",
+			(unsigned long long)keyFileBytes, (unsigned long long)deadKeys, (unsigned long long)deadKeyBytes,
+			(unsigned long long)indexFileBytes, (unsigned long long)deadIndexes, (unsigned long long)deadIndexBytes);
+		text.append(line);
+	}
+}SpaceStat;
+
+// 运行统计：每个线程使用自己的StatShard（按ReaderId分配，线程结束后编号连同统计留给新的线程），
+// 写入不加锁、不使用原子加法；编号用完的线程共用一个加锁的StatShard；读取时把所有线程的数据相加
+class Stats
+{
+public:
+	std::atomic<StatShard*> m_shards[LOCK_READER_SLOT_NUMBER];
+	StatShard m_sharedShard;
+	std::mutex m_sharedMutex;
+	std::atomic<bool> m_isEnabled;
+public:
+	Stats(void) : m_isEnabled(true){
+		for(int i=0; i<LOCK_READER_SLOT_NUMBER; ++i){
+			m_shards[i].store(NULL, std::memory_order_relaxed);
+		}
+	}
+	virtual ~Stats(void){
+		for(int i=0; i<LOCK_READER_SLOT_NUMBER; ++i){
+			delete m_shards[i].load();
+		}
+	}
+	inline void setEnabled(bool enabled){
+		m_isEnabled.store(enabled, std::memory_order_relaxed);
+	}
+	inline bool isEnabled(void) const {
+		return m_isEnabled.load(std::memory_order_relaxed);
+	}
+	// 当前线程的StatShard，编号用完时返回NULL
+	inline StatShard* getShard(void){
+		int id = ReaderId::get();
+		if(id < 0){
+			return NULL;
+		}
+		StatShard* pShard = m_shards[id].load(std::memory_order_acquire);
+		if(NULL == pShard){
+			pShard = new StatShard();
+			m_shards[id].store(pShard, std::memory_order_release);
+		}
+		return pShard;
+	}
+	inline void addCounter(int counter, uint64 value = 1){
+		if(!isEnabled()){
+			return;
+		}
+		StatShard* pShard = getShard();
+		if(NULL == pShard){
+			std::lock_guard<std::mutex> guard(m_sharedMutex);
+			addStat(m_sharedShard.counters[counter], value);
+			return;
+		}
+		addStat(pShard->counters[counter], value);
+	}
+	// 记录一次操作；start为0表示这次没有采样延迟
+	inline void finishOp(StatShard* pShard, int op, int result, uint64 start){
+		std::unique_lock<std::mutex> lock;
+		if(NULL == pShard){
+			lock = std::unique_lock<std::mutex>(m_sharedMutex);
+			pShard = &m_sharedShard;
+		}
+		addStat(pShard->counts[op], 1);
+		if(FERR_KEY_NOT_FOUND == result){
+			addStat(pShard->misses[op], 1);
+		}else if(FILE_OK != result){
+			addStat(pShard->errors[op], 1);
+		}
+		if(0 != start){
+			pShard->latencies[op].record(getTimeNanosecond() - start);
+		}
+	}
+	void collect(StatSnapshot& snapshot){
+		for(int i=0; i<LOCK_READER_SLOT_NUMBER; ++i){
+			StatShard* pShard = m_shards[i].load(std::memory_order_acquire);
+			if(NULL != pShard){
+				collectShard(*pShard, snapshot);
+			}
+		}
+		std::lock_guard<std::mutex> guard(m_sharedMutex);
+		collectShard(m_sharedShard, snapshot);
+	}
+protected:
+	static void collectShard(const StatShard& shard, StatSnapshot& snapshot){
+		for(int op=0; op<STAT_OP_COUNT; ++op){
+			snapshot.counts[op] += shard.counts[op].load(std::memory_order_relaxed);
+			snapshot.misses[op] += shard.misses[op].load(std::memory_order_relaxed);
+			snapshot.errors[op] += shard.errors[op].load(std::memory_order_relaxed);
+			shard.latencies[op].collect(snapshot.latencies[op]);
+		}
+		for(int i=0; i<STAT_COUNTER_COUNT; ++i){
+			snapshot.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+		}
+	}
+};
+
+// 一次操作的统计：构造时决定是否采样延迟，done记录结果并返回result
+class StatScope
+{
+public:
+	Stats* m_pStats;
+	StatShard* m_pShard;
+	int m_op;
+	uint64 m_start;
+public:
+	StatScope(Stats& stats, int op) : m_pStats(stats.isEnabled() ? &stats : NULL), m_pShard(NULL), m_op(op), m_start(0){
+		if(NULL == m_pStats){
+			return;
+		}
+		m_pShard = stats.getShard();
+		if(NULL != m_pShard && 0 == (m_pShard->sample++ % STATS_LATENCY_SAMPLE_RATE)){
+			m_start = getTimeNanosecond();
+		}
+	}
+	inline int done(int result){
+		if(NULL != m_pStats){
+			m_pStats->finishOp(m_pShard, m_op, result, m_start);
+		}
+		return result;
+	}
+};
+
+NS_HIVE_END
+
+#endif /* stats_hpp */
@@ -0,0 +1,1546 @@
+//
+//  test.cpp
+//  test
+//
+//  Created by AppleTree on 17/4/23.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+// 功能测试：每个用例使用新的数据库检查一组接口的行为，任何一项失败时返回1；
+// 数据库文件使用-d指定的名字，用例结束后删除
+
+#include <map>
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "alphakv.hpp"
+#include "histogram.hpp"
+USING_NS_HIVE;
+
+static std::atomic<int> g_failed(0);
+
+#define TEST_LARGE_VALUE_SIZE 34000000		// 超过单个数据块的上限（32M），分段保存
+
+#define TEST_CHECK(condition) do{ \
+	if(!(condition)){ \
+		fprintf(stderr, "%s:%d check failed: %s\n", __FILE__, __LINE__, #condition); \
+		++g_failed; \
+	} \
+}while(0)
+
+// 删除name开头的所有数据库文件
+// 数据库的所有文件：同一目录下以“name.”开头的文件
+static std::vector<std::string> listDBFiles(const std::string& name){
+	std::vector<std::string> files;
+	std::string dirName = ".";
+	std::string prefix = name + ".";
+	size_t pos = name.rfind('/');
+	if(std::string::npos != pos){
+		dirName = name.substr(0, pos + 1);
+		prefix = name.substr(pos + 1) + ".";
+	}
+	DIR* pDir = opendir(dirName.c_str());
+	if(NULL == pDir){
+		return files;
+	}
+	struct dirent* pEntry;
+	while(NULL != (pEntry = readdir(pDir))){
+		if(0 == strncmp(pEntry->d_name, prefix.c_str(), prefix.length())){
+			files.push_back(dirName + "/" + pEntry->d_name);
+		}
+	}
+	closedir(pDir);
+	return files;
+}
+static void removeDB(const std::string& name){
+	std::vector<std::string> files = listDBFiles(name);
+	for(size_t i=0; i<files.size(); ++i){
+		unlink(files[i].c_str());
+	}
+}
+static int countDBFiles(const std::string& name, const std::string& ext){
+	std::vector<std::string> files = listDBFiles(name);
+	int count = 0;
+	for(size_t i=0; i<files.size(); ++i){
+		if(files[i].length() >= ext.length() && 0 == files[i].compare(files[i].length() - ext.length(), ext.length(), ext)){
+			++count;
+		}
+	}
+	return count;
+}
+// value的内容由key和长度决定，读取时可以检查是不是完整的某一次写入
+static std::string makeValue(const std::string& key, size_t length){
+	std::string value(length, '\0');
+	for(size_t i=0; i<length; ++i){
+		value[i] = key[i % key.length()] ^ (char)(length + i / key.length());
+	}
+	return value;
+}
+// 随机内容，基本不能压缩
+static std::string makeRandomValue(uint32 seed, size_t length){
+	std::mt19937 rng(seed);
+	std::string value(length, '\0');
+	for(size_t i=0; i<length; ++i){
+		value[i] = (char)rng();
+	}
+	return value;
+}
+static int64 getFileSize(const std::string& fileName){
+	struct stat st;
+	return (0 == stat(fileName.c_str(), &st)) ? (int64)st.st_size : -1;
+}
+template<typename _DB_>
+static bool hasValue(_DB_& db, const std::string& key, const std::string& expect){
+	CharVector value;
+	return (db.get(key.data(), (uint32)key.length(), value) && value.size() == expect.length() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+template<typename _DB_>
+static bool hasValue(_DB_& db, uint64 key, const std::string& expect){
+	CharVector value;
+	return (db.get(key, value) && value.size() == expect.length() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+
+// 批量写入：重复的key以最后一个为准，已有的key被覆盖，重新打开后内容不变；setNotExist时有一个key存在整批都不写入
+static void testMset(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	TEST_CHECK(db.set("old", 3, "old value", 9));
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<200; ++i){
+		keys.push_back("mset" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), 10 + i * 37));
+	}
+	keys.push_back("old");
+	values.push_back("new value");
+	KeySetEntryVector entries;
+	for(size_t i=0; i<keys.size(); ++i){
+		entries.push_back(KeySetEntry(keys[i].data(), keys[i].length(), values[i].data(), values[i].length()));
+	}
+	entries.push_back(KeySetEntry("mset0", 5, "last", 4));
+	values[0] = "last";
+	TEST_CHECK(db.mset(entries));
+	IndexSetEntryVector indexes;
+	std::string indexValue = makeValue("index", 1000);
+	for(uint64 i=1; i<=100; ++i){
+		indexes.push_back(IndexSetEntry(i, indexValue.data(), (int64)(i * 10)));
+	}
+	TEST_CHECK(db.mset(indexes));
+	KeySetEntryVector exist;
+	exist.push_back(KeySetEntry("fresh", 5, "fresh", 5));
+	exist.push_back(KeySetEntry("old", 3, "again", 5));
+	TEST_CHECK(FERR_KEY_ALREADY_EXIST == db.m_pDB->mset(exist, true));
+	CharVector value;
+	TEST_CHECK(!db.get("fresh", 5, value));
+	for(int round=0; round<2; ++round){
+		for(size_t i=0; i<keys.size(); ++i){
+			TEST_CHECK(hasValue(db, keys[i], values[i]));
+		}
+		for(uint64 i=1; i<=100; ++i){
+			TEST_CHECK(hasValue(db, i, indexValue.substr(0, i * 10)));
+		}
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+}
+
+// 批量读取：value读入各自的缓冲区，缓冲区不够时返回需要的长度，不存在的key单独返回错误
+static void testMget(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<300; ++i){
+		keys.push_back("mget" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), 1 + (i * 97) % 5000));
+		TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), values[i].data(), (uint32)values[i].length()));
+		TEST_CHECK(db.set((uint64)i, values[i].data(), (uint32)values[i].length()));
+	}
+	// 删除一部分，让数据块的位置和key的顺序不一致
+	for(int i=0; i<300; i+=7){
+		TEST_CHECK(db.del(keys[i].data(), (uint32)keys[i].length()));
+		TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), values[i].data(), (uint32)values[i].length()));
+	}
+	std::vector<CharVector> buffers(keys.size() + 1, CharVector(5000));
+	KeyGetEntryVector entries;
+	IndexGetEntryVector indexes;
+	for(size_t i=0; i<keys.size(); i+=3){
+		entries.push_back(KeyGetEntry(keys[i].data(), keys[i].length(), buffers[i].data(), (int64)buffers[i].size()));
+	}
+	entries.push_back(KeyGetEntry("missing", 7, buffers.back().data(), (int64)buffers.back().size()));
+	entries.push_back(KeyGetEntry(keys[2].data(), keys[2].length(), buffers[1].data(), 10));
+	TEST_CHECK(db.mget(entries));
+	for(size_t i=0; i+2<entries.size(); ++i){
+		const std::string& expect = values[i * 3];
+		TEST_CHECK(FILE_OK == entries[i].result && (int64)expect.length() == entries[i].length
+			&& 0 == memcmp(entries[i].buffer, expect.data(), expect.length()));
+	}
+	TEST_CHECK(FERR_KEY_NOT_FOUND == entries[entries.size() - 2].result);
+	TEST_CHECK(FERR_BUFFER_TOO_SMALL == entries.back().result && (int64)values[2].length() == entries.back().length);
+	for(size_t i=1; i<keys.size(); i+=3){
+		indexes.push_back(IndexGetEntry((uint64)i, buffers[i].data(), (int64)buffers[i].size()));
+	}
+	TEST_CHECK(db.mget(indexes));
+	for(size_t i=0; i<indexes.size(); ++i){
+		const std::string& expect = values[indexes[i].key];
+		TEST_CHECK(FILE_OK == indexes[i].result && (int64)expect.length() == indexes[i].length
+			&& 0 == memcmp(indexes[i].buffer, expect.data(), expect.length()));
+	}
+}
+
+// 读取到调用者的缓冲区：缓冲区正好够用时成功，少一个字节时返回需要的长度；返回指针的get报告value的长度
+static void testCallerBuffer(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	static const uint32 lengths[] = {0, 1, 59, 60, 61, 1000, 100000};
+	for(size_t i=0; i<sizeof(lengths)/sizeof(lengths[0]); ++i){
+		std::string key = "buffer" + std::to_string(i);
+		std::string value = makeValue(key, lengths[i]);
+		TEST_CHECK(db.set(key.data(), (uint32)key.length(), value.data(), lengths[i]));
+		TEST_CHECK(db.set((uint64)i, value.data(), lengths[i]));
+		CharVector buffer(lengths[i] + 1);
+		uint32 length = 0;
+		TEST_CHECK(db.get(key.data(), (uint32)key.length(), buffer.data(), lengths[i], &length));
+		TEST_CHECK(lengths[i] == length && 0 == memcmp(buffer.data(), value.data(), length));
+		length = 0;
+		TEST_CHECK(db.get((uint64)i, buffer.data(), lengths[i] + 1, &length));
+		TEST_CHECK(lengths[i] == length && 0 == memcmp(buffer.data(), value.data(), length));
+		if(lengths[i] > 0){
+			TEST_CHECK(!db.get(key.data(), (uint32)key.length(), buffer.data(), lengths[i] - 1, &length) && lengths[i] == length);
+			TEST_CHECK(!db.get((uint64)i, buffer.data(), 0, &length) && lengths[i] == length);
+		}
+		char* ptr = db.get(key.data(), (uint32)key.length(), &length);
+		TEST_CHECK(NULL != ptr && lengths[i] == length && 0 == memcmp(ptr, value.data(), length));
+		ptr = db.get((uint64)i, &length);
+		TEST_CHECK(NULL != ptr && lengths[i] == length && 0 == memcmp(ptr, value.data(), length));
+		TEST_CHECK(hasValue(db, key, value) && hasValue(db, (uint64)i, value));
+	}
+	uint32 length = 0;
+	char buffer[16];
+	TEST_CHECK(!db.get("missing", 7, buffer, sizeof(buffer), &length));
+	TEST_CHECK(NULL == db.get("missing", 7, &length));
+}
+
+// 读取数据块中的value时只读取实际保存的长度：缓冲区中value后面的部分不被改写（校验码和填充不会读入缓冲区）
+static void testExactRead(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	static const uint32 lengths[] = {100, 1000, 3001};
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(size_t i=0; i<sizeof(lengths)/sizeof(lengths[0]); ++i){
+		keys.push_back("exact" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), lengths[i]));
+		TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), values[i].data(), lengths[i]));
+	}
+	for(int round=0; round<2; ++round){
+		std::vector<CharVector> buffers;
+		KeyGetEntryVector entries;
+		for(size_t i=0; i<keys.size(); ++i){
+			buffers.push_back(CharVector(lengths[i] + BLOCK_SIZE, '#'));
+			entries.push_back(KeyGetEntry(keys[i].data(), (int64)keys[i].length(), buffers[i].data(), (int64)buffers[i].size()));
+		}
+		// 第一轮逐个读取，第二轮重新打开（清空缓存）后批量读取
+		if(0 == round){
+			for(size_t i=0; i<entries.size(); ++i){
+				uint32 length = 0;
+				TEST_CHECK(db.get(keys[i].data(), (uint32)keys[i].length(), buffers[i].data(), (uint32)buffers[i].size(), &length));
+				entries[i].length = length;
+			}
+		}else{
+			TEST_CHECK(db.mget(entries));
+		}
+		for(size_t i=0; i<entries.size(); ++i){
+			TEST_CHECK(lengths[i] == entries[i].length && 0 == memcmp(buffers[i].data(), values[i].data(), lengths[i]));
+			TEST_CHECK(std::string(BLOCK_SIZE, '#') == std::string(buffers[i].data() + lengths[i], BLOCK_SIZE));
+		}
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+}
+
+// 兼容旧接口的get：内联、压缩、带校验码和分段保存的value都返回旧格式的长度记录+原始数据
+static void testLegacyGet(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string text;
+	while(text.length() < 5000){
+		text += "legacy get " + std::to_string(text.length() % 7) + "; ";
+	}
+	std::vector<std::string> values;
+	values.push_back("tiny");
+	values.push_back(makeValue("plain", 1000));
+	values.push_back(text);
+	values.push_back(makeValue("large", TEST_LARGE_VALUE_SIZE));
+	for(size_t i=0; i<values.size(); ++i){
+		std::string key = "legacy" + std::to_string(i);
+		TEST_CHECK(db.set(key.data(), (uint32)key.length(), values[i].data(), (uint32)values[i].length(), VALUE_CODEC_LZ));
+		TEST_CHECK(db.set((uint64)i, values[i].data(), (uint32)values[i].length(), VALUE_CODEC_LZ));
+		for(int round=0; round<2; ++round){
+			CharVector data;
+			int result = (0 == round) ? db.m_pDB->get(key.data(), (int64)key.length(), data) : db.m_pDB->get((uint64)i, data);
+			int prefix = 0;
+			TEST_CHECK(FILE_OK == result && data.size() == values[i].length() + 4);
+			if(data.size() >= 4){
+				memcpy(&prefix, data.data(), 4);
+			}
+			TEST_CHECK(prefix == (int)data.size() && 0 == memcmp(data.data() + 4, values[i].data(), values[i].length()));
+		}
+	}
+	CharVector data;
+	TEST_CHECK(FERR_KEY_NOT_FOUND == db.m_pDB->get("missing", 7, data));
+}
+
+// 压缩：各种压缩方式写入的value都能从所有读取接口原样读出，可压缩的数据占用的空间变小，字典在重新打开后继续使用
+static void testCompress(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string text;
+	while(text.length() < 100000){
+		text += "alphakv stores values in blocks of " + std::to_string(text.length() % 97) + " bytes; ";
+	}
+	TEST_CHECK(db.set("text", 4, text.data(), (uint32)text.length(), VALUE_CODEC_LZ));
+	TEST_CHECK(getFileSize(name + ".v") < (int64)text.length() / 2);
+	db.setCompress(VALUE_CODEC_ZLIB, 64);
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	static const int codecs[] = {VALUE_CODEC_DEFAULT, VALUE_CODEC_NONE, VALUE_CODEC_LZ, VALUE_CODEC_ZLIB};
+	for(int i=0; i<40; ++i){
+		keys.push_back("compress" + std::to_string(i));
+		size_t length = 10 + i * 1500;
+		values.push_back((i % 3) ? text.substr(i, length) : makeRandomValue(i, length));
+		TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), values[i].data(), (uint32)values[i].length(), codecs[i % 4]));
+	}
+	std::string dict = text.substr(0, 2000);
+	TEST_CHECK(db.setDictionary(dict.data(), (uint32)dict.length()));
+	TEST_CHECK(!db.setDictionary(dict.data(), (uint32)dict.length()));
+	for(int i=40; i<60; ++i){
+		keys.push_back("compress" + std::to_string(i));
+		values.push_back(text.substr(i * 7, 100 + i));
+		TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), values[i].data(), (uint32)values[i].length()));
+	}
+	for(int round=0; round<2; ++round){
+		TEST_CHECK(hasValue(db, "text", text));
+		std::vector<CharVector> buffers(keys.size(), CharVector(100000));
+		KeyGetEntryVector entries;
+		for(size_t i=0; i<keys.size(); ++i){
+			TEST_CHECK(hasValue(db, keys[i], values[i]));
+			uint32 length = 0;
+			TEST_CHECK(db.get(keys[i].data(), (uint32)keys[i].length(), buffers[i].data(), (uint32)values[i].length(), &length));
+			TEST_CHECK(values[i].length() == length && 0 == memcmp(buffers[i].data(), values[i].data(), length));
+			entries.push_back(KeyGetEntry(keys[i].data(), keys[i].length(), buffers[i].data(), (int64)buffers[i].size()));
+		}
+		TEST_CHECK(db.mget(entries));
+		for(size_t i=0; i<keys.size(); ++i){
+			TEST_CHECK(FILE_OK == entries[i].result && (int64)values[i].length() == entries[i].length
+				&& 0 == memcmp(buffers[i].data(), values[i].data(), values[i].length()));
+		}
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+}
+
+// 大数据：超过单个数据块上限的value分段保存，所有读取接口都能读出；覆盖和删除后分段被回收重用，重新打开后不会被当作空闲空间
+static void testLargeValue(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string large = makeValue("large", TEST_LARGE_VALUE_SIZE);
+	TEST_CHECK(db.set("large", 5, large.data(), (uint32)large.length()));
+	TEST_CHECK(hasValue(db, "large", large));
+	CharVector buffer(large.length());
+	uint32 length = 0;
+	TEST_CHECK(db.get("large", 5, buffer.data(), (uint32)buffer.size(), &length));
+	TEST_CHECK(large.length() == length && 0 == memcmp(buffer.data(), large.data(), length));
+	TEST_CHECK(!db.get("large", 5, buffer.data(), 1000, &length) && large.length() == length);
+	std::string streamed;
+	TEST_CHECK(FILE_OK == db.m_pDB->getStream("large", 5, [&streamed](const char* data, int64 length){
+		streamed.append(data, length);
+		return true;
+	}));
+	TEST_CHECK(streamed == large);
+	// 分段提供数据写入
+	std::string other = makeValue("other", TEST_LARGE_VALUE_SIZE + 1000);
+	size_t position = 0;
+	TEST_CHECK(FILE_OK == db.m_pDB->setStream(7, (int64)other.length(), [&other, &position](char* buffer, int64 length){
+		memcpy(buffer, other.data() + position, length);
+		position += length;
+		return true;
+	}, false));
+	TEST_CHECK(hasValue(db, 7, other));
+	// 覆盖成小数据后，分段的空间给下一个大数据使用
+	int64 fileSize = getFileSize(name + ".v");
+	TEST_CHECK(db.set("large", 5, "small", 5));
+	TEST_CHECK(db.set("again", 5, large.data(), (uint32)large.length()));
+	TEST_CHECK(getFileSize(name + ".v") < fileSize + TEST_LARGE_VALUE_SIZE / 2);
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	TEST_CHECK(db.set("after", 5, large.data(), 100000));
+	TEST_CHECK(hasValue(db, "large", "small"));
+	TEST_CHECK(hasValue(db, "again", large));
+	TEST_CHECK(hasValue(db, 7, other));
+	TEST_CHECK(db.del(7));
+	TEST_CHECK(hasValue(db, "again", large));
+}
+// 空闲块的分配：反复写入和删除不同长度的value，空闲块拆分合并后所有value不受影响
+static void testIdleBlocks(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::mt19937 rng(7);
+	std::map<std::string, std::string> values;
+	for(int i=0; i<20000; ++i){
+		std::string key = "idle" + std::to_string(rng() % 200);
+		if(rng() % 3){
+			std::string value = makeValue(key, 1 + rng() % ((rng() % 4) ? 500 : 20000));
+			TEST_CHECK(db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length()));
+			values[key] = value;
+		}else if(values.erase(key)){
+			TEST_CHECK(db.del(key.data(), (uint32)key.length()));
+		}
+	}
+	for(int round=0; round<2; ++round){
+		for(std::map<std::string, std::string>::iterator it=values.begin(); it!=values.end(); ++it){
+			TEST_CHECK(hasValue(db, it->first, it->second));
+		}
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+}
+
+// 缓存：命中时读到的是最新的value，覆盖和删除后不会读到旧数据；一次性扫描大量冷数据后热数据仍然留在缓存中
+static void testCache(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.setCacheSize(1 << 20);
+	std::vector<std::string> keys;
+	for(int i=0; i<3000; ++i){
+		keys.push_back("cache" + std::to_string(i));
+		std::string value = makeValue(keys[i], 1000);
+		TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), value.data(), (uint32)value.length()));
+	}
+	for(int round=0; round<10; ++round){
+		for(int i=0; i<20; ++i){
+			TEST_CHECK(hasValue(db, keys[i], makeValue(keys[i], 1000)));
+		}
+	}
+	CacheStat stat = db.getCacheStat();
+	TEST_CHECK(stat.hitCount >= 150);
+	// 同样长度的覆盖原地写入，不同长度的覆盖换到新的数据块
+	std::string value = makeValue("same size", 1000);
+	TEST_CHECK(db.set(keys[0].data(), (uint32)keys[0].length(), value.data(), (uint32)value.length()));
+	TEST_CHECK(hasValue(db, keys[0], value));
+	TEST_CHECK(db.set(keys[1].data(), (uint32)keys[1].length(), "short", 5));
+	TEST_CHECK(hasValue(db, keys[1], "short"));
+	TEST_CHECK(db.del(keys[2].data(), (uint32)keys[2].length()));
+	CharVector deleted;
+	TEST_CHECK(!db.get(keys[2].data(), (uint32)keys[2].length(), deleted));
+	// 扫描冷数据，总量是缓存的两倍多
+	for(size_t i=100; i<keys.size(); ++i){
+		TEST_CHECK(hasValue(db, keys[i], makeValue(keys[i], 1000)));
+	}
+	stat = db.getCacheStat();
+	uint64 hitCount = stat.hitCount;
+	for(int i=3; i<20; ++i){
+		TEST_CHECK(hasValue(db, keys[i], makeValue(keys[i], 1000)));
+	}
+	stat = db.getCacheStat();
+	TEST_CHECK(stat.hitCount - hitCount >= 15);
+	TEST_CHECK(stat.usedSize <= stat.capacity && stat.evictCount + stat.rejectCount > 0);
+	db.setCacheSize(0);
+	TEST_CHECK(hasValue(db, keys[0], value));
+}
+
+// 过期时间：setex/expire/persist/ttl，过期的key读取不到，回收后数据块可以重用，重新打开后过期时间不变
+static void testExpire(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string value = makeValue("expire", 1000);
+	TEST_CHECK(db.set("forever", 7, value.data(), (uint32)value.length()));
+	TEST_CHECK(-1 == db.ttl("forever", 7));
+	TEST_CHECK(-2 == db.ttl("missing", 7));
+	TEST_CHECK(db.setex("later", 5, value.data(), (uint32)value.length(), 1000));
+	TEST_CHECK(db.ttl("later", 5) > 990 && db.ttl("later", 5) <= 1000);
+	TEST_CHECK(db.setex((uint64)5, value.data(), (uint32)value.length(), 1000));
+	TEST_CHECK(db.ttl((uint64)5) > 990);
+	TEST_CHECK(db.expire("forever", 7, 100) && db.ttl("forever", 7) > 90);
+	TEST_CHECK(db.persist("forever", 7) && -1 == db.ttl("forever", 7));
+	// 普通的写入清除过期时间
+	TEST_CHECK(db.setex("reset", 5, "short", 5, 1000));
+	TEST_CHECK(db.set("reset", 5, "plain", 5) && -1 == db.ttl("reset", 5));
+	// 过期时间设置到过去，马上过期
+	TEST_CHECK(db.set("gone", 4, value.data(), (uint32)value.length()));
+	TEST_CHECK(db.set((uint64)9, value.data(), (uint32)value.length()));
+	TEST_CHECK(FILE_OK == db.m_pDB->setExpire("gone", 4, getTimeSecond() - 1));
+	TEST_CHECK(FILE_OK == db.m_pDB->setExpire((uint64)9, getTimeSecond() - 1));
+	CharVector data;
+	TEST_CHECK(!db.get("gone", 4, data) && !db.get((uint64)9, data));
+	TEST_CHECK(-2 == db.ttl("gone", 4) && -2 == db.ttl((uint64)9));
+	// 写操作会顺带回收到期的key，之后较小的value重用回收的数据块
+	db.expireCycle(100);
+	int64 fileSize = getFileSize(name + ".v");
+	std::string smaller = value.substr(0, 900);
+	TEST_CHECK(db.set("reuse", 5, smaller.data(), (uint32)smaller.length()));
+	TEST_CHECK(db.set((uint64)10, smaller.data(), (uint32)smaller.length()));
+	TEST_CHECK(getFileSize(name + ".v") == fileSize);
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	TEST_CHECK(db.ttl("later", 5) > 990 && db.ttl((uint64)5) > 990);
+	TEST_CHECK(-1 == db.ttl("forever", 7) && -2 == db.ttl("gone", 4));
+	TEST_CHECK(hasValue(db, "later", value) && hasValue(db, "reuse", value.substr(0, 900)) && hasValue(db, "reset", "plain"));
+}
+// 没有版本的旧格式：头部32字节，key记录中是8字节的BlockNode；.v中每个value是4字节的长度（包含长度本身）和数据
+static void writeLegacyDB(const std::string& name, const std::vector<std::string>& keys, const std::vector<std::string>& values){
+	std::string valueData, keyData, indexData;
+	uint64 keyHead[4] = {sizeof(uint64), MAX_KEY_LENGTH, sizeof(uint64) + MAX_KEY_LENGTH, BLOCK_SIZE};
+	uint64 indexHead[4] = {sizeof(uint64), MAX_INDEX_KEY_LENGTH, sizeof(uint64) * 2, BLOCK_SIZE};
+	keyData.append((const char*)keyHead, sizeof(keyHead));
+	indexData.append((const char*)indexHead, sizeof(indexHead));
+	for(size_t i=0; i<keys.size(); ++i){
+		int prefix = (int)values[i].length() + 4;
+		uint64 blocks = (prefix + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		uint64 node = BlockNode(valueData.length() / BLOCK_SIZE, blocks).value;
+		valueData.append((const char*)&prefix, 4);
+		valueData.append(values[i]);
+		valueData.append(blocks * BLOCK_SIZE - prefix, '\0');
+		keyData.append((const char*)&node, sizeof(node));
+		keyData.push_back((char)keys[i].length());
+		keyData.append(keys[i]);
+		uint64 index = i;
+		indexData.append((const char*)&node, sizeof(node));
+		indexData.append((const char*)&index, sizeof(index));
+		// 每隔几个记录插入删除后留下的空闲位置
+		if(0 == i % 5){
+			uint64 zero = 0;
+			keyData.append((const char*)&zero, sizeof(zero));
+			keyData.push_back('\0');
+			keyData.push_back((char)6);
+			keyData.append(5, 'x');
+			indexData.append((const char*)&zero, sizeof(zero));
+			indexData.append((const char*)&zero, sizeof(zero));
+		}
+	}
+	const std::string* contents[] = {&valueData, &keyData, &indexData};
+	const char* exts[] = {".v", ".k", ".i"};
+	for(int i=0; i<3; ++i){
+		FILE* pFile = fopen((name + exts[i]).c_str(), "wb");
+		TEST_CHECK(NULL != pFile && 1 == fwrite(contents[i]->data(), contents[i]->length(), 1, pFile));
+		if(NULL != pFile){
+			fclose(pFile);
+		}
+	}
+}
+// 旧格式的数据库打开时升级：所有key都能读取，之后可以继续写入，头部保存当前的格式版本
+static void testUpgrade(const std::string& name){
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<50; ++i){
+		keys.push_back("legacy" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), 10 + i * 50));
+	}
+	writeLegacyDB(name, keys, values);
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	for(int round=0; round<2; ++round){
+		for(size_t i=0; i<keys.size(); ++i){
+			TEST_CHECK(hasValue(db, keys[i], values[i]));
+			TEST_CHECK(hasValue(db, (uint64)i, values[i]));
+		}
+		TEST_CHECK(db.set("new", 3, "new value", 9) && hasValue(db, "new", "new value"));
+		TEST_CHECK(db.set(keys[3].data(), (uint32)keys[3].length(), "changed", 7));
+		TEST_CHECK(db.set((uint64)3, "changed", 7));
+		values[3] = "changed";
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+	const char* exts[] = {".k", ".i"};
+	for(int i=0; i<2; ++i){
+		uint64 head[5] = {0};
+		FILE* pFile = fopen((name + exts[i]).c_str(), "rb");
+		TEST_CHECK(NULL != pFile && 1 == fread(head, sizeof(head), 1, pFile) && FILE_FORMAT_VERSION == head[4]);
+		if(NULL != pFile){
+			fclose(pFile);
+		}
+	}
+}
+
+// 内联保存：短value保存在key记录中，不占用.v的数据块；变长和变短时在内联和数据块之间转换
+static void testInline(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string longValue = makeValue("inline", 500);
+	TEST_CHECK(db.set("long", 4, longValue.data(), (uint32)longValue.length()));
+	int64 fileSize = getFileSize(name + ".v");
+	for(int i=0; i<100; ++i){
+		std::string key = "inline" + std::to_string(i);
+		std::string value = makeValue(key, i % (VALUE_INLINE_MAX_LENGTH + 1));
+		TEST_CHECK(db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length()));
+		TEST_CHECK(db.set((uint64)i, value.data(), (uint32)value.length()));
+	}
+	TEST_CHECK(getFileSize(name + ".v") == fileSize);
+	// 变长后使用数据块，再变短后重新内联，原来的数据块被回收
+	TEST_CHECK(db.set("inline1", 7, longValue.data(), (uint32)longValue.length()) && hasValue(db, "inline1", longValue));
+	TEST_CHECK(getFileSize(name + ".v") > fileSize);
+	fileSize = getFileSize(name + ".v");
+	TEST_CHECK(db.set("inline1", 7, "short", 5) && hasValue(db, "inline1", "short"));
+	TEST_CHECK(db.set("grow", 4, longValue.data(), 400) && getFileSize(name + ".v") == fileSize);
+	// 关闭内联后短value也写入数据块
+	db.setInlineLength(-1);
+	TEST_CHECK(db.set("outline", 7, "tiny", 4) && hasValue(db, "outline", "tiny"));
+	TEST_CHECK(getFileSize(name + ".v") > fileSize);
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	for(int i=2; i<100; ++i){
+		std::string key = "inline" + std::to_string(i);
+		std::string value = makeValue(key, i % (VALUE_INLINE_MAX_LENGTH + 1));
+		TEST_CHECK(hasValue(db, key, value) && hasValue(db, (uint64)i, value));
+	}
+	TEST_CHECK(hasValue(db, "inline1", "short") && hasValue(db, "outline", "tiny") && hasValue(db, "long", longValue));
+}
+
+// Bitcask：覆盖写入产生多个数据段，合并后只保留有效数据；重新打开时读取hint文件，最后一个数据段不完整的记录被截掉
+typedef Bitcask<ALPHAKV_HASH_SLOT> BitcaskDB;
+static bool hasValue(BitcaskDB& db, const std::string& key, const std::string& expect){
+	CharVector value;
+	return (FILE_OK == db.getValue(key.data(), key.length(), value) && value.size() == expect.length() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+static void testBitcask(const std::string& name){
+	std::map<std::string, std::string> values;
+	{
+		BitcaskDB db(name);
+		db.setSegmentSize(16384);
+		TEST_CHECK(FILE_OK == db.openDB());
+		for(int round=0; round<10; ++round){
+			for(int i=0; i<50; ++i){
+				std::string key = "cask" + std::to_string(i);
+				values[key] = makeValue(key, 100 + round * 10 + i);
+				TEST_CHECK(FILE_OK == db.set(key.data(), key.length(), values[key].data(), values[key].length(), true, false));
+			}
+		}
+		TEST_CHECK(FILE_OK == db.set((uint64)7, "number", 6, true, false));
+		TEST_CHECK(FILE_OK == db.del("cask0", 5));
+		values.erase("cask0");
+		int segments = countDBFiles(name, BITCASK_SEGMENT_EXT);
+		TEST_CHECK(segments > 3);
+		TEST_CHECK(db.merge() > 0);
+		TEST_CHECK(countDBFiles(name, BITCASK_SEGMENT_EXT) < segments);
+		for(std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it){
+			TEST_CHECK(hasValue(db, it->first, it->second));
+		}
+		db.closeDB();
+	}
+	TEST_CHECK(countDBFiles(name, BITCASK_HINT_EXT) > 0);
+	// 最后一个数据段的末尾写入不完整的记录
+	std::vector<std::string> files = listDBFiles(name);
+	std::sort(files.begin(), files.end());
+	std::string lastSegment;
+	for(size_t i=0; i<files.size(); ++i){
+		if(std::string::npos != files[i].find(BITCASK_SEGMENT_EXT)){
+			lastSegment = files[i];
+		}
+	}
+	int64 fileSize = getFileSize(lastSegment);
+	FILE* pFile = fopen(lastSegment.c_str(), "ab");
+	TEST_CHECK(NULL != pFile && 10 == fwrite("torn write", 1, 10, pFile));
+	if(NULL != pFile){
+		fclose(pFile);
+	}
+	BitcaskDB db(name);
+	db.setSegmentSize(16384);
+	TEST_CHECK(FILE_OK == db.openDB());
+	TEST_CHECK(getFileSize(lastSegment) == fileSize);
+	for(std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it){
+		TEST_CHECK(hasValue(db, it->first, it->second));
+	}
+	CharVector value;
+	TEST_CHECK(FERR_KEY_NOT_FOUND == db.getValue("cask0", 5, value));
+	TEST_CHECK(FILE_OK == db.getValue((uint64)7, value) && 6 == value.size());
+	db.closeDB();
+}
+
+// LSM：写入超过内存表长度的数据产生多层数据表，合并后读取和范围查询的结果不变，重新打开后内容不变
+typedef Lsm<ALPHAKV_HASH_SLOT> LsmDB;
+static bool hasValue(LsmDB& db, const std::string& key, const std::string& expect){
+	CharVector value;
+	return (FILE_OK == db.getValue(key.data(), key.length(), value) && value.size() == expect.length() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+static void checkLsm(LsmDB& db, const std::map<std::string, std::string>& values){
+	for(std::map<std::string, std::string>::const_iterator it = values.begin(); it != values.end(); ++it){
+		TEST_CHECK(hasValue(db, it->first, it->second));
+	}
+	CharVector value;
+	TEST_CHECK(FERR_KEY_NOT_FOUND == db.getValue("lsm00010", 8, value));
+	// 范围查询按key排序，跳过删除的key
+	KeyScanVector result;
+	TEST_CHECK(FILE_OK == db.scan("lsm00005", 8, "lsm00100", 8, 0, result));
+	TEST_CHECK(94 == result.size());
+	for(size_t i=0; i<result.size(); ++i){
+		std::map<std::string, std::string>::const_iterator it = values.find(result[i].first);
+		TEST_CHECK(values.end() != it && it->second == result[i].second);
+		TEST_CHECK(0 == i || result[i - 1].first < result[i].first);
+	}
+	result.clear();
+	TEST_CHECK(FILE_OK == db.scan("lsm", 3, "", 0, 10, result) && 10 == result.size());
+	IndexScanVector indexResult;
+	TEST_CHECK(FILE_OK == db.scan((uint64)100, (uint64)200, 0, indexResult) && 100 == indexResult.size());
+	for(size_t i=0; i<indexResult.size(); ++i){
+		TEST_CHECK(100 + i == indexResult[i].first && makeValue("index", 30) == indexResult[i].second);
+	}
+}
+static void testLsm(const std::string& name){
+	std::map<std::string, std::string> values;
+	{
+		LsmDB db(name);
+		db.setTableSize(65536, 65536);
+		TEST_CHECK(FILE_OK == db.openDB());
+		for(int round=0; round<3; ++round){
+			for(int i=0; i<3000; ++i){
+				char key[16];
+				sprintf(key, "lsm%05d", i);
+				values[key] = makeValue(key, 50 + (i + round) % 100);
+				TEST_CHECK(FILE_OK == db.set(key, 8, values[key].data(), values[key].length(), true, false));
+			}
+		}
+		for(uint64 i=0; i<1000; ++i){
+			std::string value = makeValue("index", 30);
+			TEST_CHECK(FILE_OK == db.set(i, value.data(), value.length(), true, false));
+		}
+		TEST_CHECK(FILE_OK == db.del("lsm00010", 8));
+		values.erase("lsm00010");
+		db.waitCompact();
+		TEST_CHECK(countDBFiles(name, LSM_TABLE_EXT) > 1);
+		checkLsm(db, values);
+		db.closeDB();
+	}
+	LsmDB db(name);
+	TEST_CHECK(FILE_OK == db.openDB());
+	checkLsm(db, values);
+	db.closeDB();
+}
+
+// 快照：创建后的覆盖、删除、新增和改名不影响快照读取的内容；释放后数据块可以重用
+static bool hasSnapshotValue(AlphaKV& db, uint64 snapshot, const std::string& key, const std::string& expect){
+	CharVector value;
+	return (db.getSnapshot(snapshot, key.data(), (uint32)key.length(), value) && value.size() == expect.length() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+static void testSnapshot(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string value = makeValue("snapshot", 1000);
+	std::string inlineValue = "inline";
+	TEST_CHECK(db.set("same", 4, value.data(), (uint32)value.length()));
+	TEST_CHECK(db.set("deleted", 7, value.data(), (uint32)value.length()));
+	TEST_CHECK(db.set("renamed", 7, inlineValue.data(), (uint32)inlineValue.length()));
+	TEST_CHECK(db.set((uint64)1, value.data(), (uint32)value.length()));
+	uint64 snapshot = db.createSnapshot();
+	// 相同长度的覆盖写入也不能改变快照中的数据
+	std::string newValue = makeValue("changed", 1000);
+	TEST_CHECK(db.set("same", 4, newValue.data(), (uint32)newValue.length()));
+	TEST_CHECK(db.del("deleted", 7));
+	TEST_CHECK(db.replace("renamed", 7, "moved", 5));
+	TEST_CHECK(db.set("added", 5, "added", 5));
+	TEST_CHECK(db.set((uint64)1, newValue.data(), (uint32)newValue.length()));
+	TEST_CHECK(hasValue(db, "same", newValue) && hasValue(db, (uint64)1, newValue) && hasValue(db, "moved", inlineValue));
+	TEST_CHECK(hasSnapshotValue(db, snapshot, "same", value) && hasSnapshotValue(db, snapshot, "deleted", value));
+	TEST_CHECK(hasSnapshotValue(db, snapshot, "renamed", inlineValue));
+	CharVector data;
+	TEST_CHECK(!db.getSnapshot(snapshot, "moved", 5, data) && !db.getSnapshot(snapshot, "added", 5, data));
+	TEST_CHECK(db.getSnapshot(snapshot, (uint64)1, data) && std::string(data.data(), data.size()) == value);
+	std::vector<std::string> keys;
+	std::vector<uint64> indexes;
+	TEST_CHECK(db.getSnapshotKeys(snapshot, keys, indexes));
+	std::sort(keys.begin(), keys.end());
+	TEST_CHECK(3 == keys.size() && "deleted" == keys[0] && "renamed" == keys[1] && "same" == keys[2]);
+	TEST_CHECK(1 == indexes.size() && 1 == indexes[0]);
+	// 释放前被替换的数据块不能重用，释放后可以
+	int64 fileSize = getFileSize(name + ".v");
+	std::string smaller = value.substr(0, 900);
+	TEST_CHECK(db.set("reuse", 5, smaller.data(), (uint32)smaller.length()));
+	TEST_CHECK(getFileSize(name + ".v") > fileSize);
+	db.releaseSnapshot(snapshot);
+	TEST_CHECK(!db.getSnapshot(snapshot, "same", 4, data));
+	fileSize = getFileSize(name + ".v");
+	TEST_CHECK(db.set("reuse2", 6, smaller.data(), (uint32)smaller.length()));
+	TEST_CHECK(getFileSize(name + ".v") == fileSize);
+	TEST_CHECK(hasValue(db, "same", newValue) && hasValue(db, "reuse", smaller) && hasValue(db, "reuse2", smaller));
+}
+
+// 全库遍历：内联、普通、压缩的value都能读到，删除和过期的key不出现；遍历期间的写入不影响遍历的内容
+static void testIterator(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::map<std::string, std::string> values;
+	std::map<uint64, std::string> indexValues;
+	for(int i=0; i<3000; ++i){
+		std::string key = "iter" + std::to_string(i);
+		values[key] = makeValue(key, (0 == i % 3) ? 10 : 3000 + i);
+		int codec = (1 == i % 3) ? VALUE_CODEC_LZ : VALUE_CODEC_NONE;
+		TEST_CHECK(db.set(key.data(), (uint32)key.length(), values[key].data(), (uint32)values[key].length(), codec));
+	}
+	for(uint64 i=0; i<100; ++i){
+		indexValues[i] = makeValue("index", 100 + i);
+		TEST_CHECK(db.set(i, indexValues[i].data(), (uint32)indexValues[i].length()));
+	}
+	TEST_CHECK(db.del("iter5", 5) && db.del((uint64)5));
+	values.erase("iter5");
+	indexValues.erase(5);
+	TEST_CHECK(db.set("expired", 7, "value", 5) && FILE_OK == db.m_pDB->setExpire("expired", 7, getTimeSecond() - 1));
+	AlphaKVIterator it;
+	TEST_CHECK(db.openIterator(it));
+	TEST_CHECK(values.size() + indexValues.size() == it.size());
+	size_t count = 0;
+	while(it.next()){
+		std::string value(it.getValue(), it.getValueLength());
+		if(it.isIndex()){
+			TEST_CHECK(indexValues.count(it.getIndex()) && indexValues[it.getIndex()] == value);
+		}else{
+			TEST_CHECK(values.count(it.getKey()) && values[it.getKey()] == value);
+		}
+		// 遍历期间修改和删除还没有遍历到的数据
+		if(0 == count % 100){
+			std::string key = "iter" + std::to_string(count + 1);
+			db.set(key.data(), (uint32)key.length(), "overwritten", 11);
+			db.del((uint64)(count / 100 + 50));
+		}
+		++count;
+	}
+	TEST_CHECK(FILE_OK == it.getResult());
+	TEST_CHECK(values.size() + indexValues.size() == count);
+	it.close();
+	TEST_CHECK(hasValue(db, "iter1", "overwritten"));
+}
+
+// 批量导入：字符串和数字key，短value内联，批次内重复的key以最后一个为准，已有的key被覆盖，重新打开后内容不变
+static void testBulkLoad(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	TEST_CHECK(db.set("bulk7", 5, "old value", 9));
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<20000; ++i){
+		keys.push_back("bulk" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), (0 == i % 4) ? 8 : 100 + i % 1000));
+	}
+	// 最后一条重复第0个key
+	keys.push_back(keys[0]);
+	values.push_back(makeValue(keys[0], 500));
+	size_t next = 0;
+	TEST_CHECK(db.bulkLoad([&](BulkEntry& entry){
+		if(next >= keys.size() * 2){
+			return false;
+		}
+		size_t i = next / 2;
+		entry = BulkEntry();
+		if(0 == next % 2){
+			entry.key = keys[i].data();
+			entry.keyLen = (int64)keys[i].length();
+		}else{
+			entry.index = i;
+		}
+		entry.value = values[i].data();
+		entry.valueLen = (int64)values[i].length();
+		++next;
+		return true;
+	}));
+	for(int round=0; round<2; ++round){
+		TEST_CHECK(hasValue(db, keys[0], values.back()) && hasValue(db, "bulk7", values[7]));
+		for(size_t i=1; i<keys.size(); ++i){
+			TEST_CHECK(hasValue(db, keys[i], values[i]));
+			TEST_CHECK(hasValue(db, (uint64)i, values[i]));
+		}
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+}
+
+// 在线备份：备份的内容是开始时的状态，备份期间的写入不影响；增量备份只复制写入过的区域，结果和完整备份相同
+static void checkBackup(const std::string& backupName, const std::map<std::string, std::string>& values){
+	TEST_CHECK(getFileSize(backupName + BACKUP_MARK_EXT) > 0);
+	AlphaKV backup;
+	TEST_CHECK(backup.openDB(backupName.c_str()));
+	for(std::map<std::string, std::string>::const_iterator it = values.begin(); it != values.end(); ++it){
+		TEST_CHECK(hasValue(backup, it->first, it->second));
+	}
+	CharVector value;
+	TEST_CHECK(!backup.get("during", 6, value));
+}
+static void testCheckpoint(const std::string& name){
+	std::string backupName = name + ".backup";
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::map<std::string, std::string> values;
+	for(int i=0; i<2000; ++i){
+		std::string key = "ckpt" + std::to_string(i);
+		values[key] = makeValue(key, 10 + i * 3);
+		TEST_CHECK(db.set(key.data(), (uint32)key.length(), values[key].data(), (uint32)values[key].length()));
+	}
+	for(int round=0; round<2; ++round){
+		TEST_CHECK(db.startCheckpoint(backupName.c_str(), 1 == round));
+		// 备份期间继续写入，包括覆盖已有的key
+		std::string value = makeValue("during", 5000);
+		TEST_CHECK(db.set("during", 6, value.data(), (uint32)value.length()));
+		TEST_CHECK(db.set("ckpt1", 5, value.data(), (uint32)value.length()));
+		TEST_CHECK(db.finishCheckpoint() && db.isCheckpointDone());
+		checkBackup(backupName, values);
+		// 下一轮增量备份前修改一部分数据
+		TEST_CHECK(db.del("during", 6));
+		values["ckpt1"] = value;
+		for(int i=0; i<2000; i+=7){
+			std::string key = "ckpt" + std::to_string(i);
+			values[key] = makeValue(key, 20 + i * 2);
+			TEST_CHECK(db.set(key.data(), (uint32)key.length(), values[key].data(), (uint32)values[key].length()));
+		}
+	}
+}
+
+// 在文件中找到data第一次出现的位置，把这个位置的一个字节取反
+static bool corruptFile(const std::string& fileName, const std::string& data){
+	FILE* pFile = fopen(fileName.c_str(), "rb+");
+	if(NULL == pFile){
+		return false;
+	}
+	std::string content;
+	char buffer[65536];
+	size_t n;
+	while((n = fread(buffer, 1, sizeof(buffer), pFile)) > 0){
+		content.append(buffer, n);
+	}
+	size_t pos = content.find(data);
+	bool result = (std::string::npos != pos);
+	if(result){
+		char c = ~content[pos + data.length() / 2];
+		result = (0 == fseek(pFile, (long)(pos + data.length() / 2), SEEK_SET) && 1 == fwrite(&c, 1, 1, pFile));
+	}
+	fclose(pFile);
+	return result;
+}
+// 校验：损坏.v中的value后读取和后台校验都能发现；损坏.k中的记录后这条记录在打开时被丢弃，其它记录不受影响
+static void testChecksum(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string badValue(1000, 'v');
+	TEST_CHECK(db.set("badvalue", 8, badValue.data(), (uint32)badValue.length(), VALUE_CODEC_NONE));
+	TEST_CHECK(db.set("badrecord", 9, "record", 6));
+	TEST_CHECK(db.set("good", 4, "good value", 10));
+	db.closeDB();
+	TEST_CHECK(corruptFile(name + ".v", badValue));
+	TEST_CHECK(corruptFile(name + ".k", "badrecord"));
+	TEST_CHECK(db.openDB(name.c_str()));
+	CharVector value;
+	TEST_CHECK(FERR_CHECKSUM_MISMATCH == db.m_pDB->getValue("badvalue", 8, value));
+	TEST_CHECK(FERR_KEY_NOT_FOUND == db.m_pDB->getValue("badrecord", 9, value));
+	TEST_CHECK(hasValue(db, "good", "good value"));
+	ScrubStat stat;
+	TEST_CHECK(db.startScrub());
+	db.finishScrub(stat);
+	TEST_CHECK(1 == stat.badKeys.size() && "badvalue" == stat.badKeys[0]);
+}
+// 版本2的key文件：内联数据不超过现在长度的可以升级，超过的不能升级，打开失败并且文件保持不变
+static void writeVersion2DB(const std::string& name, const std::string& inlineValue){
+	uint64 head[5] = {32, MAX_KEY_LENGTH, 32 + MAX_KEY_LENGTH, BLOCK_SIZE, 2};
+	std::string keyData((const char*)head, sizeof(head));
+	std::string valueData;
+	// 数据块保存的value：旧的长度记录没有校验码标记
+	std::string blockValue = makeValue("block", 100);
+	int prefix = (int)blockValue.length() + 4;
+	valueData.append((const char*)&prefix, 4);
+	valueData.append(blockValue);
+	valueData.append(2 * BLOCK_SIZE - prefix, '\0');
+	char record[32] = {0};
+	uint64 node = BlockNode(0, 2).value;
+	memcpy(record, &node, sizeof(node));
+	keyData.append(record, sizeof(record));
+	keyData.push_back((char)5);
+	keyData.append("block");
+	// 内联记录：flags为1，之后是长度和数据
+	memset(record, 0, sizeof(record));
+	record[12] = 1;
+	record[13] = (char)inlineValue.length();
+	memcpy(record + 14, inlineValue.data(), inlineValue.length());
+	keyData.append(record, sizeof(record));
+	keyData.push_back((char)6);
+	keyData.append("inline");
+	head[2] = 32 + sizeof(uint64);
+	head[1] = MAX_INDEX_KEY_LENGTH;
+	std::string indexData((const char*)head, sizeof(head));
+	const std::string* contents[] = {&valueData, &keyData, &indexData};
+	const char* exts[] = {".v", ".k", ".i"};
+	for(int i=0; i<3; ++i){
+		FILE* pFile = fopen((name + exts[i]).c_str(), "wb");
+		TEST_CHECK(NULL != pFile && 1 == fwrite(contents[i]->data(), contents[i]->length(), 1, pFile));
+		if(NULL != pFile){
+			fclose(pFile);
+		}
+	}
+}
+static void testUpgradeInline(const std::string& name){
+	std::string shortValue(VALUE_INLINE_MAX_LENGTH, 's');
+	writeVersion2DB(name, shortValue);
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	TEST_CHECK(hasValue(db, "inline", shortValue) && hasValue(db, "block", makeValue("block", 100)));
+	db.closeDB();
+	removeDB(name);
+	std::string longValue(VALUE_INLINE_MAX_LENGTH + 2, 'l');
+	writeVersion2DB(name, longValue);
+	int64 fileSize = getFileSize(name + ".k");
+	TEST_CHECK(!db.openDB(name.c_str()));
+	db.closeDB();
+	TEST_CHECK(getFileSize(name + ".k") == fileSize);
+}
+
+// 线程安全模式：多个线程对同一批key执行set/get/del，读取到的value必须是某一次完整的写入，重新打开后内容不变
+static bool isValidValue(const std::string& key, const CharVector& value){
+	std::string expect = makeValue(key, value.size());
+	return (!value.empty() && 0 == memcmp(value.data(), expect.data(), value.size()));
+}
+static void testConcurrentAccess(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.setThreadSafe(true);
+	std::vector<std::thread> threads;
+	for(int t=0; t<4; ++t){
+		threads.push_back(std::thread([&db, t](){
+			std::mt19937 rng(t + 1);
+			// 长度覆盖内联保存、普通数据块和多个数据块
+			static const size_t lengths[] = {8, 100, 3000, 70000};
+			for(int i=0; i<10000; ++i){
+				std::string key = "key" + std::to_string(rng() % 64);
+				uint32 op = rng() % 10;
+				if(op < 4){
+					std::string value = makeValue(key, lengths[rng() % 4] + rng() % 16);
+					TEST_CHECK(db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length()));
+				}else if(op < 9){
+					CharVector value;
+					int result = db.m_pDB->getValue(key.data(), key.length(), value);
+					TEST_CHECK(FERR_KEY_NOT_FOUND == result || (FILE_OK == result && isValidValue(key, value)));
+				}else{
+					int result = db.m_pDB->del(key.data(), key.length());
+					TEST_CHECK(FILE_OK == result || FERR_KEY_NOT_FOUND == result);
+				}
+			}
+		}));
+	}
+	for(size_t i=0; i<threads.size(); ++i){
+		threads[i].join();
+	}
+	std::map<std::string, CharVector> values;
+	for(int i=0; i<64; ++i){
+		std::string key = "key" + std::to_string(i);
+		if(db.get(key.data(), (uint32)key.length(), values[key])){
+			TEST_CHECK(isValidValue(key, values[key]));
+		}else{
+			values.erase(key);
+		}
+	}
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	for(int i=0; i<64; ++i){
+		std::string key = "key" + std::to_string(i);
+		CharVector value;
+		bool found = db.get(key.data(), (uint32)key.length(), value);
+		TEST_CHECK(values.count(key) ? (found && value == values[key]) : !found);
+	}
+}
+
+// 分片：key按哈希分到各个分片，单个、批量和跨分片改名的结果和单个数据库相同；分片数量不同时打开失败
+static void testShard(const std::string& name){
+	for(int threaded=0; threaded<2; ++threaded){
+		std::vector<std::string> keys;
+		std::vector<std::string> values;
+		{
+			AlphaShardKV db;
+			TEST_CHECK(db.openDB(name.c_str(), 4, 1 == threaded));
+			KeySetEntryVector entries;
+			for(int i=0; i<1000; ++i){
+				keys.push_back("shard" + std::to_string(i));
+				values.push_back(makeValue(keys.back(), 10 + i));
+			}
+			for(int i=0; i<500; ++i){
+				TEST_CHECK(db.set(keys[i].data(), (uint32)keys[i].length(), values[i].data(), (uint32)values[i].length()));
+				TEST_CHECK(db.set((uint64)i, values[i].data(), (uint32)values[i].length()));
+			}
+			for(int i=500; i<1000; ++i){
+				entries.push_back(KeySetEntry(keys[i].data(), (int64)keys[i].length(), values[i].data(), (int64)values[i].length()));
+			}
+			TEST_CHECK(db.mset(entries));
+			// 改名到其它分片的key复制value后删除原来的key
+			for(int i=0; i<20; ++i){
+				std::string newKey = "renamed" + std::to_string(i);
+				TEST_CHECK(db.replace(keys[i].data(), (uint32)keys[i].length(), newKey.data(), (uint32)newKey.length()));
+				keys[i] = newKey;
+			}
+			TEST_CHECK(db.del(keys[999].data(), (uint32)keys[999].length()));
+			keys.pop_back();
+			std::vector<CharVector> buffers(keys.size(), CharVector(2000));
+			KeyGetEntryVector gets;
+			for(size_t i=0; i<keys.size(); ++i){
+				gets.push_back(KeyGetEntry(keys[i].data(), (int64)keys[i].length(), buffers[i].data(), (int64)buffers[i].size()));
+			}
+			TEST_CHECK(db.mget(gets));
+			for(size_t i=0; i<gets.size(); ++i){
+				TEST_CHECK(FILE_OK == gets[i].result && std::string(gets[i].buffer, gets[i].length) == values[i]);
+			}
+		}
+		AlphaShardKV db;
+		TEST_CHECK(!db.openDB(name.c_str(), 3, false));
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str(), 4, false));
+		for(size_t i=0; i<keys.size(); ++i){
+			TEST_CHECK(hasValue(db, keys[i], values[i]));
+		}
+		for(int i=0; i<500; ++i){
+			TEST_CHECK(hasValue(db, (uint64)i, values[i]));
+		}
+		CharVector value;
+		TEST_CHECK(!db.get("shard0", 6, value) && !db.get("shard999", 8, value));
+		db.closeDB();
+		removeDB(name);
+	}
+}
+
+// 无锁读取：写入线程不断改变value的长度（内联、单个数据块、多个数据块）和删除，同时读取的线程只能读到完整的value；
+// 读取线程的数量超过登记位置的数量时改用读写锁
+static void testLockFreeRead(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.setThreadSafe(true);
+	std::atomic<bool> isRunning(true);
+	std::thread writer([&db, &isRunning](){
+		static const size_t lengths[] = {6, 200, 5000, 100000};
+		for(int i=0; i<20000 && isRunning; ++i){
+			std::string key = "free" + std::to_string(i % 16);
+			if(0 == i % 7){
+				db.del(key.data(), (uint32)key.length());
+			}else{
+				std::string value = makeValue(key, lengths[i % 4] + i % 13);
+				TEST_CHECK(db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length()));
+			}
+		}
+	});
+	std::vector<std::thread> readers;
+	for(int t=0; t<300; ++t){
+		readers.push_back(std::thread([&db, t](){
+			for(int i=0; i<(t < 8 ? 20000 : 50); ++i){
+				std::string key = "free" + std::to_string((t + i) % 16);
+				CharVector value;
+				int result = db.m_pDB->getValue(key.data(), key.length(), value);
+				TEST_CHECK(FERR_KEY_NOT_FOUND == result || (FILE_OK == result && isValidValue(key, value)));
+			}
+		}));
+	}
+	for(size_t i=0; i<readers.size(); ++i){
+		readers[i].join();
+	}
+	isRunning = false;
+	writer.join();
+}
+
+// 异步写入：调用返回后马上可以读到，future和回调得到写入的结果，被覆盖的写入得到覆盖它的写入结果；关闭时写完所有数据
+static void testAsync(const std::string& name){
+	std::map<std::string, std::string> values;
+	{
+		AlphaAsyncKV db;
+		TEST_CHECK(db.openDB(name.c_str()));
+		std::vector< std::future<int> > futures;
+		for(int round=0; round<3; ++round){
+			for(int i=0; i<1000; ++i){
+				std::string key = "async" + std::to_string(i);
+				values[key] = makeValue(key, 10 + round * 100 + i);
+				futures.push_back(db.setAsync(key.data(), (uint32)key.length(), values[key].data(), (uint32)values[key].length()));
+				TEST_CHECK(hasValue(db, key, values[key]));
+			}
+		}
+		std::atomic<int> callbacks(0);
+		std::string value = makeValue("number", 300);
+		db.setAsync((uint64)1, value.data(), (uint32)value.length(), [&callbacks](int result){
+			TEST_CHECK(FILE_OK == result);
+			++callbacks;
+		});
+		futures.push_back(db.delAsync("async7", 6));
+		values.erase("async7");
+		CharVector data;
+		TEST_CHECK(!db.get("async7", 6, data) && hasValue(db, (uint64)1, value));
+		for(size_t i=0; i<futures.size(); ++i){
+			TEST_CHECK(FILE_OK == futures[i].get());
+		}
+		db.flush();
+		TEST_CHECK(1 == callbacks);
+		TEST_CHECK(FERR_KEY_NOT_FOUND == db.delAsync("missing", 7).get());
+		for(int i=0; i<100; ++i){
+			std::string key = "last" + std::to_string(i);
+			values[key] = makeValue(key, 50);
+			db.setAsync(key.data(), (uint32)key.length(), values[key].data(), (uint32)values[key].length());
+		}
+	}
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	for(std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it){
+		TEST_CHECK(hasValue(db, it->first, it->second));
+	}
+	CharVector data;
+	TEST_CHECK(!db.get("async7", 6, data) && hasValue(db, (uint64)1, makeValue("number", 300)));
+}
+
+// 只读内存：内联的value和缓存命中的value直接返回，其它需要读取数据文件的返回FERR_VALUE_NOT_IN_MEMORY
+static void testMemoryValue(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string value = makeValue("memory", 1000);
+	TEST_CHECK(db.set("inline", 6, "small", 5) && db.set("block", 5, value.data(), (uint32)value.length()));
+	CharVector data;
+	TEST_CHECK(FILE_OK == db.m_pDB->getMemoryValue("inline", 6, data) && std::string(data.data(), data.size()) == "small");
+	TEST_CHECK(FERR_VALUE_NOT_IN_MEMORY == db.m_pDB->getMemoryValue("block", 5, data));
+	TEST_CHECK(FERR_KEY_NOT_FOUND == db.m_pDB->getMemoryValue("missing", 7, data));
+	db.setCacheSize(1 << 20);
+	TEST_CHECK(hasValue(db, "block", value));
+	TEST_CHECK(FILE_OK == db.m_pDB->getMemoryValue("block", 5, data) && std::string(data.data(), data.size()) == value);
+}
+
+// 整数加减：不存在的key从0开始，保留过期时间，不是整数或者溢出时返回错误并且value不变
+static void testIncrby(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	int64 value = 0;
+	TEST_CHECK(db.incrby("counter", 7, 5, &value) && 5 == value);
+	TEST_CHECK(db.incrby("counter", 7, -12, &value) && -7 == value);
+	TEST_CHECK(hasValue(db, "counter", "-7"));
+	TEST_CHECK(db.incrby((uint64)3, 100, &value) && db.incrby((uint64)3, 1, &value) && 101 == value);
+	TEST_CHECK(db.setex("ttl", 3, "41", 2, 1000));
+	TEST_CHECK(db.incrby("ttl", 3, 1, &value) && 42 == value && db.ttl("ttl", 3) > 990);
+	TEST_CHECK(db.set("text", 4, "abc", 3));
+	TEST_CHECK(FERR_VALUE_NOT_INTEGER == db.m_pDB->incrby("text", 4, 1, value) && hasValue(db, "text", "abc"));
+	std::string max = std::to_string(LLONG_MAX);
+	TEST_CHECK(db.set("max", 3, max.data(), (uint32)max.length()));
+	TEST_CHECK(FERR_VALUE_NOT_INTEGER == db.m_pDB->incrby("max", 3, 1, value) && hasValue(db, "max", max));
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	TEST_CHECK(hasValue(db, "counter", "-7") && hasValue(db, (uint64)3, "101") && hasValue(db, "ttl", "42"));
+}
+
+// 复制：副本先通过快照全量同步已有的数据，之后按顺序执行日志；断开后从保存的位置继续同步，最终和主库的内容相同
+static bool waitReplica(AlphaReplicaClient& client, AlphaKV& primary){
+	uint64 sequence = primary.m_pDB->getReplicationLog()->getSequence();
+	for(int i=0; i<1000 && client.getSequence() != sequence; ++i){
+		usleep(10000);
+	}
+	return (client.getSequence() == sequence);
+}
+static void checkReplica(AlphaKV& primary, AlphaKV& replica){
+	AlphaKVIterator it;
+	TEST_CHECK(primary.openIterator(it));
+	uint64 count = 0;
+	while(it.next()){
+		std::string value(it.getValue(), it.getValueLength());
+		TEST_CHECK(it.isIndex() ? hasValue(replica, it.getIndex(), value) : hasValue(replica, it.getKey(), value));
+		++count;
+	}
+	it.close();
+	AlphaKVIterator replicaIt;
+	TEST_CHECK(replica.openIterator(replicaIt) && count == replicaIt.size());
+}
+static void testReplication(const std::string& name){
+	std::string replicaName = name + ".replica";
+	int port = 20000 + getpid() % 20000;
+	AlphaKV primary;
+	TEST_CHECK(primary.openDB(name.c_str()));
+	primary.setThreadSafe(true);
+	primary.m_pDB->enableReplication();
+	// 副本连接之前写入的数据通过快照同步
+	for(int i=0; i<500; ++i){
+		std::string key = "repl" + std::to_string(i);
+		std::string value = makeValue(key, 10 + i * 7);
+		TEST_CHECK(primary.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length()));
+	}
+	TEST_CHECK(500 == primary.m_pDB->getReplicationLog()->getSequence());
+	AlphaReplicationServer server(primary.m_pDB);
+	TEST_CHECK(server.start(port));
+	AlphaKV replica;
+	TEST_CHECK(replica.openDB(replicaName.c_str()));
+	replica.setThreadSafe(true);
+	{
+		AlphaReplicaClient client(replica.m_pDB);
+		TEST_CHECK(client.start("127.0.0.1", port, replicaName));
+		TEST_CHECK(waitReplica(client, primary));
+		// 之后的修改按日志同步
+		std::vector<std::string> keys;
+		for(int i=0; i<100; ++i){
+			keys.push_back("mset" + std::to_string(i));
+		}
+		KeySetEntryVector entries;
+		std::string value = makeValue("mset", 3000);
+		for(int i=0; i<100; ++i){
+			entries.push_back(KeySetEntry(keys[i].data(), (int64)keys[i].length(), value.data(), (int64)(i * 30)));
+		}
+		TEST_CHECK(primary.mset(entries));
+		TEST_CHECK(primary.del("repl1", 5) && primary.replace("repl2", 5, "moved", 5));
+		TEST_CHECK(primary.set((uint64)8, "number", 6) && primary.expire("repl3", 5, 1000));
+		TEST_CHECK(waitReplica(client, primary));
+		checkReplica(primary, replica);
+		TEST_CHECK(replica.ttl("repl3", 5) > 990);
+		client.stop();
+	}
+	// 断开期间的修改在重新连接后从日志补上
+	TEST_CHECK(primary.del("repl4", 5) && primary.set("later", 5, "later", 5));
+	{
+		AlphaReplicaClient client(replica.m_pDB);
+		TEST_CHECK(client.start("127.0.0.1", port, replicaName));
+		TEST_CHECK(waitReplica(client, primary));
+		checkReplica(primary, replica);
+		client.stop();
+	}
+	server.stop();
+}
+
+// 延迟直方图：百分位数的相对误差不超过1%，合并后的结果和一起记录的相同
+static void testHistogram(const std::string& name){
+	LatencyHistogram a, b, all;
+	for(uint64 i=1; i<=100000; ++i){
+		uint64 value = i * 37;
+		((0 == i % 2) ? a : b).record(value);
+		all.record(value);
+	}
+	a.merge(b);
+	TEST_CHECK(100000 == a.getCount() && 37 == a.getMin() && 3700000 == a.getMax());
+	const double percentiles[] = {50, 99, 99.9, 100};
+	for(size_t i=0; i<sizeof(percentiles)/sizeof(percentiles[0]); ++i){
+		double expect = percentiles[i] * 1000 * 37;
+		uint64 value = a.getPercentile(percentiles[i]);
+		TEST_CHECK(value >= expect * 0.99 && value <= expect * 1.01);
+		TEST_CHECK(value == all.getPercentile(percentiles[i]));
+	}
+	TEST_CHECK(a.getMean() > 1850000 * 0.999 && a.getMean() < 1850037 * 1.001);
+	a.reset();
+	TEST_CHECK(0 == a.getCount() && 0 == a.getPercentile(50));
+}
+
+// 运行统计：多个线程的操作次数合并计算，写入方式和数据块分配的计数符合实际的操作，关闭后不再计数
+static void testStats(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.setThreadSafe(true);
+	std::string value = makeValue("stats", 1000);
+	TEST_CHECK(db.set("inline", 6, "small", 5));
+	TEST_CHECK(db.set("block", 5, value.data(), (uint32)value.length()));
+	TEST_CHECK(db.set("block", 5, value.data(), (uint32)value.length()));
+	TEST_CHECK(db.set("block", 5, value.data(), 500));
+	TEST_CHECK(db.del("inline", 6) && !db.del("missing", 7));
+	std::vector<std::thread> threads;
+	for(int t=0; t<2; ++t){
+		threads.push_back(std::thread([&db](){
+			for(int i=0; i<1000; ++i){
+				CharVector data;
+				TEST_CHECK(db.get((0 == i % 10) ? "missing" : "block", (0 == i % 10) ? 7 : 5, data) == (0 != i % 10));
+			}
+		}));
+	}
+	for(size_t i=0; i<threads.size(); ++i){
+		threads[i].join();
+	}
+	StatSnapshot stat;
+	db.getStats(stat);
+	TEST_CHECK(4 == stat.counts[STAT_OP_SET] && 0 == stat.errors[STAT_OP_SET]);
+	TEST_CHECK(2000 == stat.counts[STAT_OP_GET] && 200 == stat.misses[STAT_OP_GET]);
+	TEST_CHECK(2 == stat.counts[STAT_OP_DEL] && 1 == stat.misses[STAT_OP_DEL]);
+	TEST_CHECK(stat.latencies[STAT_OP_GET].getCount() > 0 && stat.latencies[STAT_OP_GET].getCount() < 2000);
+	TEST_CHECK(1 == stat.counters[STAT_SET_INLINE] && 1 == stat.counters[STAT_SET_NEW]);
+	TEST_CHECK(1 == stat.counters[STAT_SET_INPLACE] && 1 == stat.counters[STAT_SET_RELOCATE]);
+	TEST_CHECK(stat.counters[STAT_VALUE_FILE_EXTEND] > 0 && stat.counters[STAT_VALUE_FILE_EXTEND_BYTES] > 0);
+	TEST_CHECK(std::string::npos != db.dumpStats().find("get_count:2000"));
+	db.m_pDB->setStatsEnabled(false);
+	CharVector data;
+	TEST_CHECK(db.get("block", 5, data));
+	StatSnapshot disabled;
+	db.getStats(disabled);
+	TEST_CHECK(2000 == disabled.counts[STAT_OP_GET]);
+}
+
+// 空间统计：有效数据、对齐浪费、空闲段和删除的key记录按实际的写入和删除计算，重新打开后不变；快照保留的数据块单独统计
+static void checkSpace(AlphaKV& db, uint64 liveValues, uint64 freeBlocks, uint64 freeRuns, uint64 deadKeys){
+	SpaceStat stat;
+	db.getSpaceStat(stat);
+	TEST_CHECK(liveValues == stat.liveValues && liveValues * 16 == stat.liveBlocks && liveValues * 1000 == stat.liveBytes);
+	TEST_CHECK(stat.liveBlocks * BLOCK_SIZE - stat.liveBytes == stat.roundingWaste);
+	TEST_CHECK(freeBlocks == stat.freeBlocks && freeRuns == stat.freeRuns);
+	TEST_CHECK((0 == freeRuns ? 0 : 16) == stat.largestFreeRun);
+	TEST_CHECK(stat.allocatedBlocks == stat.liveBlocks + stat.unreclaimedBlocks && 0 == stat.unreclaimedBlocks);
+	TEST_CHECK(deadKeys == stat.deadKeys);
+}
+static void testSpaceStat(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::string value = makeValue("space", 1000);
+	for(int i=0; i<100; ++i){
+		std::string key = "space" + std::to_string(i);
+		TEST_CHECK(db.set(key.data(), (uint32)key.length(), value.data(), (uint32)value.length(), VALUE_CODEC_NONE));
+	}
+	TEST_CHECK(db.set("inline", 6, "small", 5));
+	checkSpace(db, 100, 0, 0, 0);
+	for(int i=0; i<100; i+=2){
+		std::string key = "space" + std::to_string(i);
+		TEST_CHECK(db.del(key.data(), (uint32)key.length()));
+	}
+	checkSpace(db, 50, 800, 50, 50);
+	// 快照期间覆盖写入，原来的数据块没有key引用，但是还不能回收
+	uint64 snapshot = db.createSnapshot();
+	TEST_CHECK(db.set("space1", 6, value.data(), (uint32)value.length(), VALUE_CODEC_NONE));
+	SpaceStat stat;
+	db.getSpaceStat(stat);
+	TEST_CHECK(16 == stat.unreclaimedBlocks && 50 == stat.liveValues);
+	db.releaseSnapshot(snapshot);
+	db.closeDB();
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.getSpaceStat(stat);
+	TEST_CHECK(50 == stat.liveValues && 0 == stat.unreclaimedBlocks && stat.allocatedBlocks == stat.liveBlocks);
+	TEST_CHECK(stat.liveBlocks * BLOCK_SIZE - stat.liveBytes == stat.roundingWaste);
+	TEST_CHECK(std::string::npos != db.dumpSpaceStat().find("live_values:50"));
+}
+
+// 线程安全模式下批量导入超过单个数据块上限的value：每条数据只记录一次复制日志，导入结束后锁已经释放，其它线程可以继续写入
+static void testBulkLoadLarge(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.setThreadSafe(true);
+	db.m_pDB->enableReplication();
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<100; ++i){
+		keys.push_back("bulk" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), (50 == i) ? TEST_LARGE_VALUE_SIZE : 200 + i));
+	}
+	size_t next = 0;
+	TEST_CHECK(db.bulkLoad([&](BulkEntry& entry){
+		if(next >= keys.size()){
+			return false;
+		}
+		entry = BulkEntry();
+		entry.key = keys[next].data();
+		entry.keyLen = (int64)keys[next].length();
+		entry.value = values[next].data();
+		entry.valueLen = (int64)values[next].length();
+		++next;
+		return true;
+	}));
+	TEST_CHECK(keys.size() == db.m_pDB->getReplicationLog()->getSequence());
+	std::thread writer([&db](){
+		TEST_CHECK(db.set("after", 5, "value", 5));
+	});
+	writer.join();
+	for(size_t i=0; i<keys.size(); ++i){
+		TEST_CHECK(hasValue(db, keys[i], values[i]));
+	}
+	TEST_CHECK(hasValue(db, "after", "value"));
+}
+
+// 批量写入中超过单个数据块上限的value和set一样分段保存，同一批的其它value不受影响
+static void testMsetLarge(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	for(int i=0; i<20; ++i){
+		keys.push_back("mlarge" + std::to_string(i));
+		values.push_back(makeValue(keys.back(), (7 == i) ? TEST_LARGE_VALUE_SIZE : 300 + i));
+	}
+	KeySetEntryVector entries;
+	for(size_t i=0; i<keys.size(); ++i){
+		entries.push_back(KeySetEntry(keys[i].data(), (int64)keys[i].length(), values[i].data(), (int64)values[i].length()));
+	}
+	TEST_CHECK(db.mset(entries));
+	for(int round=0; round<2; ++round){
+		for(size_t i=0; i<keys.size(); ++i){
+			TEST_CHECK(hasValue(db, keys[i], values[i]));
+		}
+		db.closeDB();
+		TEST_CHECK(db.openDB(name.c_str()));
+	}
+}
+
+// 流式读取的回调中再读取其它key：回调结束之前外层的读取登记仍然有效，覆盖这个key的写入必须等待回调结束
+static void testNestedRead(const std::string& name){
+	AlphaKV db;
+	TEST_CHECK(db.openDB(name.c_str()));
+	db.setThreadSafe(true);
+	std::string value = makeValue("outer", 5000);
+	TEST_CHECK(db.set("outer", 5, value.data(), (uint32)value.length()));
+	TEST_CHECK(db.set("inner", 5, "inner value", 11));
+	std::atomic<bool> isWritten(false);
+	std::thread writer;
+	bool isFirst = true;
+	int result = db.m_pDB->getStream("outer", 5, [&](const char* data, int64 length){
+		if(!isFirst){
+			return true;
+		}
+		isFirst = false;
+		CharVector inner;
+		TEST_CHECK(FILE_OK == db.m_pDB->getValue("inner", 5, inner) && 11 == inner.size());
+		writer = std::thread([&db, &isWritten](){
+			TEST_CHECK(db.set("outer", 5, "new", 3));
+			isWritten = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		TEST_CHECK(!isWritten.load());
+		return true;
+	});
+	TEST_CHECK(FILE_OK == result);
+	writer.join();
+	TEST_CHECK(isWritten.load());
+	TEST_CHECK(hasValue(db, "outer", "new"));
+}
+
+static void runTest(const char* title, void (*test)(const std::string&), const std::string& name){
+	int failed = g_failed.load();
+	removeDB(name);
+	test(name);
+	removeDB(name);
+	fprintf(stderr, "%s: %s\n", title, (g_failed.load() > failed) ? "failed" : "ok");
+}
+
+int main(int argc, char * argv[]) {
+	std::string name = "testdb";
+	int opt;
+	while(-1 != (opt = getopt(argc, argv, "d:"))){
+		if('d' == opt){
+			name = optarg;
+		}else{
+			fprintf(stderr, "usage: %s [-d dbname]\n", argv[0]);
+			return 1;
+		}
+	}
+	runTest("mset", testMset, name);
+	runTest("mget", testMget, name);
+	runTest("caller buffer", testCallerBuffer, name);
+	runTest("exact read", testExactRead, name);
+	runTest("compress", testCompress, name);
+	runTest("large value", testLargeValue, name);
+	runTest("legacy get", testLegacyGet, name);
+	runTest("idle blocks", testIdleBlocks, name);
+	runTest("cache", testCache, name);
+	runTest("expire", testExpire, name);
+	runTest("upgrade", testUpgrade, name);
+	runTest("inline", testInline, name);
+	runTest("bitcask", testBitcask, name);
+	runTest("lsm", testLsm, name);
+	runTest("snapshot", testSnapshot, name);
+	runTest("iterator", testIterator, name);
+	runTest("bulk load", testBulkLoad, name);
+	runTest("checkpoint", testCheckpoint, name);
+	runTest("checksum", testChecksum, name);
+	runTest("upgrade inline", testUpgradeInline, name);
+	runTest("concurrent access", testConcurrentAccess, name);
+	runTest("shard", testShard, name);
+	runTest("lock-free read", testLockFreeRead, name);
+	runTest("nested read", testNestedRead, name);
+	runTest("async", testAsync, name);
+	runTest("memory value", testMemoryValue, name);
+	runTest("incrby", testIncrby, name);
+	runTest("replication", testReplication, name);
+	runTest("histogram", testHistogram, name);
+	runTest("stats", testStats, name);
+	runTest("space", testSpaceStat, name);
+	runTest("bulk load large value", testBulkLoadLarge, name);
+	runTest("mset large value", testMsetLarge, name);
+	return g_failed.load() ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+//
+//  timer.hpp
+//  base
+//
+//  Created by AppleTree on 17/4/5.
+//  Copyright © 2017年 AppleTree. All rights reserved.
+//
+
+#ifndef timer_hpp
+#define timer_hpp
+
+#include "file.hpp"
+#include <time.h>
+
+NS_HIVE_BEGIN
+
+#define TIMER_WHEEL_LEVEL 4				// 时间轮的层数
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOT 64				// 每层的槽数量；4层64槽可以覆盖约194天，更远的时间到期前会重新放入
+#define TIMER_WHEEL_MASK 63
+
+inline uint32 getTimeSecond(void){
+	return (uint32)time(NULL);
+}
+
+// 分层时间轮：每个tick为1秒，第0层的每个槽对应1秒，第n层的每个槽对应64^n秒；
+// 高层的槽到期时把里面的数据重新分配到低层，到期的数据放入就绪列表等待处理
+template <typename _KEY_>
+class TimerWheel
+{
+public:
+	typedef struct TimerEntry{
+		_KEY_ key;
+		uint32 expire;
+		TimerEntry(const _KEY_& k, uint32 e) : key(k), expire(e){}
+	}TimerEntry;
+	typedef std::vector<TimerEntry> TimerEntryVector;
+
+	TimerEntryVector m_slots[TIMER_WHEEL_LEVEL][TIMER_WHEEL_SLOT];
+	TimerEntryVector m_ready;			// 已经到期，等待处理的数据
+	uint32 m_current;					// 时间轮当前的时间
+	uint64 m_count;						// 时间轮中的数据数量，不包括就绪列表
+public:
+	TimerWheel(void) : m_current(0), m_count(0) {}
+	virtual ~TimerWheel(void){}
+	inline void reset(uint32 now){
+		for(int level=0; level<TIMER_WHEEL_LEVEL; ++level){
+			for(int slot=0; slot<TIMER_WHEEL_SLOT; ++slot){
+				m_slots[level][slot].clear();
+			}
+		}
+		m_ready.clear();
+		m_current = now;
+		m_count = 0;
+	}
+	inline void add(const _KEY_& key, uint32 expire){
+		if(expire <= m_current){
+			m_ready.push_back(TimerEntry(key, expire));
+			return;
+		}
+		uint64 delta = expire - m_current;
+		uint64 due = expire;
+		int level = 0;
+		while(level < TIMER_WHEEL_LEVEL - 1 && delta >= ((uint64)1 << (TIMER_WHEEL_BITS * (level + 1)))){
+			++level;
+		}
+		// 超出时间轮范围的放在最高层最远的槽，到时候再重新分配
+		uint64 range = (uint64)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVEL);
+		if(delta >= range){
+			due = m_current + range - 1;
+		}
+		int slot = (int)((due >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+		m_slots[level][slot].push_back(TimerEntry(key, expire));
+		++m_count;
+	}
+	// 推进到now，把到期的数据放入就绪列表
+	inline void advance(uint32 now){
+		while(m_current < now){
+			// 时间轮为空时直接跳到当前时间
+			if(0 == m_count){
+				m_current = now;
+				break;
+			}
+			++m_current;
+			// 先从高层往低层重新分配，再处理第0层
+			for(int level=TIMER_WHEEL_LEVEL - 1; level>0; --level){
+				uint32 mask = ((uint32)1 << (TIMER_WHEEL_BITS * level)) - 1;
+				if(0 == (m_current & mask)){
+					cascade(level, (int)((m_current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK));
+				}
+			}
+			TimerEntryVector& slot = m_slots[0][m_current & TIMER_WHEEL_MASK];
+			if(!slot.empty()){
+				m_count -= slot.size();
+				m_ready.insert(m_ready.end(), slot.begin(), slot.end());
+				slot.clear();
+			}
+		}
+	}
+	// 取出一个到期的数据；没有返回false
+	inline bool pop(_KEY_& key, uint32& expire){
+		if(m_ready.empty()){
+			return false;
+		}
+		TimerEntry& entry = m_ready.back();
+		key = entry.key;
+		expire = entry.expire;
+		m_ready.pop_back();
+		return true;
+	}
+	inline bool hasReady(uint32 now) const {
+		return (!m_ready.empty() || (m_count > 0 && m_current < now));
+	}
+	inline uint64 size(void) const {
+		return m_count + m_ready.size();
+	}
+protected:
+	inline void cascade(int level, int slot){
+		TimerEntryVector entries;
+		entries.swap(m_slots[level][slot]);
+		m_count -= entries.size();
+		for(size_t i=0; i<entries.size(); ++i){
+			add(entries[i].key, entries[i].expire);
+		}
+	}
+};
+
+NS_HIVE_END
+
+#endif /* timer_hpp */